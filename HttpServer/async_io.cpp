@@ -0,0 +1,89 @@
+#include "async_io.h"
+
+#include <limits.h>
+
+SocketOperation::SocketOperation(SOCKET socket, char *buf, int len, bool write) :
+	m_handle(), m_socket(socket), m_bufs(nullptr), m_bufCount(1), m_write(write), m_result(-1),
+	m_transmitFile(nullptr), m_file(NULL), m_fileLength(0)
+{
+	memset(&m_context, 0, sizeof(m_context));
+	m_context.operation = IO_RESUME;
+
+	m_buf.buf = buf;
+	m_buf.len = (ULONG)len;
+
+	memset(&m_buffers, 0, sizeof(m_buffers));
+}
+
+SocketOperation::SocketOperation(SOCKET socket, WSABUF *bufs, DWORD count) :
+	m_handle(), m_socket(socket), m_bufs(bufs), m_bufCount(count), m_write(true), m_result(-1),
+	m_transmitFile(nullptr), m_file(NULL), m_fileLength(0)
+{
+	memset(&m_context, 0, sizeof(m_context));
+	m_context.operation = IO_RESUME;
+
+	m_buf.buf = nullptr;
+	m_buf.len = 0;
+
+	memset(&m_buffers, 0, sizeof(m_buffers));
+}
+
+SocketOperation::SocketOperation(SOCKET socket, LPFN_TRANSMITFILE transmitFile, HANDLE file, ULONG64 offset, DWORD length,
+	const char *head, int headlen) :
+	m_handle(), m_socket(socket), m_bufs(nullptr), m_bufCount(1), m_write(true), m_result(-1),
+	m_transmitFile(transmitFile), m_file(file), m_fileLength(length)
+{
+	memset(&m_context, 0, sizeof(m_context));
+	m_context.operation = IO_RESUME;
+
+	// the file is read from the position in the overlapped structure
+	m_context.overlapped.Offset = (DWORD)offset;
+	m_context.overlapped.OffsetHigh = (DWORD)(offset >> 32);
+
+	m_buf.buf = nullptr;
+	m_buf.len = 0;
+
+	memset(&m_buffers, 0, sizeof(m_buffers));
+	m_buffers.Head = (PVOID)head;
+	m_buffers.HeadLength = (DWORD)headlen;
+}
+
+bool SocketOperation::await_suspend(std::coroutine_handle<> handle)
+{
+	m_handle = handle;
+
+	int res;
+	if (m_transmitFile)
+	{
+		res = m_transmitFile(m_socket, m_file, m_fileLength, 0, &m_context.overlapped, &m_buffers, 0) ? 0 : SOCKET_ERROR;
+	}
+	else if (m_write)
+	{
+		res = WSASend(m_socket, m_bufs ? m_bufs : &m_buf, m_bufCount, NULL, 0, &m_context.overlapped, NULL);
+	}
+	else
+	{
+		DWORD flags = 0;
+		res = WSARecv(m_socket, &m_buf, 1, NULL, &flags, &m_context.overlapped, NULL);
+	}
+
+	if (res == SOCKET_ERROR && WSAGetLastError() != WSA_IO_PENDING)
+	{
+		// nothing was queued, continue the coroutine right away
+		m_result = -1;
+		return false;
+	}
+
+	// the completion may already be resuming the coroutine on another thread,
+	// so this object must not be touched anymore
+	return true;
+}
+
+void SocketOperation::Complete(bool success, DWORD transferred)
+{
+	if (!success)
+		m_result = -1;
+	else
+		m_result = transferred > INT_MAX ? INT_MAX : (int)transferred;
+	m_handle.resume();
+}
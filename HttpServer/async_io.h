@@ -0,0 +1,103 @@
+#pragma once
+
+#include "common.h"
+
+#include <MSWSock.h>
+
+#include <coroutine>
+#include <exception>
+
+// operations dispatched by the completion port workers of IOReactor
+enum
+{
+	IO_ACCEPT = 0,
+	IO_READ,
+	IO_WRITE,
+	IO_RIO_NOTIFY,
+	IO_RESUME
+};
+
+// header of every overlapped operation posted to a completion port, the
+// OVERLAPPED pointer dequeued from the port is the address of this struct
+struct IOContext
+{
+	OVERLAPPED overlapped;
+	int operation;
+};
+
+// Overlapped send, receive or file transmission which suspends the awaiting
+// coroutine until its completion is dequeued from the port the socket is
+// associated with. Awaiting yields the number of bytes transferred or -1 on error.
+class SocketOperation
+{
+private:
+	IOContext m_context;  // must stay first
+	std::coroutine_handle<> m_handle;
+	SOCKET m_socket;
+	WSABUF m_buf;
+	WSABUF *m_bufs;  // gathered write, m_buf is used if null
+	DWORD m_bufCount;
+	bool m_write;
+	int m_result;
+
+	LPFN_TRANSMITFILE m_transmitFile;
+	HANDLE m_file;
+	DWORD m_fileLength;
+	TRANSMIT_FILE_BUFFERS m_buffers;
+public:
+	SocketOperation(SOCKET socket, char *buf, int len, bool write);
+
+	// writes all buffers with a single WSASend
+	SocketOperation(SOCKET socket, WSABUF *bufs, DWORD count);
+
+	// sends head followed by length bytes of the file from offset with TransmitFile
+	SocketOperation(SOCKET socket, LPFN_TRANSMITFILE transmitFile, HANDLE file, ULONG64 offset, DWORD length,
+		const char *head, int headlen);
+
+	SocketOperation(const SocketOperation &) = delete;
+
+	constexpr bool await_ready() const
+	{
+		return false;
+	}
+
+	bool await_suspend(std::coroutine_handle<> handle);
+
+	constexpr int await_resume() const
+	{
+		return m_result;
+	}
+
+	// called by the thread which dequeued the completion, resumes the coroutine
+	void Complete(bool success, DWORD transferred);
+};
+
+// Coroutine which starts running immediately and frees its own frame when it
+// returns. Nothing can await it, so it must not let exceptions escape.
+struct DetachedTask
+{
+	struct promise_type
+	{
+		inline DetachedTask get_return_object()
+		{
+			return DetachedTask();
+		}
+
+		inline std::suspend_never initial_suspend()
+		{
+			return std::suspend_never();
+		}
+
+		inline std::suspend_never final_suspend() noexcept
+		{
+			return std::suspend_never();
+		}
+
+		inline void return_void() { }
+
+		inline void unhandled_exception()
+		{
+			std::terminate();
+		}
+	};
+};
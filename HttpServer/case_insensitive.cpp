@@ -0,0 +1,84 @@
+#include "case_insensitive.h"
+
+#include <bit>
+#include <stdint.h>
+#include <string.h>
+#include <intrin.h>
+
+static constexpr unsigned long long HashSeed = 0x9E3779B97F4A7C15ull;
+static constexpr unsigned long long HashMultiplier = 0xBF58476D1CE4E5B9ull;
+
+// sets the 0x20 bit of every byte in 'A'..'Z'. Moving the range to the bottom of
+// the signed bytes lets a single signed compare test both bounds.
+static inline __m128i FoldCase(__m128i bytes)
+{
+	const __m128i shifted = _mm_add_epi8(bytes, _mm_set1_epi8((char)(0x80 - 'A')));
+	const __m128i upper = _mm_cmplt_epi8(shifted, _mm_set1_epi8((char)(0x80 - 'A' + 'Z' + 1)));
+	return _mm_or_si128(bytes, _mm_and_si128(upper, _mm_set1_epi8(0x20)));
+}
+
+// loads up to 16 bytes without reading past the end, the rest is zero
+static inline __m128i LoadPartial(const char *data, size_t len)
+{
+	char block[16] = { 0 };
+	memcpy(block, data, len);
+	return _mm_loadu_si128((const __m128i *)block);
+}
+
+static inline unsigned long long Mix(unsigned long long hash, __m128i block)
+{
+	// through memory, moving 64 bits out of a register needs x64
+	uint64_t halves[2];
+	_mm_storeu_si128((__m128i *)halves, block);
+
+	hash = (hash ^ halves[0]) * HashMultiplier;
+	hash = std::rotl(hash, 29);
+	hash = (hash ^ halves[1]) * HashMultiplier;
+	return std::rotl(hash, 29);
+}
+
+size_t HashIgnoreCase(const char *data, size_t len)
+{
+	unsigned long long hash = HashSeed ^ len;
+
+	size_t i = 0;
+	for (; i + 16 <= len; i += 16)
+		hash = Mix(hash, FoldCase(_mm_loadu_si128((const __m128i *)(data + i))));
+
+	if (i < len)
+		hash = Mix(hash, FoldCase(LoadPartial(data + i, len - i)));
+
+	// final avalanche so the low bits used for bucket selection depend on every byte
+	hash ^= hash >> 31;
+	hash *= HashMultiplier;
+	hash ^= hash >> 29;
+	return (size_t)hash;
+}
+
+bool EqualsIgnoreCase(std::string_view first, std::string_view second)
+{
+	const size_t len = first.length();
+	if (len != second.length()) return false;
+
+	const char *a = first.data();
+	const char *b = second.data();
+
+	size_t i = 0;
+	for (; i + 16 <= len; i += 16)
+	{
+		__m128i x = FoldCase(_mm_loadu_si128((const __m128i *)(a + i)));
+		__m128i y = FoldCase(_mm_loadu_si128((const __m128i *)(b + i)));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) != 0xFFFF)
+			return false;
+	}
+
+	if (i < len)
+	{
+		__m128i x = FoldCase(LoadPartial(a + i, len - i));
+		__m128i y = FoldCase(LoadPartial(b + i, len - i));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) != 0xFFFF)
+			return false;
+	}
+
+	return true;
+}
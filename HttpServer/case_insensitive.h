@@ -0,0 +1,53 @@
+#pragma once
+
+#include <memory_resource>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <strutil/cpp_string_util.h>
+
+using namespace strutil;
+
+// ASCII case folding hash, equal for strings which only differ in the case of
+// letters. Folds 16 bytes at a time and never allocates.
+size_t HashIgnoreCase(const char *data, size_t len);
+
+// ASCII only comparison which ignores case, both lengths have to match
+bool EqualsIgnoreCase(std::string_view first, std::string_view second);
+
+// key types the functors below accept, each viewed as its characters
+inline std::string_view ViewOf(std::string_view value) { return value; }
+inline std::string_view ViewOf(const std::string &value) { return value; }
+inline std::string_view ViewOf(const char *value) { return value; }
+inline std::string_view ViewOf(const CaseInsensitiveString &value) { return value.value(); }
+
+// Hash and equality for maps keyed by CaseInsensitiveString. Both are transparent,
+// so find accepts a std::string_view or a string without building a key first.
+struct CaseInsensitiveHash
+{
+	using is_transparent = void;
+
+	template <class Key>
+	inline size_t operator()(const Key &value) const
+	{
+		std::string_view view = ViewOf(value);
+		return HashIgnoreCase(view.data(), view.length());
+	}
+};
+
+struct CaseInsensitiveEqual
+{
+	using is_transparent = void;
+
+	template <class First, class Second>
+	inline bool operator()(const First &first, const Second &second) const
+	{
+		return EqualsIgnoreCase(ViewOf(first), ViewOf(second));
+	}
+};
+
+template <class T>
+using CaseInsensitiveMap = std::unordered_map<CaseInsensitiveString, T, CaseInsensitiveHash, CaseInsensitiveEqual>;
+
+template <class T>
+using PmrCaseInsensitiveMap = std::pmr::unordered_map<CaseInsensitiveString, T, CaseInsensitiveHash, CaseInsensitiveEqual>;
@@ -1,6 +1,7 @@
 #include "client_connection.h"
 
 #include <stdio.h>
+#include <limits.h>
 
 ClientConnection::ClientConnection() :
 	m_client(INVALID_SOCKET), m_family(0), m_port(0)
@@ -89,16 +90,102 @@ void ClientConnection::Close()
 	}
 }
 
+bool ClientConnection::SetNonBlocking(bool nonblocking)
+{
+	u_long mode = nonblocking ? 1 : 0;
+	return ioctlsocket(m_client, FIONBIO, &mode) != SOCKET_ERROR;
+}
+
 int ClientConnection::ReadBytes(char *dest, int len)
 {
-	int res = recv(m_client, dest, len, 0);
-	if (res <= 0) Close();
-	return res;
+	return recv(m_client, dest, len, 0);
 }
 
 int ClientConnection::WriteBytes(const char *src, int len)
 {
-	int res = send(m_client, src, len, 0);
-	if (res < 0) Close();
-	return res;
+	return send(m_client, src, len, 0);
+}
+
+int ClientConnection::WriteVector(WSABUF *bufs, DWORD count)
+{
+	int total = 0;
+	while (count > 0)
+	{
+		DWORD sent;
+		if (WSASend(m_client, bufs, count, &sent, 0, NULL, NULL) == SOCKET_ERROR)
+			return -1;
+
+		total += (int)sent;
+
+		// a send may return before everything was written, continue after the last byte
+		while (count > 0 && sent >= bufs->len)
+		{
+			sent -= bufs->len;
+			bufs++;
+			count--;
+		}
+
+		if (count > 0)
+		{
+			bufs->buf += sent;
+			bufs->len -= sent;
+		}
+	}
+
+	return total;
+}
+
+int ClientConnection::ReadAvailable(char *dest, int len)
+{
+	int res = recv(m_client, dest, len, 0);
+	if (res > 0) return res;
+	if (res == SOCKET_ERROR && WSAGetLastError() == WSAEWOULDBLOCK) return 0;
+	return -1;
+}
+
+int ClientConnection::GetAvailable() const
+{
+	u_long available;
+	if (ioctlsocket(m_client, FIONREAD, &available) == SOCKET_ERROR)
+		return -1;
+	return available > INT_MAX ? INT_MAX : (int)available;
+}
+
+static LPFN_TRANSMITFILE LoadTransmitFile(SOCKET socket)
+{
+	GUID transmitFileId = WSAID_TRANSMITFILE;
+	LPFN_TRANSMITFILE transmitFile = nullptr;
+	DWORD bytes;
+
+	if (WSAIoctl(socket, SIO_GET_EXTENSION_FUNCTION_POINTER, &transmitFileId, sizeof(transmitFileId),
+		&transmitFile, sizeof(transmitFile), &bytes, NULL, NULL) == SOCKET_ERROR)
+		return nullptr;
+
+	return transmitFile;
+}
+
+LPFN_TRANSMITFILE ClientConnection::GetTransmitFile() const
+{
+	// every TCP socket uses the same provider, so it only has to be loaded once
+	static LPFN_TRANSMITFILE transmitFile = LoadTransmitFile(m_client);
+	return transmitFile;
+}
+
+bool ClientConnection::SendFile(HANDLE file, ULONG64 offset, DWORD length, const char *head, int headlen)
+{
+	LPFN_TRANSMITFILE transmitFile = GetTransmitFile();
+	if (!transmitFile) return false;
+
+	// without an overlapped structure the transmission starts at the file pointer
+	LARGE_INTEGER position;
+	position.QuadPart = (LONGLONG)offset;
+	if (!SetFilePointerEx(file, position, NULL, FILE_BEGIN))
+		return false;
+
+	TRANSMIT_FILE_BUFFERS buffers;
+	memset(&buffers, 0, sizeof(buffers));
+	buffers.Head = (PVOID)head;
+	buffers.HeadLength = (DWORD)headlen;
+
+	return transmitFile(m_client, file, length, 0, NULL, &buffers, 0) != FALSE;
 }
@@ -1,10 +1,32 @@
 #pragma once
 
 #include "common.h"
+#include "async_io.h"
+#include "object_pool.h"
 
 #include <WS2tcpip.h>
 
-class ClientConnection
+// largest amount of a response passed to one send. The write timeout is armed for
+// every send, so it limits how long a client may stop reading, not how long the
+// whole response may take.
+static constexpr size_t SendPieceSize = 256 * 1024;
+
+// shortens the buffers to at most limit bytes in total, returns how many are used
+inline DWORD LimitBuffers(WSABUF *bufs, DWORD count, size_t limit)
+{
+	for (DWORD i = 0; i < count; i++)
+	{
+		if (bufs[i].len >= limit)
+		{
+			bufs[i].len = (ULONG)limit;
+			return i + 1;
+		}
+		limit -= bufs[i].len;
+	}
+	return count;
+}
+
+class ClientConnection : public Pooled
 {
 private:
 	SOCKET m_client;
@@ -34,7 +56,59 @@ public:
 	{
 		return m_port;
 	}
+
+	constexpr SOCKET GetSocket() const
+	{
+		return m_client;
+	}
+
+	bool SetNonBlocking(bool nonblocking);
 	
+	// failed operations leave the socket open, only the owner closes it once
+	// nothing else can still use the handle, like a timer shutting it down
 	int ReadBytes(char *dest, int len);
 	int WriteBytes(const char *src, int len);
+
+	// writes every buffer in order with as few sends as possible, bufs is advanced past
+	// what was sent. Returns the number of bytes written or -1 on error.
+	int WriteVector(WSABUF *bufs, DWORD count);
+
+	// reads from a non-blocking socket, returns 0 if no data is available
+	// and -1 if the connection was closed or errored
+	int ReadAvailable(char *dest, int len);
+
+	// number of bytes which can be read without blocking, -1 on error
+	int GetAvailable() const;
+
+	// awaitable overlapped variants of ReadBytes and WriteBytes, the socket must be
+	// associated with a completion port serviced by an IOReactor. Reading zero
+	// bytes waits until data is available without holding a buffer.
+	inline SocketOperation ReadBytesAsync(char *dest, int len)
+	{
+		return SocketOperation(m_client, dest, len, false);
+	}
+
+	inline SocketOperation WriteBytesAsync(const char *src, int len)
+	{
+		return SocketOperation(m_client, (char *)src, len, true);
+	}
+
+	// bufs must stay valid until the operation was started
+	inline SocketOperation WriteVectorAsync(WSABUF *bufs, DWORD count)
+	{
+		return SocketOperation(m_client, bufs, count);
+	}
+
+	// TransmitFile from the socket's provider, nullptr if it could not be loaded
+	LPFN_TRANSMITFILE GetTransmitFile() const;
+
+	// sends head followed by length bytes of the file starting at offset, without
+	// copying the file through user space. length must not be zero. Client editions
+	// of Windows only run two transmissions at a time and queue the others.
+	bool SendFile(HANDLE file, ULONG64 offset, DWORD length, const char *head, int headlen);
+
+	inline SocketOperation SendFileAsync(HANDLE file, ULONG64 offset, DWORD length, const char *head, int headlen)
+	{
+		return SocketOperation(m_client, GetTransmitFile(), file, offset, length, head, headlen);
+	}
 };
\ No newline at end of file
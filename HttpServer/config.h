@@ -3,6 +3,8 @@
 #include <unordered_map>
 #include <strutil/cpp_string_util.h>
 
+#include "case_insensitive.h"
+
 using namespace strutil;
 
 class ConfigFile
@@ -48,7 +50,7 @@ public:
 	class Section
 	{
 	private:
-		std::unordered_map<CaseInsensitiveString, Value> m_values;
+		CaseInsensitiveMap<Value> m_values;
 	public:
 		inline Section() { }
 
@@ -73,19 +75,19 @@ public:
 
 		void AddValue(const CaseInsensitiveString &key, const char *value, int valuelen);
 
-		inline const Value *FindValue(const CaseInsensitiveString &key) const
+		inline const Value *FindValue(std::string_view key) const
 		{
 			auto it = m_values.find(key);
 			return it == m_values.end() ? nullptr : &it->second;
 		}
 
-		constexpr const std::unordered_map<CaseInsensitiveString, Value> &GetValues() const
+		constexpr const CaseInsensitiveMap<Value> &GetValues() const
 		{
 			return m_values;
 		}
 	};
 private:
-	std::unordered_map<CaseInsensitiveString, Section> m_sections;
+	CaseInsensitiveMap<Section> m_sections;
 public:
 	ConfigFile(const char *file);
 	inline ConfigFile(const ConfigFile &other)
@@ -93,7 +95,7 @@ public:
 		operator=(other);
 	}
 
-	inline const Section *FindSection(const CaseInsensitiveString &name) const
+	inline const Section *FindSection(std::string_view name) const
 	{
 		auto it = m_sections.find(name);
 		return it == m_sections.end() ? nullptr : &it->second;
@@ -0,0 +1,151 @@
+#include "epoch.h"
+
+#include "object_pool.h"
+
+static constexpr int SlotCount = 256;
+
+// thread slot states
+static constexpr int SlotUnclaimed = -1;
+static constexpr int SlotNone = -2;  // every slot taken, the thread counts as an overflow reader
+
+// a slot is a cache line of its own, so readers never share one
+struct alignas(64) EpochSlot
+{
+	volatile LONGLONG epoch;  // epoch the owner entered in, 0 while outside
+	volatile LONG owner;
+};
+
+struct ThreadEpoch
+{
+	int slot = SlotUnclaimed;
+	int depth = 0;
+
+	~ThreadEpoch();
+};
+
+struct RetiredObject : public Pooled
+{
+	void *object;
+	EpochFreeFunc free;
+	LONGLONG epoch;
+	RetiredObject *next;
+};
+
+static EpochSlot g_slots[SlotCount];
+static volatile LONGLONG g_epoch = 1;
+
+// readers without a slot, while there are any nothing is freed
+static volatile LONG g_overflow;
+
+static SRWLOCK g_retiredLock = SRWLOCK_INIT;
+static RetiredObject *g_retired;
+static size_t g_retiredCount;
+
+static thread_local ThreadEpoch t_epoch;
+
+ThreadEpoch::~ThreadEpoch()
+{
+	if (slot >= 0)
+		g_slots[slot].owner = 0;
+}
+
+static int ClaimSlot()
+{
+	for (int i = 0; i < SlotCount; i++)
+	{
+		if (!g_slots[i].owner && InterlockedCompareExchange(&g_slots[i].owner, 1, 0) == 0)
+			return i;
+	}
+	return SlotNone;
+}
+
+void EpochEnter()
+{
+	ThreadEpoch &local = t_epoch;
+	if (local.depth++ > 0)
+		return;
+
+	if (local.slot == SlotUnclaimed)
+		local.slot = ClaimSlot();
+
+	// full barriers, the mark has to be visible before the reader loads anything
+	if (local.slot >= 0)
+		InterlockedExchange64(&g_slots[local.slot].epoch, g_epoch);
+	else
+		InterlockedIncrement(&g_overflow);
+}
+
+void EpochLeave()
+{
+	ThreadEpoch &local = t_epoch;
+	if (--local.depth > 0)
+		return;
+
+	// a volatile store releases, every load inside happened before it
+	if (local.slot >= 0)
+		g_slots[local.slot].epoch = 0;
+	else
+		InterlockedDecrement(&g_overflow);
+}
+
+void EpochRetire(void *object, EpochFreeFunc free)
+{
+	RetiredObject *retired = new RetiredObject();
+	retired->object = object;
+	retired->free = free;
+
+	// readers entering from now on see the new epoch and can't have loaded the object
+	retired->epoch = InterlockedIncrement64(&g_epoch) - 1;
+
+	AcquireSRWLockExclusive(&g_retiredLock);
+	retired->next = g_retired;
+	g_retired = retired;
+	g_retiredCount++;
+	ReleaseSRWLockExclusive(&g_retiredLock);
+}
+
+size_t EpochCollect()
+{
+	RetiredObject *freed = nullptr;
+
+	AcquireSRWLockExclusive(&g_retiredLock);
+
+	if (!g_overflow)
+	{
+		LONGLONG oldest = MAXLONGLONG;
+		for (int i = 0; i < SlotCount; i++)
+		{
+			const LONGLONG epoch = g_slots[i].epoch;
+			if (epoch && epoch < oldest)
+				oldest = epoch;
+		}
+
+		RetiredObject **link = &g_retired;
+		while (*link)
+		{
+			RetiredObject *retired = *link;
+			if (retired->epoch < oldest)
+			{
+				*link = retired->next;
+				retired->next = freed;
+				freed = retired;
+				g_retiredCount--;
+			}
+			else
+				link = &retired->next;
+		}
+	}
+
+	const size_t left = g_retiredCount;
+	ReleaseSRWLockExclusive(&g_retiredLock);
+
+	while (freed)
+	{
+		RetiredObject *next = freed->next;
+		freed->free(freed->object);
+		delete freed;
+		freed = next;
+	}
+
+	return left;
+}
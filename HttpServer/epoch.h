@@ -0,0 +1,38 @@
+#pragma once
+
+#include "common.h"
+
+typedef void (*EpochFreeFunc)(void *object);
+
+// Epoch based reclamation for data read without locks. A reader marks itself as
+// inside with the current global epoch before it loads a shared pointer, and a
+// writer which unpublishes an object retires it with the epoch of the swap. The
+// object is freed once every reader inside has entered in a later epoch, so it
+// could not have seen the object anymore. Entering and leaving only touch the
+// calling thread's own slot. Sections nest, only the outermost one counts.
+void EpochEnter();
+void EpochLeave();
+
+// frees the object with the given function once no reader can still see it. Must
+// be called after the object was unpublished. Nothing is freed before the next
+// EpochCollect, so a batch of objects is retired first and collected once.
+void EpochRetire(void *object, EpochFreeFunc free);
+
+// frees the retired objects no reader can still see, returns the number left
+size_t EpochCollect();
+
+class EpochGuard
+{
+public:
+	inline EpochGuard()
+	{
+		EpochEnter();
+	}
+
+	inline ~EpochGuard()
+	{
+		EpochLeave();
+	}
+
+	EpochGuard(const EpochGuard &) = delete;
+};
@@ -0,0 +1,504 @@
+#include "hpack.h"
+
+#include <string.h>
+
+// size of the table we allow peers to use and the size we use towards them
+static constexpr size_t DefaultTableSize = 4096;
+
+// each entry is charged for its strings plus this much bookkeeping
+static constexpr size_t EntryOverhead = 32;
+
+static constexpr size_t StaticTableSize = 61;
+
+struct HPACKEntry
+{
+	const char *name;
+	const char *value;
+};
+
+struct HuffmanCode
+{
+	unsigned int code;
+	unsigned char length;
+};
+
+static const HPACKEntry StaticTable[StaticTableSize] =
+{
+	{ ":authority", "" },
+	{ ":method", "GET" },
+	{ ":method", "POST" },
+	{ ":path", "/" },
+	{ ":path", "/index.html" },
+	{ ":scheme", "http" },
+	{ ":scheme", "https" },
+	{ ":status", "200" },
+	{ ":status", "204" },
+	{ ":status", "206" },
+	{ ":status", "304" },
+	{ ":status", "400" },
+	{ ":status", "404" },
+	{ ":status", "500" },
+	{ "accept-charset", "" },
+	{ "accept-encoding", "gzip, deflate" },
+	{ "accept-language", "" },
+	{ "accept-ranges", "" },
+	{ "accept", "" },
+	{ "access-control-allow-origin", "" },
+	{ "age", "" },
+	{ "allow", "" },
+	{ "authorization", "" },
+	{ "cache-control", "" },
+	{ "content-disposition", "" },
+	{ "content-encoding", "" },
+	{ "content-language", "" },
+	{ "content-length", "" },
+	{ "content-location", "" },
+	{ "content-range", "" },
+	{ "content-type", "" },
+	{ "cookie", "" },
+	{ "date", "" },
+	{ "etag", "" },
+	{ "expect", "" },
+	{ "expires", "" },
+	{ "from", "" },
+	{ "host", "" },
+	{ "if-match", "" },
+	{ "if-modified-since", "" },
+	{ "if-none-match", "" },
+	{ "if-range", "" },
+	{ "if-unmodified-since", "" },
+	{ "last-modified", "" },
+	{ "link", "" },
+	{ "location", "" },
+	{ "max-forwards", "" },
+	{ "proxy-authenticate", "" },
+	{ "proxy-authorization", "" },
+	{ "range", "" },
+	{ "referer", "" },
+	{ "refresh", "" },
+	{ "retry-after", "" },
+	{ "server", "" },
+	{ "set-cookie", "" },
+	{ "strict-transport-security", "" },
+	{ "transfer-encoding", "" },
+	{ "user-agent", "" },
+	{ "vary", "" },
+	{ "via", "" },
+	{ "www-authenticate", "" },
+};
+
+// code and bit length of each symbol, 256 is EOS
+static const HuffmanCode HuffmanCodes[257] =
+{
+	{ 0x1ff8, 13 }, { 0x7fffd8, 23 }, { 0xfffffe2, 28 }, { 0xfffffe3, 28 },
+	{ 0xfffffe4, 28 }, { 0xfffffe5, 28 }, { 0xfffffe6, 28 }, { 0xfffffe7, 28 },
+	{ 0xfffffe8, 28 }, { 0xffffea, 24 }, { 0x3ffffffc, 30 }, { 0xfffffe9, 28 },
+	{ 0xfffffea, 28 }, { 0x3ffffffd, 30 }, { 0xfffffeb, 28 }, { 0xfffffec, 28 },
+	{ 0xfffffed, 28 }, { 0xfffffee, 28 }, { 0xfffffef, 28 }, { 0xffffff0, 28 },
+	{ 0xffffff1, 28 }, { 0xffffff2, 28 }, { 0x3ffffffe, 30 }, { 0xffffff3, 28 },
+	{ 0xffffff4, 28 }, { 0xffffff5, 28 }, { 0xffffff6, 28 }, { 0xffffff7, 28 },
+	{ 0xffffff8, 28 }, { 0xffffff9, 28 }, { 0xffffffa, 28 }, { 0xffffffb, 28 },
+	{ 0x14, 6 }, { 0x3f8, 10 }, { 0x3f9, 10 }, { 0xffa, 12 },
+	{ 0x1ff9, 13 }, { 0x15, 6 }, { 0xf8, 8 }, { 0x7fa, 11 },
+	{ 0x3fa, 10 }, { 0x3fb, 10 }, { 0xf9, 8 }, { 0x7fb, 11 },
+	{ 0xfa, 8 }, { 0x16, 6 }, { 0x17, 6 }, { 0x18, 6 },
+	{ 0x0, 5 }, { 0x1, 5 }, { 0x2, 5 }, { 0x19, 6 },
+	{ 0x1a, 6 }, { 0x1b, 6 }, { 0x1c, 6 }, { 0x1d, 6 },
+	{ 0x1e, 6 }, { 0x1f, 6 }, { 0x5c, 7 }, { 0xfb, 8 },
+	{ 0x7ffc, 15 }, { 0x20, 6 }, { 0xffb, 12 }, { 0x3fc, 10 },
+	{ 0x1ffa, 13 }, { 0x21, 6 }, { 0x5d, 7 }, { 0x5e, 7 },
+	{ 0x5f, 7 }, { 0x60, 7 }, { 0x61, 7 }, { 0x62, 7 },
+	{ 0x63, 7 }, { 0x64, 7 }, { 0x65, 7 }, { 0x66, 7 },
+	{ 0x67, 7 }, { 0x68, 7 }, { 0x69, 7 }, { 0x6a, 7 },
+	{ 0x6b, 7 }, { 0x6c, 7 }, { 0x6d, 7 }, { 0x6e, 7 },
+	{ 0x6f, 7 }, { 0x70, 7 }, { 0x71, 7 }, { 0x72, 7 },
+	{ 0xfc, 8 }, { 0x73, 7 }, { 0xfd, 8 }, { 0x1ffb, 13 },
+	{ 0x7fff0, 19 }, { 0x1ffc, 13 }, { 0x3ffc, 14 }, { 0x22, 6 },
+	{ 0x7ffd, 15 }, { 0x3, 5 }, { 0x23, 6 }, { 0x4, 5 },
+	{ 0x24, 6 }, { 0x5, 5 }, { 0x25, 6 }, { 0x26, 6 },
+	{ 0x27, 6 }, { 0x6, 5 }, { 0x74, 7 }, { 0x75, 7 },
+	{ 0x28, 6 }, { 0x29, 6 }, { 0x2a, 6 }, { 0x7, 5 },
+	{ 0x2b, 6 }, { 0x76, 7 }, { 0x2c, 6 }, { 0x8, 5 },
+	{ 0x9, 5 }, { 0x2d, 6 }, { 0x77, 7 }, { 0x78, 7 },
+	{ 0x79, 7 }, { 0x7a, 7 }, { 0x7b, 7 }, { 0x7ffe, 15 },
+	{ 0x7fc, 11 }, { 0x3ffd, 14 }, { 0x1ffd, 13 }, { 0xffffffc, 28 },
+	{ 0xfffe6, 20 }, { 0x3fffd2, 22 }, { 0xfffe7, 20 }, { 0xfffe8, 20 },
+	{ 0x3fffd3, 22 }, { 0x3fffd4, 22 }, { 0x3fffd5, 22 }, { 0x7fffd9, 23 },
+	{ 0x3fffd6, 22 }, { 0x7fffda, 23 }, { 0x7fffdb, 23 }, { 0x7fffdc, 23 },
+	{ 0x7fffdd, 23 }, { 0x7fffde, 23 }, { 0xffffeb, 24 }, { 0x7fffdf, 23 },
+	{ 0xffffec, 24 }, { 0xffffed, 24 }, { 0x3fffd7, 22 }, { 0x7fffe0, 23 },
+	{ 0xffffee, 24 }, { 0x7fffe1, 23 }, { 0x7fffe2, 23 }, { 0x7fffe3, 23 },
+	{ 0x7fffe4, 23 }, { 0x1fffdc, 21 }, { 0x3fffd8, 22 }, { 0x7fffe5, 23 },
+	{ 0x3fffd9, 22 }, { 0x7fffe6, 23 }, { 0x7fffe7, 23 }, { 0xffffef, 24 },
+	{ 0x3fffda, 22 }, { 0x1fffdd, 21 }, { 0xfffe9, 20 }, { 0x3fffdb, 22 },
+	{ 0x3fffdc, 22 }, { 0x7fffe8, 23 }, { 0x7fffe9, 23 }, { 0x1fffde, 21 },
+	{ 0x7fffea, 23 }, { 0x3fffdd, 22 }, { 0x3fffde, 22 }, { 0xfffff0, 24 },
+	{ 0x1fffdf, 21 }, { 0x3fffdf, 22 }, { 0x7fffeb, 23 }, { 0x7fffec, 23 },
+	{ 0x1fffe0, 21 }, { 0x1fffe1, 21 }, { 0x3fffe0, 22 }, { 0x1fffe2, 21 },
+	{ 0x7fffed, 23 }, { 0x3fffe1, 22 }, { 0x7fffee, 23 }, { 0x7fffef, 23 },
+	{ 0xfffea, 20 }, { 0x3fffe2, 22 }, { 0x3fffe3, 22 }, { 0x3fffe4, 22 },
+	{ 0x7ffff0, 23 }, { 0x3fffe5, 22 }, { 0x3fffe6, 22 }, { 0x7ffff1, 23 },
+	{ 0x3ffffe0, 26 }, { 0x3ffffe1, 26 }, { 0xfffeb, 20 }, { 0x7fff1, 19 },
+	{ 0x3fffe7, 22 }, { 0x7ffff2, 23 }, { 0x3fffe8, 22 }, { 0x1ffffec, 25 },
+	{ 0x3ffffe2, 26 }, { 0x3ffffe3, 26 }, { 0x3ffffe4, 26 }, { 0x7ffffde, 27 },
+	{ 0x7ffffdf, 27 }, { 0x3ffffe5, 26 }, { 0xfffff1, 24 }, { 0x1ffffed, 25 },
+	{ 0x7fff2, 19 }, { 0x1fffe3, 21 }, { 0x3ffffe6, 26 }, { 0x7ffffe0, 27 },
+	{ 0x7ffffe1, 27 }, { 0x3ffffe7, 26 }, { 0x7ffffe2, 27 }, { 0xfffff2, 24 },
+	{ 0x1fffe4, 21 }, { 0x1fffe5, 21 }, { 0x3ffffe8, 26 }, { 0x3ffffe9, 26 },
+	{ 0xffffffd, 28 }, { 0x7ffffe3, 27 }, { 0x7ffffe4, 27 }, { 0x7ffffe5, 27 },
+	{ 0xfffec, 20 }, { 0xfffff3, 24 }, { 0xfffed, 20 }, { 0x1fffe6, 21 },
+	{ 0x3fffe9, 22 }, { 0x1fffe7, 21 }, { 0x1fffe8, 21 }, { 0x7ffff3, 23 },
+	{ 0x3fffea, 22 }, { 0x3fffeb, 22 }, { 0x1ffffee, 25 }, { 0x1ffffef, 25 },
+	{ 0xfffff4, 24 }, { 0xfffff5, 24 }, { 0x3ffffea, 26 }, { 0x7ffff4, 23 },
+	{ 0x3ffffeb, 26 }, { 0x7ffffe6, 27 }, { 0x3ffffec, 26 }, { 0x3ffffed, 26 },
+	{ 0x7ffffe7, 27 }, { 0x7ffffe8, 27 }, { 0x7ffffe9, 27 }, { 0x7ffffea, 27 },
+	{ 0x7ffffeb, 27 }, { 0xffffffe, 28 }, { 0x7ffffec, 27 }, { 0x7ffffed, 27 },
+	{ 0x7ffffee, 27 }, { 0x7ffffef, 27 }, { 0x7fffff0, 27 }, { 0x3ffffee, 26 },
+	{ 0x3fffffff, 30 },
+};
+
+static constexpr int HuffmanEOS = 256;
+
+// binary tree built from HuffmanCodes, a node is either a leaf with a symbol or
+// has two children. Node 0 is the root.
+struct HuffmanTree
+{
+	struct Node
+	{
+		short children[2];
+		short symbol;
+	};
+
+	// a full binary tree with one leaf per symbol
+	Node nodes[(HuffmanEOS + 1) * 2 - 1];
+	int count;
+
+	HuffmanTree() :
+		count(1)
+	{
+		memset(nodes, 0, sizeof(nodes));
+		nodes[0].symbol = -1;
+
+		for (int symbol = 0; symbol <= HuffmanEOS; symbol++)
+		{
+			const HuffmanCode &code = HuffmanCodes[symbol];
+
+			int node = 0;
+			for (int bit = code.length - 1; bit >= 0; bit--)
+			{
+				int branch = (code.code >> bit) & 1;
+				if (!nodes[node].children[branch])
+				{
+					nodes[count].symbol = -1;
+					nodes[node].children[branch] = (short)count++;
+				}
+				node = nodes[node].children[branch];
+			}
+
+			nodes[node].symbol = (short)symbol;
+		}
+	}
+};
+
+static const HuffmanTree Huffman;
+
+static bool DecodeHuffman(const unsigned char *data, size_t size, std::string &dest)
+{
+	int node = 0;
+	int depth = 0;  // bits since the last symbol
+	bool allOnes = true;
+
+	for (size_t i = 0; i < size; i++)
+	{
+		for (int bit = 7; bit >= 0; bit--)
+		{
+			int branch = (data[i] >> bit) & 1;
+			node = Huffman.nodes[node].children[branch];
+			if (!node) return false;
+
+			depth++;
+			allOnes = allOnes && branch;
+
+			int symbol = Huffman.nodes[node].symbol;
+			if (symbol >= 0)
+			{
+				if (symbol == HuffmanEOS) return false;
+
+				dest.push_back((char)symbol);
+				node = 0;
+				depth = 0;
+				allOnes = true;
+			}
+		}
+	}
+
+	// padding has to be a prefix of EOS, which is all ones, and shorter than a byte
+	return depth < 8 && allOnes;
+}
+
+// integer with an n bit prefix, the remaining bits of the first byte are flags
+static bool DecodeInteger(const unsigned char *&pos, const unsigned char *end, int prefix, size_t *result)
+{
+	if (pos >= end) return false;
+
+	const size_t max = ((size_t)1 << prefix) - 1;
+	size_t value = *pos++ & max;
+	if (value < max)
+	{
+		*result = value;
+		return true;
+	}
+
+	for (int shift = 0; pos < end; shift += 7)
+	{
+		// anything larger is not a sensible length or index
+		if (shift > 28) return false;
+
+		unsigned char c = *pos++;
+		value += (size_t)(c & 0x7f) << shift;
+		if (!(c & 0x80))
+		{
+			*result = value;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static void EncodeInteger(size_t value, int prefix, unsigned char flags, StringBuilder &dest)
+{
+	const size_t max = ((size_t)1 << prefix) - 1;
+	if (value < max)
+	{
+		dest.Append((char)(flags | value));
+		return;
+	}
+
+	dest.Append((char)(flags | max));
+	value -= max;
+	while (value >= 0x80)
+	{
+		dest.Append((char)((value & 0x7f) | 0x80));
+		value >>= 7;
+	}
+	dest.Append((char)value);
+}
+
+static bool DecodeString(const unsigned char *&pos, const unsigned char *end, std::string &dest)
+{
+	if (pos >= end) return false;
+
+	bool huffman = (*pos & 0x80) != 0;
+
+	size_t length;
+	if (!DecodeInteger(pos, end, 7, &length) || length > (size_t)(end - pos))
+		return false;
+
+	dest.clear();
+	if (huffman)
+	{
+		if (!DecodeHuffman(pos, length, dest))
+			return false;
+	}
+	else
+		dest.assign((const char *)pos, length);
+
+	pos += length;
+	return true;
+}
+
+static void EncodeString(std::string_view string, StringBuilder &dest)
+{
+	EncodeInteger(string.length(), 7, 0, dest);
+	dest.Append(string.data(), string.length());
+}
+
+HPACKTable::HPACKTable(size_t maxSize) :
+	m_entries(), m_size(0), m_maxSize(maxSize)
+{
+}
+
+void HPACKTable::Evict(size_t maxSize)
+{
+	while (m_size > maxSize)
+	{
+		const HPACKHeader &oldest = m_entries.back();
+		m_size -= oldest.name.length() + oldest.value.length() + EntryOverhead;
+		m_entries.pop_back();
+	}
+}
+
+void HPACKTable::Add(std::string_view name, std::string_view value)
+{
+	const size_t size = name.length() + value.length() + EntryOverhead;
+	if (size > m_maxSize)
+	{
+		Evict(0);
+		return;
+	}
+
+	Evict(m_maxSize - size);
+	m_entries.push_front(HPACKHeader{ std::string(name), std::string(value) });
+	m_size += size;
+}
+
+void HPACKTable::SetMaxSize(size_t maxSize)
+{
+	m_maxSize = maxSize;
+	Evict(maxSize);
+}
+
+HPACKDecoder::HPACKDecoder(size_t maxTableSize) :
+	m_table(maxTableSize), m_maxTableSize(maxTableSize)
+{
+}
+
+bool HPACKDecoder::Decode(const char *data, size_t size, size_t maxListSize, std::vector<HPACKHeader> &headers)
+{
+	const unsigned char *pos = (const unsigned char *)data;
+	const unsigned char *end = pos + size;
+
+	size_t listSize = 0;
+	bool first = true;
+	while (pos < end)
+	{
+		const unsigned char c = *pos;
+
+		if (c & 0x80)
+		{
+			// indexed field
+			size_t index;
+			if (!DecodeInteger(pos, end, 7, &index) || index == 0)
+				return false;
+
+			if (index <= StaticTableSize)
+				headers.push_back(HPACKHeader{ StaticTable[index - 1].name, StaticTable[index - 1].value });
+			else if (index - StaticTableSize - 1 < m_table.Count())
+				headers.push_back(m_table.Get(index - StaticTableSize - 1));
+			else
+				return false;
+		}
+		else if ((c & 0xe0) == 0x20)
+		{
+			// dynamic table size update, only allowed before the first field
+			size_t maxSize;
+			if (!first || !DecodeInteger(pos, end, 5, &maxSize) || maxSize > m_maxTableSize)
+				return false;
+
+			m_table.SetMaxSize(maxSize);
+			continue;
+		}
+		else
+		{
+			// literal, added to the table with incremental indexing
+			const bool indexing = (c & 0xc0) == 0x40;
+			const int prefix = indexing ? 6 : 4;
+
+			size_t index;
+			if (!DecodeInteger(pos, end, prefix, &index))
+				return false;
+
+			HPACKHeader header;
+			if (index == 0)
+			{
+				if (!DecodeString(pos, end, header.name))
+					return false;
+			}
+			else if (index <= StaticTableSize)
+				header.name = StaticTable[index - 1].name;
+			else if (index - StaticTableSize - 1 < m_table.Count())
+				header.name = m_table.Get(index - StaticTableSize - 1).name;
+			else
+				return false;
+
+			if (!DecodeString(pos, end, header.value))
+				return false;
+
+			if (indexing)
+				m_table.Add(header.name, header.value);
+
+			headers.push_back(std::move(header));
+		}
+
+		const HPACKHeader &added = headers.back();
+		listSize += added.name.length() + added.value.length() + EntryOverhead;
+		if (listSize > maxListSize)
+			return false;
+
+		first = false;
+	}
+
+	return true;
+}
+
+HPACKEncoder::HPACKEncoder() :
+	m_table(DefaultTableSize), m_sizeChanged(false)
+{
+}
+
+void HPACKEncoder::SetMaxTableSize(size_t size)
+{
+	if (size > DefaultTableSize)
+		size = DefaultTableSize;
+
+	if (size != m_table.GetMaxSize())
+	{
+		m_table.SetMaxSize(size);
+		m_sizeChanged = true;
+	}
+}
+
+void HPACKEncoder::Begin(StringBuilder &dest)
+{
+	if (m_sizeChanged)
+	{
+		EncodeInteger(m_table.GetMaxSize(), 5, 0x20, dest);
+		m_sizeChanged = false;
+	}
+}
+
+void HPACKEncoder::Encode(std::string_view name, std::string_view value, bool index, StringBuilder &dest)
+{
+	size_t nameIndex = 0;
+
+	for (size_t i = 0; i < StaticTableSize; i++)
+	{
+		if (name != StaticTable[i].name)
+			continue;
+
+		if (value == StaticTable[i].value)
+		{
+			EncodeInteger(i + 1, 7, 0x80, dest);
+			return;
+		}
+
+		if (!nameIndex)
+			nameIndex = i + 1;
+	}
+
+	for (size_t i = 0; i < m_table.Count(); i++)
+	{
+		const HPACKHeader &entry = m_table.Get(i);
+		if (name != entry.name)
+			continue;
+
+		if (value == entry.value)
+		{
+			EncodeInteger(StaticTableSize + i + 1, 7, 0x80, dest);
+			return;
+		}
+
+		if (!nameIndex)
+			nameIndex = StaticTableSize + i + 1;
+	}
+
+	// literal with incremental indexing or without indexing
+	EncodeInteger(nameIndex, index ? 6 : 4, index ? 0x40 : 0x00, dest);
+	if (!nameIndex)
+		EncodeString(name, dest);
+	EncodeString(value, dest);
+
+	if (index)
+		m_table.Add(name, value);
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <deque>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "string_builder.h"
+
+struct HPACKHeader
+{
+	std::string name;
+	std::string value;
+};
+
+// HPACK dynamic table, the newest entry has the lowest index
+class HPACKTable
+{
+private:
+	std::deque<HPACKHeader> m_entries;
+	size_t m_size;
+	size_t m_maxSize;
+
+	void Evict(size_t maxSize);
+public:
+	HPACKTable(size_t maxSize);
+
+	// entries larger than the whole table empty it and are not added
+	void Add(std::string_view name, std::string_view value);
+
+	void SetMaxSize(size_t maxSize);
+
+	constexpr size_t GetMaxSize() const
+	{
+		return m_maxSize;
+	}
+
+	inline size_t Count() const
+	{
+		return m_entries.size();
+	}
+
+	// index is relative to the dynamic table, starting at 0
+	inline const HPACKHeader &Get(size_t index) const
+	{
+		return m_entries[index];
+	}
+};
+
+// Decodes header blocks received from a peer. The dynamic table is kept across
+// blocks, so every block of a connection has to be decoded in the order received.
+class HPACKDecoder
+{
+private:
+	HPACKTable m_table;
+	size_t m_maxTableSize;  // limit announced to the peer
+public:
+	HPACKDecoder(size_t maxTableSize);
+
+	// decodes a complete header block and appends its fields to headers, returns
+	// false on malformed input, which is a connection error. Fields count with their
+	// name, value and 32 bytes towards maxListSize, a larger list is also refused,
+	// as literals and table references can expand far beyond the block itself.
+	bool Decode(const char *data, size_t size, size_t maxListSize, std::vector<HPACKHeader> &headers);
+};
+
+// Encodes header blocks sent to a peer. Fields sent before are referred to by their
+// index in the dynamic table, other strings are sent as literals without Huffman coding.
+class HPACKEncoder
+{
+private:
+	HPACKTable m_table;
+	bool m_sizeChanged;
+public:
+	HPACKEncoder();
+
+	// applies the table size the peer announced, the change is signalled at the
+	// start of the next header block
+	void SetMaxTableSize(size_t size);
+
+	// starts a header block in dest
+	void Begin(StringBuilder &dest);
+
+	// appends one field, the name must be lowercase. Values which change with every
+	// response are not worth a table entry and should pass index = false.
+	void Encode(std::string_view name, std::string_view value, bool index, StringBuilder &dest);
+};
@@ -0,0 +1,977 @@
+#include "http2.h"
+
+#include <string.h>
+
+static constexpr char Preface[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+static constexpr size_t PrefaceLength = sizeof(Preface) - 1;
+
+static constexpr char SwitchingProtocols[] = "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n";
+static constexpr size_t SwitchingProtocolsLength = sizeof(SwitchingProtocols) - 1;
+
+static constexpr size_t FrameHeaderLength = 9;
+
+// largest frame accepted from the peer and largest DATA frame sent
+static constexpr size_t MaxFrameSize = 16384;
+
+static constexpr size_t MaxHeaderBlock = 64 * 1024;
+static constexpr unsigned int MaxConcurrentStreams = 100;
+static constexpr size_t HeaderTableSize = 4096;
+
+static constexpr long long DefaultWindow = 65535;
+
+// body bytes a session holds for requests not handed out yet, in bodies of the
+// largest size allowed. Beyond it the connection window is only credited again
+// once requests are taken.
+static constexpr size_t BufferedBodies = 4;
+static constexpr long long MaxWindow = 0x7fffffff;
+
+// bytes added by one call to CollectOutput, so a large response is sent in parts
+static constexpr size_t OutputBudget = 64 * 1024;
+
+enum
+{
+	SESSION_PREFACE = 0,
+	SESSION_SETTINGS,  // the first frame after the preface has to be SETTINGS
+	SESSION_OPEN,
+	SESSION_FAILED
+};
+
+enum
+{
+	FRAME_DATA = 0,
+	FRAME_HEADERS,
+	FRAME_PRIORITY,
+	FRAME_RST_STREAM,
+	FRAME_SETTINGS,
+	FRAME_PUSH_PROMISE,
+	FRAME_PING,
+	FRAME_GOAWAY,
+	FRAME_WINDOW_UPDATE,
+	FRAME_CONTINUATION
+};
+
+enum
+{
+	FLAG_END_STREAM = 0x1,
+	FLAG_ACK = 0x1,
+	FLAG_END_HEADERS = 0x4,
+	FLAG_PADDED = 0x8,
+	FLAG_PRIORITY = 0x20
+};
+
+enum
+{
+	SETTINGS_HEADER_TABLE_SIZE = 1,
+	SETTINGS_ENABLE_PUSH,
+	SETTINGS_MAX_CONCURRENT_STREAMS,
+	SETTINGS_INITIAL_WINDOW_SIZE,
+	SETTINGS_MAX_FRAME_SIZE,
+	SETTINGS_MAX_HEADER_LIST_SIZE
+};
+
+enum
+{
+	ERROR_NONE = 0,
+	ERROR_PROTOCOL,
+	ERROR_INTERNAL,
+	ERROR_FLOW_CONTROL,
+	ERROR_SETTINGS_TIMEOUT,
+	ERROR_STREAM_CLOSED,
+	ERROR_FRAME_SIZE,
+	ERROR_REFUSED_STREAM,
+	ERROR_CANCEL,
+	ERROR_COMPRESSION,
+	ERROR_CONNECT,
+	ERROR_ENHANCE_YOUR_CALM
+};
+
+struct HTTP2Stream : public Pooled
+{
+	unsigned int id;
+
+	HTTPRequest *request;  // owned by the stream until NextRequest hands it out
+	StringBuilder body;
+	long long expectedLength;  // content-length sent by the peer, -1 if none
+	bool received;  // the peer ended its side of the stream
+	size_t held;  // body bytes counted against the session's buffer limit
+
+	HTTPResponse *response;
+	bool headersSent;
+	size_t sent;  // body bytes sent
+	long long sendWindow;
+
+	HTTP2Stream(unsigned int id, long long window) :
+		id(id), request(nullptr), body(), expectedLength(-1), received(false), held(0),
+		response(nullptr), headersSent(false), sent(0), sendWindow(window) { }
+
+	~HTTP2Stream()
+	{
+		delete request;
+		delete response;
+	}
+};
+
+static inline unsigned int ReadUInt32(const unsigned char *data)
+{
+	return ((unsigned int)data[0] << 24) | ((unsigned int)data[1] << 16) | ((unsigned int)data[2] << 8) | data[3];
+}
+
+static inline void WriteUInt32(StringBuilder &dest, unsigned int value)
+{
+	dest.Append((char)(value >> 24)).Append((char)(value >> 16)).Append((char)(value >> 8)).Append((char)value);
+}
+
+static void WriteFrameHeader(StringBuilder &dest, size_t length, int type, int flags, unsigned int stream)
+{
+	dest.Append((char)(length >> 16)).Append((char)(length >> 8)).Append((char)length);
+	dest.Append((char)type).Append((char)flags);
+	WriteUInt32(dest, stream);
+}
+
+static void WriteSetting(StringBuilder &dest, int id, unsigned int value)
+{
+	dest.Append((char)(id >> 8)).Append((char)id);
+	WriteUInt32(dest, value);
+}
+
+// strips the padding of a DATA or HEADERS payload, returns false if it is malformed
+static bool RemovePadding(int flags, const unsigned char *&payload, size_t &length)
+{
+	if (!(flags & FLAG_PADDED))
+		return true;
+
+	if (length < 1 || payload[0] >= length)
+		return false;
+
+	length -= 1 + payload[0];
+	payload++;
+	return true;
+}
+
+// HTTP2-Settings carries a SETTINGS payload in base64url without padding
+static bool DecodeBase64Url(std::string_view text, std::string &dest)
+{
+	unsigned int bits = 0;
+	int count = 0;
+
+	for (char c : text)
+	{
+		int value;
+		if (c >= 'A' && c <= 'Z')
+			value = c - 'A';
+		else if (c >= 'a' && c <= 'z')
+			value = c - 'a' + 26;
+		else if (c >= '0' && c <= '9')
+			value = c - '0' + 52;
+		else if (c == '-' || c == '+')
+			value = 62;
+		else if (c == '_' || c == '/')
+			value = 63;
+		else if (c == '=')
+			break;
+		else
+			return false;
+
+		bits = (bits << 6) | value;
+		count += 6;
+		if (count >= 8)
+		{
+			count -= 8;
+			dest.push_back((char)(bits >> count));
+			bits &= (1u << count) - 1;
+		}
+	}
+
+	return true;
+}
+
+int MatchHTTP2Preface(const char *data, size_t size)
+{
+	const size_t length = size < PrefaceLength ? size : PrefaceLength;
+	if (length == 0)
+		return PARSE_INCOMPLETE;
+	if (memcmp(data, Preface, length) != 0)
+		return PARSE_ERROR;
+	return length == PrefaceLength ? PARSE_OK : PARSE_INCOMPLETE;
+}
+
+HTTP2Session::HTTP2Session(HTTPConnection *connection, size_t maxBody) :
+	m_connection(connection), m_state(SESSION_PREFACE), m_decoder(HeaderTableSize), m_encoder(),
+	m_streams(), m_ready(), m_lastStream(0), m_headerStream(0), m_headerFlags(0), m_headerError(ERROR_NONE),
+	m_headerBlock(), m_sendWindow(DefaultWindow), m_initialWindow(DefaultWindow), m_maxFrameSize(MaxFrameSize),
+	m_maxBody(maxBody), m_buffered(0), m_uncredited(0), m_peerClosing(false), m_control()
+{
+}
+
+HTTP2Session::~HTTP2Session()
+{
+	for (auto &p : m_streams)
+		delete p.second;
+}
+
+bool HTTP2Session::IsUpgrade(const HTTPRequest *request)
+{
+	// a body would have to be read before switching, such requests stay on HTTP/1.1
+	const std::string_view *upgrade = request->GetHeader(HEADER_UPGRADE);
+	return upgrade && EqualsIgnoreCase(*upgrade, "h2c") && request->GetHeader(HEADER_HTTP2_SETTINGS) &&
+		request->GetContentLength() == 0;
+}
+
+bool HTTP2Session::Start(HTTPRequest *upgrade)
+{
+	if (upgrade)
+	{
+		// the 101 response acknowledges these settings
+		std::string settings;
+		if (!DecodeBase64Url(*upgrade->GetHeader(HEADER_HTTP2_SETTINGS), settings) || settings.length() % 6 != 0 ||
+			!ApplySettings((const unsigned char *)settings.data(), settings.length()))
+			return false;
+
+		m_control.Append(SwitchingProtocols, SwitchingProtocolsLength);
+	}
+
+	WriteFrameHeader(m_control, 12, FRAME_SETTINGS, 0, 0);
+	WriteSetting(m_control, SETTINGS_MAX_CONCURRENT_STREAMS, MaxConcurrentStreams);
+	WriteSetting(m_control, SETTINGS_MAX_HEADER_LIST_SIZE, (unsigned int)MaxHeaderBlock);
+
+	if (upgrade)
+	{
+		HTTP2Stream *stream = new HTTP2Stream(1, m_initialWindow);
+		stream->request = upgrade;
+		stream->received = true;
+		upgrade->m_stream = 1;
+
+		m_streams[1] = stream;
+		m_lastStream = 1;
+		m_ready.push_back(1);
+	}
+
+	return true;
+}
+
+bool HTTP2Session::Fail(int error)
+{
+	if (m_state != SESSION_FAILED)
+	{
+		WriteFrameHeader(m_control, 8, FRAME_GOAWAY, 0, 0);
+		WriteUInt32(m_control, m_lastStream);
+		WriteUInt32(m_control, error);
+		m_state = SESSION_FAILED;
+	}
+
+	return false;
+}
+
+void HTTP2Session::ResetStream(unsigned int id, int error)
+{
+	WriteFrameHeader(m_control, 4, FRAME_RST_STREAM, 0, id);
+	WriteUInt32(m_control, error);
+
+	HTTP2Stream *stream = FindStream(id);
+	if (stream)
+		CloseStream(stream);
+}
+
+void HTTP2Session::CloseStream(HTTP2Stream *stream)
+{
+	ReleaseBody(stream);
+	m_streams.erase(stream->id);
+	delete stream;
+}
+
+void HTTP2Session::ReleaseBody(HTTP2Stream *stream)
+{
+	if (stream->held == 0) return;
+
+	m_buffered -= stream->held;
+	stream->held = 0;
+	CreditConnection();
+}
+
+void HTTP2Session::CreditConnection()
+{
+	if (m_state == SESSION_FAILED) return;
+
+	// held data beyond the limit stays uncredited, so the peer runs out of window
+	const size_t limit = m_maxBody * BufferedBodies;
+	const size_t excess = m_buffered > limit ? m_buffered - limit : 0;
+	if (m_uncredited > excess)
+	{
+		WriteWindowUpdate(0, m_uncredited - excess);
+		m_uncredited = excess;
+	}
+}
+
+void HTTP2Session::WriteWindowUpdate(unsigned int id, size_t increment)
+{
+	WriteFrameHeader(m_control, 4, FRAME_WINDOW_UPDATE, 0, id);
+	WriteUInt32(m_control, (unsigned int)increment);
+}
+
+HTTP2Stream *HTTP2Session::FindStream(unsigned int id) const
+{
+	auto it = m_streams.find(id);
+	return it == m_streams.end() ? nullptr : it->second;
+}
+
+int HTTP2Session::Receive(const char *data, size_t size)
+{
+	if (m_state == SESSION_FAILED)
+		return -1;
+
+	size_t pos = 0;
+	if (m_state == SESSION_PREFACE)
+	{
+		switch (MatchHTTP2Preface(data, size))
+		{
+		case PARSE_INCOMPLETE:
+			return 0;
+		case PARSE_ERROR:
+			Fail(ERROR_PROTOCOL);
+			return -1;
+		}
+
+		pos = PrefaceLength;
+		m_state = SESSION_SETTINGS;
+	}
+
+	while (size - pos >= FrameHeaderLength)
+	{
+		const unsigned char *header = (const unsigned char *)data + pos;
+		const size_t length = ((size_t)header[0] << 16) | ((size_t)header[1] << 8) | header[2];
+		if (length > MaxFrameSize)
+		{
+			Fail(ERROR_FRAME_SIZE);
+			return -1;
+		}
+
+		if (size - pos - FrameHeaderLength < length)
+			break;
+
+		const unsigned int stream = ReadUInt32(header + 5) & 0x7fffffff;
+		if (!OnFrame(header[3], header[4], stream, header + FrameHeaderLength, length))
+			return -1;
+
+		pos += FrameHeaderLength + length;
+	}
+
+	return (int)pos;
+}
+
+bool HTTP2Session::OnFrame(int type, int flags, unsigned int stream, const unsigned char *payload, size_t length)
+{
+	if (m_state == SESSION_SETTINGS)
+	{
+		if (type != FRAME_SETTINGS || (flags & FLAG_ACK))
+			return Fail(ERROR_PROTOCOL);
+		m_state = SESSION_OPEN;
+	}
+
+	// a header block can't be interrupted by other frames
+	if (m_headerStream && (type != FRAME_CONTINUATION || stream != m_headerStream))
+		return Fail(ERROR_PROTOCOL);
+
+	switch (type)
+	{
+	case FRAME_DATA:
+		return OnData(flags, stream, payload, length);
+	case FRAME_HEADERS:
+		return OnHeaders(flags, stream, payload, length);
+	case FRAME_PRIORITY:
+		// priorities are not used, responses share the window evenly
+		if (!stream)
+			return Fail(ERROR_PROTOCOL);
+		if (length != 5)
+			ResetStream(stream, ERROR_FRAME_SIZE);
+		return true;
+	case FRAME_RST_STREAM:
+		if (!stream || stream > m_lastStream)
+			return Fail(ERROR_PROTOCOL);
+		if (length != 4)
+			return Fail(ERROR_FRAME_SIZE);
+
+		if (HTTP2Stream *closed = FindStream(stream))
+			CloseStream(closed);
+		return true;
+	case FRAME_SETTINGS:
+		return OnSettings(flags, stream, payload, length);
+	case FRAME_PUSH_PROMISE:
+		// only servers push
+		return Fail(ERROR_PROTOCOL);
+	case FRAME_PING:
+		if (stream)
+			return Fail(ERROR_PROTOCOL);
+		if (length != 8)
+			return Fail(ERROR_FRAME_SIZE);
+
+		if (!(flags & FLAG_ACK))
+		{
+			WriteFrameHeader(m_control, 8, FRAME_PING, FLAG_ACK, 0);
+			m_control.Append((const char *)payload, 8);
+		}
+		return true;
+	case FRAME_GOAWAY:
+		if (stream)
+			return Fail(ERROR_PROTOCOL);
+		if (length < 8)
+			return Fail(ERROR_FRAME_SIZE);
+
+		// streams already opened are still answered
+		m_peerClosing = true;
+		return true;
+	case FRAME_WINDOW_UPDATE:
+		return OnWindowUpdate(stream, payload, length);
+	case FRAME_CONTINUATION:
+		if (!m_headerStream)
+			return Fail(ERROR_PROTOCOL);
+		if (m_headerBlock.Size() + length > MaxHeaderBlock)
+			return Fail(ERROR_ENHANCE_YOUR_CALM);
+
+		m_headerBlock.Append((const char *)payload, length);
+		return (flags & FLAG_END_HEADERS) ? OnHeaderBlock() : true;
+	}
+
+	// unknown frame types are ignored
+	return true;
+}
+
+bool HTTP2Session::OnData(int flags, unsigned int id, const unsigned char *payload, size_t length)
+{
+	if (!id || id > m_lastStream)
+		return Fail(ERROR_PROTOCOL);
+
+	// a stream is bounded by m_maxBody and credited as its data is kept. The
+	// connection is credited by CreditConnection, which holds back data kept
+	// beyond the session's limit until the requests are taken.
+	const size_t frameLength = length;
+	m_uncredited += frameLength;
+
+	if (!RemovePadding(flags, payload, length))
+		return Fail(ERROR_PROTOCOL);
+
+	HTTP2Stream *stream = FindStream(id);
+	if (!stream || stream->received)
+	{
+		ResetStream(id, ERROR_STREAM_CLOSED);
+		CreditConnection();
+		return true;
+	}
+
+	if (stream->body.Size() + length > m_maxBody)
+	{
+		ResetStream(id, ERROR_CANCEL);
+		CreditConnection();
+		return true;
+	}
+
+	stream->body.Append((const char *)payload, length);
+	stream->held += length;
+	m_buffered += length;
+
+	if (flags & FLAG_END_STREAM)
+		CompleteRequest(stream);
+	else if (frameLength > 0)
+		WriteWindowUpdate(id, frameLength);
+
+	CreditConnection();
+	return true;
+}
+
+bool HTTP2Session::OnHeaders(int flags, unsigned int id, const unsigned char *payload, size_t length)
+{
+	if (!id)
+		return Fail(ERROR_PROTOCOL);
+
+	if (!RemovePadding(flags, payload, length))
+		return Fail(ERROR_PROTOCOL);
+
+	if (flags & FLAG_PRIORITY)
+	{
+		if (length < 5)
+			return Fail(ERROR_FRAME_SIZE);
+		payload += 5;
+		length -= 5;
+	}
+
+	m_headerError = ERROR_NONE;
+	if (id > m_lastStream)
+	{
+		// clients open streams with increasing odd ids
+		if (!(id & 1))
+			return Fail(ERROR_PROTOCOL);
+
+		m_lastStream = id;
+		if (m_streams.size() < MaxConcurrentStreams && !m_peerClosing)
+			m_streams[id] = new HTTP2Stream(id, m_initialWindow);
+		else
+			m_headerError = ERROR_REFUSED_STREAM;
+	}
+	else if (!FindStream(id))
+		m_headerError = ERROR_STREAM_CLOSED;
+
+	// the block is decoded even if the stream is gone to keep the table in sync
+	m_headerStream = id;
+	m_headerFlags = flags;
+	m_headerBlock.Clear();
+	m_headerBlock.Append((const char *)payload, length);
+
+	return (flags & FLAG_END_HEADERS) ? OnHeaderBlock() : true;
+}
+
+bool HTTP2Session::OnHeaderBlock()
+{
+	const unsigned int id = m_headerStream;
+	m_headerStream = 0;
+
+	std::vector<HPACKHeader> headers;
+	if (!m_decoder.Decode(m_headerBlock.GetElements(), m_headerBlock.Size(), MaxHeaderBlock, headers))
+		return Fail(ERROR_COMPRESSION);
+	m_headerBlock.Clear();
+
+	if (m_headerError != ERROR_NONE)
+	{
+		ResetStream(id, m_headerError);
+		return true;
+	}
+
+	HTTP2Stream *stream = FindStream(id);
+	if (stream->received)
+	{
+		ResetStream(id, ERROR_STREAM_CLOSED);
+		return true;
+	}
+
+	if (stream->request)
+	{
+		// trailers have to end the stream, their fields are dropped
+		if (!(m_headerFlags & FLAG_END_STREAM))
+			return Fail(ERROR_PROTOCOL);
+
+		CompleteRequest(stream);
+		return true;
+	}
+
+	if (!CreateRequest(stream, headers))
+	{
+		ResetStream(id, ERROR_PROTOCOL);
+		return true;
+	}
+
+	if (m_headerFlags & FLAG_END_STREAM)
+		CompleteRequest(stream);
+	return true;
+}
+
+bool HTTP2Session::OnSettings(int flags, unsigned int stream, const unsigned char *payload, size_t length)
+{
+	if (stream)
+		return Fail(ERROR_PROTOCOL);
+
+	if (flags & FLAG_ACK)
+		return length == 0 ? true : Fail(ERROR_FRAME_SIZE);
+
+	if (length % 6 != 0)
+		return Fail(ERROR_FRAME_SIZE);
+
+	if (!ApplySettings(payload, length))
+		return false;
+
+	WriteFrameHeader(m_control, 0, FRAME_SETTINGS, FLAG_ACK, 0);
+	return true;
+}
+
+bool HTTP2Session::ApplySettings(const unsigned char *payload, size_t length)
+{
+	for (size_t i = 0; i + 6 <= length; i += 6)
+	{
+		const int id = (payload[i] << 8) | payload[i + 1];
+		const unsigned int value = ReadUInt32(payload + i + 2);
+
+		switch (id)
+		{
+		case SETTINGS_HEADER_TABLE_SIZE:
+			m_encoder.SetMaxTableSize(value);
+			break;
+		case SETTINGS_ENABLE_PUSH:
+			if (value > 1)
+				return Fail(ERROR_PROTOCOL);
+			break;
+		case SETTINGS_INITIAL_WINDOW_SIZE:
+			if (value > MaxWindow)
+				return Fail(ERROR_FLOW_CONTROL);
+
+			// open streams are adjusted as well, which may leave their window negative
+			for (auto &p : m_streams)
+			{
+				p.second->sendWindow += (long long)value - m_initialWindow;
+				if (p.second->sendWindow > MaxWindow)
+					return Fail(ERROR_FLOW_CONTROL);
+			}
+			m_initialWindow = value;
+			break;
+		case SETTINGS_MAX_FRAME_SIZE:
+			if (value < MaxFrameSize || value > 0xffffff)
+				return Fail(ERROR_PROTOCOL);
+			m_maxFrameSize = value;
+			break;
+		}
+	}
+
+	return true;
+}
+
+bool HTTP2Session::OnWindowUpdate(unsigned int id, const unsigned char *payload, size_t length)
+{
+	if (length != 4)
+		return Fail(ERROR_FRAME_SIZE);
+
+	const unsigned int increment = ReadUInt32(payload) & 0x7fffffff;
+
+	if (!id)
+	{
+		if (!increment)
+			return Fail(ERROR_PROTOCOL);
+
+		m_sendWindow += increment;
+		return m_sendWindow > MaxWindow ? Fail(ERROR_FLOW_CONTROL) : true;
+	}
+
+	if (id > m_lastStream)
+		return Fail(ERROR_PROTOCOL);
+
+	// updates may still arrive for streams which were closed
+	HTTP2Stream *stream = FindStream(id);
+	if (!stream)
+		return true;
+
+	stream->sendWindow += increment;
+	if (!increment)
+		ResetStream(id, ERROR_PROTOCOL);
+	else if (stream->sendWindow > MaxWindow)
+		ResetStream(id, ERROR_FLOW_CONTROL);
+	return true;
+}
+
+bool HTTP2Session::CreateRequest(HTTP2Stream *stream, const std::vector<HPACKHeader> &headers)
+{
+	HTTPRequest *request = new HTTPRequest();
+
+	std::string method;
+	std::string path;
+	std::string authority;
+	bool scheme = false;
+	bool regular = false;
+	bool valid = true;
+
+	for (const HPACKHeader &header : headers)
+	{
+		const std::string &name = header.name;
+		const std::string &value = header.value;
+
+		if (name.empty())
+		{
+			valid = false;
+			break;
+		}
+
+		if (name[0] == ':')
+		{
+			// pseudo-header fields come before all others
+			if (regular)
+				valid = false;
+			else if (name == ":method")
+				method = value;
+			else if (name == ":path")
+				path = value;
+			else if (name == ":scheme")
+				scheme = true;
+			else if (name == ":authority")
+				authority = value;
+			else
+				valid = false;
+
+			if (!valid) break;
+			continue;
+		}
+
+		regular = true;
+
+		// names have to be lowercase and connection specific fields are not allowed
+		for (char c : name)
+		{
+			if (c >= 'A' && c <= 'Z')
+				valid = false;
+		}
+
+		const int id = GetHeaderID(name);
+		if (id == HEADER_CONNECTION || id == HEADER_KEEP_ALIVE || name == "proxy-connection" ||
+			id == HEADER_TRANSFER_ENCODING || id == HEADER_UPGRADE || (id == HEADER_TE && value != "trailers"))
+			valid = false;
+
+		if (!valid) break;
+
+		// cookies may be split into several fields
+		if (id == HEADER_COOKIE)
+		{
+			request->ParseCookies(value);
+			continue;
+		}
+
+		if (id == HEADER_CONTENT_LENGTH)
+		{
+			if (value.empty() || value.length() > 18 || value.find_first_not_of("0123456789") != std::string::npos)
+			{
+				valid = false;
+				break;
+			}
+			stream->expectedLength = std::stoll(value);
+		}
+
+		// repeated fields stay separate like on HTTP/1.1
+		request->m_headers.Add(id, name, value);
+	}
+
+	if (valid)
+	{
+		request->m_method = GetMethodFromString(method);
+		valid = request->m_method != METHOD_NONE && !path.empty() && scheme;
+	}
+
+	if (!valid)
+	{
+		delete request;
+		return false;
+	}
+
+	if (!authority.empty() && !request->GetHeader(HEADER_HOST))
+		request->m_headers.Add(HEADER_HOST, GetHeaderName(HEADER_HOST), authority);
+
+	request->m_uri.Parse(path);
+	request->m_source = m_connection;
+	request->m_stream = stream->id;
+
+	stream->request = request;
+	return true;
+}
+
+void HTTP2Session::CompleteRequest(HTTP2Stream *stream)
+{
+	const size_t length = stream->body.Size();
+	if (stream->expectedLength >= 0 && (size_t)stream->expectedLength != length)
+	{
+		ResetStream(stream->id, ERROR_PROTOCOL);
+		return;
+	}
+
+	HTTPRequest *request = stream->request;
+	request->m_contentlen = length;
+	if (length > 0)
+	{
+		request->m_content = new char[length];
+		memcpy(request->m_content, stream->body.GetElements(), length);
+		stream->body.Clear();
+	}
+
+	stream->received = true;
+	m_ready.push_back(stream->id);
+}
+
+HTTPRequest *HTTP2Session::NextRequest()
+{
+	while (!m_ready.empty())
+	{
+		HTTP2Stream *stream = FindStream(m_ready.front());
+		m_ready.pop_front();
+
+		// the stream may have been reset in the meantime
+		if (stream && stream->request)
+		{
+			HTTPRequest *request = stream->request;
+			stream->request = nullptr;
+			ReleaseBody(stream);
+			return request;
+		}
+	}
+
+	return nullptr;
+}
+
+void HTTP2Session::Submit(const HTTPRequest *request, HTTPResponse *response)
+{
+	HTTP2Stream *stream = request ? FindStream(request->m_stream) : nullptr;
+	if (!stream || stream->response || m_state == SESSION_FAILED)
+	{
+		delete response;
+		return;
+	}
+
+	if (!response)
+	{
+		ResetStream(stream->id, ERROR_INTERNAL);
+		return;
+	}
+
+	response->Finalize();
+	stream->response = response;
+}
+
+size_t HTTP2Session::CollectOutput(StringBuilder &dest)
+{
+	const size_t start = dest.Size();
+
+	dest.Append(m_control.GetElements(), m_control.Size());
+	m_control.Clear();
+
+	if (m_state == SESSION_FAILED)
+		return dest.Size() - start;
+
+	// every stream gets one frame per pass, so they share the window evenly
+	bool progress = true;
+	while (progress && dest.Size() - start < OutputBudget)
+	{
+		progress = false;
+		for (auto it = m_streams.begin(); it != m_streams.end() && dest.Size() - start < OutputBudget;)
+		{
+			// writing may close the stream
+			HTTP2Stream *stream = (it++)->second;
+			if (!stream->response)
+				continue;
+
+			if (!stream->headersSent)
+			{
+				WriteResponseHead(stream, dest);
+				progress = true;
+			}
+			else if (WriteResponseData(stream, dest))
+				progress = true;
+		}
+	}
+
+	return dest.Size() - start;
+}
+
+bool HTTP2Session::IsClosing() const
+{
+	return m_state == SESSION_FAILED || (m_peerClosing && m_streams.empty());
+}
+
+void HTTP2Session::WriteResponseHead(HTTP2Stream *stream, StringBuilder &dest)
+{
+	const HTTPResponse *response = stream->response;
+
+	StringBuilder block;
+	m_encoder.Begin(block);
+	m_encoder.Encode(":status", std::to_string(response->GetCode()), true, block);
+
+	std::string name;
+	for (const auto &field : response->GetHeaders())
+	{
+		// framing replaces these, a streamed body still ends with the stream
+		if (field.id == HEADER_CONNECTION || field.id == HEADER_KEEP_ALIVE || field.id == HEADER_TRANSFER_ENCODING ||
+			field.id == HEADER_UPGRADE)
+			continue;
+
+		name.assign(field.name);
+		for (char &c : name)
+			c = (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+
+		// lengths differ between responses and would only push useful entries out
+		m_encoder.Encode(name, field.value, field.id != HEADER_CONTENT_LENGTH, block);
+	}
+
+	StringBuilder cookie;
+	for (auto &p : response->GetCookies())
+	{
+		cookie.Clear();
+		p.second->AppendToBuilder(cookie);
+		m_encoder.Encode("set-cookie", std::string_view(cookie.GetElements(), cookie.Size()), false, block);
+	}
+
+	size_t length = response->GetFile() ? response->GetFileLength() : response->GetContentLength();
+	const bool empty = !response->IsChunked() && length == 0;
+
+	// blocks larger than a frame continue in CONTINUATION frames
+	size_t offset = 0;
+	do
+	{
+		length = block.Size() - offset;
+		if (length > m_maxFrameSize)
+			length = m_maxFrameSize;
+
+		int flags = offset + length == block.Size() ? FLAG_END_HEADERS : 0;
+		if (offset == 0 && empty)
+			flags |= FLAG_END_STREAM;
+
+		WriteFrameHeader(dest, length, offset == 0 ? FRAME_HEADERS : FRAME_CONTINUATION, flags, stream->id);
+		dest.Append(block.GetElements() + offset, length);
+		offset += length;
+	} while (offset < block.Size());
+
+	stream->headersSent = true;
+	if (empty)
+		CloseStream(stream);
+}
+
+bool HTTP2Session::WriteResponseData(HTTP2Stream *stream, StringBuilder &dest)
+{
+	const HTTPResponse *response = stream->response;
+
+	long long window = m_sendWindow < stream->sendWindow ? m_sendWindow : stream->sendWindow;
+	if (window <= 0)
+		return false;
+	if (window > (long long)MaxFrameSize)
+		window = MaxFrameSize;
+
+	char buffer[MaxFrameSize];
+	const char *data;
+	size_t length;
+	bool last;
+
+	if (response->IsChunked())
+	{
+		int produced = response->ProduceContent(buffer, (int)window);
+		if (produced < 0)
+		{
+			ResetStream(stream->id, ERROR_INTERNAL);
+			return false;
+		}
+
+		data = buffer;
+		length = produced < window ? produced : (size_t)window;
+		last = produced == 0;
+	}
+	else
+	{
+		const size_t total = response->GetFile() ? response->GetFileLength() : response->GetContentLength();
+
+		length = total - stream->sent;
+		if (length > (size_t)window)
+			length = (size_t)window;
+
+		if (response->GetFile())
+		{
+			DWORD read;
+			if (!ReadFile(response->GetFile(), buffer, (DWORD)length, &read, NULL) || read != length)
+			{
+				ResetStream(stream->id, ERROR_INTERNAL);
+				return false;
+			}
+			data = buffer;
+		}
+		else
+			data = response->GetContent() + stream->sent;
+
+		last = stream->sent + length == total;
+	}
+
+	WriteFrameHeader(dest, length, FRAME_DATA, last ? FLAG_END_STREAM : 0, stream->id);
+	dest.Append(data, length);
+
+	stream->sent += length;
+	stream->sendWindow -= length;
+	m_sendWindow -= length;
+
+	if (last)
+		CloseStream(stream);
+	return true;
+}
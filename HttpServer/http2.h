@@ -0,0 +1,105 @@
+#pragma once
+
+#include <deque>
+#include <map>
+#include <string_view>
+
+#include "http_connection.h"
+#include "hpack.h"
+
+struct HTTP2Stream;
+
+// checks whether data starts with the HTTP/2 client preface. Returns PARSE_OK if
+// it does, PARSE_INCOMPLETE if data is a prefix of it and PARSE_ERROR otherwise.
+int MatchHTTP2Preface(const char *data, size_t size);
+
+// HTTP/2 over cleartext TCP for one connection. The session does no I/O itself:
+// received bytes are passed to Receive, completed requests are taken with
+// NextRequest and answered with Submit, and CollectOutput returns the frames to
+// send. This lets every I/O model drive it the same way it drives HTTP/1.1.
+//
+// Requests are handed out in the order their streams completed and responses may
+// be submitted in any order. Response bodies are sent as DATA frames interleaved
+// between streams as far as the peer's flow control windows allow, so a large
+// body doesn't hold back the others.
+class HTTP2Session
+{
+private:
+	HTTPConnection *m_connection;
+	int m_state;
+
+	HPACKDecoder m_decoder;
+	HPACKEncoder m_encoder;
+
+	std::map<unsigned int, HTTP2Stream *> m_streams;
+	std::deque<unsigned int> m_ready;  // streams with a complete request
+	unsigned int m_lastStream;  // highest stream opened by the peer
+
+	// header block being received in CONTINUATION frames
+	unsigned int m_headerStream;
+	int m_headerFlags;
+	int m_headerError;  // reset sent once the block is decoded if the stream was refused or closed
+	StringBuilder m_headerBlock;
+
+	long long m_sendWindow;
+	long long m_initialWindow;  // for streams, set by the peer
+	size_t m_maxFrameSize;  // largest frame the peer accepts
+	size_t m_maxBody;
+	size_t m_buffered;  // body bytes of requests not handed out yet
+	size_t m_uncredited;  // received bytes the connection window was not credited for
+	bool m_peerClosing;  // GOAWAY received
+
+	StringBuilder m_control;  // frames which are not flow controlled, sent first
+
+	bool Fail(int error);
+	void ResetStream(unsigned int id, int error);
+	void CloseStream(HTTP2Stream *stream);
+	void ReleaseBody(HTTP2Stream *stream);
+	void CreditConnection();
+	void WriteWindowUpdate(unsigned int id, size_t increment);
+	HTTP2Stream *FindStream(unsigned int id) const;
+
+	bool OnFrame(int type, int flags, unsigned int stream, const unsigned char *payload, size_t length);
+	bool OnData(int flags, unsigned int stream, const unsigned char *payload, size_t length);
+	bool OnHeaders(int flags, unsigned int stream, const unsigned char *payload, size_t length);
+	bool OnHeaderBlock();
+	bool OnSettings(int flags, unsigned int stream, const unsigned char *payload, size_t length);
+	bool OnWindowUpdate(unsigned int stream, const unsigned char *payload, size_t length);
+	bool ApplySettings(const unsigned char *payload, size_t length);
+
+	bool CreateRequest(HTTP2Stream *stream, const std::vector<HPACKHeader> &headers);
+	void CompleteRequest(HTTP2Stream *stream);
+
+	void WriteResponseHead(HTTP2Stream *stream, StringBuilder &dest);
+	bool WriteResponseData(HTTP2Stream *stream, StringBuilder &dest);
+public:
+	// bodies larger than maxBody reset their stream
+	HTTP2Session(HTTPConnection *connection, size_t maxBody);
+	~HTTP2Session();
+
+	HTTP2Session(const HTTP2Session &) = delete;
+
+	// true if the request asks to switch to HTTP/2 with Upgrade: h2c
+	static bool IsUpgrade(const HTTPRequest *request);
+
+	// queues the server preface. If upgrade is set, the switching response goes first
+	// and the session takes the request over as stream 1. Returns false if the
+	// settings sent with the upgrade are invalid.
+	bool Start(HTTPRequest *upgrade);
+
+	// handles all complete frames at the start of data, returns the number of bytes
+	// used or -1 if the connection failed, which queues a GOAWAY to send before closing
+	int Receive(const char *data, size_t size);
+
+	// next request whose headers and body arrived, nullptr if there is none
+	HTTPRequest *NextRequest();
+
+	// answers a request returned by NextRequest and takes ownership of the response,
+	// nullptr resets the stream instead
+	void Submit(const HTTPRequest *request, HTTPResponse *response);
+
+	// appends frames ready to be sent, returns the number of bytes added
+	size_t CollectOutput(StringBuilder &dest);
+
+	bool IsClosing() const;
+};
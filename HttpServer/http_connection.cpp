@@ -1,11 +1,14 @@
 #include "http_connection.h"
 
+#include <stdio.h>
+#include <vector>
+
 #include "util.h"
+#include "http2.h"
+#include "perfect_hash.h"
 
 static constexpr char NewLine[] = "\r\n";
 static constexpr int NewLineLength = sizeof(NewLine) - 1;
-static constexpr char HeaderSeparator[] = ":";
-static constexpr int HeaderSeparatorLength = sizeof(HeaderSeparator) - 1;
 
 constexpr const char CookieSetSeparator[] = "=";
 constexpr const int CookieSetSeparatorLength = sizeof CookieSetSeparator - 1;
@@ -15,8 +18,20 @@ constexpr int SetCookieKeyLength = sizeof SetCookieKey - 1;
 
 static constexpr int BufferSize = 8192;
 
+// input read ahead of a body being written to disk
+static constexpr size_t SpillReadAhead = 8 * BufferSize;
+
+// chunk sizes are written with a fixed width, leading zeros are allowed
+static constexpr int ChunkSizeDigits = 8;
+static constexpr char LastChunk[] = "0\r\n\r\n";
+static constexpr int LastChunkLength = sizeof(LastChunk) - 1;
+
+static_assert(ChunkOverhead == ChunkSizeDigits + NewLineLength * 2, "chunk framing size changed");
+
 HTTPConnection::~HTTPConnection()
 {
+	delete m_http2;
+	delete m_spilling;
 	Close();
 }
 
@@ -29,6 +44,10 @@ bool HTTPConnection::Bind(ClientConnection *connection)
 
 void HTTPConnection::Close()
 {
+	// the timer must not reach the connection once it is gone
+	if (m_timers)
+		m_timers->Cancel(&m_timer);
+
 	if (m_connection)
 	{
 		delete m_connection;
@@ -40,180 +59,731 @@ HTTPRequest *HTTPConnection::GetNextRequest()
 {
 	if (!m_connection) return nullptr;
 
-	char buffer[BufferSize];
-	int headerlen;
+	HTTPRequest *request;
 
 	do
 	{
-		// first read any data remaining in the buffer
-		char *buf = m_buffer.GetElements();
-		int bufsize = m_buffer.Size();
+		// HTTP/2 connections are served by the caller
+		if (m_http2) return nullptr;
 
-		int lastind, currind = 0;
-		do
+		// first try to parse any data remaining in the buffer
+		switch (ParseRequest(&request))
 		{
-			lastind = currind;
-			currind = FindFirstOf(buf, bufsize, NewLine, NewLineLength);
-			if (currind == -1) break; // need to read more
-
-			// double NewLine means go to content field
-			//if (currind - lastind == sizeof(NewLine))
-			//	goto exit_main;
-
-			buf += currind + NewLineLength;
-			bufsize -= currind + NewLineLength;
-
-			// double NewLine means go to message body
-			if (equals(buf, NewLine))
-			{
-				buf += NewLineLength;
-				headerlen = buf - m_buffer.GetElements();
-				goto exit_main;
-			}
-		} while (true);
+		case PARSE_OK:
+			return request;
+		case PARSE_ERROR:
+			return nullptr;
+		}
 
 		// we need to read more data from the stream
-		int len = m_connection->ReadBytes(buffer, BufferSize);
-		if (len <= 0)
+		if (!m_http2 && Receive() <= 0)
 		{
 			// connection closed/error
 			return nullptr;
 		}
-
-		m_buffer.Append(buffer, len);
 	} while (true);
+}
 
-exit_main:
-	HTTPRequest *request = new HTTPRequest();
-	std::unordered_map<CaseInsensitiveString, std::string> &headers = request->m_headers;
-	std::unordered_map<std::string, HTTPCookie *> &cookies = request->m_cookies;
+int HTTPConnection::Receive()
+{
+	if (!m_connection) return -1;
+
+	char *dest = m_buffer.Reserve(BufferSize);
+	if (!dest) return -1;
+
+	WaitForInput();
+	int len = m_connection->ReadBytes(dest, BufferSize);
+	StopWaiting();
+
+	if (len <= 0)
+	{
+		m_buffer.Release();
+		return -1;
+	}
+
+	m_buffer.Commit(len);
+	return len;
+}
+
+void HTTPConnection::SubmitResponse(const HTTPRequest *request, HTTPResponse *response)
+{
+	if (m_http2)
+		m_http2->Submit(request, response);
+	else
+		delete response;
+}
 
-	// parse the header
-	char *headerdata = new char[headerlen + 1];
-	memcpy(headerdata, m_buffer.GetElements(), headerlen);
-	headerdata[headerlen] = 0;
+size_t HTTPConnection::CollectOutput(StringBuilder &dest)
+{
+	return m_http2 ? m_http2->CollectOutput(dest) : 0;
+}
 
-	std::vector<std::string> lines;
-	Tokenize(headerdata, NewLine, &lines);
+int HTTPConnection::FlushOutput()
+{
+	if (!m_connection) return -1;
 
-	delete[] headerdata;
+	StringBuilder output;
+	if (CollectOutput(output) == 0)
+		return 0;
 
-	if (lines.size() == 0)
+	WaitForOutput();
+	int len = m_connection->WriteBytes(output.GetElements(), (int)output.Size());
+	StopWaiting();
+
+	return len <= 0 ? -1 : len;
+}
+
+void HTTPConnection::OnTimeout(void *context)
+{
+	HTTPConnection *connection = (HTTPConnection *)context;
+	if (!connection->m_connection) return;
+
+	// closing the socket here could release its handle while another thread still
+	// uses it, shutting it down makes every operation on it fail instead. The
+	// handle stays valid, it is only closed by Close after the timer was cancelled.
+	SOCKET socket = connection->m_connection->GetSocket();
+	if (socket != INVALID_SOCKET)
 	{
-		delete request;
-		return nullptr;
+		shutdown(socket, SD_BOTH);
+		CancelIoEx((HANDLE)socket, NULL);
+	}
+}
+
+void HTTPConnection::WaitForInput()
+{
+	if (!m_timers) return;
+
+	int waiting;
+	if (m_http2)
+		waiting = WAITING_IDLE;  // streams are kept alive by the client's frames
+	else if (m_spilling)
+		waiting = WAITING_BODY;
+	else if (m_buffer.Size() == 0)
+		waiting = WAITING_IDLE;
+	else if (!m_parser.IsHeadComplete())
+		waiting = WAITING_HEADER;
+	else
+		waiting = WAITING_BODY;
+
+	DWORD timeout;
+	switch (waiting)
+	{
+	case WAITING_HEADER:
+		timeout = m_timeouts->header;
+		break;
+	case WAITING_BODY:
+		timeout = m_timeouts->body;
+		break;
+	default:
+		timeout = m_timeouts->idle;
+		break;
+	}
+
+	// the head deadline counts from the first wait for it
+	if (waiting == WAITING_HEADER && timeout > 0)
+	{
+		ULONGLONG now = GetTickCount64();
+		if (m_waiting != WAITING_HEADER)
+			m_headerStart = now;
+
+		ULONGLONG elapsed = now - m_headerStart;
+		timeout = elapsed < timeout ? (DWORD)(timeout - elapsed) : 1;
 	}
 
-	// parse: [METHOD] [URI] HTTP/1.1
-	std::string &info = lines[0];
-	std::vector<std::string> tokens;
+	m_waiting = waiting;
+
+	if (timeout > 0)
+		m_timers->Arm(&m_timer, timeout);
+	else
+		m_timers->Cancel(&m_timer);
+}
+
+void HTTPConnection::WaitForOutput()
+{
+	if (!m_timers) return;
+
+	m_waiting = WAITING_WRITE;
+	if (m_timeouts->write > 0)
+		m_timers->Arm(&m_timer, m_timeouts->write);
+	else
+		m_timers->Cancel(&m_timer);
+}
+
+void HTTPConnection::StopWaiting()
+{
+	// keeps m_waiting, a head arriving in several reads has one deadline
+	if (m_timers)
+		m_timers->Cancel(&m_timer);
+}
+
+bool HTTPConnection::IsClosing() const
+{
+	return m_http2 && m_http2->IsClosing();
+}
+
+// trims spaces and tabs from both ends
+static std::string_view TrimView(std::string_view view)
+{
+	while (!view.empty() && (view.front() == ' ' || view.front() == '\t'))
+		view.remove_prefix(1);
+	while (!view.empty() && (view.back() == ' ' || view.back() == '\t'))
+		view.remove_suffix(1);
+	return view;
+}
 
-	Tokenize((char *)info.c_str(), " ", &tokens);
-	if (tokens.size() != 3)
+// temporary file deleted by the system once closed
+static HANDLE CreateSpillFile()
+{
+	char dir[MAX_PATH + 1];
+	char path[MAX_PATH + 1];
+
+	DWORD len = GetTempPathA(sizeof(dir), dir);
+	if (len == 0 || len > sizeof(dir) || !GetTempFileNameA(dir, "htp", 0, path))
 	{
-		delete request;
-		return nullptr;
+		printf("ERROR> Failed to create a temporary file: %lu\n", GetLastError());
+		return INVALID_HANDLE_VALUE;
 	}
 
-	request->m_method = GetMethodFromString(tokens[0].c_str());
-	if (request->m_method == METHOD_NONE)
+	HANDLE file = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+		FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, NULL);
+	if (file == INVALID_HANDLE_VALUE)
 	{
-		delete request;
-		return nullptr;
+		printf("ERROR> Failed to open temporary file %s: %lu\n", path, GetLastError());
+		DeleteFileA(path);
 	}
 
-	request->m_uri.Parse(tokens[1]);
+	return file;
+}
 
-	if (!equalsIgnoreCase(tokens[2], "HTTP/1.1"))
+void HTTPRequest::ParseCookies(std::string_view value)
+{
+	// name=value pairs separated by semicolons
+	while (!value.empty())
 	{
-		delete request;
-		return nullptr;
+		size_t end = value.find(';');
+		std::string_view pair = value.substr(0, end);
+		value = end == std::string_view::npos ? std::string_view() : value.substr(end + 1);
+
+		size_t ind = pair.find(CookieSetSeparator[0]);
+		if (ind == std::string_view::npos) continue;
+
+		std::string_view cookiename = TrimView(pair.substr(0, ind));
+		std::string_view cookievalue = TrimView(pair.substr(ind + 1));
+		if (cookiename.empty() || cookievalue.empty()) continue; // ignore the cookie
+
+		std::string key(cookiename);
+		auto it = m_cookies.find(key);
+		if (it != m_cookies.end())
+			delete it->second;
+		m_cookies[key] = new HTTPCookie(key, std::string(cookievalue));
 	}
+}
+
+int HTTPRequest::ReadContent(size_t offset, char *dest, int len) const
+{
+	if (offset >= m_contentlen || len <= 0) return 0;
 
-	// parse headers
+	if (m_contentlen - offset < (size_t)len)
+		len = (int)(m_contentlen - offset);
 
-	for (size_t lidx = 1; lidx < lines.size(); lidx++)
+	if (m_content)
 	{
-		const std::string &line = lines[lidx];
-		int ind = FindFirstOf(line.c_str(), line.size(), HeaderSeparator, HeaderSeparatorLength);
-		if (ind == -1) continue;
+		memcpy(dest, m_content + offset, len);
+		return len;
+	}
 
-		CaseInsensitiveString key(line.substr(0, ind));
-		std::string value(line.c_str() + ind + 1);
-		std::string trimmed = Trim(value);
+	// positioned read, so concurrent readers don't share a file pointer
+	OVERLAPPED overlapped;
+	memset(&overlapped, 0, sizeof(overlapped));
+	overlapped.Offset = (DWORD)offset;
+	overlapped.OffsetHigh = (DWORD)((ULONG64)offset >> 32);
 
-		if (key != "Cookie")
-			headers[key] = trimmed;
-		else
+	DWORD read;
+	if (!ReadFile(m_contentFile, dest, (DWORD)len, &read, &overlapped))
+		return -1;
+	return (int)read;
+}
+
+int HTTPConnection::ParseRequest(HTTPRequest **result)
+{
+	*result = nullptr;
+
+	if (m_http2)
+	{
+		int used = m_http2->Receive(m_buffer.GetElements(), m_buffer.Size());
+		if (used < 0)
+			return PARSE_ERROR;
+
+		m_buffer.Consume(used);
+
+		*result = m_http2->NextRequest();
+		return *result ? PARSE_OK : PARSE_INCOMPLETE;
+	}
+
+	if (m_spilling)
+		return SpillContent(result);
+
+	// a client with prior knowledge starts with the HTTP/2 preface instead of a request
+	if (m_buffer.Size() > 0 && !m_parser.IsHeadComplete())
+	{
+		switch (MatchHTTP2Preface(m_buffer.GetElements(), m_buffer.Size()))
 		{
-			std::vector<std::string> cookiestrs;
-			Tokenize((char *)trimmed.c_str(), ";", &cookiestrs);
-			for (size_t cookidx = 0; cookidx < cookiestrs.size(); cookidx++)
-			{
-				int ind = FindFirstOf(trimmed.c_str(), trimmed.length(), CookieSetSeparator, CookieSetSeparatorLength);
-				if (ind > 0 && ind < trimmed.size() - 1)
-				{
-					std::string name = Trim(trimmed.substr(0, ind));
-					std::string value = Trim(trimmed.substr(ind + 1));
-					if (name.length() == 0 || value.length() == 0) continue; // ignore the cookie
-					cookies[name] = new HTTPCookie(name, value);
-				}
-			}
+		case PARSE_OK:
+			m_http2 = new HTTP2Session(this, m_bodyMemoryLimit);
+			m_http2->Start(nullptr);
+			// like an upgrade, the caller notices the switch and serves the session
+			return PARSE_INCOMPLETE;
+		case PARSE_INCOMPLETE:
+			return PARSE_INCOMPLETE;
 		}
 	}
 
+	int status = m_parser.Parse(m_buffer.GetElements(), m_buffer.Size());
+	if (status == PARSE_ERROR)
+		return Reject(m_parser.GetErrorStatus());
+	if (!m_parser.IsHeadComplete())
+		return status;
 
-	// test whether this has content, if so copy it
-	auto it = headers.find("Content-Length");
-	if (it != headers.end())
+	const char *data = m_buffer.GetElements();
+	const size_t headerlen = m_parser.GetHeaderLength();
+	const size_t contentlen = m_parser.GetContentLength();
+
+	if (contentlen > m_bodyMemoryLimit)
 	{
-		char *end;
-		request->m_contentlen = strtol(it->second.c_str(), &end, 10);
-		if (request->m_contentlen > 0)
+		// the head is handled now and the body goes to disk as it arrives, so the
+		// buffer never has to hold more than a single read
+		HTTPRequest *request = CreateRequest(data);
+		if (!request)
+			return Reject(RESP_BAD_REQUEST);
+
+		request->m_contentFile = CreateSpillFile();
+		if (request->m_contentFile == INVALID_HANDLE_VALUE)
 		{
-			request->m_content = new char[request->m_contentlen];
-			memcpy(request->m_content, m_buffer.GetElements() + headerlen, request->m_contentlen);
-			//int len = m_connection->ReadBytes(request->m_content, request->m_contentlen);
-
-			/*if (len < request->m_contentlen)
-			{
-				delete request;
-				return nullptr;
-			}*/
+			request->m_contentFile = NULL;
+			delete request;
+			return Reject(RESP_INTERNAL_SERVER_ERROR);
 		}
+
+		m_buffer.Consume(headerlen);
+		m_parser.Reset();
+
+		m_spilling = request;
+		m_spillLength = contentlen;
+		return SpillContent(result);
 	}
 
-	request->m_source = this;
+	if (status != PARSE_OK)
+		return status;
 
-	// shift the buffer over
-	size_t requestsize = headerlen + request->m_contentlen;
-	m_buffer.ShiftBack(requestsize);// = StringBuilder(m_buffer, requestsize);
+	HTTPRequest *request = CreateRequest(data);
+	if (!request)
+		return Reject(RESP_BAD_REQUEST);
 
+	request->m_contentlen = contentlen;
+	if (contentlen > 0)
+	{
+		request->m_content = new char[contentlen];
+		memcpy(request->m_content, data + headerlen, contentlen);
+	}
+
+	// remove the request from the buffer
+	m_buffer.Consume(headerlen + contentlen);
+	m_parser.Reset();
+
+	if (HTTP2Session::IsUpgrade(request))
+	{
+		// the request is answered on stream 1 after switching protocols
+		m_http2 = new HTTP2Session(this, m_bodyMemoryLimit);
+		if (!m_http2->Start(request))
+			return PARSE_ERROR;
+		return PARSE_INCOMPLETE;
+	}
+
+	*result = request;
+	return PARSE_OK;
+}
+
+int HTTPConnection::SpillContent(HTTPRequest **result)
+{
+	HTTPRequest *request = m_spilling;
+
+	// the buffer may already hold the start of the next request
+	size_t remaining = m_spillLength - request->m_contentlen;
+	size_t count = m_buffer.Size() < remaining ? m_buffer.Size() : remaining;
+
+	DWORD written;
+	if (count > 0 && (!WriteFile(request->m_contentFile, m_buffer.GetElements(), (DWORD)count, &written, NULL) || written != count))
+		return Reject(RESP_INTERNAL_SERVER_ERROR);
+
+	request->m_contentlen += count;
+	m_buffer.Consume(count);
+
+	if (count < remaining)
+		return PARSE_INCOMPLETE;
+
+	m_spilling = nullptr;
+
+	*result = request;
+	return PARSE_OK;
+}
+
+int HTTPConnection::Reject(int status)
+{
+	m_errorStatus = status;
+	return PARSE_ERROR;
+}
+
+HTTPResponse *HTTPConnection::CreateErrorResponse() const
+{
+	if (m_http2 || !m_errorStatus)
+		return nullptr;
+
+	const char *reason;
+	switch (m_errorStatus)
+	{
+	case RESP_NOT_IMPLEMENTED:
+		reason = "Not Implemented";
+		break;
+	case RESP_INTERNAL_SERVER_ERROR:
+		reason = "Internal Server Error";
+		break;
+	default:
+		reason = "Bad Request";
+		break;
+	}
+
+	std::string text = std::to_string(m_errorStatus) + " " + reason;
+
+	HTTPResponse *response = new HTTPResponse();
+	response->SetCode(m_errorStatus);
+	response->SetReason(reason);
+	response->SetHeader(HEADER_CONNECTION, "close");
+	response->SetContentType("text/plain");
+	response->AppendContent(text.c_str(), text.length());
+	response->Finalize();
+	return response;
+}
+
+HTTPRequest *HTTPConnection::CreateRequest(const char *data)
+{
+	if (!EqualsIgnoreCase(m_parser.GetVersion(data), "HTTP/1.1"))
+		return nullptr;
+
+	int method = GetMethodFromString(m_parser.GetMethod(data));
+	if (method == METHOD_NONE)
+		return nullptr;
+
+	HTTPRequest *request = new HTTPRequest();
+	request->m_method = method;
+	request->m_uri.Parse(std::string(m_parser.GetTarget(data)));
+
+	for (const HTTPFieldSlice &field : m_parser.GetFields())
+	{
+		std::string_view name = field.name.View(data);
+		std::string_view value = field.value.View(data);
+
+		if (field.id == HEADER_COOKIE)
+			request->ParseCookies(value);
+		else
+			request->m_headers.Add(field.id, name, value);
+	}
+
+	request->m_source = this;
 	return request;
 }
 
+int HTTPResponse::ProduceChunk(char *dest, int len, bool *last) const
+{
+	static constexpr char HexDigits[] = "0123456789ABCDEF";
+
+	*last = false;
+
+	int space = len - ChunkOverhead;
+	if (space <= 0 || len < LastChunkLength) return -1;
+
+	// the data goes straight to its place behind the chunk size
+	char *data = dest + ChunkSizeDigits + NewLineLength;
+	int produced = m_producer(m_producerContext, data, space);
+	if (produced < 0)
+		return -1;
+
+	if (produced == 0)
+	{
+		*last = true;
+		memcpy(dest, LastChunk, LastChunkLength);
+		return LastChunkLength;
+	}
+
+	if (produced > space)
+		produced = space;
+
+	for (int i = 0; i < ChunkSizeDigits; i++)
+		dest[i] = HexDigits[(produced >> ((ChunkSizeDigits - 1 - i) * 4)) & 0xf];
+	memcpy(dest + ChunkSizeDigits, NewLine, NewLineLength);
+	memcpy(data + produced, NewLine, NewLineLength);
+
+	return produced + ChunkOverhead;
+}
+
 int HTTPConnection::SendResponse(const HTTPResponse *response)
 {
-	if (!m_connection) return false;
+	if (!m_connection) return -1;
+
+	WaitForOutput();
+	int len = WriteResponse(response);
+	StopWaiting();
 
+	return len;
+}
+
+// writes the buffers at most SendPieceSize bytes at a time, a client which keeps
+// taking pieces isn't stalled
+int HTTPConnection::WritePieces(WSABUF *bufs, DWORD count)
+{
+	int total = 0;
+	while (count > 0)
+	{
+		// the last buffer of the piece may only be sent in part
+		WSABUF *last = bufs;
+		size_t size = 0;
+		while (last < bufs + count - 1 && size + last->len < SendPieceSize)
+			size += (last++)->len;
+
+		const WSABUF whole = *last;
+		const ULONG cut = size + whole.len > SendPieceSize ? (ULONG)(SendPieceSize - size) : whole.len;
+		last->len = cut;
+
+		WaitForOutput();
+		int len = m_connection->WriteVector(bufs, (DWORD)(last - bufs) + 1);
+		if (len < 0) return -1;
+		total += len;
+
+		// continue with the rest of the last buffer
+		count -= (DWORD)(last - bufs);
+		bufs = last;
+		bufs->buf = whole.buf + cut;
+		bufs->len = whole.len - cut;
+		if (bufs->len == 0)
+		{
+			bufs++;
+			count--;
+		}
+	}
+
+	return total;
+}
+
+int HTTPConnection::WriteResponse(const HTTPResponse *response)
+{
+	StringBuilder head;
+	if (response->IsChunked())
+	{
+		// the head leaves before the body is generated
+		SerializeHeader(response, head);
+		int total = m_connection->WriteBytes(head.GetElements(), (int)head.Size());
+		if (total <= 0) return -1;
+
+		// the blocking write keeps the producer at the pace of the client
+		char buffer[BufferSize];
+		bool last = false;
+		while (!last)
+		{
+			int len = response->ProduceChunk(buffer, BufferSize, &last);
+			if (len < 0)
+				return -1;
+
+			// a client which keeps taking chunks isn't stalled
+			WaitForOutput();
+			if (m_connection->WriteBytes(buffer, len) <= 0)
+				return -1;
+			total += len;
+		}
+
+		return total;
+	}
+
+	if (response->GetFile())
+	{
+		if (!m_connection->GetTransmitFile() || response->GetFileLength() == 0)
+		{
+			SerializeResponse(response, head);
+
+			WSABUF buf;
+			buf.buf = head.GetElements();
+			buf.len = (ULONG)head.Size();
+			return WritePieces(&buf, 1);
+		}
+
+		SerializeHeader(response, head);
+
+		// the head goes with the first piece
+		const char *first = head.GetElements();
+		int firstlen = (int)head.Size();
+
+		const size_t length = response->GetFileLength();
+		for (size_t offset = 0; offset < length;)
+		{
+			DWORD piece = (DWORD)(length - offset < SendPieceSize ? length - offset : SendPieceSize);
+
+			WaitForOutput();
+			if (!m_connection->SendFile(response->GetFile(), offset, piece, first, firstlen))
+				return -1;
+
+			offset += piece;
+			first = nullptr;
+			firstlen = 0;
+		}
+
+		const size_t total = head.Size() + length;
+		return total > INT_MAX ? INT_MAX : (int)total;
+	}
+
+	// the body is sent from the response instead of being copied after the head
+	SerializeHeader(response, head);
+
+	WSABUF bufs[2];
+	bufs[0].buf = head.GetElements();
+	bufs[0].len = (ULONG)head.Size();
+	bufs[1].buf = (CHAR *)response->GetContent();
+	bufs[1].len = (ULONG)response->GetContentLength();
+
+	return WritePieces(bufs, bufs[1].len > 0 ? 2 : 1);
+}
+
+int HTTPConnection::SendResponses(const HTTPResponse *const *responses, int count)
+{
+	if (!m_connection) return -1;
+
+	WaitForOutput();
+	int len = WriteResponses(responses, count);
+	StopWaiting();
+
+	return len;
+}
+
+int HTTPConnection::WriteResponses(const HTTPResponse *const *responses, int count)
+{
+	if (count == 1) return WriteResponse(responses[0]);
+
+	// heads are serialized back to back, the builder may move while growing so
+	// only their end offsets are kept until the buffers are described
+	StringBuilder heads;
+	std::vector<size_t> headEnds;
+	std::vector<WSABUF> bufs;
+
+	int total = 0;
+	int first = 0;  // first response not written yet
+	for (int i = 0; i <= count; i++)
+	{
+		if (i < count && !responses[i]->GetFile() && !responses[i]->IsChunked())
+		{
+			SerializeHeader(responses[i], heads);
+			headEnds.push_back(heads.Size());
+			continue;
+		}
+
+		// file and streamed bodies can't be gathered, write everything before them first
+		if (i > first)
+		{
+			size_t start = 0;
+			for (int j = first; j < i; j++)
+			{
+				WSABUF buf;
+				buf.buf = heads.GetElements() + start;
+				buf.len = (ULONG)(headEnds[j - first] - start);
+				bufs.push_back(buf);
+				start = headEnds[j - first];
+
+				if (responses[j]->GetContentLength() > 0)
+				{
+					buf.buf = (CHAR *)responses[j]->GetContent();
+					buf.len = (ULONG)responses[j]->GetContentLength();
+					bufs.push_back(buf);
+				}
+			}
+
+			int len = WritePieces(bufs.data(), (DWORD)bufs.size());
+			if (len <= 0) return -1;
+			total += len;
+
+			heads.Clear();
+			headEnds.clear();
+			bufs.clear();
+		}
+
+		if (i < count)
+		{
+			int len = WriteResponse(responses[i]);
+			if (len <= 0) return -1;
+			total += len;
+		}
+
+		first = i + 1;
+	}
+
+	return total;
+}
+
+int HTTPConnection::ReceiveAvailable()
+{
+	if (!m_connection) return -1;
+
+	// never more than one request held in memory, a body going to disk is only
+	// read a little ahead. Anything beyond stays in the socket until the buffered
+	// input was parsed, which also makes the client wait through flow control.
+	const size_t limit = m_spilling ? SpillReadAhead : MaxHeaderLength + m_bodyMemoryLimit;
+
+	int total = 0;
+	while (m_buffer.Size() < limit)
+	{
+		// receive straight into the buffer
+		char *dest = m_buffer.Reserve(BufferSize);
+		if (!dest) return -1;
+
+		int len = m_connection->ReadAvailable(dest, BufferSize);
+		if (len < 0) return -1;
+		if (len == 0) break;
+
+		m_buffer.Commit(len);
+		total += len;
+	}
+
+	return total;
+}
+
+void HTTPConnection::SerializeResponse(const HTTPResponse *response, StringBuilder &data) const
+{
 	const size_t contentLength = response->GetContentLength();
-	StringBuilder data(contentLength);
 
+	SerializeHeader(response, data);
+
+	if (response->GetFile())
+	{
+		char buffer[BufferSize];
+		DWORD read;
+		while (ReadFile(response->GetFile(), buffer, BufferSize, &read, NULL) && read > 0)
+			data.Append(buffer, read);
+	}
+	else if (contentLength > 0)
+		data.Append(response->GetContent(), contentLength);
+}
+
+void HTTPConnection::SerializeHeader(const HTTPResponse *response, StringBuilder &data) const
+{
 	data.Append("HTTP/1.1").Append(' ');
 	data.Append(std::to_string(response->GetCode()).c_str()).Append(' ');
 	data.Append(response->GetReason()).Append(NewLine);
 
-	for (auto p : response->GetHeaders())
+	for (const auto &field : response->GetHeaders())
 	{
-		data.Append(p.first.cstr(), p.first.length());
+		data.Append(field.name.data(), field.name.length());
 		data.Append(':').Append(' ');
-		data.Append(p.second);
+		data.Append(field.value.data(), field.value.length());
 
 		data.Append(NewLine, NewLineLength);
 	}
 
-	size_t cookienum = 1;
-	for (auto p : response->GetCookies())
+	for (const auto &p : response->GetCookies())
 	{
 		data.Append(SetCookieKey, SetCookieKeyLength);
 		p.second->AppendToBuilder(data);
@@ -221,13 +791,6 @@ int HTTPConnection::SendResponse(const HTTPResponse *response)
 	}
 
 	data.Append(NewLine, NewLineLength);
-	if (contentLength > 0)
-		data.Append(response->GetContent(), contentLength);
-
-	char *const out = data.GetElements();
-	const int writelen = (int)data.Size();
-
-	return m_connection->WriteBytes(out, writelen);
 }
 
 const char *GetMethodString(int method)
@@ -249,23 +812,179 @@ const char *GetMethodString(int method)
 	return METHODS[method];
 }
 
-int GetMethodFromString(const char *str)
-{
-	if (equalsIgnoreCase(str, "CONNECT"))
-		return METHOD_CONNECT;
-	else if (equalsIgnoreCase(str, "DELETE"))
-		return METHOD_DELETE;
-	else if (equalsIgnoreCase(str, "GET"))
-		return METHOD_GET;
-	else if (equalsIgnoreCase(str, "HEAD"))
-		return METHOD_HEAD;
-	else if (equalsIgnoreCase(str, "OPTIONS"))
-		return METHOD_OPTIONS;
-	else if (equalsIgnoreCase(str, "POST"))
-		return METHOD_POST;
-	else if (equalsIgnoreCase(str, "PUT"))
-		return METHOD_PUT;
-	else if (equalsIgnoreCase(str, "TRACE"))
-		return METHOD_TRACE;
-	return METHOD_NONE;
+int GetMethodFromString(std::string_view str)
+{
+	static constexpr std::string_view Methods[] = {
+		"CONNECT",
+		"DELETE",
+		"GET",
+		"HEAD",
+		"OPTIONS",
+		"POST",
+		"PUT",
+		"TRACE"
+	};
+	static constexpr PerfectHash<METHOD_COUNT, 32> MethodTable(Methods);
+
+	return MethodTable.Find(str);
+}
+
+static constexpr char BenchmarkHead[] =
+"GET /images/banner.gif?size=large&theme=dark HTTP/1.1\r\n"
+"Host: localhost\r\n"
+"Connection: keep-alive\r\n"
+"User-Agent: Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/110.0.0.0 Safari/537.36\r\n"
+"Accept: image/avif,image/webp,image/apng,image/svg+xml,image/*,*/*;q=0.8\r\n"
+"Sec-Fetch-Site: same-origin\r\n"
+"Sec-Fetch-Mode: no-cors\r\n"
+"Sec-Fetch-Dest: image\r\n"
+"Referer: http://localhost/index.html\r\n"
+"Accept-Encoding: gzip, deflate, br\r\n"
+"Accept-Language: en-US,en;q=0.9\r\n"
+"Cookie: session=4f2a9c81d07b3e65; theme=dark; consent=yes\r\n"
+"\r\n";
+
+static constexpr int BenchmarkHeadLength = sizeof(BenchmarkHead) - 1;
+static constexpr int ParseRounds = 200000;
+
+// bytes delivered per read when measuring a head that arrives in pieces
+static constexpr int FragmentSize = 16;
+
+// the parser on a head that arrived at once
+static int MeasureParser(volatile size_t *sink)
+{
+	HTTPRequestParser parser;
+	int failed = 0;
+	for (int round = 0; round < ParseRounds; round++)
+	{
+		parser.Reset();
+		if (parser.Parse(BenchmarkHead, BenchmarkHeadLength) != PARSE_OK)
+			failed++;
+		*sink = *sink + parser.GetFields().size();
+	}
+	return failed;
+}
+
+// the parser resuming after every read of a head arriving in small pieces
+static int MeasureFragmentedParser(volatile size_t *sink)
+{
+	HTTPRequestParser parser;
+	int failed = 0;
+	for (int round = 0; round < ParseRounds; round++)
+	{
+		parser.Reset();
+
+		int status = PARSE_INCOMPLETE;
+		for (int size = FragmentSize; status == PARSE_INCOMPLETE; size += FragmentSize)
+			status = parser.Parse(BenchmarkHead, size < BenchmarkHeadLength ? size : BenchmarkHeadLength);
+
+		if (status != PARSE_OK)
+			failed++;
+		*sink = *sink + parser.GetFields().size();
+	}
+	return failed;
+}
+
+// buffering, parsing and building the request like a connection does
+static int MeasureConnection(volatile size_t *sink)
+{
+	HTTPConnection connection(nullptr);
+	int failed = 0;
+	for (int round = 0; round < ParseRounds; round++)
+	{
+		connection.AppendInput(BenchmarkHead, BenchmarkHeadLength);
+
+		HTTPRequest *request;
+		if (connection.ParseRequest(&request) != PARSE_OK)
+		{
+			failed++;
+			break;
+		}
+
+		*sink = *sink + request->GetURI().GetPath().length();
+		delete request;
+	}
+	return failed;
+}
+
+// copying the head and splitting it into lines and tokens
+static int MeasureTokenizing(volatile size_t *sink)
+{
+	static constexpr char HeaderEnd[] = "\r\n\r\n";
+
+	int failed = 0;
+	for (int round = 0; round < ParseRounds; round++)
+	{
+		int end = FindFirstOf(BenchmarkHead, BenchmarkHeadLength, HeaderEnd, sizeof(HeaderEnd) - 1);
+		if (end < 0)
+		{
+			failed++;
+			continue;
+		}
+
+		std::string head(BenchmarkHead, end);
+
+		std::vector<std::string> lines;
+		Tokenize(head.data(), NewLine, &lines);
+
+		std::vector<std::string> tokens;
+		Tokenize(lines[0].data(), " ", &tokens);
+		if (tokens.size() != 3)
+			failed++;
+
+		CaseInsensitiveMap<std::string> headers;
+		for (size_t i = 1; i < lines.size(); i++)
+		{
+			const std::string &line = lines[i];
+			size_t ind = line.find(':');
+			if (ind == std::string::npos) continue;
+
+			headers[CaseInsensitiveString(line.substr(0, ind))] = Trim(line.substr(ind + 1));
+		}
+
+		*sink = *sink + headers.size();
+	}
+	return failed;
+}
+
+static double MeasureParsing(int (*func)(volatile size_t *sink), int *failed)
+{
+	volatile size_t sink = 0;
+
+	LARGE_INTEGER frequency, start, end;
+	QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&start);
+
+	*failed = func(&sink);
+
+	QueryPerformanceCounter(&end);
+
+	double seconds = (double)(end.QuadPart - start.QuadPart) / frequency.QuadPart;
+	return seconds * 1e9 / ParseRounds;
+}
+
+void BenchmarkParsing()
+{
+	static const struct
+	{
+		const char *name;
+		int (*func)(volatile size_t *sink);
+	} Methods[] = {
+		{ "parser", &MeasureParser },
+		{ "fragmented", &MeasureFragmentedParser },
+		{ "connection", &MeasureConnection },
+		{ "tokenize", &MeasureTokenizing },
+	};
+
+	printf("Parsing %d byte request head %d times, fragments of %d bytes\n",
+		BenchmarkHeadLength, ParseRounds, FragmentSize);
+	printf("%-12s %-12s %-14s %-10s\n", "[Method]", "[ns/Head]", "[MB/s]", "[Failed]");
+
+	for (const auto &method : Methods)
+	{
+		int failed;
+		double ns = MeasureParsing(method.func, &failed);
+		printf("%-12s %-12.1f %-14.1f %-10d\n", method.name, ns,
+			BenchmarkHeadLength / ns * 1e3, failed);
+	}
 }
@@ -7,15 +7,44 @@
 #include "client_connection.h"
 #include "uri.h"
 #include "http_cookie.h"
+#include "http_parser.h"
+#include "ring_buffer.h"
+#include "timer_wheel.h"
+#include "object_pool.h"
+#include "case_insensitive.h"
+#include "http_headers.h"
 
 using namespace strutil;
 
 class HTTPRequest;
 class HTTPResponse;
 class HTTPConnection;
+class HTTP2Session;
 
 using HTTPRequestHandlerFunc = HTTPResponse * (*)(const HTTPRequest *request);
 
+// generates the body of a streamed response piece by piece. It is only called again
+// after the previous piece was sent, so a slow client holds back the producer
+// instead of letting output pile up. Writes at most len bytes to dest and returns
+// the number written, 0 once the body is complete or -1 to abort the connection.
+// Called a last time with dest == nullptr when the response is deleted, to let
+// the producer release the context.
+using HTTPContentProducer = int (*)(void *context, char *dest, int len);
+
+// gives up the reference passed to SetSharedContent once the response is destroyed
+using HTTPContentRelease = void (*)(void *context);
+
+// bytes added around each chunk of a streamed response
+static constexpr int ChunkOverhead = 12;
+
+// bytes of a request's or response's arena stored inline, enough for the header
+// text and maps of a typical request without taking another block
+static constexpr size_t MessageArenaSize = 1024;
+
+// maps of a request or response, their nodes live in the message's arena
+using HTTPQueryMap = PmrCaseInsensitiveMap<CaseInsensitiveString>;
+using HTTPCookieMap = std::pmr::unordered_map<std::string, HTTPCookie *>;
+
 enum
 {
 	METHOD_NONE = -1,
@@ -50,33 +79,74 @@ enum
 	RESP_NOT_FOUND = 404,
 	RESP_METHOD_NOT_ALLOWED = 405,
 
-	RESP_INTERNAL_SERVER_ERROR = 500
+	RESP_INTERNAL_SERVER_ERROR = 500,
+	RESP_NOT_IMPLEMENTED = 501
+};
+
+enum
+{
+	PARSE_INCOMPLETE = 0,
+	PARSE_OK,
+	PARSE_ERROR
+};
+
+// what a connection is waiting for when its timer fires
+enum
+{
+	WAITING_NONE = 0,
+	WAITING_IDLE,  // the next request on a kept-alive connection
+	WAITING_HEADER,  // the rest of a request head
+	WAITING_BODY,  // more of a request body
+	WAITING_WRITE  // the client to accept more of a response
+};
+
+// limits in milliseconds on how long a connection may wait, 0 disables one.
+// The header timeout is a deadline for the whole head, which keeps slow clients
+// from trickling in a byte at a time. The others start over whenever data moves.
+struct ConnectionTimeouts
+{
+	DWORD idle;
+	DWORD header;
+	DWORD body;
+	DWORD write;
 };
 
 const char *GetMethodString(int method);
-int GetMethodFromString(const char *str);
+int GetMethodFromString(std::string_view str);
 
-class HTTPRequest
+class HTTPRequest : public Pooled
 {
 private:
 	friend class HTTPConnection;
+	friend class HTTP2Session;
 	
+	Arena<MessageArenaSize> m_arena;  // must be constructed before the maps using it
 	int m_method;
 	URI m_uri;
-	std::unordered_map<CaseInsensitiveString, CaseInsensitiveString> m_queries;
-	std::unordered_map<CaseInsensitiveString, std::string> m_headers;
-	std::unordered_map<std::string, HTTPCookie *> m_cookies;
+	HTTPQueryMap m_queries;
+	HTTPHeaderList m_headers;
+	HTTPCookieMap m_cookies;
 	char *m_content;
-	int m_contentlen;
+	HANDLE m_contentFile;  // temporary file holding a body too large for memory
+	size_t m_contentlen;
 	HTTPConnection *m_source;
+	unsigned int m_stream;  // HTTP/2 stream carrying the request, 0 for HTTP/1.1
+
+	// adds the name=value pairs of a Cookie header
+	void ParseCookies(std::string_view value);
 public:
 	inline HTTPRequest() :
-		m_method(METHOD_NONE), m_uri(), m_headers(), m_content(nullptr), m_contentlen(0), m_source(nullptr) { }
+		m_arena(), m_method(METHOD_NONE), m_uri(), m_queries(m_arena.GetResource()), m_headers(m_arena.GetResource()),
+		m_cookies(m_arena.GetResource()), m_content(nullptr), m_contentFile(NULL), m_contentlen(0), m_source(nullptr),
+		m_stream(0) { }
 	inline ~HTTPRequest()
 	{
 		if (m_content)
 			delete[] m_content;
 
+		if (m_contentFile)
+			CloseHandle(m_contentFile);
+
 		for (auto p : m_cookies)
 			delete p.second;
 	}
@@ -93,16 +163,29 @@ public:
 		return m_uri;
 	}
 	
-	inline const CaseInsensitiveString *GetQuery(const CaseInsensitiveString &name) const
+	inline const CaseInsensitiveString *GetQuery(std::string_view name) const
 	{
 		auto it = m_queries.find(name);
 		return it == m_queries.end() ? nullptr : &it->second;
 	}
 
-	inline const std::string *GetHeader(const CaseInsensitiveString &name) const
+	// value of the first field with the name, GetHeaders lists repeated fields. id
+	// is one of HEADER_
+	inline const std::string_view *GetHeader(int id) const
+	{
+		const HTTPHeaderList::Field *field = m_headers.Find(id);
+		return field ? &field->value : nullptr;
+	}
+
+	inline const std::string_view *GetHeader(std::string_view name) const
+	{
+		const HTTPHeaderList::Field *field = m_headers.Find(name);
+		return field ? &field->value : nullptr;
+	}
+
+	constexpr const HTTPHeaderList &GetHeaders() const
 	{
-		auto it = m_headers.find(name);
-		return it == m_headers.end() ? nullptr : &it->second;
+		return m_headers;
 	}
 
 	inline const HTTPCookie *GetCookie(const std::string &name) const
@@ -111,40 +194,72 @@ public:
 		return it == m_cookies.end() ? nullptr : it->second;
 	}
 
+	// nullptr if the body was spilled to disk, ReadContent works either way
 	constexpr const char *GetContent() const
 	{
 		return m_content;
 	}
 
-	constexpr int GetContentLength() const
+	constexpr size_t GetContentLength() const
 	{
 		return m_contentlen;
 	}
 
+	// copies up to len bytes of the body starting at offset into dest, returns
+	// the number of bytes copied, 0 at the end of the body or -1 on failure
+	int ReadContent(size_t offset, char *dest, int len) const;
+
 	constexpr HTTPConnection *GetSource() const
 	{
 		return m_source;
 	}
 };
 
-class HTTPResponse
+class HTTPResponse : public Pooled
 {
 private:
+	Arena<MessageArenaSize> m_arena;
 	int m_code;
 	std::string m_reason;
-	std::unordered_map<CaseInsensitiveString, std::string> m_headers;
-	std::unordered_map<std::string, HTTPCookie *> m_cookies;
+	HTTPHeaderList m_headers;
+	HTTPCookieMap m_cookies;
 	StringBuilder m_content;
+
+	HANDLE m_file;
+	size_t m_fileLength;
+
+	HTTPContentProducer m_producer;
+	void *m_producerContext;
+
+	const char *m_shared;
+	size_t m_sharedLength;
+	HTTPContentRelease m_release;
+	void *m_releaseContext;
 public:
 	inline HTTPResponse() :
-		m_code(0), m_reason(), m_headers(), m_content() { }
+		m_arena(), m_code(0), m_reason(), m_headers(m_arena.GetResource()), m_cookies(m_arena.GetResource()), m_content(),
+		m_file(NULL), m_fileLength(0),
+		m_producer(nullptr), m_producerContext(nullptr),
+		m_shared(nullptr), m_sharedLength(0), m_release(nullptr), m_releaseContext(nullptr) { }
 	inline HTTPResponse(size_t expectedcontentlen) :
-		m_code(0), m_reason(), m_headers(), m_content(expectedcontentlen) { }
+		m_arena(), m_code(0), m_reason(), m_headers(m_arena.GetResource()), m_cookies(m_arena.GetResource()),
+		m_content(expectedcontentlen), m_file(NULL), m_fileLength(0),
+		m_producer(nullptr), m_producerContext(nullptr),
+		m_shared(nullptr), m_sharedLength(0), m_release(nullptr), m_releaseContext(nullptr) { }
 
 	inline ~HTTPResponse()
 	{
 		for (auto p : m_cookies)
 			delete p.second;
+
+		if (m_file)
+			CloseHandle(m_file);
+
+		if (m_producer)
+			m_producer(m_producerContext, nullptr, 0);
+
+		if (m_release)
+			m_release(m_releaseContext);
 	}
 	
 	HTTPResponse(const HTTPResponse &) = delete;
@@ -159,10 +274,24 @@ public:
 		if (reason && *reason) m_reason = reason;
 	}
 
-	inline void AddHeader(const CaseInsensitiveString &name, const std::string &value)
+	// appends a field, repeated names are sent as separate fields
+	inline void AddHeader(std::string_view name, std::string_view value)
 	{
 		if (name.length() > 0 && value.length() > 0)
-			m_headers[name] = value;
+			m_headers.Add(name, value);
+	}
+
+	// replaces the value of a field added before, or appends it
+	inline void SetHeader(std::string_view name, std::string_view value)
+	{
+		if (name.length() > 0 && value.length() > 0)
+			m_headers.Set(name, value);
+	}
+
+	inline void SetHeader(int id, std::string_view value)
+	{
+		if (value.length() > 0)
+			m_headers.Set(id, GetHeaderName(id), value);
 	}
 
 	inline void AddCookie(const HTTPCookie &cookie)
@@ -180,8 +309,7 @@ public:
 
 	inline void SetContentType(const std::string &type)
 	{
-		static CaseInsensitiveString CONTENT_TYPE_KEY("Content-Type");
-		AddHeader(CONTENT_TYPE_KEY, type);
+		SetHeader(HEADER_CONTENT_TYPE, type);
 	}
 
 	inline void AppendContent(const char *data, size_t len)
@@ -189,14 +317,66 @@ public:
 		m_content.Append(data, len);
 	}
 
+	// uses length bytes of the file from its current position as the body, which lets
+	// the connection send it without copying it through user space. The response
+	// takes ownership of the handle and any appended content is discarded.
+	inline void SetFileContent(HANDLE file, size_t length)
+	{
+		if (m_file)
+			CloseHandle(m_file);
+
+		m_content.Clear();
+		m_file = file;
+		m_fileLength = length;
+	}
+
+	// streams the body with Transfer-Encoding: chunked, pulling each chunk from the
+	// producer while the response is sent. Any appended content is discarded.
+	inline void SetContentProducer(HTTPContentProducer producer, void *context)
+	{
+		if (m_producer)
+			m_producer(m_producerContext, nullptr, 0);
+
+		m_content.Clear();
+		m_producer = producer;
+		m_producerContext = context;
+	}
+
+	// sends len bytes of data as the body without copying them, like the contents
+	// of a cached file. release is called with context once the response is
+	// destroyed. Any appended content is discarded.
+	inline void SetSharedContent(const char *data, size_t len, HTTPContentRelease release, void *context)
+	{
+		if (m_release)
+			m_release(m_releaseContext);
+
+		m_content.Clear();
+		m_shared = data;
+		m_sharedLength = len;
+		m_release = release;
+		m_releaseContext = context;
+	}
+
+	// pulls the next piece of a streamed body without framing it
+	inline int ProduceContent(char *dest, int len) const
+	{
+		return m_producer(m_producerContext, dest, len);
+	}
+
+	// frames the next piece of a streamed body as a chunk in dest, which should hold
+	// more than ChunkOverhead bytes. Returns the size of the chunk and sets last once
+	// the terminating chunk was written, or returns -1 if the producer failed
+	int ProduceChunk(char *dest, int len, bool *last) const;
+
 	inline const HTTPResponse *Finalize()
 	{
-		static CaseInsensitiveString CONTENT_LENGTH_KEY("Content-Length");
-		static CaseInsensitiveString SERVER_KEY("Server");
-		
-		if (m_content.Size() > 0)
-			AddHeader(CONTENT_LENGTH_KEY, std::to_string(m_content.Size()));
-		AddHeader(SERVER_KEY, "HttpServer/1.0");
+		if (m_producer)
+			SetHeader(HEADER_TRANSFER_ENCODING, "chunked");
+		else if (m_file)
+			SetHeader(HEADER_CONTENT_LENGTH, std::to_string(m_fileLength));
+		else if (GetContentLength() > 0)
+			SetHeader(HEADER_CONTENT_LENGTH, std::to_string(GetContentLength()));
+		SetHeader(HEADER_SERVER, "HttpServer/1.0");
 		return this;
 	}
 
@@ -210,36 +390,80 @@ public:
 		return m_reason.c_str();
 	}
 
-	constexpr const std::unordered_map<CaseInsensitiveString, std::string> &GetHeaders() const
+	constexpr const HTTPHeaderList &GetHeaders() const
 	{
 		return m_headers;
 	}
 
-	constexpr const std::unordered_map<std::string, const HTTPCookie *> &GetCookies() const
+	constexpr const HTTPCookieMap &GetCookies() const
 	{
-		return (const std::unordered_map<std::string, const HTTPCookie *> &)m_cookies;
+		return m_cookies;
 	}
 
 	inline const char *GetContent() const
 	{
-		return m_content.GetElements();
+		return m_shared ? m_shared : m_content.GetElements();
 	}
 
 	inline size_t GetContentLength() const
 	{
-		return m_content.Size();
+		return m_shared ? m_sharedLength : m_content.Size();
+	}
+
+	constexpr HANDLE GetFile() const
+	{
+		return m_file;
+	}
+
+	constexpr size_t GetFileLength() const
+	{
+		return m_fileLength;
+	}
+
+	constexpr bool IsChunked() const
+	{
+		return m_producer != nullptr;
 	}
 };
 
-class HTTPConnection
+class HTTPConnection : public Pooled
 {
 private:
 	ClientConnection *m_connection;
 	void *m_httpServer;
 
-	StringBuilder m_buffer;
+	RingBuffer m_buffer;
+	HTTPRequestParser m_parser;
+
+	// set once the client switched to HTTP/2
+	HTTP2Session *m_http2;
+
+	// request whose body is written to disk as it arrives
+	HTTPRequest *m_spilling;
+	size_t m_spillLength;
+	size_t m_bodyMemoryLimit;
+
+	TimerWheel *m_timers;
+	const ConnectionTimeouts *m_timeouts;
+	Timer m_timer;
+	int m_waiting;  // what the connection last waited for
+	ULONGLONG m_headerStart;  // when the head of the current request started arriving
+
+	int m_errorStatus;  // status answering the request ParseRequest failed on, 0 if none
+
+	static void OnTimeout(void *context);
+	int Reject(int status);
+
+	HTTPRequest *CreateRequest(const char *data);
+	int SpillContent(HTTPRequest **result);
+	int WritePieces(WSABUF *bufs, DWORD count);
+	int WriteResponse(const HTTPResponse *response);
+	int WriteResponses(const HTTPResponse *const *responses, int count);
 public:
-	inline HTTPConnection(void *httpServer) : m_connection(nullptr), m_httpServer(httpServer) { }
+	inline HTTPConnection(void *httpServer) :
+		m_connection(nullptr), m_httpServer(httpServer), m_parser(), m_http2(nullptr), m_spilling(nullptr), m_spillLength(0), m_bodyMemoryLimit(1024 * 1024),
+		m_timers(nullptr), m_timeouts(nullptr), m_timer(&OnTimeout, this), m_waiting(WAITING_NONE), m_headerStart(0),
+		m_errorStatus(0) { }
 	~HTTPConnection();
 
 	bool Bind(ClientConnection *connection);
@@ -260,6 +484,100 @@ public:
 		return m_httpServer;
 	}
 
+	// request bodies larger than this are written to a temporary file while they
+	// are received instead of being kept in memory
+	constexpr void SetBodyMemoryLimit(size_t limit)
+	{
+		m_bodyMemoryLimit = limit;
+	}
+
+	// enables timeouts, both must outlive the connection. An expired timeout shuts
+	// the socket down and cancels its pending I/O, so the operation waiting on it
+	// fails and the connection is closed by whoever is serving it.
+	constexpr void SetTimeouts(TimerWheel *timers, const ConnectionTimeouts *timeouts)
+	{
+		m_timers = timers;
+		m_timeouts = timeouts;
+	}
+
+	// arm the timeout for the next read or write, transports which don't go through
+	// Receive and SendResponse call these around their own I/O
+	void WaitForInput();
+	void WaitForOutput();
+	void StopWaiting();
+
+	// blocks until a full request has been read from the connection. Returns nullptr
+	// as well once the client switched to HTTP/2, which is checked with IsHTTP2
 	HTTPRequest *GetNextRequest();
 	int SendResponse(const HTTPResponse *response);
-};
\ No newline at end of file
+
+	// sends responses in order, gathering as many as possible into a single write.
+	// Returns the number of bytes written or -1 on failure
+	int SendResponses(const HTTPResponse *const *responses, int count);
+
+	// parses a request from already buffered data without touching the socket,
+	// returns PARSE_INCOMPLETE if more data has to be appended first
+	int ParseRequest(HTTPRequest **result);
+
+	// response telling the client why ParseRequest returned PARSE_ERROR, to be sent
+	// before the connection is closed. nullptr if there is none, HTTP/2 sends a
+	// GOAWAY through CollectOutput instead.
+	HTTPResponse *CreateErrorResponse() const;
+
+	inline void AppendInput(const char *data, int len)
+	{
+		m_buffer.Append(data, len);
+	}
+
+	// buffers what a non-blocking connection has received so far, at most one request
+	// head and a body up to the memory limit. Returns the number of bytes added or -1
+	// if the connection was closed.
+	int ReceiveAvailable();
+
+	// gives the input buffer back to the shared pool if nothing is buffered. Called
+	// before waiting for an idle connection rather than after every request, so a
+	// busy connection keeps its buffer.
+	inline void ReleaseInput()
+	{
+		m_buffer.Release();
+	}
+
+	constexpr bool HasBufferedInput() const
+	{
+		return m_buffer.Size() > 0;
+	}
+
+	// blocks until data arrives and buffers it, returns the number of bytes added
+	// or -1 if the connection was closed
+	int Receive();
+
+	// An HTTP/2 connection is detected from its preface or an h2c upgrade request.
+	// ParseRequest then returns requests from any stream, the responses are passed to
+	// SubmitResponse and the frames to send are taken with CollectOutput, which has to
+	// be called until it adds nothing before waiting for more input.
+	constexpr bool IsHTTP2() const
+	{
+		return m_http2 != nullptr;
+	}
+
+	// takes ownership of the response, nullptr resets the request's stream
+	void SubmitResponse(const HTTPRequest *request, HTTPResponse *response);
+
+	// appends HTTP/2 frames which can be sent, returns the number of bytes added
+	size_t CollectOutput(StringBuilder &dest);
+
+	// writes everything CollectOutput returns, returns the number of bytes written or -1
+	int FlushOutput();
+
+	// true once an HTTP/2 connection failed or finished after the client's GOAWAY
+	bool IsClosing() const;
+
+	// writes the status line and headers, followed by the body. Flattening copies the
+	// body, so transports which can gather or send files directly use SerializeHeader
+	void SerializeResponse(const HTTPResponse *response, StringBuilder &data) const;
+	void SerializeHeader(const HTTPResponse *response, StringBuilder &data) const;
+};
+
+// measures the request parser on a typical head, whole and as it arrives in small
+// reads, against tokenizing the head into lines which it replaced
+void BenchmarkParsing();
\ No newline at end of file
@@ -4,6 +4,7 @@
 #include <stdlib.h>
 
 #include "util.h"
+#include "object_pool.h"
 
 enum
 {
@@ -30,7 +31,7 @@ enum
 	SAMESITE_NONE
 };
 
-class HTTPCookie
+class HTTPCookie : public Pooled
 {
 private:
 	std::string m_name;
@@ -0,0 +1,202 @@
+#include "http_headers.h"
+
+#include "perfect_hash.h"
+
+#include <string.h>
+#include <limits.h>
+
+// text of most requests fits the first block, larger values get a block of their own
+static constexpr size_t TextBlockSize = 512;
+
+// in the order of the HEADER_ values
+static constexpr std::string_view HeaderNames[] =
+{
+	"Accept",
+	"Accept-Charset",
+	"Accept-Encoding",
+	"Accept-Language",
+	"Accept-Ranges",
+	"Access-Control-Allow-Credentials",
+	"Access-Control-Allow-Headers",
+	"Access-Control-Allow-Methods",
+	"Access-Control-Allow-Origin",
+	"Access-Control-Expose-Headers",
+	"Access-Control-Max-Age",
+	"Access-Control-Request-Headers",
+	"Access-Control-Request-Method",
+	"Age",
+	"Allow",
+	"Authorization",
+	"Cache-Control",
+	"Connection",
+	"Content-Disposition",
+	"Content-Encoding",
+	"Content-Language",
+	"Content-Length",
+	"Content-Location",
+	"Content-Range",
+	"Content-Type",
+	"Cookie",
+	"Date",
+	"DNT",
+	"ETag",
+	"Expect",
+	"Expires",
+	"Forwarded",
+	"From",
+	"Host",
+	"HTTP2-Settings",
+	"If-Match",
+	"If-Modified-Since",
+	"If-None-Match",
+	"If-Range",
+	"If-Unmodified-Since",
+	"Keep-Alive",
+	"Last-Modified",
+	"Link",
+	"Location",
+	"Max-Forwards",
+	"Origin",
+	"Pragma",
+	"Proxy-Authenticate",
+	"Proxy-Authorization",
+	"Range",
+	"Referer",
+	"Retry-After",
+	"Sec-Fetch-Dest",
+	"Sec-Fetch-Mode",
+	"Sec-Fetch-Site",
+	"Sec-Fetch-User",
+	"Server",
+	"Set-Cookie",
+	"TE",
+	"Trailer",
+	"Transfer-Encoding",
+	"Upgrade",
+	"Upgrade-Insecure-Requests",
+	"User-Agent",
+	"Vary",
+	"Via",
+	"WWW-Authenticate",
+	"X-Forwarded-For",
+	"X-Forwarded-Host",
+	"X-Forwarded-Proto",
+	"X-Requested-With"
+};
+
+static_assert(sizeof(HeaderNames) / sizeof(HeaderNames[0]) == HEADER_COUNT, "a header name is missing");
+
+static constexpr PerfectHash<HEADER_COUNT, 1024> HeaderTable(HeaderNames);
+
+int GetHeaderID(std::string_view name)
+{
+	return HeaderTable.Find(name);
+}
+
+std::string_view GetHeaderName(int id)
+{
+	if (id < 0 || id >= HEADER_COUNT)
+		return std::string_view();
+	return HeaderTable.GetName(id);
+}
+
+HTTPHeaderList::HTTPHeaderList(std::pmr::memory_resource *resource) :
+	m_resource(resource), m_fields(m_inline), m_count(0), m_capacity(InlineFields), m_text(nullptr), m_textLeft(0),
+	m_blocks(nullptr), m_known()
+{
+}
+
+HTTPHeaderList::~HTTPHeaderList()
+{
+	while (m_blocks)
+	{
+		Block *next = m_blocks->next;
+		m_resource->deallocate(m_blocks, m_blocks->size, alignof(Block));
+		m_blocks = next;
+	}
+}
+
+void *HTTPHeaderList::AllocateBlock(size_t size)
+{
+	size += sizeof(Block);
+
+	Block *block = (Block *)m_resource->allocate(size, alignof(Block));
+	block->next = m_blocks;
+	block->size = size;
+	m_blocks = block;
+
+	return block + 1;
+}
+
+std::string_view HTTPHeaderList::Store(std::string_view text)
+{
+	if (text.empty())
+		return std::string_view();
+
+	char *dest;
+	if (text.length() <= m_textLeft)
+	{
+		dest = m_text;
+		m_text += text.length();
+		m_textLeft -= text.length();
+	}
+	else if (text.length() > TextBlockSize / 2)
+		dest = (char *)AllocateBlock(text.length());
+	else
+	{
+		dest = (char *)AllocateBlock(TextBlockSize);
+		m_text = dest + text.length();
+		m_textLeft = TextBlockSize - text.length();
+	}
+
+	memcpy(dest, text.data(), text.length());
+	return std::string_view(dest, text.length());
+}
+
+HTTPHeaderList::Field *HTTPHeaderList::FindField(int id, std::string_view name)
+{
+	if (id != HEADER_UNKNOWN)
+		return m_known[id] ? &m_fields[m_known[id] - 1] : nullptr;
+
+	for (size_t i = 0; i < m_count; i++)
+	{
+		if (m_fields[i].id == HEADER_UNKNOWN && EqualsIgnoreCase(m_fields[i].name, name))
+			return &m_fields[i];
+	}
+
+	return nullptr;
+}
+
+const HTTPHeaderList::Field *HTTPHeaderList::Find(std::string_view name) const
+{
+	return const_cast<HTTPHeaderList *>(this)->FindField(GetHeaderID(name), name);
+}
+
+void HTTPHeaderList::Add(int id, std::string_view name, std::string_view value)
+{
+	if (m_count == m_capacity)
+	{
+		// the previous array stays allocated until the list is destroyed
+		Field *fields = (Field *)AllocateBlock(m_capacity * 2 * sizeof(Field));
+		memcpy(fields, m_fields, m_count * sizeof(Field));
+		m_fields = fields;
+		m_capacity *= 2;
+	}
+
+	Field &field = m_fields[m_count++];
+	field.id = id;
+	field.name = Store(name);
+	field.value = Store(value);
+
+	if (id != HEADER_UNKNOWN && !m_known[id] && m_count <= USHRT_MAX)
+		m_known[id] = (unsigned short)m_count;
+}
+
+void HTTPHeaderList::Set(int id, std::string_view name, std::string_view value)
+{
+	Field *field = FindField(id, name);
+	if (field)
+		field->value = Store(value);
+	else
+		Add(id, name, value);
+}
@@ -0,0 +1,174 @@
+#pragma once
+
+#include <string_view>
+#include <memory_resource>
+
+// header fields the server knows by name, header lists keep the position of these
+// in fixed slots so they are found without hashing the name again
+enum
+{
+	HEADER_UNKNOWN = -1,
+	HEADER_ACCEPT = 0,
+	HEADER_ACCEPT_CHARSET,
+	HEADER_ACCEPT_ENCODING,
+	HEADER_ACCEPT_LANGUAGE,
+	HEADER_ACCEPT_RANGES,
+	HEADER_ACCESS_CONTROL_ALLOW_CREDENTIALS,
+	HEADER_ACCESS_CONTROL_ALLOW_HEADERS,
+	HEADER_ACCESS_CONTROL_ALLOW_METHODS,
+	HEADER_ACCESS_CONTROL_ALLOW_ORIGIN,
+	HEADER_ACCESS_CONTROL_EXPOSE_HEADERS,
+	HEADER_ACCESS_CONTROL_MAX_AGE,
+	HEADER_ACCESS_CONTROL_REQUEST_HEADERS,
+	HEADER_ACCESS_CONTROL_REQUEST_METHOD,
+	HEADER_AGE,
+	HEADER_ALLOW,
+	HEADER_AUTHORIZATION,
+	HEADER_CACHE_CONTROL,
+	HEADER_CONNECTION,
+	HEADER_CONTENT_DISPOSITION,
+	HEADER_CONTENT_ENCODING,
+	HEADER_CONTENT_LANGUAGE,
+	HEADER_CONTENT_LENGTH,
+	HEADER_CONTENT_LOCATION,
+	HEADER_CONTENT_RANGE,
+	HEADER_CONTENT_TYPE,
+	HEADER_COOKIE,
+	HEADER_DATE,
+	HEADER_DNT,
+	HEADER_ETAG,
+	HEADER_EXPECT,
+	HEADER_EXPIRES,
+	HEADER_FORWARDED,
+	HEADER_FROM,
+	HEADER_HOST,
+	HEADER_HTTP2_SETTINGS,
+	HEADER_IF_MATCH,
+	HEADER_IF_MODIFIED_SINCE,
+	HEADER_IF_NONE_MATCH,
+	HEADER_IF_RANGE,
+	HEADER_IF_UNMODIFIED_SINCE,
+	HEADER_KEEP_ALIVE,
+	HEADER_LAST_MODIFIED,
+	HEADER_LINK,
+	HEADER_LOCATION,
+	HEADER_MAX_FORWARDS,
+	HEADER_ORIGIN,
+	HEADER_PRAGMA,
+	HEADER_PROXY_AUTHENTICATE,
+	HEADER_PROXY_AUTHORIZATION,
+	HEADER_RANGE,
+	HEADER_REFERER,
+	HEADER_RETRY_AFTER,
+	HEADER_SEC_FETCH_DEST,
+	HEADER_SEC_FETCH_MODE,
+	HEADER_SEC_FETCH_SITE,
+	HEADER_SEC_FETCH_USER,
+	HEADER_SERVER,
+	HEADER_SET_COOKIE,
+	HEADER_TE,
+	HEADER_TRAILER,
+	HEADER_TRANSFER_ENCODING,
+	HEADER_UPGRADE,
+	HEADER_UPGRADE_INSECURE_REQUESTS,
+	HEADER_USER_AGENT,
+	HEADER_VARY,
+	HEADER_VIA,
+	HEADER_WWW_AUTHENTICATE,
+	HEADER_X_FORWARDED_FOR,
+	HEADER_X_FORWARDED_HOST,
+	HEADER_X_FORWARDED_PROTO,
+	HEADER_X_REQUESTED_WITH,
+
+	HEADER_COUNT = HEADER_X_REQUESTED_WITH + 1
+};
+
+// HEADER_UNKNOWN if the name is not one of the above, case is ignored
+int GetHeaderID(std::string_view name);
+
+// canonical spelling of a known header
+std::string_view GetHeaderName(int id);
+
+// Header fields of a request or response in the order they were added. Names and
+// values are copied into blocks taken from the memory resource, normally the
+// message's arena, and the fields live inside the list until there are more than
+// InlineFields of them. Repeated names, like Set-Cookie, stay separate fields.
+// Nothing is released before the list is destroyed.
+class HTTPHeaderList
+{
+public:
+	static constexpr size_t InlineFields = 16;
+
+	struct Field
+	{
+		int id;  // one of HEADER_, HEADER_UNKNOWN for other names
+		std::string_view name;
+		std::string_view value;
+	};
+private:
+	struct Block
+	{
+		Block *next;
+		size_t size;
+	};
+
+	std::pmr::memory_resource *m_resource;
+	Field *m_fields;
+	size_t m_count;
+	size_t m_capacity;
+	char *m_text;  // unused rest of the current text block
+	size_t m_textLeft;
+	Block *m_blocks;
+	unsigned short m_known[HEADER_COUNT];  // index + 1 of the first field of each known name
+	Field m_inline[InlineFields];
+
+	void *AllocateBlock(size_t size);
+	std::string_view Store(std::string_view text);
+	Field *FindField(int id, std::string_view name);
+public:
+	explicit HTTPHeaderList(std::pmr::memory_resource *resource);
+	~HTTPHeaderList();
+
+	HTTPHeaderList(const HTTPHeaderList &) = delete;
+
+	// appends a field, id is the result of GetHeaderID for name
+	void Add(int id, std::string_view name, std::string_view value);
+
+	inline void Add(std::string_view name, std::string_view value)
+	{
+		Add(GetHeaderID(name), name, value);
+	}
+
+	// replaces the value of the first field with the name, or appends one
+	void Set(int id, std::string_view name, std::string_view value);
+
+	inline void Set(std::string_view name, std::string_view value)
+	{
+		Set(GetHeaderID(name), name, value);
+	}
+
+	// first field with a known name, id must be one of HEADER_
+	inline const Field *Find(int id) const
+	{
+		unsigned short index = m_known[id];
+		return index ? &m_fields[index - 1] : nullptr;
+	}
+
+	// first field with the name, nullptr if there is none
+	const Field *Find(std::string_view name) const;
+
+	constexpr size_t Size() const
+	{
+		return m_count;
+	}
+
+	constexpr const Field *begin() const
+	{
+		return m_fields;
+	}
+
+	constexpr const Field *end() const
+	{
+		return m_fields + m_count;
+	}
+};
@@ -0,0 +1,262 @@
+#include "http_parser.h"
+
+#include "http_connection.h"
+#include "http_headers.h"
+#include "util.h"
+
+enum
+{
+	STATE_METHOD = 0,
+	STATE_TARGET,
+	STATE_VERSION,
+	STATE_REQUEST_LINE_LF,
+	STATE_FIELD_START,
+	STATE_FIELD_NAME,
+	STATE_FIELD_VALUE_START,
+	STATE_FIELD_VALUE,
+	STATE_FIELD_LF,
+	STATE_HEADER_END_LF,
+	STATE_BODY,
+	STATE_ERROR
+};
+
+// bytes ending a plain run of the target or version, and of a field value where
+// tabs and obs-text are allowed
+static constexpr char TargetStops[] = "\x00\x20\x7f\x7f";
+static constexpr char FieldValueStops[] = "\x00\x08\x0a\x1f\x7f\x7f";
+
+// token characters as defined by RFC 7230 section 3.2.6
+static inline bool IsTokenChar(unsigned char c)
+{
+	if (c >= 'a' && c <= 'z') return true;
+	if (c >= 'A' && c <= 'Z') return true;
+	if (c >= '0' && c <= '9') return true;
+
+	switch (c)
+	{
+	case '!': case '#': case '$': case '%': case '&': case '\'': case '*':
+	case '+': case '-': case '.': case '^': case '_': case '`': case '|': case '~':
+		return true;
+	default:
+		return false;
+	}
+}
+
+static inline bool IsFieldChar(unsigned char c)
+{
+	return c == '\t' || (c >= 0x20 && c != 0x7f);
+}
+
+HTTPRequestParser::HTTPRequestParser() :
+	m_state(STATE_METHOD), m_position(0), m_method(), m_target(), m_version(), m_fields(), m_field(),
+	m_valueEnd(0), m_headerLength(0), m_contentLength(0), m_hasContentLength(false), m_hasTransferEncoding(false),
+	m_errorStatus(RESP_BAD_REQUEST)
+{
+}
+
+void HTTPRequestParser::Reset()
+{
+	m_state = STATE_METHOD;
+	m_position = 0;
+	m_method = HTTPSlice();
+	m_target = HTTPSlice();
+	m_version = HTTPSlice();
+	m_fields.clear();
+	m_headerLength = 0;
+	m_contentLength = 0;
+	m_hasContentLength = false;
+	m_hasTransferEncoding = false;
+	m_errorStatus = RESP_BAD_REQUEST;
+}
+
+bool HTTPRequestParser::OnFieldComplete(const char *data)
+{
+	m_field.value.length = m_valueEnd - m_field.value.offset;
+	m_field.id = GetHeaderID(m_field.name.View(data));
+	m_fields.push_back(m_field);
+
+	if (m_field.id == HEADER_TRANSFER_ENCODING)
+		m_hasTransferEncoding = true;
+
+	if (m_field.id != HEADER_CONTENT_LENGTH)
+		return true;
+
+	std::string_view value = m_field.value.View(data);
+	if (value.empty())
+		return false;
+
+	size_t length = 0;
+	for (char c : value)
+	{
+		if (c < '0' || c > '9')
+			return false;
+
+		size_t next = length * 10 + (c - '0');
+		if (next / 10 != length)
+			return false;  // overflow
+		length = next;
+	}
+
+	// repeated lengths are only allowed to agree
+	if (m_hasContentLength && length != m_contentLength)
+		return false;
+
+	m_contentLength = length;
+	m_hasContentLength = true;
+	return true;
+}
+
+bool HTTPRequestParser::OnHeadComplete(size_t length)
+{
+	if (m_hasTransferEncoding)
+	{
+		m_errorStatus = m_hasContentLength ? RESP_BAD_REQUEST : RESP_NOT_IMPLEMENTED;
+		return false;
+	}
+
+	m_headerLength = length;
+	return true;
+}
+
+int HTTPRequestParser::Parse(const char *data, size_t size)
+{
+	if (m_state == STATE_ERROR)
+		return PARSE_ERROR;
+
+	while (m_position < size && m_state != STATE_BODY)
+	{
+		// skip plain runs with a single scan, only the byte that stops it goes
+		// through the state machine
+		if (m_state == STATE_TARGET || m_state == STATE_VERSION)
+		{
+			m_position += FindAnyInRanges(data + m_position, size - m_position, TargetStops, sizeof(TargetStops) - 1);
+			if (m_position == size)
+				break;
+		}
+		else if (m_state == STATE_FIELD_VALUE)
+		{
+			size_t skip = FindAnyInRanges(data + m_position, size - m_position, FieldValueStops, sizeof(FieldValueStops) - 1);
+			for (size_t end = m_position + skip; end > m_position; end--)
+			{
+				if (data[end - 1] != ' ' && data[end - 1] != '\t')
+				{
+					m_valueEnd = end;
+					break;
+				}
+			}
+
+			m_position += skip;
+			if (m_position == size)
+				break;
+		}
+
+		const size_t pos = m_position++;
+		const unsigned char c = (unsigned char)data[pos];
+
+		switch (m_state)
+		{
+		case STATE_METHOD:
+			if (c == ' ')
+			{
+				m_method.length = pos - m_method.offset;
+				m_state = m_method.length > 0 ? STATE_TARGET : STATE_ERROR;
+				m_target.offset = pos + 1;
+			}
+			else if (!IsTokenChar(c))
+				m_state = STATE_ERROR;
+			break;
+		case STATE_TARGET:
+			if (c == ' ')
+			{
+				m_target.length = pos - m_target.offset;
+				m_state = m_target.length > 0 ? STATE_VERSION : STATE_ERROR;
+				m_version.offset = pos + 1;
+			}
+			else if (c <= 0x20 || c == 0x7f)
+				m_state = STATE_ERROR;
+			break;
+		case STATE_VERSION:
+			if (c == '\r' || c == '\n')
+			{
+				m_version.length = pos - m_version.offset;
+				if (m_version.length == 0)
+					m_state = STATE_ERROR;
+				else
+					m_state = c == '\r' ? STATE_REQUEST_LINE_LF : STATE_FIELD_START;
+			}
+			else if (c <= 0x20 || c == 0x7f)
+				m_state = STATE_ERROR;
+			break;
+		case STATE_REQUEST_LINE_LF:
+			m_state = c == '\n' ? STATE_FIELD_START : STATE_ERROR;
+			break;
+		case STATE_FIELD_START:
+			if (c == '\r')
+				m_state = STATE_HEADER_END_LF;
+			else if (c == '\n')
+				m_state = OnHeadComplete(pos + 1) ? STATE_BODY : STATE_ERROR;
+			else if (IsTokenChar(c))
+			{
+				// obsolete line folding starts with whitespace and is rejected here
+				m_field.name.offset = pos;
+				m_state = STATE_FIELD_NAME;
+			}
+			else
+				m_state = STATE_ERROR;
+			break;
+		case STATE_FIELD_NAME:
+			if (c == ':')
+			{
+				m_field.name.length = pos - m_field.name.offset;
+				m_field.value.offset = pos + 1;
+				m_valueEnd = pos + 1;
+				m_state = STATE_FIELD_VALUE_START;
+			}
+			else if (!IsTokenChar(c))
+				m_state = STATE_ERROR;
+			break;
+		case STATE_FIELD_VALUE_START:
+			if (c == ' ' || c == '\t')
+			{
+				m_field.value.offset = pos + 1;
+				m_valueEnd = pos + 1;
+				break;
+			}
+			m_state = STATE_FIELD_VALUE;
+			// fall through
+		case STATE_FIELD_VALUE:
+			if (c == '\r' || c == '\n')
+			{
+				if (!OnFieldComplete(data))
+					m_state = STATE_ERROR;
+				else
+					m_state = c == '\r' ? STATE_FIELD_LF : STATE_FIELD_START;
+			}
+			else if (!IsFieldChar(c))
+				m_state = STATE_ERROR;
+			else if (c != ' ' && c != '\t')
+				m_valueEnd = pos + 1;
+			break;
+		case STATE_FIELD_LF:
+			m_state = c == '\n' ? STATE_FIELD_START : STATE_ERROR;
+			break;
+		case STATE_HEADER_END_LF:
+			if (c == '\n')
+				m_state = OnHeadComplete(pos + 1) ? STATE_BODY : STATE_ERROR;
+			else
+				m_state = STATE_ERROR;
+			break;
+		}
+
+		if (m_state == STATE_ERROR)
+			return PARSE_ERROR;
+	}
+
+	if (m_state != STATE_BODY)
+		return m_position > MaxHeaderLength ? PARSE_ERROR : PARSE_INCOMPLETE;
+
+	if (size - m_headerLength < m_contentLength)
+		return PARSE_INCOMPLETE;
+
+	return PARSE_OK;
+}
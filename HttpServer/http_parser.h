@@ -0,0 +1,110 @@
+#pragma once
+
+#include <string_view>
+#include <vector>
+
+// largest request line plus header block accepted
+static constexpr size_t MaxHeaderLength = 64 * 1024;
+
+// position of a parsed element inside the connection buffer, stored as an offset
+// because the buffer may be reallocated while the rest of the request arrives
+struct HTTPSlice
+{
+	size_t offset;
+	size_t length;
+
+	inline std::string_view View(const char *base) const
+	{
+		return std::string_view(base + offset, length);
+	}
+};
+
+struct HTTPFieldSlice
+{
+	HTTPSlice name;
+	HTTPSlice value;  // without surrounding whitespace
+	int id;  // one of HEADER_, HEADER_UNKNOWN for other names
+};
+
+// Incremental HTTP/1.1 request parser. Every call continues where the last one
+// stopped, so each byte of the request head is looked at exactly once no matter
+// how the data is split across reads. Nothing is copied, the parser only records
+// where the request line and header fields are in the buffer.
+class HTTPRequestParser
+{
+private:
+	int m_state;
+	size_t m_position;  // next byte to consume
+
+	HTTPSlice m_method;
+	HTTPSlice m_target;
+	HTTPSlice m_version;
+	std::vector<HTTPFieldSlice> m_fields;
+	HTTPFieldSlice m_field;
+	size_t m_valueEnd;  // end of the current value, excluding trailing whitespace
+
+	size_t m_headerLength;
+	size_t m_contentLength;
+	bool m_hasContentLength;
+	bool m_hasTransferEncoding;
+	int m_errorStatus;
+
+	bool OnFieldComplete(const char *data);
+	bool OnHeadComplete(size_t length);
+public:
+	HTTPRequestParser();
+
+	// continues parsing the first size bytes of data, which must start with the same
+	// bytes as in the previous call. Returns PARSE_OK once the head and the whole
+	// body are available, PARSE_INCOMPLETE if more data is needed.
+	int Parse(const char *data, size_t size);
+
+	// prepares for the next request, the caller removes the last one from the buffer
+	void Reset();
+
+	inline std::string_view GetMethod(const char *data) const
+	{
+		return m_method.View(data);
+	}
+
+	inline std::string_view GetTarget(const char *data) const
+	{
+		return m_target.View(data);
+	}
+
+	inline std::string_view GetVersion(const char *data) const
+	{
+		return m_version.View(data);
+	}
+
+	constexpr const std::vector<HTTPFieldSlice> &GetFields() const
+	{
+		return m_fields;
+	}
+
+	// true once the request line and header fields were parsed, the body may
+	// still be arriving
+	constexpr bool IsHeadComplete() const
+	{
+		return m_headerLength > 0;
+	}
+
+	// size of the request line and header fields including the empty line
+	constexpr size_t GetHeaderLength() const
+	{
+		return m_headerLength;
+	}
+
+	constexpr size_t GetContentLength() const
+	{
+		return m_contentLength;
+	}
+
+	// status to answer a request with once Parse returned PARSE_ERROR. Bodies are
+	// only framed by Content-Length, so a request with Transfer-Encoding is refused
+	// with 501, or with 400 if it also has a Content-Length and could be smuggled.
+	constexpr int GetErrorStatus() const
+	{
+		return m_errorStatus;
+	}
+};
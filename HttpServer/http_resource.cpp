@@ -53,27 +53,8 @@ void ResolveContentType(const char *ext, std::string &out)
 		out = "video/mp4";
 }
 
-bool HTTPResource::LoadResource()
-{
-	FILE *stream;
-	fopen_s(&stream, m_location.c_str(), "rb");
-	if (!stream) return false;
-
-	fseek(stream, 0, SEEK_END);
-	m_len = (size_t)_ftelli64(stream);
-	fseek(stream, 0, SEEK_SET);
-
-	m_data = new char[m_len];
-	fread_s(m_data, m_len, 1, m_len, stream);
-
-	fclose(stream);
-
-	return true;
-}
-
 HTTPResource::HTTPResource(const std::string &name, const std::string &location) :
-	m_name(name), m_location(location), m_data(nullptr), m_len(0), m_refs(0),
-	m_mutex(NULL)
+	m_name(name), m_location(location)
 {
 	size_t sepidx = name.find_last_of('/');
 	size_t extidx = name.find_last_of('.');
@@ -83,55 +64,27 @@ HTTPResource::HTTPResource(const std::string &name, const std::string &location)
 		ResolveContentType(ext, m_contentType);
 	}
 	else m_contentType = "text/plain";
-	m_mutex = CreateMutexA(NULL, FALSE, NULL);
 }
 
-HTTPResource::~HTTPResource()
+void HTTPResource::Free(void *resource)
 {
-	CloseHandle(m_mutex);
-	m_mutex = NULL;
+	delete (HTTPResource *)resource;
 }
 
-bool HTTPResource::Request()
+HANDLE HTTPResource::OpenFile(size_t *length) const
 {
-	DWORD dwWaitResult = WaitForSingleObject(m_mutex, INFINITE);
-	switch (dwWaitResult)
-	{
-	case WAIT_OBJECT_0:
-		if (!LoadResource())
-		{
-			ReleaseMutex(m_mutex);
-			return false;
-		}
-		m_refs++;
-		ReleaseMutex(m_mutex);
-		return true;
-		break;
-	case WAIT_ABANDONED:
-		ReleaseMutex(m_mutex);
-		return false;
-		break;
-	}
-
-	ReleaseMutex(m_mutex);
-	return false;
-}
+	HANDLE file = CreateFileA(m_location.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL,
+		OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+		return file;
 
-void HTTPResource::Done()
-{
-	DWORD dwWaitResult = WaitForSingleObject(m_mutex, INFINITE);
-	switch (dwWaitResult)
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(file, &size))
 	{
-	case WAIT_OBJECT_0:
-		if (m_refs > 0)
-			m_refs--;
-		if (m_refs == 0)
-		{
-			delete[] m_data;
-			m_data = nullptr;
-			m_len = 0;
-		}
-		break;
+		CloseHandle(file);
+		return INVALID_HANDLE_VALUE;
 	}
-	ReleaseMutex(m_mutex);
+
+	*length = (size_t)size.QuadPart;
+	return file;
 }
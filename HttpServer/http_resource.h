@@ -12,22 +12,12 @@ class HTTPResource
 private:
 	std::string m_name;
 	std::string m_location;
-	char *m_data;
-	size_t m_len;
-
 	std::string m_contentType;
-
-	size_t m_refs;
-
-	HANDLE m_mutex;
-
-	bool LoadResource();
 public:
 	HTTPResource(const std::string &name, const std::string &location);
-	~HTTPResource();
 
-	bool Request();
-	void Done();
+	// opens the backing file for a single response, returns INVALID_HANDLE_VALUE on failure
+	HANDLE OpenFile(size_t *length) const;
 
 	constexpr const std::string &GetName() const
 	{
@@ -39,28 +29,11 @@ public:
 		return m_location;
 	}
 
-	constexpr const char *GetData() const
-	{
-		return m_data;
-	}
-
-	constexpr size_t GetDataLength() const
-	{
-		return m_len;
-	}
-	
 	inline const char *GetContentType() const
 	{
 		return m_contentType.c_str();
 	}
 
-	constexpr size_t GetDRAMUsage() const
-	{
-		return m_len;
-	}
-
-	constexpr size_t GetMemoryMappedSize() const
-	{
-		return 0;
-	}
+	// matches EpochFreeFunc
+	static void Free(void *resource);
 };
\ No newline at end of file
@@ -1,21 +1,63 @@
 #include "http_server.h"
 
 #include <assert.h>
+#include <vector>
+#include <psapi.h>
 
-struct HTTPConnectionWorkerInfo
+#include "thread_util.h"
+#include "epoch.h"
+#include "resource_scan.h"
+
+struct PreloadState
+{
+	ResourceCache *cache;
+	std::vector<const HTTPResource *> resources;
+	volatile LONG loaded;
+	volatile LONGLONG bytes;
+};
+
+// state of a connection served by the pool, lives as long as the connection
+struct HTTPConnectionWorkerInfo : public Pooled
 {
+	OVERLAPPED overlapped;  // must stay first, receives the wakeup of a parked connection
 	HTTPConnection *connection;
 	HTTPServer *server;
 
 	HTTPConnectionWorkerInfo(HTTPConnection *connection, HTTPServer *server) :
-		connection(connection), server(server) { }
+		connection(connection), server(server)
+	{
+		memset(&overlapped, 0, sizeof(overlapped));
+	}
 };
 
-static DWORD HTTPConnectionWorker(__in HTTPConnectionWorkerInfo *info);
+static constexpr DWORD TimerTickLength = 100;
 
 static HTTPResponse *HandleUnsupportedRequest(const HTTPRequest *request);
 
-static void FindFiles(const char *root, std::vector<std::string> &paths);
+// name a resource is requested by, the path below the resource directory with
+// forward slashes
+static std::string GetResourceName(const std::string &path, size_t rootLength)
+{
+	std::string name(path.c_str() + rootLength);
+	for (char &c : name)
+	{
+		if (c == '\\') c = '/';
+	}
+	return name;
+}
+
+static void PreloadResource(void *context, size_t index)
+{
+	PreloadState *state = (PreloadState *)context;
+
+	CachedContent *content = state->cache->Acquire(state->resources[index]->GetLocation());
+	if (content)
+	{
+		InterlockedIncrement(&state->loaded);
+		InterlockedExchangeAdd64(&state->bytes, (LONGLONG)content->length);
+		ResourceCache::Release(content);
+	}
+}
 
 DWORD HTTPServer::HTTPServerWorker(__in HTTPServer *httpServer)
 {
@@ -31,73 +73,297 @@ DWORD HTTPServer::HTTPServerWorker(__in HTTPServer *httpServer)
 		//printf("Client connected from: %s:%hu\n", connection->GetRemoteAddress(), connection->GetPort());
 
 		con = new HTTPConnection(httpServer);
+		httpServer->ConfigureConnection(con);
 		if (!con->Bind(connection))
 		{
 			delete con;
 			break;
 		}
 
+		AcquireSRWLockExclusive(&httpServer->m_connectionsLock);
+		httpServer->m_connections.insert(con);
+		ReleaseSRWLockExclusive(&httpServer->m_connectionsLock);
+
+		// the first request is waited for like every later one, without a worker
 		HTTPConnectionWorkerInfo *info = new HTTPConnectionWorkerInfo(con, httpServer);
-		HANDLE connectionWorker = CreateThread(0, 0, (LPTHREAD_START_ROUTINE)&HTTPConnectionWorker, info, 0, NULL);
-		if (!connectionWorker)
-		{
-			delete info;
-			delete connectionWorker;
-			continue;
-		}
+		if (!CreateIoCompletionPort((HANDLE)connection->GetSocket(), httpServer->m_idlePort, 0, 0))
+			httpServer->CloseConnection(info);
+		else
+			httpServer->ParkConnection(info);
+	}
+	return 0;
+}
 
-		// detach the thread
-		CloseHandle(connectionWorker);
+DWORD HTTPServer::HTTPIdleWorker(__in HTTPServer *httpServer)
+{
+	while (true)
+	{
+		DWORD transferred;
+		ULONG_PTR key;
+		OVERLAPPED *overlapped;
+		BOOL success = GetQueuedCompletionStatus(httpServer->m_idlePort, &transferred, &key, &overlapped, INFINITE);
+
+		// a null overlapped is the signal to exit
+		if (!overlapped)
+			break;
+
+		// a failed wait was cancelled by a timeout or by Close. Input arriving while
+		// every worker is busy and the queue is full sheds the connection
+		HTTPConnectionWorkerInfo *info = (HTTPConnectionWorkerInfo *)overlapped;
+		if (!success || !httpServer->m_pool->Submit((WorkFunc)&HTTPConnectionWorker, info))
+			httpServer->CloseConnection(info);
 	}
 	return 0;
 }
 
-void HTTPServer::LoadResources(const std::string &resourcedir)
+void HTTPServer::ParkConnection(HTTPConnectionWorkerInfo *info)
+{
+	HTTPConnection *connection = info->connection;
+
+	// a zero byte receive completes once data or the end of the stream arrives,
+	// without holding a buffer or a thread meanwhile
+	connection->ReleaseInput();
+	connection->WaitForInput();
+
+	WSABUF buf;
+	buf.buf = nullptr;
+	buf.len = 0;
+	DWORD flags = 0;
+
+	memset(&info->overlapped, 0, sizeof(info->overlapped));
+	int res = WSARecv(connection->GetConnection()->GetSocket(), &buf, 1, NULL, &flags, &info->overlapped, NULL);
+	if (res == SOCKET_ERROR && WSAGetLastError() != WSA_IO_PENDING)
+	{
+		connection->StopWaiting();
+		CloseConnection(info);
+	}
+
+	// otherwise the idle thread may already have handed the connection on
+}
+
+void HTTPServer::CloseConnection(HTTPConnectionWorkerInfo *info)
+{
+	AcquireSRWLockExclusive(&m_connectionsLock);
+	m_connections.erase(info->connection);
+	ReleaseSRWLockExclusive(&m_connectionsLock);
+
+	delete info->connection;
+	delete info;
+}
+
+void HTTPServer::CloseIdlePort()
+{
+	if (m_idleThread)
+	{
+		PostQueuedCompletionStatus(m_idlePort, 0, 0, NULL);
+		WaitForSingleObject(m_idleThread, INFINITE);
+		CloseHandle(m_idleThread);
+		m_idleThread = NULL;
+	}
+
+	if (m_idlePort)
+	{
+		CloseHandle(m_idlePort);
+		m_idlePort = NULL;
+	}
+}
+
+void HTTPServer::LoadResources(const std::string &resourcedir, ResourceTable *table)
 {
+	const ULONGLONG start = GetTickCount64();
+
 	std::vector<std::string> files;
-	FindFiles(resourcedir.c_str(), files);
+	ScanStatistics stats;
+	ScanDirectory(resourcedir, 0, &files, &stats);
+
+	const ULONGLONG scanned = GetTickCount64();
+	printf("Scanned %ld directories and %ld files in %llu ms\n", stats.directories, stats.files, scanned - start);
 
 	for (size_t i = 0; i < files.size(); i++)
+		table->AddResource(new HTTPResource(GetResourceName(files[i], resourcedir.length()), files[i]));
+
+	printf("Registered %zu resources in %llu ms\n", files.size(), GetTickCount64() - scanned);
+}
+
+void HTTPServer::PreloadResources()
+{
+	const ULONGLONG start = GetTickCount64();
+
+	// keeps the resources alive while the threads load them
+	EpochGuard epoch;
+
+	PreloadState state;
+	state.cache = &m_cache;
+	state.loaded = 0;
+	state.bytes = 0;
+	for (auto &p : GetResourceTable()->GetResources())
+		state.resources.push_back(p.second);
+
+	ParallelFor("Preloading", state.resources.size(), 0, &PreloadResource, &state);
+
+	printf("Preloaded %ld of %zu resources (%lld KB) in %llu ms\n", state.loaded, state.resources.size(),
+		state.bytes / 1024, GetTickCount64() - start);
+}
+
+void HTTPServer::Publish(ResourceTable *table)
+{
+	ResourceTable *old = (ResourceTable *)InterlockedExchangePointer((PVOID volatile *)&m_table, table);
+
+	// resources only the old table refers to go with it
+	const CaseInsensitiveMap<HTTPResource *> &current = table->GetResources();
+	for (auto &p : old->GetResources())
+	{
+		auto it = current.find(p.first);
+		if (it == current.end() || it->second != p.second)
+			EpochRetire(p.second, &HTTPResource::Free);
+	}
+
+	EpochRetire(old, &ResourceTable::Free);
+	EpochCollect();
+}
+
+void HTTPServer::UpdateResources(const std::vector<std::string> &paths)
+{
+	std::vector<std::string> invalidated;
+	std::vector<HTTPResource *> removed;
+
+	// only resources requested so far are known, which are simply forgotten
+	if (m_resolver)
 	{
-		std::string normalized(files[i].c_str() + resourcedir.length());
-		char *tochange = (char *)normalized.c_str();
-		while (*tochange)
+		for (const std::string &path : paths)
 		{
-			if (*tochange == '\\') *tochange = '/';
-			tochange++;
+			std::string location = m_resourcedir + "\\" + path;
+
+			WIN32_FILE_ATTRIBUTE_DATA data;
+			const bool file = GetFileAttributesExA(location.c_str(), GetFileExInfoStandard, &data) &&
+				!(data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY);
+
+			m_resolver->Invalidate(GetResourceName(location, m_resourcedir.length()), !file, &invalidated);
+		}
+
+		for (const std::string &location : invalidated)
+			m_cache.Invalidate(location);
+		return;
+	}
+
+	AcquireSRWLockExclusive(&m_tableLock);
+
+	// resources which didn't change stay shared with the current table
+	ResourceTable *table = new ResourceTable(*m_table);
+	const CaseInsensitiveMap<HTTPResource *> &resources = table->GetResources();
+
+	for (const std::string &path : paths)
+	{
+		std::string location = m_resourcedir + "\\" + path;
+		std::string name = GetResourceName(location, m_resourcedir.length());
+
+		WIN32_FILE_ATTRIBUTE_DATA data;
+		if (!GetFileAttributesExA(location.c_str(), GetFileExInfoStandard, &data))
+		{
+			// deleted or moved away, a directory takes everything below it along
+			HTTPResource *resource = table->RemoveResource(name);
+			if (resource)
+				removed.push_back(resource);
+			else
+				table->RemoveDirectory(name + "/", &removed);
+		}
+		else if (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+		{
+			// a directory moved in arrives with its files and only reports its name
+			std::vector<std::string> files;
+			ScanStatistics stats;
+			ScanDirectory(location, 0, &files, &stats);
+			for (const std::string &file : files)
+			{
+				std::string fileName = GetResourceName(file, m_resourcedir.length());
+				if (resources.find(fileName) == resources.end())
+				{
+					table->AddResource(new HTTPResource(fileName, file));
+					printf("Added resource: %s\n", fileName.c_str());
+				}
+			}
+		}
+		else if (resources.find(name) == resources.end())
+		{
+			table->AddResource(new HTTPResource(name, location));
+			printf("Added resource: %s\n", name.c_str());
+		}
+		else
+		{
+			invalidated.push_back(location);
+			printf("Updated resource: %s\n", name.c_str());
 		}
+	}
 
-		m_resources[normalized] = new HTTPResource(normalized, files[i]);
-		printf("Registered resource: %s\n", normalized.c_str());
+	// the removed resources may be freed as soon as the table is published
+	for (HTTPResource *resource : removed)
+	{
+		invalidated.push_back(resource->GetLocation());
+		printf("Removed resource: %s\n", resource->GetName().c_str());
 	}
 
-	printf("Registered %zu resources!\n", files.size());
+	Publish(table);
+
+	ReleaseSRWLockExclusive(&m_tableLock);
+
+	for (const std::string &location : invalidated)
+		m_cache.Invalidate(location);
+}
+
+void HTTPServer::OnResourcesChanged(void *context, const std::vector<std::string> &paths, bool rescan)
+{
+	HTTPServer *server = (HTTPServer *)context;
+	if (rescan)
+	{
+		printf("Missed changes to %s, reloading all resources\n", server->m_resourcedir.c_str());
+		server->ReloadResources();
+	}
+	else
+		server->UpdateResources(paths);
 }
 
-HTTPServer::HTTPServer(const std::string &resourcedir) :
-	m_server(nullptr), m_handle(NULL), m_rsrcMutex(NULL), m_resources(),
-	m_resourcedir(resourcedir)
+HTTPServer::HTTPServer(const std::string &resourcedir, bool lazy) :
+	m_server(nullptr), m_handles(nullptr), m_handleCount(0), m_ioModel(IOMODEL_IOCP),
+	m_reactorThreads(0), m_acceptThreads(1), m_pinThreads(false), m_registeredBuffers(4096), m_reactor(nullptr),
+	m_poolThreads(0), m_poolQueueDepth(1024), m_pool(nullptr), m_idlePort(NULL), m_idleThread(NULL), m_pipelineDepth(16), m_bodyMemoryLimit(1024 * 1024),
+	m_timers(TimerTickLength), m_timeouts{ 60000, 20000, 60000, 60000 }, m_requests(0), m_connections(), m_resourcedir(resourcedir),
+	m_table(nullptr), m_resolver(nullptr), m_watch(false), m_watchDelay(250), m_watcher(nullptr)
 {
 	memset(m_handleFuncs, 0, sizeof(m_handleFuncs));
-	LoadResources(resourcedir);
+	InitializeSRWLock(&m_connectionsLock);
+	InitializeSRWLock(&m_tableLock);
 
-	m_rsrcMutex = CreateMutexA(NULL, FALSE, NULL);
+	ResourceTable *table = new ResourceTable();
+	if (lazy)
+		m_resolver = new ResourceResolver(resourcedir);
+	else
+		LoadResources(resourcedir, table);
+	m_table = table;
 }
 
 HTTPServer::~HTTPServer()
 {
 	Close();
 
-	if (m_rsrcMutex)
-	{
-		CloseHandle(m_rsrcMutex);
-		m_rsrcMutex = NULL;
-	}
+	for (auto &p : m_table->GetResources())
+		delete p.second;
+	delete m_table;
+	m_table = nullptr;
+
+	delete m_resolver;
+	m_resolver = nullptr;
+
+	EpochCollect();
 }
 
 void HTTPServer::CreateResourceProxy(const CaseInsensitiveString &from, const CaseInsensitiveString &to)
 {
-	m_resourceProxies[from] = to;
+	AcquireSRWLockExclusive(&m_tableLock);
+	ResourceTable *table = new ResourceTable(*m_table);
+	table->AddProxy(from, to);
+	Publish(table);
+	ReleaseSRWLockExclusive(&m_tableLock);
+
 	printf("Created proxy from resource %s to %s\n", from.cstr(), to.cstr());
 }
 
@@ -105,19 +371,65 @@ bool HTTPServer::Bind(Server *server)
 {
 	if (m_server || !server) return false;
 	m_server = server;
+	return true;
 }
 
 void HTTPServer::Close()
 {
 	if (m_server)
 	{
+		if (m_watcher)
+		{
+			m_watcher->Stop();
+			delete m_watcher;
+			m_watcher = nullptr;
+		}
+
+		if (m_reactor)
+		{
+			m_reactor->Stop();
+			delete m_reactor;
+			m_reactor = nullptr;
+		}
+
 		m_server->Close();
-		if (m_handle)
+		WaitUntilFinish();  // must wait for the threads to finish before freeing
+
+		if (m_pool)
 		{
-			WaitForSingleObject(m_handle, INFINITE);  // must wait for the thread to finish before freeing
-			CloseHandle(m_handle);
-			m_handle = nullptr;
+			// fail whatever the connections wait for, which wakes workers blocked on one
+			// and cancels the receive of parked ones. They close as this is noticed, a
+			// connection parked again meanwhile is caught by the next pass.
+			while (true)
+			{
+				AcquireSRWLockShared(&m_connectionsLock);
+				const bool empty = m_connections.empty();
+				for (HTTPConnection *connection : m_connections)
+				{
+					if (connection->IsOpen())
+					{
+						SOCKET socket = connection->GetConnection()->GetSocket();
+						shutdown(socket, SD_BOTH);
+						CancelIoEx((HANDLE)socket, NULL);
+					}
+				}
+				ReleaseSRWLockShared(&m_connectionsLock);
+
+				if (empty)
+					break;
+				Sleep(10);
+			}
+
+			m_pool->Stop();
+			delete m_pool;
+			m_pool = nullptr;
 		}
+
+		CloseIdlePort();
+
+		// every connection is gone, so none can be armed anymore
+		m_timers.Stop();
+
 		m_server = nullptr;
 	}
 }
@@ -126,11 +438,12 @@ void HTTPServer::ForceClose()
 {
 	if (m_server)
 	{
-		if (m_handle)
-		{
-			CloseHandle(m_handle);
-			m_handle = nullptr;
-		}
+		for (int i = 0; i < m_handleCount; i++)
+			CloseHandle(m_handles[i]);
+
+		delete[] m_handles;
+		m_handles = nullptr;
+		m_handleCount = 0;
 
 		m_server = nullptr;
 	}
@@ -138,18 +451,103 @@ void HTTPServer::ForceClose()
 
 bool HTTPServer::DispatchServer()
 {
-	if (m_handle) return false;
-	m_handle = CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE)&HTTPServerWorker, this, 0, NULL);
-	return m_handle;
+	if (m_handles || m_reactor || m_pool || !m_server) return false;
+
+	if (!m_timers.Start())
+		return false;
+
+	// the server still runs without, changes then wait for a reload
+	if (m_watch)
+	{
+		m_watcher = new ResourceWatcher(m_resourcedir, m_watchDelay, &OnResourcesChanged, this);
+		if (!m_watcher->Start())
+		{
+			delete m_watcher;
+			m_watcher = nullptr;
+		}
+	}
+
+	if (m_ioModel == IOMODEL_IOCP || m_ioModel == IOMODEL_RIO || m_ioModel == IOMODEL_COROUTINE)
+	{
+		m_reactor = new IOReactor(this, m_ioModel);
+		m_reactor->SetRegisteredBufferCount(m_registeredBuffers);
+		m_reactor->SetThreadAffinity(m_pinThreads);
+		if (!m_reactor->Start(m_server, m_reactorThreads))
+		{
+			delete m_reactor;
+			m_reactor = nullptr;
+			return false;
+		}
+		return true;
+	}
+
+	m_pool = new WorkPool(m_poolQueueDepth);
+	if (!m_pool->Start(m_poolThreads, m_pinThreads))
+	{
+		delete m_pool;
+		m_pool = nullptr;
+		return false;
+	}
+
+	m_idlePort = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 1);
+	if (m_idlePort)
+		m_idleThread = CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE)&HTTPIdleWorker, this, 0, NULL);
+
+	if (!m_idleThread)
+	{
+		CloseIdlePort();
+
+		m_pool->Stop();
+		delete m_pool;
+		m_pool = nullptr;
+		return false;
+	}
+
+	int threads = m_acceptThreads > 0 ? m_acceptThreads : GetProcessorCount();
+
+	m_handles = new HANDLE[threads];
+	for (m_handleCount = 0; m_handleCount < threads; m_handleCount++)
+	{
+		HANDLE handle = CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE)&HTTPServerWorker, this, CREATE_SUSPENDED, NULL);
+		if (!handle)
+			break;
+
+		if (m_pinThreads)
+			PinThread(handle, m_handleCount);
+
+		ResumeThread(handle);
+		m_handles[m_handleCount] = handle;
+	}
+
+	if (m_handleCount == 0)
+	{
+		delete[] m_handles;
+		m_handles = nullptr;
+
+		CloseIdlePort();
+
+		m_pool->Stop();
+		delete m_pool;
+		m_pool = nullptr;
+		return false;
+	}
+
+	return true;
 }
 
 bool HTTPServer::WaitUntilFinish()
 {
-	if (m_handle)
+	if (m_handles)
 	{
-		WaitForSingleObject(m_handle, INFINITE);
-		CloseHandle(m_handle);
-		m_handle = nullptr;
+		for (int i = 0; i < m_handleCount; i++)
+		{
+			WaitForSingleObject(m_handles[i], INFINITE);
+			CloseHandle(m_handles[i]);
+		}
+
+		delete[] m_handles;
+		m_handles = nullptr;
+		m_handleCount = 0;
 		return true;
 	}
 	return false;
@@ -157,74 +555,87 @@ bool HTTPServer::WaitUntilFinish()
 
 bool HTTPServer::ReloadResources()
 {
-	DWORD dwWaitResult = WaitForSingleObject(m_rsrcMutex, INFINITE);
-	switch (dwWaitResult)
+	// requests still using the old table keep it until they return
+	AcquireSRWLockExclusive(&m_tableLock);
+
+	if (m_resolver)
+		m_resolver->Clear();
+	else
 	{
-	case WAIT_OBJECT_0:
-		for (auto &p : m_resources)
-			delete p.second;
-		m_resources.clear();
+		ResourceTable *table = new ResourceTable();
+		LoadResources(m_resourcedir, table);
+		for (auto &p : m_table->GetProxies())
+			table->AddProxy(p.first, p.second);
 
-		LoadResources(m_resourcedir);
-		return true;
-	case WAIT_ABANDONED:
-		return false;
-		break;
+		Publish(table);
 	}
+
+	m_cache.Clear();
+
+	ReleaseSRWLockExclusive(&m_tableLock);
+	return true;
 }
 
-HTTPResource *HTTPServer::FindHTTPResource(const CaseInsensitiveString &location) const
+HTTPResource *HTTPServer::FindHTTPResource(std::string_view location) const
 {
-	const CaseInsensitiveString *actual;
-	std::unordered_map<CaseInsensitiveString, CaseInsensitiveString>::const_iterator proxit;
-	std::unordered_map<CaseInsensitiveString, HTTPResource *>::const_iterator it;
-	HTTPResource *result = nullptr;
+	const ResourceTable *table = m_table;
+	if (!m_resolver)
+		return table->Find(location);
 
-	DWORD dwWaitResult = WaitForSingleObject(m_rsrcMutex, INFINITE);
-	switch (dwWaitResult)
-	{
-	case WAIT_OBJECT_0:
-		proxit = m_resourceProxies.find(location);
-		if (proxit != m_resourceProxies.end())
-			actual = &proxit->second;
-		else
-			actual = &location;
+	return m_resolver->Resolve(table->Resolve(location));
+}
 
-		it = m_resources.find(*actual);
-		if (it != m_resources.end())
-			result = it->second;
+void HTTPServer::ConfigureConnection(HTTPConnection *connection)
+{
+	connection->SetBodyMemoryLimit(m_bodyMemoryLimit);
+	connection->SetTimeouts(&m_timers, &m_timeouts);
+}
 
-		ReleaseMutex(m_rsrcMutex);
-		break;
-	case WAIT_ABANDONED:
-		break;
-	}
-	
-	return result;
+void HTTPServer::GetTimerStatistics(TimerStatistics *stats) const
+{
+	m_timers.GetStatistics(stats);
 }
 
-const std::unordered_map<CaseInsensitiveString, HTTPResource *> &HTTPServer::GetResources() const
+bool HTTPServer::GetReactorStatistics(ReactorStatistics *stats) const
 {
-	DWORD dwWaitResult = WaitForSingleObject(m_rsrcMutex, INFINITE);
-	switch (dwWaitResult)
-	{
-	case WAIT_OBJECT_0:
-		ReleaseMutex(m_rsrcMutex);
-	case WAIT_ABANDONED:
-		return m_resources;
-	}
+	if (!m_reactor) return false;
+	m_reactor->GetStatistics(stats);
+	return true;
+}
+
+bool HTTPServer::GetWorkPoolStatistics(WorkPoolStatistics *stats) const
+{
+	if (!m_pool) return false;
+	m_pool->GetStatistics(stats);
+	return true;
+}
+
+size_t HTTPServer::GetConnectionCount() const
+{
+	AcquireSRWLockShared(&m_connectionsLock);
+	const size_t count = m_connections.size();
+	ReleaseSRWLockShared(&m_connectionsLock);
+	return count;
 }
 
-const std::unordered_map<CaseInsensitiveString, CaseInsensitiveString> &HTTPServer::GetResourceProxies() const
+HTTPResponse *HTTPServer::DispatchRequest(const HTTPRequest *request)
 {
-	DWORD dwWaitResult = WaitForSingleObject(m_rsrcMutex, INFINITE);
-	switch (dwWaitResult)
+	InterlockedIncrement64(&m_requests);
+
+	// resources found by the handler stay valid until it returns
+	EpochGuard epoch;
+
+	HTTPRequestHandlerFunc fun = GetRequestHandlerFunc(request->GetMethod());
+	if (!fun) fun = &HandleUnsupportedRequest;
+
+	HTTPResponse *response = fun(request);
+	if (!response)
 	{
-	case WAIT_OBJECT_0:
-		ReleaseMutex(m_rsrcMutex);
-	case WAIT_ABANDONED:
-		return m_resourceProxies;
+		assert(fun != &HandleUnsupportedRequest);
+		response = HandleUnsupportedRequest(request);
 	}
+
+	return response;
 }
 
 void HTTPServer::GenerateAllowHeader(HTTPResponse *dest) const
@@ -243,55 +654,550 @@ void HTTPServer::GenerateAllowHeader(HTTPResponse *dest) const
 	dest->AddHeader("Allow", allowed.ToInPlaceString());
 }
 
-DWORD HTTPConnectionWorker(__in HTTPConnectionWorkerInfo *info)
+static constexpr char LookupRequest[] =
+"GET /index.html HTTP/1.1\r\n"
+"Host: localhost\r\n"
+"Connection: keep-alive\r\n"
+"User-Agent: Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/110.0.0.0 Safari/537.36\r\n"
+"Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+"Accept-Encoding: gzip, deflate, br\r\n"
+"Accept-Language: en-US,en;q=0.9\r\n"
+"\r\n";
+
+static constexpr const char *LookupHeaders[] = { "host", "CONNECTION", "User-Agent", "accept-encoding", "If-None-Match" };
+static constexpr int LookupRounds = 200000;
+
+struct LookupTiming
+{
+	double millions;  // lookups per second
+	double allocations;  // heap allocations per lookup
+};
+
+// runs lookup LookupRounds times over count keys
+template <class Func>
+static LookupTiming MeasureLookups(size_t count, Func lookup)
+{
+	volatile size_t sink = 0;
+
+	PoolStatistics before, after;
+	LARGE_INTEGER frequency, start, end;
+	GetPoolStatistics(&before);
+	QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&start);
+
+	for (int round = 0; round < LookupRounds; round++)
+	{
+		for (size_t i = 0; i < count; i++)
+			sink = sink + (lookup(i) ? 1 : 0);
+	}
+
+	QueryPerformanceCounter(&end);
+	GetPoolStatistics(&after);
+
+	const double lookups = (double)count * LookupRounds;
+	const double seconds = (double)(end.QuadPart - start.QuadPart) / frequency.QuadPart;
+	return { lookups / seconds / 1e6, (double)(after.heap - before.heap) / lookups };
+}
+
+void HTTPServer::BenchmarkLookups() const
+{
+	// in a different case than registered, so every comparison has to fold
+	EpochGuard epoch;
+	const ResourceTable *table = GetResourceTable();
+	const CaseInsensitiveMap<HTTPResource *> &resources = table->GetResources();
+
+	std::vector<std::string> paths;
+	for (auto &p : resources)
+		paths.push_back(toUppercase(p.first.value()));
+	for (auto &p : table->GetProxies())
+		paths.push_back(p.first.value());
+	if (paths.empty())
+		paths.push_back("/");
+
+	HTTPConnection connection(nullptr);
+	HTTPRequest *request;
+	connection.AppendInput(LookupRequest, sizeof(LookupRequest) - 1);
+	if (connection.ParseRequest(&request) != PARSE_OK)
+	{
+		printf("ERROR> Failed to parse the benchmark request\n");
+		return;
+	}
+
+	// the same maps keyed through std::hash<CaseInsensitiveString>, which lowercases a
+	// copy of the key for every hash
+	std::unordered_map<CaseInsensitiveString, HTTPResource *> oldResources(resources.begin(), resources.end());
+	std::unordered_map<CaseInsensitiveString, std::string> oldHeaders;
+	for (const auto &field : request->GetHeaders())
+		oldHeaders[CaseInsensitiveString(std::string(field.name))] = field.value;
+
+	std::vector<CaseInsensitiveString> pathKeys(paths.begin(), paths.end());
+	std::vector<CaseInsensitiveString> headerKeys(std::begin(LookupHeaders), std::end(LookupHeaders));
+	const size_t headerCount = headerKeys.size();
+
+	int headerIDs[std::size(LookupHeaders)];
+	for (size_t i = 0; i < headerCount; i++)
+		headerIDs[i] = GetHeaderID(LookupHeaders[i]);
+
+	LookupTiming rows[6];
+	rows[0] = MeasureLookups(paths.size(), [&](size_t i) { return FindHTTPResource(paths[i]) != nullptr; });
+	rows[1] = MeasureLookups(paths.size(), [&](size_t i) { return resources.find(paths[i]) != resources.end(); });
+	rows[2] = MeasureLookups(paths.size(), [&](size_t i) { return oldResources.find(pathKeys[i]) != oldResources.end(); });
+	rows[3] = MeasureLookups(headerCount, [&](size_t i) { return request->GetHeader(LookupHeaders[i]) != nullptr; });
+	rows[4] = MeasureLookups(headerCount, [&](size_t i) { return request->GetHeader(headerIDs[i]) != nullptr; });
+	rows[5] = MeasureLookups(headerCount, [&](size_t i) { return oldHeaders.find(headerKeys[i]) != oldHeaders.end(); });
+
+	static constexpr const char *Names[] = { "FindHTTPResource", "Resource map", "Resource (std)", "GetHeader", "GetHeader (ID)", "Header (std)" };
+
+	printf("Looking up %zu paths and %zu headers %d times\n", paths.size(), headerCount, LookupRounds);
+	printf("%-18s %-14s %-14s\n", "[Lookup]", "[M/s]", "[Allocs/Op]");
+	for (int i = 0; i < 6; i++)
+		printf("%-18s %-14.2f %-14.2f\n", Names[i], rows[i].millions, rows[i].allocations);
+
+	delete request;
+}
+
+static constexpr char ModelRequest[] =
+"GET /benchmark HTTP/1.1\r\n"
+"Host: localhost\r\n"
+"Connection: keep-alive\r\n"
+"\r\n";
+
+static constexpr int ModelClients = 16;
+static constexpr DWORD ModelDuration = 2000;
+
+struct ModelClient
+{
+	USHORT port;
+	volatile LONG *stop;
+	LONGLONG requests;
+	LONGLONG ticks;  // spent waiting for responses
+};
+
+static HTTPResponse *HandleModelRequest(const HTTPRequest *request)
+{
+	static constexpr char Body[] = "Hello, world!";
+
+	HTTPResponse *response = new HTTPResponse();
+	response->SetCode(200);
+	response->SetReason("OK");
+	response->SetContentType("text/plain");
+	response->AppendContent(Body, sizeof(Body) - 1);
+	return response;
+}
+
+// reads one whole response, only one request is outstanding at a time
+static bool ReadModelResponse(SOCKET socket, char *buffer, int size)
+{
+	int filled = 0;
+	while (filled < size - 1)
+	{
+		const int received = recv(socket, buffer + filled, size - 1 - filled, 0);
+		if (received <= 0)
+			return false;
+		filled += received;
+		buffer[filled] = 0;
+
+		const char *end = strstr(buffer, "\r\n\r\n");
+		if (!end)
+			continue;
+
+		const char *length = strstr(buffer, "Content-Length: ");
+		const int contentlen = length && length < end ? atoi(length + 16) : 0;
+		if (filled >= (int)(end + 4 - buffer) + contentlen)
+			return true;
+	}
+	return false;
+}
+
+static DWORD RunModelClient(ModelClient *client)
+{
+	SOCKET socket = ::socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (socket == INVALID_SOCKET)
+		return 1;
+
+	sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = client->port;
+	inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+
+	if (connect(socket, (sockaddr *)&addr, sizeof(addr)) == SOCKET_ERROR)
+	{
+		closesocket(socket);
+		return 1;
+	}
+
+	char buffer[4096];
+	LARGE_INTEGER start, end;
+	while (!*client->stop)
+	{
+		QueryPerformanceCounter(&start);
+		if (send(socket, ModelRequest, sizeof(ModelRequest) - 1, 0) != sizeof(ModelRequest) - 1 ||
+			!ReadModelResponse(socket, buffer, sizeof(buffer)))
+			break;
+		QueryPerformanceCounter(&end);
+
+		client->requests++;
+		client->ticks += end.QuadPart - start.QuadPart;
+	}
+
+	closesocket(socket);
+	return 0;
+}
+
+void HTTPServer::BenchmarkIOModels()
 {
-	static CaseInsensitiveString CONNECTION_HEADER("Connection");
+	static constexpr int Models[] = { IOMODEL_THREADED, IOMODEL_IOCP, IOMODEL_RIO, IOMODEL_COROUTINE };
+	static constexpr const char *Names[] = { "THREADED", "IOCP", "RIO", "COROUTINE" };
+
+	LARGE_INTEGER frequency;
+	QueryPerformanceFrequency(&frequency);
+
+	printf("Running %d keep-alive clients against each I/O model for %lu ms\n", ModelClients, ModelDuration);
+	printf("%-12s %-12s %-14s %-14s %-14s\n", "[IO Model]", "[Req/s]", "[Latency us]", "[Wakeups/Req]", "[Compl/Req]");
+
+	for (int m = 0; m < (int)std::size(Models); m++)
+	{
+		// a lazy server over no directory, every request gets the same small body
+		Server listener;
+		HTTPServer server("", true);
+		server.SetIOModel(Models[m], 0);
+		server.SetRequestHandler(METHOD_GET, &HandleModelRequest);
+
+		sockaddr_in bound;
+		int boundlen = sizeof(bound);
+		if (!listener.Open(0, AF_INET) || getsockname(listener.GetSocket(), (sockaddr *)&bound, &boundlen) == SOCKET_ERROR ||
+			!server.Bind(&listener) || !server.DispatchServer())
+		{
+			printf("%-12s unavailable\n", Names[m]);
+			continue;
+		}
+
+		volatile LONG stop = 0;
+		ModelClient clients[ModelClients];
+		HANDLE threads[ModelClients];
+		int started = 0;
+		for (; started < ModelClients; started++)
+		{
+			clients[started] = { bound.sin_port, &stop, 0, 0 };
+			threads[started] = CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE)&RunModelClient, &clients[started], 0, NULL);
+			if (!threads[started])
+				break;
+		}
+
+		Sleep(ModelDuration);
+		InterlockedExchange(&stop, 1);
+		WaitForMultipleObjects(started, threads, TRUE, INFINITE);
+
+		LONGLONG requests = 0;
+		LONGLONG ticks = 0;
+		for (int i = 0; i < started; i++)
+		{
+			CloseHandle(threads[i]);
+			requests += clients[i].requests;
+			ticks += clients[i].ticks;
+		}
+
+		// the threaded model wakes a pool worker for every task it runs
+		double wakeups = 0.0;
+		double completions = 0.0;
+		ReactorStatistics reactor;
+		WorkPoolStatistics pool;
+		if (server.GetReactorStatistics(&reactor))
+		{
+			wakeups = (double)reactor.wakeups;
+			completions = (double)reactor.completions;
+		}
+		else if (server.GetWorkPoolStatistics(&pool))
+			wakeups = (double)pool.executed;
+
+		server.Close();
+
+		const double perRequest = requests ? 1.0 / requests : 0.0;
+		printf("%-12s %-12.0f %-14.1f %-14.2f %-14.2f\n", Names[m], requests * 1000.0 / ModelDuration,
+			requests ? ticks * 1e6 / frequency.QuadPart / requests : 0.0, wakeups * perRequest, completions * perRequest);
+	}
+}
+
+static constexpr int IdleCounts[] = { 10000, 100000 };
+static constexpr int IdlePortsPerAddress = 10000;
+static constexpr USHORT IdleFirstPort = 20000;  // below the ephemeral range
+
+struct MemorySample
+{
+	SIZE_T workingSet;
+	SIZE_T commit;
+};
+
+static bool SampleMemory(MemorySample *sample)
+{
+	PROCESS_MEMORY_COUNTERS_EX counters;
+	if (!GetProcessMemoryInfo(GetCurrentProcess(), (PROCESS_MEMORY_COUNTERS *)&counters, sizeof(counters)))
+		return false;
+
+	sample->workingSet = counters.WorkingSetSize;
+	sample->commit = counters.PrivateUsage;
+	return true;
+}
+
+// connects from a loopback address and port of its own, the ephemeral range alone
+// can't hold 100k connections to one port. The connection is left idle after a
+// single request, like a keep-alive client between requests.
+static SOCKET OpenIdleClient(USHORT port, int index)
+{
+	SOCKET socket = ::socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (socket == INVALID_SOCKET)
+		return INVALID_SOCKET;
+
+	// the port may still be in TIME_WAIT from an earlier run
+	BOOL reuse = TRUE;
+	setsockopt(socket, SOL_SOCKET, SO_REUSEADDR, (const char *)&reuse, sizeof(reuse));
+
+	sockaddr_in local;
+	memset(&local, 0, sizeof(local));
+	local.sin_family = AF_INET;
+	local.sin_port = htons((USHORT)(IdleFirstPort + index % IdlePortsPerAddress));
+	local.sin_addr.s_addr = htonl(INADDR_LOOPBACK + 1 + index / IdlePortsPerAddress);
+
+	sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = port;
+	inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
 
+	char buffer[4096];
+	if (bind(socket, (sockaddr *)&local, sizeof(local)) == SOCKET_ERROR ||
+		connect(socket, (sockaddr *)&addr, sizeof(addr)) == SOCKET_ERROR ||
+		send(socket, ModelRequest, sizeof(ModelRequest) - 1, 0) != sizeof(ModelRequest) - 1 ||
+		!ReadModelResponse(socket, buffer, sizeof(buffer)))
+	{
+		closesocket(socket);
+		return INVALID_SOCKET;
+	}
+
+	return socket;
+}
+
+void HTTPServer::BenchmarkIdleConnections()
+{
+	static constexpr int Models[] = { IOMODEL_THREADED, IOMODEL_IOCP, IOMODEL_RIO, IOMODEL_COROUTINE };
+	static constexpr const char *Names[] = { "THREADED", "IOCP", "RIO", "COROUTINE" };
+
+	// idle connections must outlast opening all of them
+	static constexpr ConnectionTimeouts Timeouts = { 600000, 20000, 60000, 60000 };
+
+	for (int count : IdleCounts)
+	{
+		std::vector<SOCKET> clients;
+		clients.reserve(count);
+
+		// the clients live in this process too, what their sockets cost on their own
+		// is taken off every model
+		MemorySample before, after;
+		if (!SampleMemory(&before))
+			return;
+		for (int i = 0; i < count; i++)
+		{
+			SOCKET socket = ::socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+			if (socket == INVALID_SOCKET)
+				break;
+			clients.push_back(socket);
+		}
+		SampleMemory(&after);
+		for (SOCKET socket : clients)
+			closesocket(socket);
+
+		const double clientSet = clients.empty() ? 0.0 : ((double)after.workingSet - before.workingSet) / clients.size();
+		const double clientCommit = clients.empty() ? 0.0 : ((double)after.commit - before.commit) / clients.size();
+		clients.clear();
+
+		printf("Holding %d idle keep-alive connections on each I/O model\n", count);
+		printf("%-12s %-14s %-16s %-16s %-14s\n", "[IO Model]", "[Connections]", "[Working Set/C]", "[Commit/C]", "[vs THREADED]");
+
+		double threaded = 0.0;
+		for (int m = 0; m < (int)std::size(Models); m++)
+		{
+			Server listener;
+			HTTPServer server("", true);
+			server.SetIOModel(Models[m], 0);
+			server.SetTimeouts(Timeouts);
+			server.SetRequestHandler(METHOD_GET, &HandleModelRequest);
+
+			sockaddr_in bound;
+			int boundlen = sizeof(bound);
+			if (!listener.Open(0, AF_INET) || getsockname(listener.GetSocket(), (sockaddr *)&bound, &boundlen) == SOCKET_ERROR ||
+				!server.Bind(&listener) || !server.DispatchServer() || !SampleMemory(&before))
+			{
+				printf("%-12s unavailable\n", Names[m]);
+				continue;
+			}
+
+			for (int i = 0; i < count; i++)
+			{
+				SOCKET socket = OpenIdleClient(bound.sin_port, i);
+				if (socket == INVALID_SOCKET)
+					break;
+				clients.push_back(socket);
+			}
+
+			// let the last connections settle into waiting for their next request
+			Sleep(500);
+
+			ReactorStatistics reactor;
+			const size_t held = server.GetReactorStatistics(&reactor) ? (size_t)reactor.connections : server.GetConnectionCount();
+			SampleMemory(&after);
+
+			for (SOCKET socket : clients)
+				closesocket(socket);
+			clients.clear();
+			server.Close();
+
+			if (held == 0)
+			{
+				printf("%-12s no connections held\n", Names[m]);
+				continue;
+			}
+
+			const double workingSet = ((double)after.workingSet - before.workingSet) / held - clientSet;
+			const double commit = ((double)after.commit - before.commit) / held - clientCommit;
+			if (Models[m] == IOMODEL_THREADED)
+				threaded = commit;
+
+			printf("%-12s %-14zu %-16.0f %-16.0f %-14.2f\n", Names[m], held, workingSet, commit, threaded > 0.0 ? commit / threaded : 0.0);
+		}
+	}
+}
+
+void HTTPServer::HTTPConnectionWorker(__in HTTPConnectionWorkerInfo *info)
+{
 	HTTPConnection *connection = info->connection;
 	HTTPServer *server = info->server;
 
-	delete info;
+	connection->StopWaiting();
 
-	do
+	// the connection was woken by data or the end of the stream, the read tells which
+	if (connection->Receive() <= 0)
 	{
-		HTTPRequest *req = connection->GetNextRequest();
-		if (!req) break;
+		server->CloseConnection(info);
+		return;
+	}
+
+	std::vector<HTTPResponse *> responses;
+	responses.reserve(server->m_pipelineDepth);
 
-		const std::string *conheader = req->GetHeader(CONNECTION_HEADER);
-		if (conheader && equalsIgnoreCase(*conheader, "close"))
+	bool open = true;
+	while (open)
+	{
+		if (connection->IsHTTP2())
 		{
-			delete req;
+			if (ServeHTTP2(server, connection))
+				server->ParkConnection(info);
+			else
+				server->CloseConnection(info);
+			return;
+		}
+
+		HTTPRequest *req;
+		int status = connection->ParseRequest(&req);
+		if (status == PARSE_ERROR)
+		{
+			// the client is told why before the connection is closed
+			HTTPResponse *error = connection->CreateErrorResponse();
+			if (error)
+			{
+				connection->SendResponse(error);
+				delete error;
+			}
 			break;
 		}
 
-		HTTPRequestHandlerFunc fun = server->GetRequestHandlerFunc(req->GetMethod());
-		if (!fun) fun = &HandleUnsupportedRequest;
+		if (status == PARSE_INCOMPLETE)
+		{
+			// a request switching to HTTP/2 is served by the session
+			if (connection->IsHTTP2())
+				continue;
 
-		HTTPResponse *response = fun(req);
-		if (!response)
+			// the worker only reads what already arrived, the rest is waited for
+			// with the connection parked
+			int available = connection->GetConnection()->GetAvailable();
+			if (available == 0)
+			{
+				server->ParkConnection(info);
+				return;
+			}
+
+			if (available < 0 || connection->Receive() <= 0)
+				break;
+			continue;
+		}
+
+		// answer everything pipelined behind the request that is already buffered
+		// before writing all responses at once
+		do
 		{
-			assert(fun != &HandleUnsupportedRequest);
-			response = HandleUnsupportedRequest(req);
-			if (!response)
+			const std::string_view *conheader = req->GetHeader(HEADER_CONNECTION);
+			if (conheader && EqualsIgnoreCase(*conheader, "close"))
 			{
 				delete req;
+				open = false;
 				break;
 			}
-		}
 
-		delete req;
+			HTTPResponse *response = server->DispatchRequest(req);
+			delete req;
 
-		if (connection->SendResponse(response->Finalize()) <= 0)
-		{
+			if (!response)
+			{
+				open = false;
+				break;
+			}
+
+			response->Finalize();
+			responses.push_back(response);
+		} while ((int)responses.size() < server->m_pipelineDepth && connection->ParseRequest(&req) == PARSE_OK);
+
+		// responses to earlier requests are still sent if a later one ends the connection
+		if (!responses.empty() && connection->SendResponses(responses.data(), (int)responses.size()) <= 0)
+			open = false;
+
+		for (HTTPResponse *response : responses)
 			delete response;
-			break;
+		responses.clear();
+	}
+
+	server->CloseConnection(info);
+}
+
+// serves an HTTP/2 connection until it has to wait for the client. Returns true
+// if the connection should be parked and false if it has to be closed
+bool HTTPServer::ServeHTTP2(HTTPServer *server, HTTPConnection *connection)
+{
+	while (true)
+	{
+		HTTPRequest *req;
+		int status;
+		while ((status = connection->ParseRequest(&req)) == PARSE_OK)
+		{
+			connection->SubmitResponse(req, server->DispatchRequest(req));
+			delete req;
 		}
 
-		delete response;
-	} while (true);
+		// also sends the GOAWAY of a failed connection
+		int written = connection->FlushOutput();
+		if (written < 0 || status == PARSE_ERROR || connection->IsClosing())
+			return false;
 
-	delete connection;
-	return 0;
+		// only wait for the client once nothing more can be sent
+		if (written > 0)
+			continue;
+
+		int available = connection->GetConnection()->GetAvailable();
+		if (available == 0)
+			return true;
+
+		if (available < 0 || connection->Receive() <= 0)
+			return false;
+	}
 }
 
 HTTPResponse *HandleUnsupportedRequest(const HTTPRequest *request)
@@ -315,39 +1221,3 @@ HTTPResponse *HandleUnsupportedRequest(const HTTPRequest *request)
 
 	return response;
 }
-
-void FindFiles(const char *root, std::vector<std::string> &paths)
-{
-	WIN32_FIND_DATAA ffd;
-	CHAR szNewPath[MAX_PATH];
-
-	sprintf_s(szNewPath, "%s\\*", root);
-
-	HANDLE hFind = FindFirstFileA(szNewPath, &ffd);
-	if (hFind == INVALID_HANDLE_VALUE)
-	{
-		printf("ERROR> Finding resources in directory %s\n", root);
-		return;
-	}
-
-	do
-	{
-		if (!equalsIgnoreCase(ffd.cFileName, root) &&
-			!equalsIgnoreCase(ffd.cFileName, ".") &&
-			!equalsIgnoreCase(ffd.cFileName, "..")
-			)
-		{
-			sprintf_s(szNewPath, "%s\\%s", root, ffd.cFileName);
-			if (ffd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
-				FindFiles(szNewPath, paths);
-			else
-				paths.push_back(szNewPath);
-		}
-	} while (FindNextFileA(hFind, &ffd) != 0);
-
-	DWORD dwError = GetLastError();
-	if (dwError != ERROR_NO_MORE_FILES)
-		printf("ERROR> Find failure in directory %s\n", root);
-
-	FindClose(hFind);
-}
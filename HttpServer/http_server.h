@@ -1,33 +1,90 @@
 #pragma once
 
 #include <unordered_map>
+#include <unordered_set>
 #include <strutil/cpp_string_util.h>
 
 #include "common.h"
 #include "server.h"
 #include "http_resource.h"
 #include "http_connection.h"
+#include "case_insensitive.h"
+#include "resource_cache.h"
+#include "resource_table.h"
+#include "resource_watcher.h"
+#include "resource_resolver.h"
+#include "io_reactor.h"
+#include "work_pool.h"
 
 using namespace strutil;
 
+struct HTTPConnectionWorkerInfo;
+
 class HTTPServer
 {
 private:
 	static DWORD HTTPServerWorker(__in HTTPServer *httpServer);
+	static DWORD HTTPIdleWorker(__in HTTPServer *httpServer);
+	static void HTTPConnectionWorker(__in HTTPConnectionWorkerInfo *info);
+	static bool ServeHTTP2(HTTPServer *server, HTTPConnection *connection);
+	static void OnResourcesChanged(void *context, const std::vector<std::string> &paths, bool rescan);
 private:
 	Server *m_server;
-	HANDLE m_handle;
-	HANDLE m_rsrcMutex;
+	HANDLE *m_handles;
+	int m_handleCount;
+
+	int m_ioModel;
+	int m_reactorThreads;
+	int m_acceptThreads;
+	bool m_pinThreads;
+	int m_registeredBuffers;
+	IOReactor *m_reactor;
+
+	int m_poolThreads;
+	int m_poolQueueDepth;
+	WorkPool *m_pool;
+
+	// connections waiting for their next request, which are handed to the pool
+	// once data arrives
+	HANDLE m_idlePort;
+	HANDLE m_idleThread;
+	int m_pipelineDepth;
+	size_t m_bodyMemoryLimit;
+
+	TimerWheel m_timers;
+	ConnectionTimeouts m_timeouts;
+
+	volatile LONGLONG m_requests;
+
+	// connections served by the pool, shut down on Close so blocked workers return
+	mutable SRWLOCK m_connectionsLock;
+	std::unordered_set<HTTPConnection *> m_connections;
 
 	std::string m_resourcedir;
-	std::unordered_map<CaseInsensitiveString, HTTPResource *> m_resources;
-	std::unordered_map<CaseInsensitiveString, CaseInsensitiveString> m_resourceProxies;
+	ResourceCache m_cache;
+
+	// current table, replaced as a whole under m_tableLock and read without locks
+	ResourceTable *volatile m_table;
+	SRWLOCK m_tableLock;
+	ResourceResolver *m_resolver;  // only in lazy mode
+
+	bool m_watch;
+	DWORD m_watchDelay;
+	ResourceWatcher *m_watcher;
 
 	HTTPRequestHandlerFunc m_handleFuncs[METHOD_COUNT];
 
-	void LoadResources(const std::string &resourcedir);
+	void LoadResources(const std::string &resourcedir, ResourceTable *table);
+	void Publish(ResourceTable *table);
+	void UpdateResources(const std::vector<std::string> &paths);
+
+	void ParkConnection(HTTPConnectionWorkerInfo *info);
+	void CloseConnection(HTTPConnectionWorkerInfo *info);
+	void CloseIdlePort();
 public:
-	HTTPServer(const std::string &resourcedir);
+	// a lazy server doesn't scan resourcedir, resources are looked up on disk the
+	// first time they are requested
+	HTTPServer(const std::string &resourcedir, bool lazy = false);
 	~HTTPServer();
 
 	constexpr void SetRequestHandler(int request, HTTPRequestHandlerFunc func)
@@ -43,6 +100,147 @@ public:
 		return m_handleFuncs[method];
 	}
 
+	// selects how connections are serviced, must be called before DispatchServer
+	constexpr void SetIOModel(int model, int threads)
+	{
+		m_ioModel = model;
+		m_reactorThreads = threads;
+	}
+
+	constexpr int GetIOModel() const
+	{
+		return m_ioModel;
+	}
+
+	// number of accept loops run by IOMODEL_THREADED, <= 0 uses one per logical processor.
+	// All loops accept from the same listening socket and the kernel hands each
+	// pending connection to one of them.
+	constexpr void SetAcceptThreads(int count)
+	{
+		m_acceptThreads = count;
+	}
+
+	// pins accept loops, pool workers and reactor threads to one logical processor each
+	constexpr void SetThreadAffinity(bool pin)
+	{
+		m_pinThreads = pin;
+	}
+
+	// number of registered buffer slots used by IOMODEL_RIO
+	constexpr void SetRegisteredBufferCount(int count)
+	{
+		m_registeredBuffers = count;
+	}
+
+	// size of the pool serving IOMODEL_THREADED requests and the number of connections
+	// with a request which may wait for a free worker, threads <= 0 uses one per
+	// logical processor. A worker only holds a connection while it has input to
+	// handle, connections waiting for the client are parked without one. A
+	// connection whose input arrives while the queue is full is closed.
+	constexpr void SetWorkPool(int threads, int queueDepth)
+	{
+		m_poolThreads = threads;
+		m_poolQueueDepth = queueDepth;
+	}
+
+	// maximum number of buffered pipelined requests handled before their responses
+	// are written together
+	constexpr void SetPipelineDepth(int depth)
+	{
+		m_pipelineDepth = depth > 0 ? depth : 1;
+	}
+
+	constexpr int GetPipelineDepth() const
+	{
+		return m_pipelineDepth;
+	}
+
+	// request bodies above this size are spilled to a temporary file while received
+	constexpr void SetBodyMemoryLimit(size_t limit)
+	{
+		m_bodyMemoryLimit = limit;
+	}
+
+	constexpr size_t GetBodyMemoryLimit() const
+	{
+		return m_bodyMemoryLimit;
+	}
+
+	// total size of the files kept in memory and the largest file copied, larger
+	// files are mapped while their views fit into mapBudget and sent from disk
+	// otherwise. Must be called before DispatchServer
+	inline void SetCacheLimits(size_t budget, size_t maxEntry, size_t mapBudget)
+	{
+		m_cache.SetLimits(budget, maxEntry, mapBudget);
+	}
+
+	// applies changes to the resource directory while the server runs, once no
+	// change arrived for delay milliseconds. Must be called before DispatchServer
+	constexpr void SetResourceWatch(bool enable, DWORD delay)
+	{
+		m_watch = enable;
+		m_watchDelay = delay;
+	}
+
+	// how long and how many paths without a file a lazy server remembers, ttl is in
+	// milliseconds. Must be called before DispatchServer
+	inline void SetMissCache(DWORD ttl, size_t entries)
+	{
+		if (m_resolver)
+			m_resolver->SetMissLimits(ttl, entries);
+	}
+
+	// nullptr unless the server is lazy
+	constexpr const ResourceResolver *GetResourceResolver() const
+	{
+		return m_resolver;
+	}
+
+	// reads every resource into the cache ahead of the first request, as far as the
+	// cache limits allow. Must be called after SetCacheLimits
+	void PreloadResources();
+
+	// contents of files served by GET, shared by all connections
+	constexpr ResourceCache &GetResourceCache()
+	{
+		return m_cache;
+	}
+
+	constexpr const ResourceCache &GetResourceCache() const
+	{
+		return m_cache;
+	}
+
+	// applies to connections accepted afterwards
+	constexpr void SetTimeouts(const ConnectionTimeouts &timeouts)
+	{
+		m_timeouts = timeouts;
+	}
+
+	// applies the server's limits to a newly accepted connection
+	void ConfigureConnection(HTTPConnection *connection);
+
+	void GetTimerStatistics(TimerStatistics *stats) const;
+
+	// returns false if connections are not serviced by a reactor
+	bool GetReactorStatistics(ReactorStatistics *stats) const;
+
+	// returns false if connections are not serviced by the work pool
+	bool GetWorkPoolStatistics(WorkPoolStatistics *stats) const;
+
+	// connections open with IOMODEL_THREADED, whether served or parked
+	size_t GetConnectionCount() const;
+
+	// runs the handler registered for the request's method, returns nullptr if no
+	// response could be generated
+	HTTPResponse *DispatchRequest(const HTTPRequest *request);
+
+	// number of requests dispatched so far
+	inline LONGLONG GetRequestCount() const
+	{
+		return m_requests;
+	}
+
 	void CreateResourceProxy(const CaseInsensitiveString &from, const CaseInsensitiveString &to);
 
 	bool Bind(Server *server);
@@ -59,11 +257,25 @@ public:
 
 	bool ReloadResources();
 
-	HTTPResource *FindHTTPResource(const CaseInsensitiveString &location) const;
+	// The resource and the table stay valid while the caller is inside an epoch (see
+	// epoch.h), a reload frees them afterwards. Request handlers always are.
+	HTTPResource *FindHTTPResource(std::string_view location) const;
 
-	const std::unordered_map<CaseInsensitiveString, HTTPResource *> &GetResources() const;
-
-	const std::unordered_map<CaseInsensitiveString, CaseInsensitiveString> &GetResourceProxies() const;
+	inline const ResourceTable *GetResourceTable() const
+	{
+		return m_table;
+	}
 
 	void GenerateAllowHeader(HTTPResponse *dest) const;
+
+	// measures resource and header lookups against maps hashed by std::hash
+	void BenchmarkLookups() const;
+
+	// measures request throughput and latency of every I/O model with loopback
+	// clients, each on a server of its own listening on a free port
+	static void BenchmarkIOModels();
+
+	// measures the working set and commit charge of idle keep-alive connections on
+	// every I/O model, in bytes per connection
+	static void BenchmarkIdleConnections();
 };
\ No newline at end of file
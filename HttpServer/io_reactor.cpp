@@ -0,0 +1,1145 @@
+#include "io_reactor.h"
+
+#include <stdio.h>
+#include <vector>
+
+#include "http_server.h"
+#include "thread_util.h"
+
+static constexpr int BufferSize = 8192;
+static constexpr int MaxCompletions = 64;
+static constexpr int PendingAcceptsPerThread = 16;
+static constexpr int AcceptAddressLength = sizeof(sockaddr_storage) + 16;
+
+static constexpr int RIOSendSlots = 4;
+static constexpr ULONG RIOQueueEntriesPerConnection = 1 + RIOSendSlots;
+static constexpr ULONG RIOInitialQueueSize = 1024;
+static constexpr int RIOMaxResults = 128;
+
+struct AcceptContext
+{
+	IOContext context;
+	SOCKET socket;
+	char addresses[AcceptAddressLength * 2];
+};
+
+struct RIOQueue
+{
+	IOContext context;  // signalled through the completion port by RIONotify
+
+	RIO_CQ queue;
+	SRWLOCK lock;
+	ULONG capacity;
+	ULONG reserved;
+};
+
+// an earlier response of a pipelined batch, its head ends at headEnd in the
+// output and its body is gathered behind it
+struct BatchedResponse
+{
+	size_t headEnd;
+	HTTPResponse *response;
+};
+
+struct ReactorConnection : public Pooled
+{
+	IOContext context;
+
+	ClientConnection *client;
+	HTTPConnection *connection;
+
+	// response currently being written. output holds the serialized head and the
+	// body is gathered straight from the response, or sent after the head with
+	// TransmitFile if it is a file. Without a response output holds everything.
+	// A streamed response sends its head first and then one chunk at a time.
+	// Every write is limited to SendPieceSize, so the write timeout is rearmed
+	// while a large body is sent. Pipelined responses answered before it are
+	// batched, their heads lead the output and all of them are written at once.
+	StringBuilder output;
+	size_t outputOffset;
+	ULONG64 fileOffset;
+	DWORD filePiece;  // file bytes sent by the pending TransmitFile
+	HTTPResponse *response;
+	std::vector<BatchedResponse> batch;
+	std::vector<WSABUF> segments;  // unsent output of the pending write
+	bool lastChunk;
+	bool closing;  // the connection ends once the response was written
+	TRANSMIT_FILE_BUFFERS transmitBuffers;
+
+	// registered I/O state, the first send slot is reserved for the lifetime
+	// of the connection and the rest are borrowed per write
+	RIOQueue *queue;
+	RIO_RQ requestQueue;
+	int recvSlot;
+	int sendSlots[RIOSendSlots];
+	int pendingSends;
+	ULONG inflight;
+	bool sendFailed;
+
+	ReactorConnection *prev;
+	ReactorConnection *next;
+
+	ReactorConnection(ClientConnection *client, HTTPConnection *connection) :
+		client(client), connection(connection), output(), outputOffset(0), fileOffset(0), filePiece(0), response(nullptr), lastChunk(false),
+		closing(false), queue(nullptr), requestQueue(RIO_INVALID_RQ), recvSlot(-1), pendingSends(0), inflight(0),
+		sendFailed(false), prev(nullptr), next(nullptr)
+	{
+		memset(&context, 0, sizeof(context));
+		memset(&transmitBuffers, 0, sizeof(transmitBuffers));
+		for (int i = 0; i < RIOSendSlots; i++)
+			sendSlots[i] = -1;
+	}
+
+	inline HANDLE GetFile() const
+	{
+		return response ? response->GetFile() : NULL;
+	}
+
+	// bytes to write with WSASend, excluding a file sent by TransmitFile
+	inline size_t GetOutputSize() const
+	{
+		size_t size = output.Size();
+		for (const BatchedResponse &batched : batch)
+			size += batched.response->GetContentLength();
+		if (response && !response->GetFile())
+			size += response->GetContentLength();
+		return size;
+	}
+
+	// true if another response may follow the current one in the same write,
+	// file and streamed bodies can't be gathered
+	inline bool CanBatch() const
+	{
+		return !response || (!response->GetFile() && !response->IsChunked());
+	}
+
+	// true once the head and the whole body were sent
+	inline bool IsWritten() const
+	{
+		return outputOffset >= GetOutputSize() && (!GetFile() || fileOffset >= response->GetFileLength());
+	}
+
+	// describes the unsent part of the output in segments, returns the number
+	// of buffers used. A file is never part of it, so its head comes last.
+	inline DWORD Gather()
+	{
+		segments.clear();
+
+		size_t offset = outputOffset;
+		size_t start = 0;
+		for (const BatchedResponse &batched : batch)
+		{
+			AddSegment(output.GetElements() + start, batched.headEnd - start, offset);
+			AddSegment(batched.response->GetContent(), batched.response->GetContentLength(), offset);
+			start = batched.headEnd;
+		}
+
+		AddSegment(output.GetElements() + start, output.Size() - start, offset);
+		if (response && !response->GetFile())
+			AddSegment(response->GetContent(), response->GetContentLength(), offset);
+
+		return (DWORD)segments.size();
+	}
+
+	// adds what is left of a segment once offset bytes were skipped
+	inline void AddSegment(const char *segment, size_t size, size_t &offset)
+	{
+		if (offset >= size)
+		{
+			offset -= size;
+			return;
+		}
+
+		WSABUF buf;
+		buf.buf = (CHAR *)segment + offset;
+		buf.len = (ULONG)(size - offset);
+		segments.push_back(buf);
+		offset = 0;
+	}
+
+	// true while a streamed response has chunks left to produce
+	inline bool IsStreaming() const
+	{
+		return response && response->IsChunked() && !lastChunk;
+	}
+
+	// replaces the sent output with the next chunk of the streamed response
+	inline bool NextChunk()
+	{
+		char buffer[BufferSize];
+		int len = response->ProduceChunk(buffer, BufferSize, &lastChunk);
+		if (len < 0)
+			return false;
+
+		// responses batched before the stream were sent with its head
+		ReleaseBatch();
+
+		output.Clear();
+		output.Append(buffer, len);
+		outputOffset = 0;
+		return true;
+	}
+
+	inline void ReleaseBatch()
+	{
+		for (const BatchedResponse &batched : batch)
+			delete batched.response;
+		batch.clear();
+	}
+
+	inline void ResetOutput()
+	{
+		output.Clear();
+		outputOffset = 0;
+		fileOffset = 0;
+		filePiece = 0;
+
+		ReleaseBatch();
+		delete response;
+		response = nullptr;
+		lastChunk = false;
+	}
+};
+
+DWORD IOReactor::ReactorWorker(__in IOReactor *reactor)
+{
+	OVERLAPPED_ENTRY entries[MaxCompletions];
+	ULONG count;
+
+	while (true)
+	{
+		if (!GetQueuedCompletionStatusEx(reactor->m_port, entries, MaxCompletions, &count, INFINITE, FALSE))
+			break;
+
+		InterlockedIncrement64(&reactor->m_wakeups);
+
+		LONGLONG handled = 0;
+		for (ULONG i = 0; i < count; i++)
+		{
+			OVERLAPPED_ENTRY &entry = entries[i];
+
+			// a null overlapped is the signal to exit
+			if (!entry.lpOverlapped)
+				return 0;
+
+			IOContext *context = (IOContext *)entry.lpOverlapped;
+
+			// Internal holds the completion status, zero on success
+			bool success = entry.lpOverlapped->Internal == 0;
+
+			switch (context->operation)
+			{
+			case IO_ACCEPT:
+				reactor->OnAccept((AcceptContext *)context, success);
+				handled++;
+				break;
+			case IO_READ:
+				if (success)
+					reactor->OnReadable((ReactorConnection *)context);
+				else
+					reactor->DestroyConnection((ReactorConnection *)context);
+				handled++;
+				break;
+			case IO_WRITE:
+				if (success && entry.dwNumberOfBytesTransferred > 0)
+					reactor->OnWritten((ReactorConnection *)context, entry.dwNumberOfBytesTransferred);
+				else
+					reactor->DestroyConnection((ReactorConnection *)context);
+				handled++;
+				break;
+			case IO_RIO_NOTIFY:
+				reactor->OnRIONotify((RIOQueue *)context);
+				break;
+			case IO_RESUME:
+				((SocketOperation *)context)->Complete(success, entry.dwNumberOfBytesTransferred);
+				handled++;
+				break;
+			}
+		}
+
+		if (handled > 0)
+			InterlockedExchangeAdd64(&reactor->m_completions, handled);
+	}
+
+	return 0;
+}
+
+IOReactor::IOReactor(HTTPServer *httpServer, int model) :
+	m_httpServer(httpServer), m_server(nullptr), m_model(model), m_port(NULL), m_threads(nullptr), m_threadCount(0),
+	m_pinThreads(false), m_acceptEx(nullptr), m_getAcceptExSockaddrs(nullptr), m_accepts(nullptr), m_acceptCount(0),
+	m_rioBuffers(), m_rioBufferCount(4096), m_rioQueues(nullptr), m_rioQueueCount(0), m_rioNextQueue(0),
+	m_connections(nullptr), m_connectionCount(0), m_pendingAccepts(0), m_wakeups(0), m_completions(0),
+	m_stopping(false)
+{
+	memset(&m_rio, 0, sizeof(m_rio));
+	InitializeSRWLock(&m_connectionsLock);
+}
+
+IOReactor::~IOReactor()
+{
+	Stop();
+}
+
+bool IOReactor::LoadExtensions(SOCKET listener)
+{
+	GUID acceptExId = WSAID_ACCEPTEX;
+	GUID getAcceptExSockaddrsId = WSAID_GETACCEPTEXSOCKADDRS;
+	DWORD bytes;
+
+	if (WSAIoctl(listener, SIO_GET_EXTENSION_FUNCTION_POINTER, &acceptExId, sizeof(acceptExId),
+		&m_acceptEx, sizeof(m_acceptEx), &bytes, NULL, NULL) == SOCKET_ERROR)
+		return false;
+
+	if (WSAIoctl(listener, SIO_GET_EXTENSION_FUNCTION_POINTER, &getAcceptExSockaddrsId, sizeof(getAcceptExSockaddrsId),
+		&m_getAcceptExSockaddrs, sizeof(m_getAcceptExSockaddrs), &bytes, NULL, NULL) == SOCKET_ERROR)
+		return false;
+
+	if (m_model == IOMODEL_RIO && !LoadRegisteredIO(listener, &m_rio))
+		return false;
+
+	return true;
+}
+
+bool IOReactor::CreateRIOQueues()
+{
+	if (!m_rioBuffers.Create(&m_rio, BufferSize, m_rioBufferCount))
+	{
+		printf("ERROR> Failed to register %d I/O buffers\n", m_rioBufferCount);
+		return false;
+	}
+
+	m_rioQueues = new RIOQueue[m_threadCount];
+	for (m_rioQueueCount = 0; m_rioQueueCount < m_threadCount; m_rioQueueCount++)
+	{
+		RIOQueue *queue = &m_rioQueues[m_rioQueueCount];
+		memset(&queue->context, 0, sizeof(queue->context));
+		queue->context.operation = IO_RIO_NOTIFY;
+		InitializeSRWLock(&queue->lock);
+		queue->capacity = RIOInitialQueueSize;
+		queue->reserved = 0;
+
+		RIO_NOTIFICATION_COMPLETION notification;
+		notification.Type = RIO_IOCP_COMPLETION;
+		notification.Iocp.IocpHandle = m_port;
+		notification.Iocp.CompletionKey = NULL;
+		notification.Iocp.Overlapped = &queue->context.overlapped;
+
+		queue->queue = m_rio.RIOCreateCompletionQueue(queue->capacity, &notification);
+		if (queue->queue == RIO_INVALID_CQ)
+			return false;
+
+		m_rio.RIONotify(queue->queue);
+	}
+
+	return true;
+}
+
+void IOReactor::DestroyRIOQueues()
+{
+	for (int i = 0; i < m_rioQueueCount; i++)
+		m_rio.RIOCloseCompletionQueue(m_rioQueues[i].queue);
+
+	delete[] m_rioQueues;
+	m_rioQueues = nullptr;
+	m_rioQueueCount = 0;
+
+	m_rioBuffers.Destroy();
+}
+
+bool IOReactor::Start(Server *server, int threads)
+{
+	if (m_port || !server) return false;
+
+	SOCKET listener = server->GetSocket();
+	if (listener == INVALID_SOCKET) return false;
+
+	if (threads <= 0)
+		threads = GetProcessorCount();
+
+	if (!LoadExtensions(listener))
+	{
+		printf("ERROR> Failed to load socket extensions\n");
+		return false;
+	}
+
+	m_port = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, threads);
+	if (!m_port)
+		return false;
+
+	if (!CreateIoCompletionPort((HANDLE)listener, m_port, 0, 0))
+	{
+		CloseHandle(m_port);
+		m_port = NULL;
+		return false;
+	}
+
+	m_server = server;
+	m_stopping = false;
+
+	m_threads = new HANDLE[threads];
+	for (m_threadCount = 0; m_threadCount < threads; m_threadCount++)
+	{
+		HANDLE handle = CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE)&ReactorWorker, this, CREATE_SUSPENDED, NULL);
+		if (!handle)
+		{
+			Stop();
+			return false;
+		}
+
+		if (m_pinThreads)
+			PinThread(handle, m_threadCount);
+
+		ResumeThread(handle);
+		m_threads[m_threadCount] = handle;
+	}
+
+	if (m_model == IOMODEL_RIO && !CreateRIOQueues())
+	{
+		Stop();
+		return false;
+	}
+
+	m_acceptCount = threads * PendingAcceptsPerThread;
+	m_accepts = new AcceptContext[m_acceptCount];
+	for (int i = 0; i < m_acceptCount; i++)
+	{
+		memset(&m_accepts[i], 0, sizeof(AcceptContext));
+		m_accepts[i].context.operation = IO_ACCEPT;
+		m_accepts[i].socket = INVALID_SOCKET;
+
+		if (!PostAccept(&m_accepts[i]))
+		{
+			Stop();
+			return false;
+		}
+	}
+
+	return true;
+}
+
+void IOReactor::Stop()
+{
+	if (!m_port) return;
+
+	m_stopping = true;
+
+	// closing the listener aborts every pending accept
+	if (m_server)
+		m_server->Close();
+
+	// overlapped connections own memory the kernel writes to, so cancel their operations
+	// until every one has been released. A connection being dispatched may post a new
+	// operation after the first pass.
+	while (m_pendingAccepts > 0 || (m_model != IOMODEL_RIO && m_connectionCount > 0))
+	{
+		if (m_model != IOMODEL_RIO)
+		{
+			AcquireSRWLockShared(&m_connectionsLock);
+			for (ReactorConnection *it = m_connections; it; it = it->next)
+				CancelIoEx((HANDLE)it->client->GetSocket(), NULL);
+			ReleaseSRWLockShared(&m_connectionsLock);
+		}
+
+		Sleep(10);
+	}
+
+	for (int i = 0; i < m_threadCount; i++)
+		PostQueuedCompletionStatus(m_port, 0, 0, NULL);
+
+	for (int i = 0; i < m_threadCount; i++)
+	{
+		WaitForSingleObject(m_threads[i], INFINITE);
+		CloseHandle(m_threads[i]);
+	}
+
+	delete[] m_threads;
+	m_threads = nullptr;
+	m_threadCount = 0;
+
+	// registered I/O connections are only referenced by their request queues, which are
+	// released with the socket, so the remaining ones can be closed directly
+	while (m_connections)
+		DestroyConnection(m_connections);
+
+	if (m_model == IOMODEL_RIO)
+		DestroyRIOQueues();
+
+	delete[] m_accepts;
+	m_accepts = nullptr;
+	m_acceptCount = 0;
+
+	CloseHandle(m_port);
+	m_port = NULL;
+
+	m_server = nullptr;
+}
+
+void IOReactor::GetStatistics(ReactorStatistics *stats) const
+{
+	stats->connections = m_connectionCount;
+	stats->pendingAccepts = m_pendingAccepts;
+	stats->wakeups = m_wakeups;
+	stats->completions = m_completions;
+	stats->freeBuffers = m_model == IOMODEL_RIO ? m_rioBuffers.GetAvailable() : -1;
+}
+
+bool IOReactor::PostAccept(AcceptContext *context)
+{
+	if (m_stopping) return false;
+
+	DWORD flags = WSA_FLAG_OVERLAPPED;
+	if (m_model == IOMODEL_RIO)
+		flags |= WSA_FLAG_REGISTERED_IO;
+
+	context->socket = WSASocket(m_server->GetFamily(), SOCK_STREAM, IPPROTO_TCP, NULL, 0, flags);
+	if (context->socket == INVALID_SOCKET)
+		return false;
+
+	memset(&context->context.overlapped, 0, sizeof(OVERLAPPED));
+
+	InterlockedIncrement(&m_pendingAccepts);
+
+	DWORD received;
+	if (!m_acceptEx(m_server->GetSocket(), context->socket, context->addresses, 0,
+		AcceptAddressLength, AcceptAddressLength, &received, &context->context.overlapped))
+	{
+		if (WSAGetLastError() != ERROR_IO_PENDING)
+		{
+			closesocket(context->socket);
+			context->socket = INVALID_SOCKET;
+
+			InterlockedDecrement(&m_pendingAccepts);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+void IOReactor::OnAccept(AcceptContext *context, bool success)
+{
+	SOCKET socket = context->socket;
+	context->socket = INVALID_SOCKET;
+
+	SOCKET listener = m_server && !m_stopping ? m_server->GetSocket() : INVALID_SOCKET;
+
+	if (!success || listener == INVALID_SOCKET)
+	{
+		closesocket(socket);
+	}
+	else
+	{
+		sockaddr *local, *remote;
+		int locallen, remotelen;
+
+		setsockopt(socket, SOL_SOCKET, SO_UPDATE_ACCEPT_CONTEXT, (char *)&listener, sizeof(listener));
+		m_getAcceptExSockaddrs(context->addresses, 0, AcceptAddressLength, AcceptAddressLength,
+			&local, &locallen, &remote, &remotelen);
+
+		ClientConnection *client = new ClientConnection();
+		client->Bind(socket, *remote);
+
+		HTTPConnection *con = new HTTPConnection(m_httpServer);
+		m_httpServer->ConfigureConnection(con);
+		con->Bind(client);
+
+		ReactorConnection *connection = new ReactorConnection(client, con);
+
+		AcquireSRWLockExclusive(&m_connectionsLock);
+		connection->next = m_connections;
+		if (m_connections)
+			m_connections->prev = connection;
+		m_connections = connection;
+		ReleaseSRWLockExclusive(&m_connectionsLock);
+
+		InterlockedIncrement(&m_connectionCount);
+
+		bool attached;
+		if (m_model == IOMODEL_RIO)
+			attached = AttachRIO(connection);
+		else
+			attached = client->SetNonBlocking(true) && CreateIoCompletionPort((HANDLE)socket, m_port, 0, 0);
+
+		if (!attached)
+			DestroyConnection(connection);
+		else if (m_model == IOMODEL_COROUTINE)
+			ServeConnection(connection);
+		else if (!PostRead(connection))
+			DestroyConnection(connection);
+	}
+
+	// keep the number of pending accepts constant
+	if (!m_stopping)
+		PostAccept(context);
+
+	InterlockedDecrement(&m_pendingAccepts);
+}
+
+bool IOReactor::AttachRIO(ReactorConnection *connection)
+{
+	connection->recvSlot = m_rioBuffers.Acquire();
+	connection->sendSlots[0] = m_rioBuffers.Acquire();
+	if (connection->recvSlot < 0 || connection->sendSlots[0] < 0)
+		return false;
+
+	RIOQueue *queue = &m_rioQueues[(ULONG)InterlockedIncrement(&m_rioNextQueue) % (ULONG)m_rioQueueCount];
+
+	AcquireSRWLockExclusive(&queue->lock);
+
+	// every request queue reserves room for its results in the completion queue
+	if (queue->reserved + RIOQueueEntriesPerConnection > queue->capacity)
+	{
+		if (!m_rio.RIOResizeCompletionQueue(queue->queue, queue->capacity * 2))
+		{
+			ReleaseSRWLockExclusive(&queue->lock);
+			return false;
+		}
+		queue->capacity *= 2;
+	}
+
+	connection->requestQueue = m_rio.RIOCreateRequestQueue(connection->client->GetSocket(),
+		1, 1, RIOSendSlots, 1, queue->queue, queue->queue, connection);
+	if (connection->requestQueue != RIO_INVALID_RQ)
+	{
+		queue->reserved += RIOQueueEntriesPerConnection;
+		connection->queue = queue;
+	}
+
+	ReleaseSRWLockExclusive(&queue->lock);
+
+	return connection->requestQueue != RIO_INVALID_RQ;
+}
+
+bool IOReactor::PostRead(ReactorConnection *connection)
+{
+	if (m_stopping) return false;
+
+	connection->context.operation = IO_READ;
+	connection->connection->ReleaseInput();
+	connection->connection->WaitForInput();
+
+	if (m_model == IOMODEL_RIO)
+	{
+		RIO_BUF buf = m_rioBuffers.Describe(connection->recvSlot, m_rioBuffers.GetSlotSize());
+		return m_rio.RIOReceive(connection->requestQueue, &buf, 1, 0, (PVOID)IO_READ);
+	}
+
+	// zero-byte read: completes once data is available without pinning a buffer
+	// for the lifetime of an idle connection
+	WSABUF buf = { 0, nullptr };
+	DWORD flags = 0;
+
+	memset(&connection->context.overlapped, 0, sizeof(OVERLAPPED));
+
+	int res = WSARecv(connection->client->GetSocket(), &buf, 1, NULL, &flags, &connection->context.overlapped, NULL);
+	return res != SOCKET_ERROR || WSAGetLastError() == WSA_IO_PENDING;
+}
+
+bool IOReactor::PostWrite(ReactorConnection *connection)
+{
+	if (m_stopping) return false;
+
+	DWORD segmentCount = connection->Gather();
+	WSABUF *segments = connection->segments.data();
+
+	connection->context.operation = IO_WRITE;
+	connection->connection->WaitForOutput();
+
+	if (m_model == IOMODEL_RIO)
+	{
+		const ULONG slotSize = m_rioBuffers.GetSlotSize();
+
+		RIO_BUF bufs[RIOSendSlots];
+		int used = 0;
+
+		connection->inflight = 0;
+		connection->sendFailed = false;
+
+		DWORD segment = 0;
+		for (int i = 0; i < RIOSendSlots && segment < segmentCount; i++)
+		{
+			if (connection->sendSlots[i] < 0)
+			{
+				connection->sendSlots[i] = m_rioBuffers.Acquire();
+				if (connection->sendSlots[i] < 0)
+					break;
+			}
+
+			// fill the slot from as many segments as fit
+			char *dest = m_rioBuffers.GetSlot(connection->sendSlots[i]);
+			ULONG len = 0;
+			while (len < slotSize && segment < segmentCount)
+			{
+				WSABUF &src = segments[segment];
+				ULONG count = src.len < slotSize - len ? src.len : slotSize - len;
+				memcpy(dest + len, src.buf, count);
+
+				len += count;
+				src.buf += count;
+				src.len -= count;
+				if (src.len == 0)
+					segment++;
+			}
+
+			bufs[used++] = m_rioBuffers.Describe(connection->sendSlots[i], len);
+			connection->inflight += len;
+		}
+
+		// defer all but the last send so the batch is committed with a single call
+		for (int i = 0; i < used; i++)
+		{
+			if (!m_rio.RIOSend(connection->requestQueue, &bufs[i], 1, i < used - 1 ? RIO_MSG_DEFER : 0, (PVOID)IO_WRITE))
+			{
+				if (i == 0)
+					return false;
+
+				// flush what was deferred, the failure is reported once those complete
+				connection->pendingSends = i;
+				connection->sendFailed = true;
+				m_rio.RIOSend(connection->requestQueue, NULL, 0, RIO_MSG_COMMIT_ONLY, (PVOID)IO_WRITE);
+				return true;
+			}
+		}
+
+		connection->pendingSends = used;
+		return used > 0;
+	}
+
+	memset(&connection->context.overlapped, 0, sizeof(OVERLAPPED));
+
+	// an empty file is written like a response without a body, zero bytes to
+	// transmit would send the file up to its end
+	HANDLE file = connection->GetFile();
+	const ULONG64 fileLength = file ? connection->response->GetFileLength() : 0;
+	connection->filePiece = 0;
+
+	// responses batched before a file are sent first, TransmitFile only takes the
+	// head of the file along
+	if (connection->fileOffset < fileLength && segmentCount > 1)
+		segmentCount--;
+	else if (connection->fileOffset < fileLength)
+	{
+		const ULONG64 remaining = fileLength - connection->fileOffset;
+		connection->filePiece = (DWORD)(remaining < SendPieceSize ? remaining : SendPieceSize);
+
+		// the rest of the head goes with the first piece
+		connection->transmitBuffers.Head = segmentCount > 0 ? segments[0].buf : nullptr;
+		connection->transmitBuffers.HeadLength = segmentCount > 0 ? segments[0].len : 0;
+
+		connection->context.overlapped.Offset = (DWORD)connection->fileOffset;
+		connection->context.overlapped.OffsetHigh = (DWORD)(connection->fileOffset >> 32);
+
+		if (connection->client->GetTransmitFile()(connection->client->GetSocket(), file, connection->filePiece, 0,
+			&connection->context.overlapped, &connection->transmitBuffers, 0))
+			return true;
+		return WSAGetLastError() == WSA_IO_PENDING;
+	}
+
+	segmentCount = LimitBuffers(segments, segmentCount, SendPieceSize);
+
+	// the provider captures the array, so it may live on the stack
+	int res = WSASend(connection->client->GetSocket(), segments, segmentCount, NULL, 0, &connection->context.overlapped, NULL);
+	return res != SOCKET_ERROR || WSAGetLastError() == WSA_IO_PENDING;
+}
+
+void IOReactor::OnReadable(ReactorConnection *connection)
+{
+	// dispatching isn't limited by the timeouts
+	connection->connection->StopWaiting();
+
+	// take what the socket has buffered, up to what the connection holds at once
+	if (connection->connection->ReceiveAvailable() < 0)
+	{
+		DestroyConnection(connection);
+		return;
+	}
+
+	Process(connection);
+}
+
+void IOReactor::OnReceived(ReactorConnection *connection, ULONG transferred)
+{
+	connection->connection->StopWaiting();
+	connection->connection->AppendInput(m_rioBuffers.GetSlot(connection->recvSlot), (int)transferred);
+	Process(connection);
+}
+
+void IOReactor::OnWritten(ReactorConnection *connection, DWORD transferred)
+{
+	connection->connection->StopWaiting();
+
+	// TransmitFile only completes once the head and the whole piece were sent
+	if (connection->filePiece > 0)
+	{
+		connection->outputOffset = connection->GetOutputSize();
+		connection->fileOffset += connection->filePiece;
+	}
+	else
+		connection->outputOffset += transferred;
+
+	if (!connection->IsWritten())
+	{
+		// partial write or the next piece, send the remainder
+		if (!PostWrite(connection))
+			DestroyConnection(connection);
+		return;
+	}
+
+	if (connection->IsStreaming())
+	{
+		// the next chunk is only produced once the previous one was sent
+		if (!connection->NextChunk() || !PostWrite(connection))
+			DestroyConnection(connection);
+		return;
+	}
+
+	if (connection->closing)
+	{
+		DestroyConnection(connection);
+		return;
+	}
+
+	connection->ResetOutput();
+
+	// a pipelined request may already be buffered
+	Process(connection);
+}
+
+void IOReactor::OnRIONotify(RIOQueue *queue)
+{
+	RIORESULT results[RIOMaxResults];
+
+	AcquireSRWLockExclusive(&queue->lock);
+	ULONG count = m_rio.RIODequeueCompletion(queue->queue, results, RIOMaxResults);
+	ReleaseSRWLockExclusive(&queue->lock);
+
+	if (count == RIO_CORRUPT_CQ)
+	{
+		printf("ERROR> Registered I/O completion queue corrupted\n");
+		return;
+	}
+
+	for (ULONG i = 0; i < count; i++)
+	{
+		const RIORESULT &result = results[i];
+		ReactorConnection *connection = (ReactorConnection *)result.SocketContext;
+
+		if (result.RequestContext == IO_READ)
+		{
+			if (result.Status == 0 && result.BytesTransferred > 0)
+				OnReceived(connection, result.BytesTransferred);
+			else
+				DestroyConnection(connection);
+		}
+		else
+		{
+			if (result.Status != 0)
+				connection->sendFailed = true;
+
+			// wait for the whole batch before touching the connection again
+			if (--connection->pendingSends > 0)
+				continue;
+
+			// give back borrowed slots, the first one stays with the connection
+			for (int slot = 1; slot < RIOSendSlots; slot++)
+			{
+				m_rioBuffers.Release(connection->sendSlots[slot]);
+				connection->sendSlots[slot] = -1;
+			}
+
+			if (connection->sendFailed)
+				DestroyConnection(connection);
+			else
+				OnWritten(connection, connection->inflight);
+		}
+	}
+
+	InterlockedExchangeAdd64(&m_completions, count);
+
+	// rearm the notification, fires immediately if results arrived in the meantime
+	AcquireSRWLockExclusive(&queue->lock);
+	m_rio.RIONotify(queue->queue);
+	ReleaseSRWLockExclusive(&queue->lock);
+}
+
+void IOReactor::Process(ReactorConnection *connection)
+{
+	if (connection->connection->IsHTTP2())
+	{
+		ProcessHTTP2(connection);
+		return;
+	}
+
+	HTTPRequest *req;
+	switch (connection->connection->ParseRequest(&req))
+	{
+	case PARSE_INCOMPLETE:
+		// the client may have switched to HTTP/2
+		if (connection->connection->IsHTTP2())
+			ProcessHTTP2(connection);
+		else if (!PostRead(connection))
+			DestroyConnection(connection);
+		return;
+	case PARSE_ERROR:
+		// the client is told why before the connection is closed
+		if (HTTPResponse *error = connection->connection->CreateErrorResponse())
+		{
+			Serialize(connection, error);
+			connection->closing = true;
+			if (PostWrite(connection))
+				return;
+		}
+		DestroyConnection(connection);
+		return;
+	}
+
+	// responses to earlier requests are still sent if a later one ends the connection
+	if (DispatchPipelined(connection, req) == 0 || !PostWrite(connection))
+		DestroyConnection(connection);
+}
+
+int IOReactor::DispatchPipelined(ReactorConnection *connection, HTTPRequest *req)
+{
+	// answer everything pipelined behind the request that is already buffered
+	// before writing all responses at once
+	int count = 0;
+	do
+	{
+		const std::string_view *conheader = req->GetHeader(HEADER_CONNECTION);
+		if (conheader && EqualsIgnoreCase(*conheader, "close"))
+		{
+			delete req;
+			connection->closing = true;
+			break;
+		}
+
+		HTTPResponse *response = m_httpServer->DispatchRequest(req);
+		delete req;
+
+		if (!response)
+		{
+			connection->closing = true;
+			break;
+		}
+
+		Serialize(connection, response);
+		count++;
+	} while (count < m_httpServer->GetPipelineDepth() && connection->CanBatch() &&
+		connection->connection->ParseRequest(&req) == PARSE_OK);
+
+	return count;
+}
+
+void IOReactor::ProcessHTTP2(ReactorConnection *connection)
+{
+	HTTPConnection *con = connection->connection;
+
+	HTTPRequest *req;
+	int status;
+	while ((status = con->ParseRequest(&req)) == PARSE_OK)
+	{
+		con->SubmitResponse(req, m_httpServer->DispatchRequest(req));
+		delete req;
+	}
+
+	// frames are written like a response without a body, the write completion
+	// comes back here for more. A failed connection still sends its GOAWAY.
+	if (con->CollectOutput(connection->output) > 0)
+	{
+		if (!PostWrite(connection))
+			DestroyConnection(connection);
+		return;
+	}
+
+	if (status == PARSE_ERROR || con->IsClosing() || !PostRead(connection))
+		DestroyConnection(connection);
+}
+
+DetachedTask IOReactor::ServeConnection(ReactorConnection *connection)
+{
+	ClientConnection *client = connection->client;
+	HTTPConnection *con = connection->connection;
+
+	while (!m_stopping)
+	{
+		HTTPRequest *req;
+		int status;
+		while ((status = con->ParseRequest(&req)) == PARSE_INCOMPLETE && !con->IsHTTP2())
+		{
+			// wait without a buffer, then take everything that arrived
+			con->ReleaseInput();
+			con->WaitForInput();
+			int waited = co_await client->ReadBytesAsync(nullptr, 0);
+			con->StopWaiting();
+
+			if (waited < 0 || con->ReceiveAvailable() < 0)
+				break;
+		}
+
+		if (status == PARSE_ERROR)
+		{
+			// the client is told why before the connection is closed
+			HTTPResponse *error = con->CreateErrorResponse();
+			if (!error)
+				break;
+
+			Serialize(connection, error);
+			connection->closing = true;
+		}
+		else if (status != PARSE_OK || DispatchPipelined(connection, req) == 0)
+			break;
+
+		bool sent;
+		do
+		{
+			// every piece rearms the write timeout. Responses batched before a file
+			// are sent first, the head of the file goes with its first piece.
+			const ULONG64 fileLength = connection->GetFile() ? connection->response->GetFileLength() : 0;
+			while (!connection->IsWritten())
+			{
+				DWORD count = connection->Gather();
+				WSABUF *bufs = connection->segments.data();
+
+				con->WaitForOutput();
+				if (connection->fileOffset < fileLength && count <= 1)
+				{
+					const ULONG64 remaining = fileLength - connection->fileOffset;
+					const DWORD piece = (DWORD)(remaining < SendPieceSize ? remaining : SendPieceSize);
+
+					if (co_await client->SendFileAsync(connection->GetFile(), connection->fileOffset, piece,
+						count > 0 ? bufs[0].buf : nullptr, count > 0 ? (int)bufs[0].len : 0) <= 0)
+						break;
+
+					connection->outputOffset = connection->GetOutputSize();
+					connection->fileOffset += piece;
+					continue;
+				}
+
+				if (connection->fileOffset < fileLength)
+					count--;
+
+				int len = co_await client->WriteVectorAsync(bufs, LimitBuffers(bufs, count, SendPieceSize));
+				if (len <= 0)
+					break;
+				connection->outputOffset += len;
+			}
+
+			sent = connection->IsWritten();
+
+			// the next chunk is only produced once the previous one was sent
+		} while (sent && connection->IsStreaming() && connection->NextChunk());
+
+		con->StopWaiting();
+
+		if (!sent || connection->IsStreaming() || connection->closing)
+			break;
+
+		connection->ResetOutput();
+	}
+
+	while (con->IsHTTP2() && !m_stopping)
+	{
+		HTTPRequest *req;
+		int status;
+		while ((status = con->ParseRequest(&req)) == PARSE_OK)
+		{
+			con->SubmitResponse(req, m_httpServer->DispatchRequest(req));
+			delete req;
+		}
+
+		// also sends the GOAWAY of a failed connection
+		size_t size = con->CollectOutput(connection->output);
+		while (connection->outputOffset < size)
+		{
+			con->WaitForOutput();
+
+			DWORD count = connection->Gather();
+			int len = co_await client->WriteVectorAsync(connection->segments.data(), count);
+			if (len <= 0)
+				break;
+			connection->outputOffset += len;
+		}
+
+		con->StopWaiting();
+		if (connection->outputOffset < size)
+			break;
+
+		connection->ResetOutput();
+
+		if (status == PARSE_ERROR || con->IsClosing())
+			break;
+
+		// only wait for the client once nothing more can be sent
+		if (size == 0)
+		{
+			con->ReleaseInput();
+			con->WaitForInput();
+			int waited = co_await client->ReadBytesAsync(nullptr, 0);
+			con->StopWaiting();
+
+			if (waited < 0)
+				break;
+		}
+		if (con->ReceiveAvailable() < 0)
+			break;
+	}
+
+	DestroyConnection(connection);
+}
+
+void IOReactor::Serialize(ReactorConnection *connection, HTTPResponse *response)
+{
+	const HTTPResponse *finalized = response->Finalize();
+
+	// the previous response of a pipelined batch keeps its body, which is gathered
+	// behind its head
+	if (connection->response)
+	{
+		connection->batch.push_back({ connection->output.Size(), connection->response });
+		connection->response = nullptr;
+	}
+
+	// registered I/O can only send from registered buffers, so it copies file bodies
+	if (response->GetFile() && (m_model == IOMODEL_RIO || !connection->client->GetTransmitFile()))
+	{
+		connection->connection->SerializeResponse(finalized, connection->output);
+		delete response;
+		return;
+	}
+
+	// the body stays in the response and is gathered when writing
+	connection->connection->SerializeHeader(finalized, connection->output);
+	connection->response = response;
+}
+
+void IOReactor::DestroyConnection(ReactorConnection *connection)
+{
+	AcquireSRWLockExclusive(&m_connectionsLock);
+	if (connection->prev)
+		connection->prev->next = connection->next;
+	else
+		m_connections = connection->next;
+	if (connection->next)
+		connection->next->prev = connection->prev;
+	ReleaseSRWLockExclusive(&m_connectionsLock);
+
+	if (connection->queue)
+	{
+		AcquireSRWLockExclusive(&connection->queue->lock);
+		connection->queue->reserved -= RIOQueueEntriesPerConnection;
+		ReleaseSRWLockExclusive(&connection->queue->lock);
+	}
+
+	m_rioBuffers.Release(connection->recvSlot);
+	for (int i = 0; i < RIOSendSlots; i++)
+		m_rioBuffers.Release(connection->sendSlots[i]);
+
+	connection->ReleaseBatch();
+	delete connection->response;
+
+	// also deletes the client connection, closing the socket releases its request queue
+	delete connection->connection;
+	delete connection;
+
+	InterlockedDecrement(&m_connectionCount);
+}
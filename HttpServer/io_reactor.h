@@ -0,0 +1,142 @@
+#pragma once
+
+#include "common.h"
+#include "server.h"
+#include "rio_transport.h"
+#include "async_io.h"
+
+#include <MSWSock.h>
+
+class HTTPServer;
+class HTTPRequest;
+class HTTPResponse;
+
+struct AcceptContext;
+struct ReactorConnection;
+struct RIOQueue;
+
+enum
+{
+	IOMODEL_THREADED = 0,
+	IOMODEL_IOCP,
+	IOMODEL_RIO,
+	IOMODEL_COROUTINE
+};
+
+struct ReactorStatistics
+{
+	LONG connections;
+	LONG pendingAccepts;
+	LONGLONG wakeups;  // number of times a thread returned from the completion port
+	LONGLONG completions;  // number of I/O results handled
+	int freeBuffers;  // registered buffer slots available, -1 if not using RIO
+};
+
+// Drives every connection of an HTTPServer from a completion port serviced by a
+// fixed number of threads. Each connection is a small state machine
+// (read -> parse -> dispatch -> write) with at most one outstanding operation.
+//
+// With IOMODEL_IOCP connections use overlapped Winsock calls. With IOMODEL_RIO
+// they use registered I/O: sends and receives go through per-connection request
+// queues backed by a shared registered buffer pool, and results are dequeued in
+// batches from per-thread completion queues which signal the completion port.
+// With IOMODEL_COROUTINE every connection is a coroutine awaiting overlapped
+// socket operations, which keeps the serving loop straight-line while only a
+// small frame is held per idle connection.
+class IOReactor
+{
+private:
+	static DWORD ReactorWorker(__in IOReactor *reactor);
+private:
+	HTTPServer *m_httpServer;
+	Server *m_server;
+	int m_model;
+
+	HANDLE m_port;
+	HANDLE *m_threads;
+	int m_threadCount;
+	bool m_pinThreads;
+
+	LPFN_ACCEPTEX m_acceptEx;
+	LPFN_GETACCEPTEXSOCKADDRS m_getAcceptExSockaddrs;
+
+	AcceptContext *m_accepts;
+	int m_acceptCount;
+
+	RIO_EXTENSION_FUNCTION_TABLE m_rio;
+	RIOBufferPool m_rioBuffers;
+	int m_rioBufferCount;
+	RIOQueue *m_rioQueues;
+	int m_rioQueueCount;
+	volatile LONG m_rioNextQueue;
+
+	SRWLOCK m_connectionsLock;
+	ReactorConnection *m_connections;
+
+	volatile LONG m_connectionCount;
+	volatile LONG m_pendingAccepts;
+	volatile LONGLONG m_wakeups;
+	volatile LONGLONG m_completions;
+	volatile bool m_stopping;
+
+	bool LoadExtensions(SOCKET listener);
+	bool CreateRIOQueues();
+	void DestroyRIOQueues();
+
+	bool PostAccept(AcceptContext *context);
+	void OnAccept(AcceptContext *context, bool success);
+	bool AttachRIO(ReactorConnection *connection);
+
+	bool PostRead(ReactorConnection *connection);
+	bool PostWrite(ReactorConnection *connection);
+
+	void OnReadable(ReactorConnection *connection);
+	void OnReceived(ReactorConnection *connection, ULONG transferred);
+	void OnWritten(ReactorConnection *connection, DWORD transferred);
+	void OnRIONotify(RIOQueue *queue);
+	void Process(ReactorConnection *connection);
+	void ProcessHTTP2(ReactorConnection *connection);
+	// takes ownership of the request and serializes the responses to it and to
+	// the requests pipelined behind it, returns the number of responses
+	int DispatchPipelined(ReactorConnection *connection, HTTPRequest *req);
+	// takes ownership of the response
+	void Serialize(ReactorConnection *connection, HTTPResponse *response);
+
+	DetachedTask ServeConnection(ReactorConnection *connection);
+
+	void DestroyConnection(ReactorConnection *connection);
+public:
+	IOReactor(HTTPServer *httpServer, int model);
+	~IOReactor();
+
+	IOReactor(const IOReactor &) = delete;
+
+	// number of registered buffer slots to allocate when using IOMODEL_RIO,
+	// must be called before Start
+	constexpr void SetRegisteredBufferCount(int count)
+	{
+		m_rioBufferCount = count;
+	}
+
+	// pins each reactor thread to its own logical processor, must be called before Start
+	constexpr void SetThreadAffinity(bool pin)
+	{
+		m_pinThreads = pin;
+	}
+
+	// threads <= 0 uses one thread per logical processor
+	bool Start(Server *server, int threads);
+	void Stop();
+
+	constexpr bool IsRunning() const
+	{
+		return m_port != NULL;
+	}
+
+	constexpr int GetModel() const
+	{
+		return m_model;
+	}
+
+	void GetStatistics(ReactorStatistics *stats) const;
+};
@@ -1,10 +1,13 @@
 #include <stdio.h>
 #include <set>
+#include <psapi.h>
 
 #include "http_server.h"
 #include "settings.h"
 #include "request_handlers.h"
 #include "config.h"
+#include "simd_scan.h"
+#include "epoch.h"
 
 static constexpr unsigned short int DefaultPort = 80;
 
@@ -14,12 +17,41 @@ struct Options
 	int addressFamily = 0;
 	std::string serverFiles;
 	bool allowInternet = false;
-	std::unordered_map<CaseInsensitiveString, CaseInsensitiveString> proxies;
+	int ioModel = IOMODEL_IOCP;
+	int threads = 0;
+	int registeredBuffers = 4096;
+	int acceptThreads = 1;
+	bool pinThreads = false;
+	int workers = 64;
+	int workQueue = 1024;
+	int pipelineDepth = 16;
+	int bodyMemoryKB = 1024;
+	int cacheMemoryKB = 64 * 1024;
+	int cacheMaxFileKB = 1024;
+	int mapMemoryKB = 1024 * 1024;
+	bool watchResources = true;
+	int watchDelay = 250;
+	bool preload = false;
+	bool lazyResources = false;
+	int missTTL = 5;
+	int missEntries = 65536;
+	int idleTimeout = 60;
+	int headerTimeout = 20;
+	int bodyTimeout = 60;
+	int writeTimeout = 60;
+	CaseInsensitiveMap<CaseInsensitiveString> proxies;
 };
 
 static void ParseArguments(int argc, char *argv[], Options *out);
 static void Help();
 
+static const char *GetIOModelString(int model);
+static void PrintMemoryUsage(LONG connections);
+static void PrintTimerStatistics(const HTTPServer &httpServer);
+static void PrintAllocations(const HTTPServer &httpServer);
+static void PrintCacheStatistics(const HTTPServer &httpServer);
+static void PrintResolverStatistics(const ResourceResolver *resolver);
+
 int main(int argc, char *argv[])
 {
 	Options options;
@@ -38,7 +70,23 @@ int main(int argc, char *argv[])
 	printf("  Port: %hu\n", options.port);
 	printf("  AddressFamily: %s\n", famstr);
 	printf("  ServerFiles: \"%s\"\n", options.serverFiles.c_str());
-	printf("  AllowInternet: %s\n\n", options.allowInternet ? "true" : "false");
+	printf("  AllowInternet: %s\n", options.allowInternet ? "true" : "false");
+	printf("  IOModel: %s\n", GetIOModelString(options.ioModel));
+	printf("  Scanning: %s\n", GetScanLevelString(GetScanLevel()));
+	printf("  Threads: %d\n", options.threads);
+	printf("  AcceptThreads: %d\n", options.acceptThreads);
+	printf("  Affinity: %s\n", options.pinThreads ? "true" : "false");
+	printf("  Workers: %d\n", options.workers);
+	printf("  WorkQueue: %d\n", options.workQueue);
+	printf("  PipelineDepth: %d\n", options.pipelineDepth);
+	printf("  BodyMemory: %d KB\n", options.bodyMemoryKB);
+	printf("  Cache: %d KB, files up to %d KB\n", options.cacheMemoryKB, options.cacheMaxFileKB);
+	printf("  MapMemory: %d KB\n", options.mapMemoryKB);
+	printf("  Watch: %s, %d ms\n", options.watchResources ? "true" : "false", options.watchDelay);
+	printf("  Preload: %s\n", options.preload ? "true" : "false");
+	printf("  Lazy: %s, misses kept %ds, up to %d\n", options.lazyResources ? "true" : "false", options.missTTL, options.missEntries);
+	printf("  Timeouts: idle %ds, header %ds, body %ds, write %ds\n\n",
+		options.idleTimeout, options.headerTimeout, options.bodyTimeout, options.writeTimeout);
 
 	printf("Initialize server...\n");
 
@@ -49,7 +97,7 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 
-	HTTPServer httpServer(options.serverFiles);
+	HTTPServer httpServer(options.serverFiles, options.lazyResources);
 	//httpServer.CreateResourceProxy("/", "/index.html");
 	for (auto it : options.proxies)
 		httpServer.CreateResourceProxy(it.first, it.second);
@@ -74,6 +122,27 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 
+	httpServer.SetIOModel(options.ioModel, options.threads);
+	httpServer.SetRegisteredBufferCount(options.registeredBuffers);
+	httpServer.SetAcceptThreads(options.acceptThreads);
+	httpServer.SetThreadAffinity(options.pinThreads);
+	httpServer.SetWorkPool(options.workers, options.workQueue);
+	httpServer.SetPipelineDepth(options.pipelineDepth);
+	httpServer.SetBodyMemoryLimit((size_t)options.bodyMemoryKB * 1024);
+	httpServer.SetCacheLimits((size_t)options.cacheMemoryKB * 1024, (size_t)options.cacheMaxFileKB * 1024,
+		(size_t)options.mapMemoryKB * 1024);
+	httpServer.SetResourceWatch(options.watchResources, (DWORD)options.watchDelay);
+	httpServer.SetMissCache((DWORD)options.missTTL * 1000, (size_t)options.missEntries);
+	if (options.preload)
+		httpServer.PreloadResources();
+
+	ConnectionTimeouts timeouts;
+	timeouts.idle = (DWORD)options.idleTimeout * 1000;
+	timeouts.header = (DWORD)options.headerTimeout * 1000;
+	timeouts.body = (DWORD)options.bodyTimeout * 1000;
+	timeouts.write = (DWORD)options.writeTimeout * 1000;
+	httpServer.SetTimeouts(timeouts);
+
 	httpServer.SetRequestHandler(METHOD_GET, &HandleGETRequest);
 	httpServer.SetRequestHandler(METHOD_OPTIONS, &HandleOPTIONSRequest);
 	httpServer.SetRequestHandler(METHOD_POST, &HandlePOSTRequest);
@@ -134,17 +203,92 @@ int main(int argc, char *argv[])
 			}
 			else if (equalsIgnoreCase(buf, "rstat"))
 			{
+				EpochGuard epoch;
+				const ResourceTable *table = httpServer.GetResourceTable();
+
 				std::set<CaseInsensitiveString> orderednames;
-				for (auto it : httpServer.GetResources())
+				for (auto it : table->GetResources())
 					orderednames.insert(it.first);
 
 
-				printf("%-32s %-14s %-15s\n", "[Path]", "[DRAM Usage]", "[Mapped Size]");
+				const ResourceCache &cache = httpServer.GetResourceCache();
+				printf("%-32s %-14s %-15s %-14s\n", "[Path]", "[DRAM Usage]", "[Mapped Size]", "[Resident]");
 				for (auto &key : orderednames)
 				{
-					HTTPResource *rsrc = httpServer.FindHTTPResource(key);
-					printf("%-32s %-14zu %-15zu\n", key.cstr(), rsrc->GetDRAMUsage(), rsrc->GetMemoryMappedSize());
+					HTTPResource *rsrc = table->GetResources().find(key)->second;
+
+					CachedSizes sizes;
+					cache.GetCachedSizes(rsrc->GetLocation(), &sizes);
+					printf("%-32s %-14zu %-15zu %-14zu\n", key.cstr(), sizes.memory, sizes.mapped, sizes.resident);
+				}
+
+				printf("\n");
+				PrintCacheStatistics(httpServer);
+
+				if (httpServer.GetResourceResolver())
+				{
+					printf("\n");
+					PrintResolverStatistics(httpServer.GetResourceResolver());
+				}
+			}
+			else if (equalsIgnoreCase(buf, "cstat"))
+			{
+				WorkPoolStatistics poolStats;
+				if (httpServer.GetWorkPoolStatistics(&poolStats))
+				{
+					const LONG connections = (LONG)httpServer.GetConnectionCount();
+					printf("%-20s %s\n", "[IO Model]", GetIOModelString(httpServer.GetIOModel()));
+					printf("%-20s %ld\n", "[Connections]", connections);
+					printf("%-20s %d\n", "[Workers]", poolStats.workers);
+					printf("%-20s %ld\n", "[Active]", poolStats.active);
+					printf("%-20s %ld\n", "[Queued]", poolStats.pending);
+					printf("%-20s %lld\n", "[Served]", poolStats.executed);
+					printf("%-20s %lld\n", "[Stolen]", poolStats.stolen);
+					printf("%-20s %lld\n", "[Rejected]", poolStats.rejected);
+					PrintTimerStatistics(httpServer);
+					PrintAllocations(httpServer);
+					PrintMemoryUsage(connections);
+					continue;
+				}
+
+				ReactorStatistics stats;
+				if (!httpServer.GetReactorStatistics(&stats))
+				{
+					printf("Connection statistics are unavailable while the server is not running\n");
+					continue;
 				}
+
+				printf("%-20s %s\n", "[IO Model]", GetIOModelString(httpServer.GetIOModel()));
+				printf("%-20s %ld\n", "[Connections]", stats.connections);
+				printf("%-20s %ld\n", "[Pending Accepts]", stats.pendingAccepts);
+				printf("%-20s %lld\n", "[Wakeups]", stats.wakeups);
+				printf("%-20s %lld\n", "[Completions]", stats.completions);
+				printf("%-20s %.2f\n", "[Per Wakeup]", stats.wakeups ? (double)stats.completions / stats.wakeups : 0.0);
+				if (stats.freeBuffers >= 0)
+					printf("%-20s %d\n", "[Free Buffers]", stats.freeBuffers);
+				PrintTimerStatistics(httpServer);
+				PrintAllocations(httpServer);
+				PrintMemoryUsage(stats.connections);
+			}
+			else if (equalsIgnoreCase(buf, "sbench"))
+			{
+				BenchmarkScanning();
+			}
+			else if (equalsIgnoreCase(buf, "pbench"))
+			{
+				BenchmarkParsing();
+			}
+			else if (equalsIgnoreCase(buf, "lbench"))
+			{
+				httpServer.BenchmarkLookups();
+			}
+			else if (equalsIgnoreCase(buf, "cbench"))
+			{
+				HTTPServer::BenchmarkIOModels();
+			}
+			else if (equalsIgnoreCase(buf, "ibench"))
+			{
+				HTTPServer::BenchmarkIdleConnections();
 			}
 			else if (equalsIgnoreCase(buf, "reload"))
 			{
@@ -160,6 +304,12 @@ int main(int argc, char *argv[])
 				printf("  shutdown | exit     Shuts down the server\n");
 				printf("  quit                Forcefully exits the application\n");
 				printf("  rstat               Prints resource statistics\n");
+				printf("  cstat               Prints connection statistics\n");
+				printf("  sbench              Measures delimiter scanning throughput\n");
+				printf("  pbench              Measures request head parsing speed\n");
+				printf("  lbench              Measures resource and header lookup throughput\n");
+				printf("  cbench              Measures request throughput of every I/O model\n");
+				printf("  ibench              Measures memory per idle connection of every I/O model\n");
 				printf("  reload              Reload server resources\n");
 			}
 			else
@@ -284,6 +434,103 @@ void ParseArguments(int argc, char *argv[], Options *out)
 			value = section->FindValue("internet");
 			if (value)
 				out->allowInternet = value->boolValue;
+
+			value = section->FindValue("iomodel");
+			if (value)
+			{
+				if (equalsIgnoreCase(value->stringValue, "iocp"))
+					out->ioModel = IOMODEL_IOCP;
+				else if (equalsIgnoreCase(value->stringValue, "rio"))
+					out->ioModel = IOMODEL_RIO;
+				else if (equalsIgnoreCase(value->stringValue, "coroutine"))
+					out->ioModel = IOMODEL_COROUTINE;
+				else if (equalsIgnoreCase(value->stringValue, "threaded"))
+					out->ioModel = IOMODEL_THREADED;
+			}
+
+			value = section->FindValue("rio_buffers");
+			if (value && value->intValue > 0)
+				out->registeredBuffers = value->intValue;
+
+			value = section->FindValue("threads");
+			if (value)
+				out->threads = value->intValue;
+
+			value = section->FindValue("accept_threads");
+			if (value)
+				out->acceptThreads = value->intValue;
+
+			value = section->FindValue("affinity");
+			if (value)
+				out->pinThreads = value->boolValue;
+
+			value = section->FindValue("workers");
+			if (value)
+				out->workers = value->intValue;
+
+			value = section->FindValue("work_queue");
+			if (value && value->intValue > 0)
+				out->workQueue = value->intValue;
+
+			value = section->FindValue("pipeline_depth");
+			if (value && value->intValue > 0)
+				out->pipelineDepth = value->intValue;
+
+			value = section->FindValue("body_memory");
+			if (value && value->intValue >= 0)
+				out->bodyMemoryKB = value->intValue;
+
+			value = section->FindValue("cache_memory");
+			if (value && value->intValue >= 0)
+				out->cacheMemoryKB = value->intValue;
+
+			value = section->FindValue("cache_max_file");
+			if (value && value->intValue >= 0)
+				out->cacheMaxFileKB = value->intValue;
+
+			value = section->FindValue("map_memory");
+			if (value && value->intValue >= 0)
+				out->mapMemoryKB = value->intValue;
+
+			value = section->FindValue("watch");
+			if (value)
+				out->watchResources = value->boolValue;
+
+			value = section->FindValue("watch_delay");
+			if (value && value->intValue >= 0)
+				out->watchDelay = value->intValue;
+
+			value = section->FindValue("preload");
+			if (value)
+				out->preload = value->boolValue;
+
+			value = section->FindValue("lazy");
+			if (value)
+				out->lazyResources = value->boolValue;
+
+			value = section->FindValue("miss_ttl");
+			if (value && value->intValue >= 0)
+				out->missTTL = value->intValue;
+
+			value = section->FindValue("miss_entries");
+			if (value && value->intValue >= 0)
+				out->missEntries = value->intValue;
+
+			value = section->FindValue("idle_timeout");
+			if (value && value->intValue >= 0)
+				out->idleTimeout = value->intValue;
+
+			value = section->FindValue("header_timeout");
+			if (value && value->intValue >= 0)
+				out->headerTimeout = value->intValue;
+
+			value = section->FindValue("body_timeout");
+			if (value && value->intValue >= 0)
+				out->bodyTimeout = value->intValue;
+
+			value = section->FindValue("write_timeout");
+			if (value && value->intValue >= 0)
+				out->writeTimeout = value->intValue;
 		}
 
 		section = config.FindSection("resource.proxies");
@@ -328,3 +575,98 @@ void Help()
 	printf("--files -f      Sets the directory to search for server resources in\n");
 	printf("--internet -i   Allow internet connection\n");
 }
+
+const char *GetIOModelString(int model)
+{
+	switch (model)
+	{
+	case IOMODEL_THREADED:
+		return "THREADED";
+	case IOMODEL_IOCP:
+		return "IOCP";
+	case IOMODEL_RIO:
+		return "RIO";
+	case IOMODEL_COROUTINE:
+		return "COROUTINE";
+	default:
+		return "UNKN";
+	}
+}
+
+// committed private memory of the process, divided by the number of open connections
+// it gives a rough per-connection cost when the server holds many idle ones
+void PrintMemoryUsage(LONG connections)
+{
+	PROCESS_MEMORY_COUNTERS_EX counters;
+	if (!GetProcessMemoryInfo(GetCurrentProcess(), (PROCESS_MEMORY_COUNTERS *)&counters, sizeof(counters)))
+		return;
+
+	printf("%-20s %zu KB\n", "[Private Memory]", counters.PrivateUsage / 1024);
+	if (connections > 0)
+		printf("%-20s %zu bytes\n", "[Per Connection]", counters.PrivateUsage / connections);
+
+	RingBufferStatistics buffers;
+	GetRingBufferStatistics(&buffers);
+	printf("%-20s %ld\n", "[Input Buffers]", buffers.active);
+	printf("%-20s %ld\n", "[Pooled Buffers]", buffers.pooled);
+	printf("%-20s %s\n", "[Mirrored Buffers]", buffers.mirrored ? "true" : "false");
+}
+
+void PrintTimerStatistics(const HTTPServer &httpServer)
+{
+	TimerStatistics timers;
+	httpServer.GetTimerStatistics(&timers);
+	printf("%-20s %ld\n", "[Armed Timeouts]", timers.armed);
+	printf("%-20s %lld\n", "[Timed Out]", timers.expired);
+}
+
+// the per request figure covers the requests since the previous call, so running
+// cstat before and after a load test shows what the test cost
+void PrintAllocations(const HTTPServer &httpServer)
+{
+	static LONGLONG lastRequests = 0;
+	static LONGLONG lastHeap = 0;
+
+	PoolStatistics pools;
+	GetPoolStatistics(&pools);
+
+	LONGLONG requests = httpServer.GetRequestCount();
+	printf("%-20s %lld\n", "[Requests]", requests);
+	printf("%-20s %lld\n", "[Pooled Allocs]", pools.pooled);
+	printf("%-20s %lld\n", "[Heap Allocs]", pools.heap);
+	printf("%-20s %ld\n", "[Pool Slabs]", pools.slabs);
+	if (requests > lastRequests)
+		printf("%-20s %.2f\n", "[Heap Per Request]", (double)(pools.heap - lastHeap) / (requests - lastRequests));
+
+	lastRequests = requests;
+	lastHeap = pools.heap;
+}
+
+void PrintCacheStatistics(const HTTPServer &httpServer)
+{
+	CacheStatistics cache;
+	httpServer.GetResourceCache().GetStatistics(&cache);
+
+	const LONGLONG lookups = cache.hits + cache.misses + cache.coalesced;
+	printf("%-20s %zu / %zu KB\n", "[Cache Memory]", cache.bytes[STORAGE_MEMORY] / 1024, cache.budget[STORAGE_MEMORY] / 1024);
+	printf("%-20s %zu / %zu KB\n", "[Mapped Memory]", cache.bytes[STORAGE_MAPPED] / 1024, cache.budget[STORAGE_MAPPED] / 1024);
+	printf("%-20s %ld\n", "[Cached Files]", cache.entries);
+	printf("%-20s %lld\n", "[Hits]", cache.hits);
+	printf("%-20s %lld\n", "[Misses]", cache.misses);
+	printf("%-20s %lld\n", "[Coalesced]", cache.coalesced);
+	printf("%-20s %lld\n", "[Evictions]", cache.evictions);
+	printf("%-20s %lld\n", "[Rejected]", cache.rejected);
+	printf("%-20s %.1f%%\n", "[Hit Ratio]", lookups ? 100.0 * (cache.hits + cache.coalesced) / lookups : 0.0);
+}
+
+void PrintResolverStatistics(const ResourceResolver *resolver)
+{
+	ResolverStatistics stats;
+	resolver->GetStatistics(&stats);
+
+	printf("%-20s %zu\n", "[Resolved Files]", stats.resources);
+	printf("%-20s %zu\n", "[Known Missing]", stats.negative);
+	printf("%-20s %lld\n", "[Disk Lookups]", stats.lookups);
+	printf("%-20s %lld\n", "[Missing Hits]", stats.misses);
+	printf("%-20s %lld\n", "[Refused Paths]", stats.rejected);
+}
@@ -0,0 +1,208 @@
+#include "object_pool.h"
+
+#include <bit>
+#include <new>
+#include <stdlib.h>
+
+static constexpr int MinClassShift = 4;  // 16 bytes, the alignment SLIST_ENTRY needs
+static constexpr int ClassCount = 10;  // 16 B to 8 KB
+static constexpr size_t SlabSize = 64 * 1024;
+static constexpr size_t ThreadCacheBytes = 32 * 1024;  // per class, above this half goes to the shared list
+static constexpr size_t ThreadCacheMin = 4;
+static constexpr int CountBatch = 64;
+
+static_assert(((size_t)1 << (MinClassShift + ClassCount - 1)) == MaxPooledSize, "size classes don't reach MaxPooledSize");
+
+struct SharedClass
+{
+	SLIST_HEADER freeList;
+};
+
+struct ThreadClass
+{
+	SLIST_ENTRY *freeList;
+	size_t count;
+	char *cursor;  // unused rest of the current slab
+	char *end;
+};
+
+struct ThreadCache
+{
+	ThreadClass classes[ClassCount];
+	LONGLONG pooled;
+	int heap;  // not yet added to g_heapAllocations
+};
+
+// a zeroed SLIST_HEADER is an empty list, so the pools work during static initialization
+static SharedClass g_classes[ClassCount];
+static volatile LONG g_slabs;
+static volatile LONGLONG g_pooledAllocations;
+static volatile LONGLONG g_heapAllocations;
+
+static thread_local ThreadCache t_cache;
+
+class PoolResource : public std::pmr::memory_resource
+{
+protected:
+	void *do_allocate(size_t bytes, size_t alignment) override
+	{
+		return PoolAllocate(bytes);
+	}
+
+	void do_deallocate(void *p, size_t bytes, size_t alignment) override
+	{
+		PoolFree(p, bytes);
+	}
+
+	bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override
+	{
+		return this == &other;
+	}
+};
+
+static PoolResource g_resource;
+
+static inline int GetSizeClass(size_t size)
+{
+	if (size <= ((size_t)1 << MinClassShift))
+		return 0;
+
+	return (int)std::bit_width(size - 1) - MinClassShift;
+}
+
+static inline size_t GetClassSize(int sizeClass)
+{
+	return (size_t)1 << (sizeClass + MinClassShift);
+}
+
+// counts a heap allocation, the shared counter is only updated in batches
+static inline void CountHeapAllocation()
+{
+	ThreadCache &cache = t_cache;
+	if (++cache.heap == CountBatch)
+	{
+		InterlockedExchangeAdd64(&g_heapAllocations, CountBatch);
+		cache.heap = 0;
+	}
+}
+
+static SLIST_ENTRY *Refill(int sizeClass, ThreadClass &local)
+{
+	// surplus of other threads first, then a fresh slab
+	SLIST_ENTRY *entry = InterlockedPopEntrySList(&g_classes[sizeClass].freeList);
+	if (entry)
+		return entry;
+
+	const size_t size = GetClassSize(sizeClass);
+	if (local.cursor == local.end)
+	{
+		char *slab = (char *)VirtualAlloc(NULL, SlabSize, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+		if (!slab)
+			return nullptr;
+
+		CountHeapAllocation();
+		InterlockedIncrement(&g_slabs);
+
+		local.cursor = slab;
+		local.end = slab + SlabSize;
+	}
+
+	entry = (SLIST_ENTRY *)local.cursor;
+	local.cursor += size;
+	return entry;
+}
+
+void *PoolAllocate(size_t size)
+{
+	if (size > MaxPooledSize)
+		return ::operator new(size);
+
+	const int sizeClass = GetSizeClass(size);
+	ThreadCache &cache = t_cache;
+	ThreadClass &local = cache.classes[sizeClass];
+
+	SLIST_ENTRY *entry = local.freeList;
+	if (entry)
+	{
+		local.freeList = entry->Next;
+		local.count--;
+	}
+	else
+	{
+		entry = Refill(sizeClass, local);
+		if (!entry)
+			throw std::bad_alloc();
+	}
+
+	// published in batches like the heap counter, exact enough for statistics
+	if ((++cache.pooled & (CountBatch - 1)) == 0)
+		InterlockedExchangeAdd64(&g_pooledAllocations, CountBatch);
+
+	return entry;
+}
+
+void PoolFree(void *block, size_t size)
+{
+	if (!block) return;
+
+	if (size > MaxPooledSize)
+	{
+		::operator delete(block);
+		return;
+	}
+
+	const int sizeClass = GetSizeClass(size);
+	ThreadClass &local = t_cache.classes[sizeClass];
+
+	SLIST_ENTRY *entry = (SLIST_ENTRY *)block;
+	entry->Next = local.freeList;
+	local.freeList = entry;
+	local.count++;
+
+	if (local.count <= ThreadCacheMin || local.count * GetClassSize(sizeClass) <= ThreadCacheBytes)
+		return;
+
+	// keep half for this thread and give the rest to whoever allocates next
+	const size_t keep = local.count / 2;
+	SLIST_ENTRY *first = local.freeList;
+	SLIST_ENTRY *last = first;
+	for (size_t i = 1; i < local.count - keep; i++)
+		last = last->Next;
+
+	local.freeList = last->Next;
+	InterlockedPushListSListEx(&g_classes[sizeClass].freeList, first, last, (ULONG)(local.count - keep));
+	local.count = keep;
+}
+
+std::pmr::memory_resource *GetPoolResource()
+{
+	return &g_resource;
+}
+
+void GetPoolStatistics(PoolStatistics *stats)
+{
+	stats->slabs = g_slabs;
+	stats->pooled = g_pooledAllocations;
+	stats->heap = g_heapAllocations;
+}
+
+// every heap allocation of the process is counted, which shows what is left to pool
+void *operator new(size_t size)
+{
+	CountHeapAllocation();
+
+	void *block = malloc(size ? size : 1);
+	if (!block)
+		throw std::bad_alloc();
+	return block;
+}
+
+void operator delete(void *block) noexcept
+{
+	free(block);
+}
+
+void operator delete(void *block, size_t size) noexcept
+{
+	free(block);
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include "common.h"
+
+#include <memory_resource>
+
+struct PoolStatistics
+{
+	LONG slabs;  // blocks carved into pooled objects, never returned to the system
+	LONGLONG pooled;  // allocations served by the pools
+	LONGLONG heap;  // allocations which went to the heap, including everything outside the pools
+};
+
+// Fixed size blocks for objects of up to MaxPooledSize bytes, rounded up to a power
+// of two. Every thread keeps its own free lists and carves its own slabs, so the
+// common case never locks or touches a shared cache line. A thread freeing more
+// than it allocates, like a worker releasing connections accepted elsewhere,
+// hands its surplus to a lock-free list shared by all threads. Blocks are kept
+// for reuse and never given back to the system.
+static constexpr size_t MaxPooledSize = 8192;
+
+void *PoolAllocate(size_t size);
+void PoolFree(void *block, size_t size);
+
+// memory_resource over the pools, larger blocks come from the heap
+std::pmr::memory_resource *GetPoolResource();
+
+void GetPoolStatistics(PoolStatistics *stats);
+
+// types deriving from Pooled are allocated from the pools by new and delete. The
+// size passed to delete is that of the static type, so a pooled type must not be
+// deleted through a base class.
+struct Pooled
+{
+	static inline void *operator new(size_t size)
+	{
+		return PoolAllocate(size);
+	}
+
+	static inline void operator delete(void *block, size_t size)
+	{
+		PoolFree(block, size);
+	}
+};
+
+// Monotonic allocator for data living as long as one request or response. The
+// first InlineSize bytes are part of the owning object, which is itself pooled,
+// and later blocks come from the pools. Nothing is freed until the arena is
+// destroyed, which releases everything in one step.
+template <size_t InlineSize>
+class Arena
+{
+private:
+	alignas(16) char m_inline[InlineSize];
+	std::pmr::monotonic_buffer_resource m_resource;
+public:
+	inline Arena() :
+		m_resource(m_inline, InlineSize, GetPoolResource()) { }
+
+	Arena(const Arena &) = delete;
+
+	constexpr std::pmr::memory_resource *GetResource()
+	{
+		return &m_resource;
+	}
+};
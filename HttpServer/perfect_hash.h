@@ -0,0 +1,73 @@
+#pragma once
+
+#include <string_view>
+
+#include "case_insensitive.h"
+
+// Case-insensitive perfect hash over a fixed set of names, built while compiling.
+// The constructor tries seeds until every name lands in its own slot, so a lookup
+// is one hash, one load and one comparison to reject names outside the set. Slots
+// must be a power of two and a few times larger than Count for a seed to be found
+// quickly.
+template <size_t Count, size_t Slots>
+class PerfectHash
+{
+private:
+	static_assert((Slots & (Slots - 1)) == 0, "Slots must be a power of two");
+	static_assert(Count < 255, "slots store the index in a byte");
+
+	std::string_view m_names[Count];
+	unsigned int m_seed;
+	unsigned char m_slots[Slots];  // index of the name + 1, 0 if empty
+
+	static constexpr unsigned int Hash(std::string_view name, unsigned int seed)
+	{
+		unsigned int hash = 2166136261u ^ seed;
+		for (char c : name)
+		{
+			if (c >= 'A' && c <= 'Z') c += 'a' - 'A';
+			hash = (hash ^ (unsigned char)c) * 16777619u;
+		}
+		return (hash ^ (hash >> 15)) & (Slots - 1);
+	}
+
+	constexpr bool TrySeed(unsigned int seed)
+	{
+		for (size_t i = 0; i < Slots; i++)
+			m_slots[i] = 0;
+
+		for (size_t i = 0; i < Count; i++)
+		{
+			unsigned char &slot = m_slots[Hash(m_names[i], seed)];
+			if (slot)
+				return false;
+			slot = (unsigned char)(i + 1);
+		}
+
+		return true;
+	}
+public:
+	constexpr PerfectHash(const std::string_view (&names)[Count]) :
+		m_names(), m_seed(0), m_slots()
+	{
+		for (size_t i = 0; i < Count; i++)
+			m_names[i] = names[i];
+
+		while (!TrySeed(m_seed))
+			m_seed++;
+	}
+
+	// index of the name in the set, -1 if it is not part of it
+	inline int Find(std::string_view name) const
+	{
+		int index = (int)m_slots[Hash(name, m_seed)] - 1;
+		if (index < 0 || !EqualsIgnoreCase(name, m_names[index]))
+			return -1;
+		return index;
+	}
+
+	constexpr std::string_view GetName(size_t index) const
+	{
+		return m_names[index];
+	}
+};
@@ -28,7 +28,17 @@ HTTPResponse *HandleGETRequest(const HTTPRequest *request)
 
 	HTTPResponse *res = new HTTPResponse();
 
-	if (!rsrc || !rsrc->Request())
+	// small hot files are answered from memory, everything else is sent from disk
+	CachedContent *cached = rsrc ? server->GetResourceCache().Acquire(rsrc->GetLocation()) : nullptr;
+
+	size_t len = 0;
+	HANDLE file = INVALID_HANDLE_VALUE;
+	if (cached)
+		res->SetSharedContent(cached->data, cached->length, &ResourceCache::Release, cached);
+	else if (rsrc)
+		file = rsrc->OpenFile(&len);
+
+	if (!cached && file == INVALID_HANDLE_VALUE)
 	{
 		res->SetCode(404);
 		res->SetReason("Not Found");
@@ -40,13 +50,12 @@ HTTPResponse *HandleGETRequest(const HTTPRequest *request)
 		return res;
 	}
 
-	const char *data = rsrc->GetData();
-	size_t len = rsrc->GetDataLength();
 	const char *contentType = rsrc->GetContentType();
 
 	res->SetCode(200);
 	res->SetReason("OK");
-	res->AppendContent(data, len);
+	if (!cached)
+		res->SetFileContent(file, len);
 	res->SetContentType(contentType);
 
 	Date exp = {
@@ -62,8 +71,6 @@ HTTPResponse *HandleGETRequest(const HTTPRequest *request)
 	HTTPCookie cookie("MyCookie", "CookieValue");
 	res->AddCookie(cookie.SetExpiration(exp));
 
-	rsrc->Done();
-
 	return res;
 }
 
@@ -73,7 +80,7 @@ HTTPResponse *HandleOPTIONSRequest(const HTTPRequest *request)
 
 	HTTPResponse *response = new HTTPResponse();
 
-	const std::string *origin = request->GetHeader("Origin");
+	const std::string_view *origin = request->GetHeader(HEADER_ORIGIN);
 	if (origin)
 	{
 		response->AddHeader("Access-Control-Allow-Origin", *origin);
@@ -0,0 +1,579 @@
+#include "resource_cache.h"
+
+#include <string.h>
+#include <psapi.h>
+
+#include "thread_util.h"
+
+// share of the budget the protected segment may take, the rest is probation
+static constexpr size_t ProtectedPercent = 80;
+
+// count-min sketch of 4-bit counters in SketchRows rows, halved after
+// SketchWidth * 10 accesses so old popularity fades
+static constexpr int SketchRows = 4;
+static constexpr int SketchShift = 12;
+static constexpr size_t SketchWidth = (size_t)1 << SketchShift;
+static constexpr size_t SketchResetAdditions = SketchWidth * 10;
+static constexpr unsigned char SketchMax = 15;
+static constexpr unsigned int SketchSeeds[SketchRows] = { 0x9E3779B1u, 0x85EBCA77u, 0xC2B2AE3Du, 0x27D4EB2Fu };
+
+enum
+{
+	CONTENT_LOADING = 0,
+	CONTENT_READY,
+	CONTENT_FAILED
+};
+
+enum
+{
+	SEGMENT_NONE = -1,  // loading or no longer cached
+	SEGMENT_PROBATION = 0,
+	SEGMENT_PROTECTED = 1
+};
+
+// pages of a view looked up per QueryWorkingSetEx call
+static constexpr size_t ResidencyBatch = 512;
+
+static inline size_t GetSketchIndex(unsigned int hash, int row)
+{
+	return (size_t)row * SketchWidth + ((hash * SketchSeeds[row]) >> (32 - SketchShift));
+}
+
+ResourceCache::ResourceCache() :
+	m_entries(), m_segments(), m_budget(), m_maxEntry(0), m_bytes(),
+	m_sketch(nullptr), m_sketchAdditions(0),
+	m_hits(0), m_misses(0), m_coalesced(0), m_evictions(0), m_rejected(0)
+{
+	InitializeSRWLock(&m_lock);
+	InitializeConditionVariable(&m_loaded);
+
+	for (AccessBuffer &buffer : m_accesses)
+	{
+		InitializeSRWLock(&buffer.lock);
+		buffer.count = 0;
+	}
+
+	m_sketch = new unsigned char[SketchRows * SketchWidth];
+	memset(m_sketch, 0, SketchRows * SketchWidth);
+}
+
+ResourceCache::~ResourceCache()
+{
+	Clear();
+	delete[] m_sketch;
+}
+
+void ResourceCache::SetLimits(size_t budget, size_t maxEntry, size_t mapBudget)
+{
+	m_budget[STORAGE_MEMORY] = budget;
+	m_budget[STORAGE_MAPPED] = mapBudget;
+	m_maxEntry = maxEntry < budget ? maxEntry : budget;
+	if (m_maxEntry > MAXDWORD)
+		m_maxEntry = MAXDWORD;
+}
+
+void ResourceCache::Link(CachedContent *content, int segment)
+{
+	Segment &list = m_segments[segment];
+
+	content->segment = segment;
+	content->prev = nullptr;
+	content->next = list.head;
+	if (list.head)
+		list.head->prev = content;
+	else
+		list.tail = content;
+	list.head = content;
+	list.bytes[content->storage] += content->length;
+}
+
+void ResourceCache::Unlink(CachedContent *content)
+{
+	Segment &list = m_segments[content->segment];
+
+	if (content->prev)
+		content->prev->next = content->next;
+	else
+		list.head = content->next;
+
+	if (content->next)
+		content->next->prev = content->prev;
+	else
+		list.tail = content->prev;
+
+	list.bytes[content->storage] -= content->length;
+	content->segment = SEGMENT_NONE;
+	content->prev = nullptr;
+	content->next = nullptr;
+}
+
+void ResourceCache::Touch(CachedContent *content)
+{
+	// a second hit earns a place in the protected segment, which pushes its least
+	// recently used entries back to probation when it grows past its share
+	Unlink(content);
+	Link(content, SEGMENT_PROTECTED);
+
+	const int storage = content->storage;
+	const size_t limit = m_budget[storage] / 100 * ProtectedPercent;
+	Segment &protect = m_segments[SEGMENT_PROTECTED];
+
+	CachedContent *demoted = protect.tail;
+	while (protect.bytes[storage] > limit && demoted != content)
+	{
+		CachedContent *prev = demoted->prev;
+		if (demoted->storage == storage)
+		{
+			Unlink(demoted);
+			Link(demoted, SEGMENT_PROBATION);
+		}
+		demoted = prev;
+	}
+}
+
+void ResourceCache::Remove(CachedContent *content)
+{
+	// already removed by Clear while it was loading
+	auto it = m_entries.find(content->location);
+	if (it == m_entries.end() || it->second != content)
+		return;
+
+	m_entries.erase(it);
+
+	// a load in progress still accounts for its bytes and returns them itself
+	if (content->segment != SEGMENT_NONE)
+	{
+		Unlink(content);
+		m_bytes[content->storage] -= content->length;
+	}
+
+	Release(content);
+}
+
+CachedContent *ResourceCache::NextVictim(CachedContent *victim, int storage) const
+{
+	// least recently used first, probation before protected
+	int segment = victim ? victim->segment : SEGMENT_PROBATION;
+	victim = victim ? victim->prev : m_segments[SEGMENT_PROBATION].tail;
+
+	while (true)
+	{
+		for (; victim; victim = victim->prev)
+		{
+			if (victim->storage == storage)
+				return victim;
+		}
+
+		if (segment == SEGMENT_PROTECTED)
+			return nullptr;
+
+		segment = SEGMENT_PROTECTED;
+		victim = m_segments[SEGMENT_PROTECTED].tail;
+	}
+}
+
+bool ResourceCache::MakeRoom(size_t size, unsigned int hash, int storage)
+{
+	if (m_bytes[storage] + size <= m_budget[storage])
+		return true;
+
+	// collect victims first so a rejected file doesn't evict anything
+	const int frequency = EstimateFrequency(hash);
+	size_t freed = 0;
+	for (CachedContent *victim = NextVictim(nullptr, storage); m_bytes[storage] - freed + size > m_budget[storage];
+		victim = NextVictim(victim, storage))
+	{
+		// the rest is held by loads in progress
+		if (!victim)
+			return false;
+
+		if (EstimateFrequency(victim->hash) >= frequency)
+			return false;
+
+		freed += victim->length;
+	}
+
+	while (freed > 0)
+	{
+		CachedContent *evicted = NextVictim(nullptr, storage);
+		freed -= evicted->length;
+		Remove(evicted);
+		m_evictions++;
+	}
+
+	return true;
+}
+
+void ResourceCache::RecordAccess(unsigned int hash)
+{
+	for (int row = 0; row < SketchRows; row++)
+	{
+		unsigned char &counter = m_sketch[GetSketchIndex(hash, row)];
+		if (counter < SketchMax)
+			counter++;
+	}
+
+	if (++m_sketchAdditions >= SketchResetAdditions)
+	{
+		for (size_t i = 0; i < SketchRows * SketchWidth; i++)
+			m_sketch[i] >>= 1;
+		m_sketchAdditions /= 2;
+	}
+}
+
+int ResourceCache::EstimateFrequency(unsigned int hash) const
+{
+	int frequency = SketchMax;
+	for (int row = 0; row < SketchRows; row++)
+	{
+		int counter = m_sketch[GetSketchIndex(hash, row)];
+		if (counter < frequency)
+			frequency = counter;
+	}
+	return frequency;
+}
+
+void ResourceCache::BufferAccess(CachedContent *content)
+{
+	AccessBuffer &buffer = m_accesses[GetThreadIndex() % AccessStripes];
+
+	// a full stripe is about to be applied by the thread which filled it, accesses
+	// arriving meanwhile are dropped, which only makes the order a little less exact
+	AcquireSRWLockExclusive(&buffer.lock);
+	const bool kept = buffer.count < AccessBatch;
+	if (kept)
+	{
+		// the buffer's reference keeps the entry valid if it is evicted meanwhile
+		InterlockedIncrement(&content->refs);
+		buffer.entries[buffer.count++] = content;
+	}
+	const bool full = kept && buffer.count == AccessBatch;
+	ReleaseSRWLockExclusive(&buffer.lock);
+
+	if (full)
+	{
+		AcquireSRWLockExclusive(&m_lock);
+		ApplyAccesses();
+		ReleaseSRWLockExclusive(&m_lock);
+	}
+}
+
+void ResourceCache::ApplyAccesses()
+{
+	for (AccessBuffer &buffer : m_accesses)
+	{
+		AcquireSRWLockExclusive(&buffer.lock);
+
+		for (int i = 0; i < buffer.count; i++)
+		{
+			CachedContent *content = buffer.entries[i];
+			RecordAccess(content->hash);
+
+			// evicted entries are only counted
+			if (content->segment != SEGMENT_NONE)
+				Touch(content);
+			Release(content);
+		}
+		buffer.count = 0;
+
+		ReleaseSRWLockExclusive(&buffer.lock);
+	}
+}
+
+void ResourceCache::FailLoad(CachedContent *content, size_t reserved)
+{
+	AcquireSRWLockExclusive(&m_lock);
+
+	m_bytes[content->storage] -= reserved;
+	content->state = CONTENT_FAILED;
+	Remove(content);
+
+	WakeAllConditionVariable(&m_loaded);
+	ReleaseSRWLockExclusive(&m_lock);
+
+	Release(content);
+}
+
+bool ResourceCache::Load(CachedContent *content, HANDLE file)
+{
+	if (content->storage == STORAGE_MEMORY)
+	{
+		char *data = new char[content->length];
+		DWORD read;
+		if (!ReadFile(file, data, (DWORD)content->length, &read, NULL) || read != content->length)
+		{
+			delete[] data;
+			return false;
+		}
+
+		content->data = data;
+		return true;
+	}
+
+	// the view keeps the section alive, so neither handle stays open
+	HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (!mapping)
+		return false;
+
+	void *view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	CloseHandle(mapping);
+	if (!view)
+		return false;
+
+	// start reading the file in ahead of the first response instead of faulting
+	// it in page by page while sending, failure only costs the head start
+	WIN32_MEMORY_RANGE_ENTRY range;
+	range.VirtualAddress = view;
+	range.NumberOfBytes = content->length;
+	PrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0);
+
+	content->data = (char *)view;
+	return true;
+}
+
+CachedContent *ResourceCache::Acquire(const std::string &location)
+{
+	if (m_budget[STORAGE_MEMORY] == 0 && m_budget[STORAGE_MAPPED] == 0)
+		return nullptr;
+
+	const unsigned int hash = (unsigned int)HashIgnoreCase(location.data(), location.length());
+
+	// a hit on a loaded entry is served under the shared lock
+	CachedContent *hit = nullptr;
+
+	AcquireSRWLockShared(&m_lock);
+	auto found = m_entries.find(location);
+	if (found != m_entries.end() && found->second->state == CONTENT_READY)
+	{
+		hit = found->second;
+		InterlockedIncrement(&hit->refs);
+	}
+	ReleaseSRWLockShared(&m_lock);
+
+	if (hit)
+	{
+		InterlockedIncrement64(&m_hits);
+		BufferAccess(hit);
+		return hit;
+	}
+
+	AcquireSRWLockExclusive(&m_lock);
+	ApplyAccesses();
+	RecordAccess(hash);
+
+	auto it = m_entries.find(location);
+	if (it != m_entries.end())
+	{
+		CachedContent *content = it->second;
+		InterlockedIncrement(&content->refs);
+
+		if (content->state == CONTENT_LOADING)
+		{
+			m_coalesced++;
+			while (content->state == CONTENT_LOADING)
+				SleepConditionVariableSRW(&m_loaded, &m_lock, INFINITE, 0);
+		}
+		else
+		{
+			InterlockedIncrement64(&m_hits);
+			Touch(content);
+		}
+
+		const int state = content->state;
+		ReleaseSRWLockExclusive(&m_lock);
+
+		if (state == CONTENT_READY)
+			return content;
+
+		Release(content);
+		return nullptr;
+	}
+
+	m_misses++;
+
+	// requests for the same file wait on this entry until it is loaded
+	CachedContent *content = new CachedContent();
+	content->data = nullptr;
+	content->length = 0;
+	content->location = location;
+	content->hash = hash;
+	content->refs = 2;  // the cache's and the caller's
+	content->state = CONTENT_LOADING;
+	content->storage = STORAGE_MEMORY;
+	content->segment = SEGMENT_NONE;
+	content->prev = nullptr;
+	content->next = nullptr;
+	m_entries[CaseInsensitiveString(location)] = content;
+
+	ReleaseSRWLockExclusive(&m_lock);
+
+	HANDLE file = CreateFileA(location.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL,
+		OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+	{
+		FailLoad(content, 0);
+		return nullptr;
+	}
+
+	// empty files go through the regular path, which always sends a length and
+	// can't be mapped anyway
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(file, &size) || size.QuadPart == 0)
+	{
+		CloseHandle(file);
+		FailLoad(content, 0);
+		return nullptr;
+	}
+
+	const size_t length = (size_t)size.QuadPart;
+	const int storage = length > m_maxEntry ? STORAGE_MAPPED : STORAGE_MEMORY;
+
+	AcquireSRWLockExclusive(&m_lock);
+	const bool admitted = length <= m_budget[storage] && MakeRoom(length, hash, storage);
+	if (admitted)
+		m_bytes[storage] += length;
+	else
+		m_rejected++;
+	content->storage = storage;
+	content->length = length;
+	ReleaseSRWLockExclusive(&m_lock);
+
+	if (!admitted)
+	{
+		CloseHandle(file);
+		FailLoad(content, 0);
+		return nullptr;
+	}
+
+	const bool loaded = Load(content, file);
+	CloseHandle(file);
+
+	if (!loaded)
+	{
+		FailLoad(content, length);
+		return nullptr;
+	}
+
+	AcquireSRWLockExclusive(&m_lock);
+
+	content->state = CONTENT_READY;
+
+	// cleared while loading, the waiting requests are still served
+	auto loadedIt = m_entries.find(location);
+	if (loadedIt != m_entries.end() && loadedIt->second == content)
+		Link(content, SEGMENT_PROBATION);
+	else
+		m_bytes[storage] -= length;
+
+	WakeAllConditionVariable(&m_loaded);
+	ReleaseSRWLockExclusive(&m_lock);
+
+	return content;
+}
+
+void ResourceCache::Release(void *content)
+{
+	CachedContent *cached = (CachedContent *)content;
+	if (InterlockedDecrement(&cached->refs) == 0)
+	{
+		if (cached->storage != STORAGE_MAPPED)
+			delete[] cached->data;
+		else if (cached->data)
+			UnmapViewOfFile(cached->data);
+
+		delete cached;
+	}
+}
+
+void ResourceCache::Clear()
+{
+	AcquireSRWLockExclusive(&m_lock);
+	ApplyAccesses();
+	while (!m_entries.empty())
+		Remove(m_entries.begin()->second);
+	ReleaseSRWLockExclusive(&m_lock);
+}
+
+void ResourceCache::Invalidate(const std::string &location)
+{
+	AcquireSRWLockExclusive(&m_lock);
+	auto it = m_entries.find(location);
+	if (it != m_entries.end())
+		Remove(it->second);
+	ReleaseSRWLockExclusive(&m_lock);
+}
+
+void ResourceCache::GetCachedSizes(const std::string &location, CachedSizes *sizes) const
+{
+	memset(sizes, 0, sizeof(CachedSizes));
+
+	CachedContent *content = nullptr;
+
+	AcquireSRWLockShared(&m_lock);
+	auto it = m_entries.find(location);
+	if (it != m_entries.end() && it->second->state == CONTENT_READY)
+	{
+		content = it->second;
+		InterlockedIncrement(&content->refs);
+	}
+	ReleaseSRWLockShared(&m_lock);
+
+	if (!content)
+		return;
+
+	if (content->storage == STORAGE_MEMORY)
+	{
+		sizes->memory = content->length;
+		Release(content);
+		return;
+	}
+
+	sizes->mapped = content->length;
+
+	// the view may have been trimmed from the working set since it was loaded,
+	// ask for every page whether it is still there
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+
+	const size_t pageSize = info.dwPageSize;
+	const size_t pages = (content->length + pageSize - 1) / pageSize;
+
+	PSAPI_WORKING_SET_EX_INFORMATION batch[ResidencyBatch];
+	for (size_t first = 0; first < pages; first += ResidencyBatch)
+	{
+		const size_t count = pages - first < ResidencyBatch ? pages - first : ResidencyBatch;
+		for (size_t i = 0; i < count; i++)
+			batch[i].VirtualAddress = content->data + (first + i) * pageSize;
+
+		if (!QueryWorkingSetEx(GetCurrentProcess(), batch, (DWORD)(count * sizeof(PSAPI_WORKING_SET_EX_INFORMATION))))
+			break;
+
+		for (size_t i = 0; i < count; i++)
+		{
+			if (batch[i].VirtualAttributes.Valid)
+				sizes->resident += pageSize;
+		}
+	}
+
+	if (sizes->resident > sizes->mapped)
+		sizes->resident = sizes->mapped;
+
+	Release(content);
+}
+
+void ResourceCache::GetStatistics(CacheStatistics *stats) const
+{
+	AcquireSRWLockShared(&m_lock);
+	for (int storage = 0; storage < STORAGE_COUNT; storage++)
+	{
+		stats->bytes[storage] = m_bytes[storage];
+		stats->budget[storage] = m_budget[storage];
+	}
+	stats->entries = (LONG)m_entries.size();
+	stats->hits = m_hits;
+	stats->misses = m_misses;
+	stats->coalesced = m_coalesced;
+	stats->evictions = m_evictions;
+	stats->rejected = m_rejected;
+	ReleaseSRWLockShared(&m_lock);
+}
@@ -0,0 +1,155 @@
+#pragma once
+
+#include <string>
+
+#include "common.h"
+#include "object_pool.h"
+#include "case_insensitive.h"
+
+enum
+{
+	STORAGE_MEMORY = 0,  // private copy on the heap
+	STORAGE_MAPPED,  // view of the file, the bytes live in the system file cache
+
+	STORAGE_COUNT
+};
+
+struct CacheStatistics
+{
+	size_t bytes[STORAGE_COUNT];  // content held by the cache, including loads in progress
+	size_t budget[STORAGE_COUNT];
+	LONG entries;
+	LONGLONG hits;
+	LONGLONG misses;
+	LONGLONG coalesced;  // requests which waited for a load started by another request
+	LONGLONG evictions;
+	LONGLONG rejected;  // files the admission policy kept out of the cache
+};
+
+struct CachedSizes
+{
+	size_t memory;  // private bytes of a cached copy
+	size_t mapped;  // size of the view of a mapped file
+	size_t resident;  // bytes of the view in the working set of the process
+};
+
+// content of a cached file, valid until released even if it is evicted meanwhile
+struct CachedContent : public Pooled
+{
+	char *data;
+	size_t length;
+
+	// owned by the cache
+	std::string location;
+	unsigned int hash;
+	volatile LONG refs;
+	int state;
+	int storage;  // STORAGE_
+	int segment;
+	CachedContent *prev;  // towards the most recently used entry of the segment
+	CachedContent *next;
+};
+
+// Bounded cache of file contents shared by all connections. Entries are kept in a
+// segmented LRU: new entries start on probation and move to the protected segment
+// when they are hit again, so a scan over many files only displaces entries which
+// were never reused. Hits only take the lock shared, they are recorded per thread
+// and applied in batches while the lock is held exclusively anyway. Once the
+// budget is reached, a new file is only admitted if it was requested more often
+// recently than the entry it would evict, as estimated by a count-min sketch
+// (TinyLFU). Concurrent misses on the same file share one read from disk.
+//
+// Files up to the largest cached copy are read into private memory. Larger ones
+// are mapped read-only instead, so the system file cache holds the only copy of
+// their bytes no matter how many responses send them. Both kinds have a budget
+// of their own, for mapped files it limits the address space taken by views.
+// Only the view is kept, no handle, but Windows refuses to truncate or overwrite
+// a mapped file in place. Such files have to be replaced by renaming a new file
+// over them, which invalidates the entry while the old view lives on until the
+// responses using it are done.
+class ResourceCache
+{
+private:
+	struct Segment
+	{
+		CachedContent *head;  // most recently used
+		CachedContent *tail;
+		size_t bytes[STORAGE_COUNT];
+	};
+
+	static constexpr int AccessStripes = 16;
+	static constexpr int AccessBatch = 32;
+
+	// hits recorded by the threads sharing a stripe, each holding a reference
+	// until it was applied to the segments and the sketch
+	struct alignas(64) AccessBuffer
+	{
+		SRWLOCK lock;
+		int count;
+		CachedContent *entries[AccessBatch];
+	};
+
+	mutable SRWLOCK m_lock;
+	AccessBuffer m_accesses[AccessStripes];
+	CONDITION_VARIABLE m_loaded;
+	CaseInsensitiveMap<CachedContent *> m_entries;
+	Segment m_segments[2];
+	size_t m_budget[STORAGE_COUNT];
+	size_t m_maxEntry;
+	size_t m_bytes[STORAGE_COUNT];
+
+	unsigned char *m_sketch;
+	size_t m_sketchAdditions;
+
+	volatile LONGLONG m_hits;  // counted under the shared lock too
+	LONGLONG m_misses;
+	LONGLONG m_coalesced;
+	LONGLONG m_evictions;
+	LONGLONG m_rejected;
+
+	void Link(CachedContent *content, int segment);
+	void Unlink(CachedContent *content);
+	void Touch(CachedContent *content);
+	void Remove(CachedContent *content);
+	CachedContent *NextVictim(CachedContent *victim, int storage) const;
+	bool MakeRoom(size_t size, unsigned int hash, int storage);
+	bool Load(CachedContent *content, HANDLE file);
+
+	void RecordAccess(unsigned int hash);
+	int EstimateFrequency(unsigned int hash) const;
+
+	void BufferAccess(CachedContent *content);
+	void ApplyAccesses();
+
+	void FailLoad(CachedContent *content, size_t reserved);
+public:
+	ResourceCache();
+	~ResourceCache();
+
+	ResourceCache(const ResourceCache &) = delete;
+
+	// budget is the total size of all cached copies, files larger than maxEntry are
+	// mapped as long as the views fit into mapBudget and sent from disk otherwise.
+	// Must be called before the cache is used.
+	void SetLimits(size_t budget, size_t maxEntry, size_t mapBudget);
+
+	// returns the content of the file, loading it if necessary, or nullptr if the
+	// file can't be read or should not be cached. The caller serves the file from
+	// disk in that case. The content has to be released with Release.
+	CachedContent *Acquire(const std::string &location);
+
+	// takes a CachedContent *, matches HTTPContentRelease
+	static void Release(void *content);
+
+	// evicts every entry, contents still in use are freed once released
+	void Clear();
+
+	// evicts the file so the next request reads it again, responses already using
+	// the old content keep it until they release it
+	void Invalidate(const std::string &location);
+
+	// memory held for the file, all zero if it is not cached
+	void GetCachedSizes(const std::string &location, CachedSizes *sizes) const;
+
+	void GetStatistics(CacheStatistics *stats) const;
+};
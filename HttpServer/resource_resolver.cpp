@@ -0,0 +1,368 @@
+#include "resource_resolver.h"
+
+#include <stdio.h>
+
+#include "epoch.h"
+
+static constexpr std::string_view DeviceNames[] = {
+	"CON", "PRN", "AUX", "NUL",
+	"COM1", "COM2", "COM3", "COM4", "COM5", "COM6", "COM7", "COM8", "COM9",
+	"LPT1", "LPT2", "LPT3", "LPT4", "LPT5", "LPT6", "LPT7", "LPT8", "LPT9"
+};
+
+// true if the segment can only name the file of the same name in its directory
+static bool IsPlainSegment(std::string_view segment)
+{
+	for (size_t i = 0; i < segment.length(); i++)
+	{
+		const unsigned char c = (unsigned char)segment[i];
+		if (c < 0x20 || strchr("\\:*?\"<>|", c))
+			return false;
+
+		// short names like PROGRA~1 alias a longer name
+		if (c == '~' && i + 1 < segment.length() && segment[i + 1] >= '0' && segment[i + 1] <= '9')
+			return false;
+	}
+
+	// trailing dots and spaces are stripped by Windows
+	const char last = segment.back();
+	if (last == '.' || last == ' ')
+		return false;
+
+	// devices are found in every directory and with any extension
+	std::string_view base = segment.substr(0, segment.find('.'));
+	for (std::string_view device : DeviceNames)
+	{
+		if (EqualsIgnoreCase(base, device))
+			return false;
+	}
+
+	return true;
+}
+
+// path of an open file or directory with every link resolved
+static bool GetFinalPath(HANDLE handle, std::string *path)
+{
+	char buffer[MAX_PATH + 1];
+	DWORD len = GetFinalPathNameByHandleA(handle, buffer, sizeof(buffer), FILE_NAME_NORMALIZED | VOLUME_NAME_DOS);
+	if (len == 0)
+		return false;
+
+	if (len < sizeof(buffer))
+	{
+		path->assign(buffer, len);
+		return true;
+	}
+
+	// len is the size needed including the terminator
+	path->resize(len);
+	len = GetFinalPathNameByHandleA(handle, path->data(), len, FILE_NAME_NORMALIZED | VOLUME_NAME_DOS);
+	if (len == 0 || len >= path->size())
+		return false;
+
+	path->resize(len);
+	return true;
+}
+
+bool NormalizeResourcePath(std::string_view path, std::string *normalized)
+{
+	normalized->clear();
+	if (path.empty() || path[0] != '/')
+		return false;
+
+	size_t i = 0;
+	while (i < path.length())
+	{
+		while (i < path.length() && path[i] == '/')
+			i++;
+
+		size_t end = path.find('/', i);
+		if (end == std::string_view::npos)
+			end = path.length();
+
+		std::string_view segment = path.substr(i, end - i);
+		i = end;
+
+		if (segment.empty() || segment == ".")
+			continue;
+
+		if (segment == "..")
+		{
+			if (normalized->empty())
+				return false;
+			normalized->resize(normalized->rfind('/'));
+			continue;
+		}
+
+		if (!IsPlainSegment(segment))
+			return false;
+
+		normalized->push_back('/');
+		normalized->append(segment);
+	}
+
+	return !normalized->empty();
+}
+
+ResourceResolver::ResourceResolver(const std::string &root) :
+	m_root(root), m_missTTL(0), m_maxMisses(0), m_shards(),
+	m_resolved(0), m_lookups(0), m_misses(0), m_rejected(0)
+{
+	for (Shard &shard : m_shards)
+		InitializeSRWLock(&shard.lock);
+
+	HANDLE dir = CreateFileA(root.empty() ? "." : root.c_str(), 0, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+		NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL);
+	if (dir == INVALID_HANDLE_VALUE || !GetFinalPath(dir, &m_finalRoot))
+	{
+		printf("ERROR> Failed to open server directory %s: %lu\n", root.c_str(), GetLastError());
+		m_finalRoot.clear();
+	}
+	else if (m_finalRoot.back() == '\\')
+		m_finalRoot.pop_back();  // a drive root
+
+	if (dir != INVALID_HANDLE_VALUE)
+		CloseHandle(dir);
+}
+
+ResourceResolver::~ResourceResolver()
+{
+	for (Shard &shard : m_shards)
+	{
+		for (auto &p : shard.resources)
+			delete p.second;
+	}
+}
+
+void ResourceResolver::SetMissLimits(DWORD missTTL, size_t maxMisses)
+{
+	m_missTTL = missTTL;
+
+	// a limit below the shard count still remembers one path per shard
+	m_maxMisses = 0;
+	if (maxMisses > 0)
+		m_maxMisses = maxMisses >= ShardCount ? maxMisses / ShardCount : 1;
+}
+
+ResourceResolver::Shard &ResourceResolver::GetShard(std::string_view name)
+{
+	// the top bits, the maps bucket by the bottom ones
+	const size_t hash = HashIgnoreCase(name.data(), name.length());
+	return m_shards[hash >> (sizeof(size_t) * 8 - ShardBits)];
+}
+
+void ResourceResolver::AddMiss(Shard &shard, const std::string &name, ULONGLONG now)
+{
+	if (m_maxMisses == 0 || m_missTTL == 0)
+		return;
+
+	// expired entries go first, then the oldest while the shard is full. An entry
+	// replaced or invalidated since it was queued is left alone.
+	while (!shard.order.empty() && (shard.order.front().expires <= now || shard.order.size() >= m_maxMisses))
+	{
+		const Miss &oldest = shard.order.front();
+		auto it = shard.misses.find(oldest.name);
+		if (it != shard.misses.end() && it->second == oldest.expires)
+			shard.misses.erase(it);
+		shard.order.pop_front();
+	}
+
+	const ULONGLONG expires = now + m_missTTL;
+	shard.misses[CaseInsensitiveString(name)] = expires;
+	shard.order.push_back({ CaseInsensitiveString(name), expires });
+}
+
+void ResourceResolver::DropMiss(Shard &shard, std::string_view name)
+{
+	auto it = shard.misses.find(name);
+	if (it != shard.misses.end())
+		shard.misses.erase(it);
+}
+
+HTTPResource *ResourceResolver::Resolve(std::string_view path)
+{
+	std::string name;
+	if (!NormalizeResourcePath(path, &name))
+	{
+		InterlockedIncrement64(&m_rejected);
+		return nullptr;
+	}
+
+	Shard &shard = GetShard(name);
+	ULONGLONG now = GetTickCount64();
+
+	AcquireSRWLockShared(&shard.lock);
+
+	HTTPResource *resource = nullptr;
+	bool missing = false;
+
+	auto it = shard.resources.find(name);
+	if (it != shard.resources.end())
+		resource = it->second;
+	else
+	{
+		auto miss = shard.misses.find(name);
+		missing = miss != shard.misses.end() && miss->second > now;
+	}
+
+	ReleaseSRWLockShared(&shard.lock);
+
+	if (resource)
+		return resource;
+
+	if (missing)
+	{
+		InterlockedIncrement64(&m_misses);
+		return nullptr;
+	}
+
+	InterlockedIncrement64(&m_lookups);
+
+	std::string location = m_root + name;
+	for (char &c : location)
+	{
+		if (c == '/') c = '\\';
+	}
+
+	// a link or junction in any directory on the way could lead out of the root,
+	// so the file is opened and its resolved path has to be below the root's.
+	// Directories can't be opened without backup semantics and are never served.
+	HANDLE file = m_finalRoot.empty() ? INVALID_HANDLE_VALUE : CreateFileA(location.c_str(), 0,
+		FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, 0, NULL);
+	if (file != INVALID_HANDLE_VALUE)
+	{
+		std::string resolved;
+		if (GetFinalPath(file, &resolved) && resolved.length() > m_finalRoot.length() + 1 &&
+			resolved[m_finalRoot.length()] == '\\' &&
+			EqualsIgnoreCase(std::string_view(resolved).substr(0, m_finalRoot.length()), m_finalRoot))
+		{
+			resource = new HTTPResource(name, location);
+		}
+
+		CloseHandle(file);
+	}
+
+	now = GetTickCount64();
+	AcquireSRWLockExclusive(&shard.lock);
+
+	if (resource)
+	{
+		// another request may have found it meanwhile
+		auto result = shard.resources.emplace(CaseInsensitiveString(name), resource);
+		if (result.second)
+		{
+			InterlockedIncrement64(&m_resolved);
+			DropMiss(shard, name);
+		}
+		else
+		{
+			delete resource;
+			resource = result.first->second;
+		}
+	}
+	else
+		AddMiss(shard, name, now);
+
+	ReleaseSRWLockExclusive(&shard.lock);
+
+	return resource;
+}
+
+void ResourceResolver::Invalidate(std::string_view name, bool directory, std::vector<std::string> *locations)
+{
+	Shard &owner = GetShard(name);
+
+	AcquireSRWLockExclusive(&owner.lock);
+	auto it = owner.resources.find(name);
+	if (it != owner.resources.end())
+	{
+		HTTPResource *resource = it->second;
+		owner.resources.erase(it);
+		locations->push_back(resource->GetLocation());
+		EpochRetire(resource, &HTTPResource::Free);
+	}
+	DropMiss(owner, name);
+	ReleaseSRWLockExclusive(&owner.lock);
+
+	if (!directory)
+	{
+		EpochCollect();
+		return;
+	}
+
+	// everything below the directory, which is spread over all shards
+	std::string prefix(name);
+	prefix.push_back('/');
+
+	auto below = [&prefix](const CaseInsensitiveString &key)
+	{
+		std::string_view path = key.value();
+		return path.length() > prefix.length() && EqualsIgnoreCase(path.substr(0, prefix.length()), prefix);
+	};
+
+	for (Shard &shard : m_shards)
+	{
+		AcquireSRWLockExclusive(&shard.lock);
+
+		for (auto it = shard.resources.begin(); it != shard.resources.end();)
+		{
+			if (below(it->first))
+			{
+				HTTPResource *resource = it->second;
+				it = shard.resources.erase(it);
+				locations->push_back(resource->GetLocation());
+				EpochRetire(resource, &HTTPResource::Free);
+			}
+			else
+				it++;
+		}
+
+		for (auto it = shard.misses.begin(); it != shard.misses.end();)
+		{
+			if (below(it->first))
+				it = shard.misses.erase(it);
+			else
+				it++;
+		}
+
+		ReleaseSRWLockExclusive(&shard.lock);
+	}
+
+	EpochCollect();
+}
+
+void ResourceResolver::Clear()
+{
+	for (Shard &shard : m_shards)
+	{
+		AcquireSRWLockExclusive(&shard.lock);
+
+		for (auto &p : shard.resources)
+			EpochRetire(p.second, &HTTPResource::Free);
+		shard.resources.clear();
+		shard.misses.clear();
+		shard.order.clear();
+
+		ReleaseSRWLockExclusive(&shard.lock);
+	}
+
+	EpochCollect();
+}
+
+void ResourceResolver::GetStatistics(ResolverStatistics *stats) const
+{
+	stats->resolved = m_resolved;
+	stats->lookups = m_lookups;
+	stats->misses = m_misses;
+	stats->rejected = m_rejected;
+	stats->resources = 0;
+	stats->negative = 0;
+
+	for (const Shard &shard : m_shards)
+	{
+		AcquireSRWLockShared(&shard.lock);
+		stats->resources += shard.resources.size();
+		stats->negative += shard.misses.size();
+		ReleaseSRWLockShared(&shard.lock);
+	}
+}
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <deque>
+#include <vector>
+
+#include "common.h"
+#include "http_resource.h"
+#include "case_insensitive.h"
+
+struct ResolverStatistics
+{
+	LONGLONG resolved;  // resources found on disk and kept
+	LONGLONG lookups;  // requests which had to look on disk
+	LONGLONG misses;  // requests answered by the negative cache
+	LONGLONG rejected;  // paths refused by NormalizeResourcePath
+	size_t resources;
+	size_t negative;  // entries in the negative cache, including expired ones
+};
+
+// turns a request path into the name of a resource: repeated slashes and "."
+// are dropped and ".." is applied, but may not leave the root. Refuses anything
+// Windows would read as something other than the plain file name, like drive
+// letters and streams (':'), device names (NUL, COM1.txt), short names (FILE~1)
+// and names ending in '.' or ' '. Returns false for paths which are refused.
+bool NormalizeResourcePath(std::string_view path, std::string *normalized);
+
+// Finds resources on disk the first time they are requested instead of
+// registering the whole tree up front. Resources are kept once found. A path
+// without a file is remembered for a while, so repeated requests for it don't
+// touch the disk. The negative cache is bounded, its oldest entries are dropped
+// first. Both are split into shards with a lock of their own, lookups of known
+// names only take it shared. A file is only served if its path with every link
+// and junction resolved is still inside the root.
+//
+// Resources which are dropped are freed through the epoch, a resource returned by
+// Resolve stays valid while the caller is inside one.
+class ResourceResolver
+{
+private:
+	static constexpr int ShardBits = 4;
+	static constexpr int ShardCount = 1 << ShardBits;
+
+	struct Miss
+	{
+		CaseInsensitiveString name;
+		ULONGLONG expires;
+	};
+
+	struct Shard
+	{
+		mutable SRWLOCK lock;
+		CaseInsensitiveMap<HTTPResource *> resources;
+		CaseInsensitiveMap<ULONGLONG> misses;  // tick the entry expires at
+		std::deque<Miss> order;  // in the order entries were added, which is the order they expire in
+	};
+
+	std::string m_root;
+	std::string m_finalRoot;  // the root with every link resolved, empty if it can't be opened
+	DWORD m_missTTL;  // in milliseconds
+	size_t m_maxMisses;  // per shard
+	Shard m_shards[ShardCount];
+
+	volatile LONGLONG m_resolved;
+	volatile LONGLONG m_lookups;
+	volatile LONGLONG m_misses;
+	volatile LONGLONG m_rejected;
+
+	Shard &GetShard(std::string_view name);
+	void AddMiss(Shard &shard, const std::string &name, ULONGLONG now);
+	void DropMiss(Shard &shard, std::string_view name);
+public:
+	ResourceResolver(const std::string &root);
+	~ResourceResolver();
+
+	ResourceResolver(const ResourceResolver &) = delete;
+
+	// missTTL is how long a missing file is remembered in milliseconds, at most
+	// maxMisses paths are remembered at once. Must be called before the resolver
+	// is used.
+	void SetMissLimits(DWORD missTTL, size_t maxMisses);
+
+	// nullptr if there is no file at the path or the path was refused
+	HTTPResource *Resolve(std::string_view path);
+
+	// forgets what is known about the resource, and with directory set about
+	// everything below it, so the next request looks on disk again. The locations
+	// of the resources dropped are added to locations.
+	void Invalidate(std::string_view name, bool directory, std::vector<std::string> *locations);
+
+	void Clear();
+
+	void GetStatistics(ResolverStatistics *stats) const;
+};
@@ -0,0 +1,205 @@
+#include "resource_scan.h"
+
+#include <stdio.h>
+
+#include "thread_util.h"
+
+static constexpr DWORD ProgressInterval = 1000;  // in milliseconds
+
+typedef void (*ReportFunc)(void *context);
+
+struct ScanState
+{
+	SRWLOCK lock;
+	CONDITION_VARIABLE ready;  // a directory was pushed or the last one was listed
+	std::vector<std::string> pending;  // directories not yet taken by a thread
+	int busy;  // threads listing a directory
+
+	std::vector<std::string> *files;
+	ScanStatistics *stats;
+};
+
+struct ParallelState
+{
+	const char *name;
+	size_t count;
+	ParallelFunc func;
+	void *context;
+
+	volatile LONGLONG next;
+	volatile LONGLONG done;
+};
+
+// runs worker on the given number of threads and reports progress on the calling
+// thread until all of them returned. If no thread can be started, the calling
+// thread runs the worker itself.
+static void RunWorkers(int threads, LPTHREAD_START_ROUTINE worker, void *context, ReportFunc report)
+{
+	HANDLE *handles = new HANDLE[threads];
+
+	int started = 0;
+	for (; started < threads; started++)
+	{
+		handles[started] = CreateThread(NULL, 0, worker, context, 0, NULL);
+		if (!handles[started])
+			break;
+	}
+
+	if (started == 0)
+		worker(context);
+
+	// one at a time, WaitForMultipleObjects is limited to 64 handles
+	for (int i = 0; i < started; i++)
+	{
+		while (WaitForSingleObject(handles[i], ProgressInterval) == WAIT_TIMEOUT)
+			report(context);
+		CloseHandle(handles[i]);
+	}
+
+	delete[] handles;
+}
+
+// lists one directory, files are added to the thread's own list
+static bool ListDirectory(const std::string &directory, std::vector<std::string> &files, std::vector<std::string> &subdirectories)
+{
+	WIN32_FIND_DATAA ffd;
+	std::string pattern = directory + "\\*";
+
+	// skips the short names and fetches entries in larger batches
+	HANDLE hFind = FindFirstFileExA(pattern.c_str(), FindExInfoBasic, &ffd, FindExSearchNameMatch, NULL, FIND_FIRST_EX_LARGE_FETCH);
+	if (hFind == INVALID_HANDLE_VALUE)
+		return false;
+
+	do
+	{
+		if (!strcmp(ffd.cFileName, ".") || !strcmp(ffd.cFileName, ".."))
+			continue;
+
+		std::string path = directory + "\\" + ffd.cFileName;
+		if (ffd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+			subdirectories.push_back(std::move(path));
+		else
+			files.push_back(std::move(path));
+	} while (FindNextFileA(hFind, &ffd) != 0);
+
+	const bool complete = GetLastError() == ERROR_NO_MORE_FILES;
+	FindClose(hFind);
+	return complete;
+}
+
+static DWORD ScanWorker(__in ScanState *state)
+{
+	std::vector<std::string> files;
+	std::vector<std::string> subdirectories;
+
+	AcquireSRWLockExclusive(&state->lock);
+	while (true)
+	{
+		// the scan is over once nothing is pending and nobody can push more
+		while (state->pending.empty() && state->busy > 0)
+			SleepConditionVariableSRW(&state->ready, &state->lock, INFINITE, 0);
+
+		if (state->pending.empty())
+			break;
+
+		std::string directory = std::move(state->pending.back());
+		state->pending.pop_back();
+		state->busy++;
+		ReleaseSRWLockExclusive(&state->lock);
+
+		const size_t found = files.size();
+		if (!ListDirectory(directory, files, subdirectories))
+		{
+			printf("ERROR> Finding resources in directory %s\n", directory.c_str());
+			InterlockedIncrement(&state->stats->errors);
+		}
+
+		InterlockedIncrement(&state->stats->directories);
+		InterlockedExchangeAdd(&state->stats->files, (LONG)(files.size() - found));
+
+		AcquireSRWLockExclusive(&state->lock);
+		state->busy--;
+		for (std::string &subdirectory : subdirectories)
+			state->pending.push_back(std::move(subdirectory));
+		subdirectories.clear();
+
+		if (!state->pending.empty() || state->busy == 0)
+			WakeAllConditionVariable(&state->ready);
+	}
+
+	state->files->insert(state->files->end(), std::make_move_iterator(files.begin()), std::make_move_iterator(files.end()));
+	ReleaseSRWLockExclusive(&state->lock);
+
+	return 0;
+}
+
+static void ReportScan(void *context)
+{
+	ScanState *state = (ScanState *)context;
+	printf("  Scanning: %ld directories, %ld files\n", state->stats->directories, state->stats->files);
+}
+
+bool ScanDirectory(const std::string &root, int threads, std::vector<std::string> *files, ScanStatistics *stats)
+{
+	memset(stats, 0, sizeof(ScanStatistics));
+
+	// the root is listed here, so a missing directory fails without starting threads
+	std::vector<std::string> subdirectories;
+	if (!ListDirectory(root, *files, subdirectories))
+	{
+		printf("ERROR> Finding resources in directory %s\n", root.c_str());
+		stats->errors = 1;
+		return false;
+	}
+
+	stats->directories = 1;
+	stats->files = (LONG)files->size();
+	if (subdirectories.empty())
+		return true;
+
+	ScanState state;
+	InitializeSRWLock(&state.lock);
+	InitializeConditionVariable(&state.ready);
+	state.pending = std::move(subdirectories);
+	state.busy = 0;
+	state.files = files;
+	state.stats = stats;
+
+	RunWorkers(threads > 0 ? threads : GetProcessorCount(), (LPTHREAD_START_ROUTINE)&ScanWorker, &state, &ReportScan);
+	return true;
+}
+
+static DWORD ParallelWorker(__in ParallelState *state)
+{
+	while (true)
+	{
+		const size_t index = (size_t)InterlockedIncrement64(&state->next) - 1;
+		if (index >= state->count)
+			break;
+
+		state->func(state->context, index);
+		InterlockedIncrement64(&state->done);
+	}
+
+	return 0;
+}
+
+static void ReportParallel(void *context)
+{
+	ParallelState *state = (ParallelState *)context;
+	printf("  %s: %lld / %zu\n", state->name, state->done, state->count);
+}
+
+void ParallelFor(const char *name, size_t count, int threads, ParallelFunc func, void *context)
+{
+	if (count == 0)
+		return;
+
+	if (threads <= 0)
+		threads = GetProcessorCount();
+	if ((size_t)threads > count)
+		threads = (int)count;
+
+	ParallelState state = { name, count, func, context, 0, 0 };
+	RunWorkers(threads, (LPTHREAD_START_ROUTINE)&ParallelWorker, &state, &ReportParallel);
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "common.h"
+
+struct ScanStatistics
+{
+	LONG directories;
+	LONG files;
+	LONG errors;  // directories which couldn't be listed
+};
+
+// Lists every file below root into files, in no particular order. Directories are
+// kept on a stack shared by the threads, each thread lists one at a time and
+// pushes the subdirectories it finds for any idle thread to take, so a wide tree
+// is listed by all threads at once. threads <= 0 uses one per logical processor.
+// Progress is printed while the scan takes longer than a second. Returns false if
+// root itself can't be listed.
+bool ScanDirectory(const std::string &root, int threads, std::vector<std::string> *files, ScanStatistics *stats);
+
+typedef void (*ParallelFunc)(void *context, size_t index);
+
+// calls func for every index below count, spread over the given number of threads,
+// and returns once every call returned. Progress is printed under name.
+void ParallelFor(const char *name, size_t count, int threads, ParallelFunc func, void *context);
@@ -0,0 +1,44 @@
+#include "resource_table.h"
+
+std::string_view ResourceTable::Resolve(std::string_view location) const
+{
+	auto it = m_proxies.find(location);
+	return it != m_proxies.end() ? std::string_view(it->second.value()) : location;
+}
+
+HTTPResource *ResourceTable::Find(std::string_view location) const
+{
+	auto it = m_resources.find(Resolve(location));
+	return it != m_resources.end() ? it->second : nullptr;
+}
+
+HTTPResource *ResourceTable::RemoveResource(std::string_view name)
+{
+	auto it = m_resources.find(name);
+	if (it == m_resources.end())
+		return nullptr;
+
+	HTTPResource *resource = it->second;
+	m_resources.erase(it);
+	return resource;
+}
+
+void ResourceTable::RemoveDirectory(std::string_view name, std::vector<HTTPResource *> *removed)
+{
+	for (auto it = m_resources.begin(); it != m_resources.end();)
+	{
+		std::string_view path = it->first.value();
+		if (path.length() > name.length() && EqualsIgnoreCase(path.substr(0, name.length()), name))
+		{
+			removed->push_back(it->second);
+			it = m_resources.erase(it);
+		}
+		else
+			it++;
+	}
+}
+
+void ResourceTable::Free(void *table)
+{
+	delete (ResourceTable *)table;
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <string_view>
+#include <vector>
+
+#include "http_resource.h"
+#include "case_insensitive.h"
+
+// Resources and proxies served at one point in time. A table is never changed
+// once HTTPServer publishes it, a change builds a new table and swaps it in, so
+// readers look up without locks. Tables share their HTTPResource objects, which
+// the server frees when no published table refers to them anymore.
+class ResourceTable
+{
+private:
+	CaseInsensitiveMap<HTTPResource *> m_resources;
+	CaseInsensitiveMap<CaseInsensitiveString> m_proxies;
+public:
+	ResourceTable() = default;
+
+	// copies the entries, the resources stay shared
+	ResourceTable(const ResourceTable &other) = default;
+
+	inline void AddResource(HTTPResource *resource)
+	{
+		m_resources[resource->GetName()] = resource;
+	}
+
+	// returns the resource which was registered under the name, nullptr if none
+	HTTPResource *RemoveResource(std::string_view name);
+
+	// removes every resource below the directory, name ends with '/'
+	void RemoveDirectory(std::string_view name, std::vector<HTTPResource *> *removed);
+
+	inline void AddProxy(const CaseInsensitiveString &from, const CaseInsensitiveString &to)
+	{
+		m_proxies[from] = to;
+	}
+
+	// the location a proxy forwards to, the location itself if there is none
+	std::string_view Resolve(std::string_view location) const;
+
+	// resolves a proxy first, nullptr if there is no resource at the location
+	HTTPResource *Find(std::string_view location) const;
+
+	constexpr const CaseInsensitiveMap<HTTPResource *> &GetResources() const
+	{
+		return m_resources;
+	}
+
+	constexpr const CaseInsensitiveMap<CaseInsensitiveString> &GetProxies() const
+	{
+		return m_proxies;
+	}
+
+	// matches EpochFreeFunc
+	static void Free(void *table);
+};
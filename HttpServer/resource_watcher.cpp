@@ -0,0 +1,188 @@
+#include "resource_watcher.h"
+
+#include <stdio.h>
+#include <unordered_set>
+
+#include "case_insensitive.h"
+
+typedef std::unordered_set<CaseInsensitiveString, CaseInsensitiveHash, CaseInsensitiveEqual> PathSet;
+
+static constexpr DWORD WatchFilter = FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_DIR_NAME |
+	FILE_NOTIFY_CHANGE_SIZE | FILE_NOTIFY_CHANGE_LAST_WRITE;
+
+// adds the path of every notification in the buffer, what happened to it is looked
+// up when the batch is applied since later notifications may undo earlier ones
+static void CollectChanges(const DWORD *buffer, PathSet &paths)
+{
+	const char *cursor = (const char *)buffer;
+	while (true)
+	{
+		const FILE_NOTIFY_INFORMATION *info = (const FILE_NOTIFY_INFORMATION *)cursor;
+
+		char path[MAX_PATH * 4];
+		int len = WideCharToMultiByte(CP_ACP, 0, info->FileName, (int)(info->FileNameLength / sizeof(WCHAR)),
+			path, sizeof(path), NULL, NULL);
+		if (len > 0)
+			paths.insert(CaseInsensitiveString(std::string(path, len)));
+
+		if (!info->NextEntryOffset)
+			break;
+		cursor += info->NextEntryOffset;
+	}
+}
+
+DWORD ResourceWatcher::WatchWorker(__in ResourceWatcher *watcher)
+{
+	HANDLE events[2] = { watcher->m_stop, watcher->m_overlapped.hEvent };
+	const DWORD limit = watcher->m_delay * BatchLimit;
+
+	PathSet pending;
+	bool rescan = false;
+	ULONGLONG first = 0;  // tick of the oldest change not yet reported
+
+	while (true)
+	{
+		DWORD timeout = INFINITE;
+		if (!pending.empty() || rescan)
+		{
+			const ULONGLONG waited = GetTickCount64() - first;
+			timeout = waited >= limit ? 0 : (DWORD)(limit - waited);
+			if (timeout > watcher->m_delay)
+				timeout = watcher->m_delay;
+		}
+
+		DWORD result = WaitForMultipleObjects(2, events, FALSE, timeout);
+		if (result == WAIT_OBJECT_0)
+			break;
+
+		if (result == WAIT_TIMEOUT)
+		{
+			std::vector<std::string> paths;
+			paths.reserve(pending.size());
+			for (auto &path : pending)
+				paths.push_back(path.value());
+
+			InterlockedIncrement64(&watcher->m_batches);
+			InterlockedExchangeAdd64(&watcher->m_changes, (LONGLONG)paths.size());
+			watcher->m_callback(watcher->m_context, paths, rescan);
+
+			pending.clear();
+			rescan = false;
+			continue;
+		}
+
+		if (result != WAIT_OBJECT_0 + 1)
+		{
+			printf("ERROR> Waiting for changes in %s\n", watcher->m_directory.c_str());
+			break;
+		}
+
+		if (pending.empty() && !rescan)
+			first = GetTickCount64();
+
+		// nothing returned means the system buffer overflowed and changes were lost
+		DWORD bytes;
+		if (!GetOverlappedResult(watcher->m_handle, &watcher->m_overlapped, &bytes, FALSE) || bytes == 0)
+			rescan = true;
+		else
+			CollectChanges(watcher->m_buffer, pending);
+
+		if (!watcher->Listen())
+		{
+			printf("ERROR> Watching directory %s\n", watcher->m_directory.c_str());
+			return 1;
+		}
+	}
+
+	CancelIoEx(watcher->m_handle, &watcher->m_overlapped);
+
+	DWORD bytes;
+	GetOverlappedResult(watcher->m_handle, &watcher->m_overlapped, &bytes, TRUE);
+	return 0;
+}
+
+ResourceWatcher::ResourceWatcher(const std::string &directory, DWORD delay, ResourceChangeCallback callback, void *context) :
+	m_directory(directory), m_delay(delay > 0 ? delay : 1), m_callback(callback), m_context(context),
+	m_handle(INVALID_HANDLE_VALUE), m_thread(NULL), m_stop(NULL), m_overlapped(), m_buffer(nullptr),
+	m_batches(0), m_changes(0)
+{
+}
+
+ResourceWatcher::~ResourceWatcher()
+{
+	Stop();
+}
+
+bool ResourceWatcher::Listen()
+{
+	ResetEvent(m_overlapped.hEvent);
+	return ReadDirectoryChangesW(m_handle, m_buffer, BufferSize, TRUE, WatchFilter, NULL, &m_overlapped, NULL);
+}
+
+bool ResourceWatcher::Start()
+{
+	if (m_thread) return false;
+
+	m_handle = CreateFileA(m_directory.c_str(), FILE_LIST_DIRECTORY, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+		NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED, NULL);
+	if (m_handle == INVALID_HANDLE_VALUE)
+	{
+		printf("ERROR> Opening directory %s to watch\n", m_directory.c_str());
+		return false;
+	}
+
+	m_buffer = new DWORD[BufferSize / sizeof(DWORD)];
+	m_stop = CreateEventA(NULL, TRUE, FALSE, NULL);
+	m_overlapped.hEvent = CreateEventA(NULL, TRUE, FALSE, NULL);
+
+	// listening before the thread starts, so no change after Start is missed
+	if (m_stop && m_overlapped.hEvent && Listen())
+		m_thread = CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE)&WatchWorker, this, 0, NULL);
+
+	if (!m_thread)
+	{
+		printf("ERROR> Failed to start watching %s\n", m_directory.c_str());
+		Stop();
+		return false;
+	}
+
+	return true;
+}
+
+void ResourceWatcher::Stop()
+{
+	if (m_thread)
+	{
+		SetEvent(m_stop);
+		WaitForSingleObject(m_thread, INFINITE);
+
+		CloseHandle(m_thread);
+		m_thread = NULL;
+	}
+
+	if (m_handle != INVALID_HANDLE_VALUE)
+	{
+		// cancels a request the thread never got to wait for, the buffer is written
+		// until it completes
+		DWORD bytes;
+		CancelIoEx(m_handle, &m_overlapped);
+		GetOverlappedResult(m_handle, &m_overlapped, &bytes, TRUE);
+		CloseHandle(m_handle);
+		m_handle = INVALID_HANDLE_VALUE;
+	}
+
+	if (m_stop)
+	{
+		CloseHandle(m_stop);
+		m_stop = NULL;
+	}
+
+	if (m_overlapped.hEvent)
+	{
+		CloseHandle(m_overlapped.hEvent);
+		m_overlapped.hEvent = NULL;
+	}
+
+	delete[] m_buffer;
+	m_buffer = nullptr;
+}
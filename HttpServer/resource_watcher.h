@@ -0,0 +1,60 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "common.h"
+
+// called on the watcher's thread with the paths, relative to the watched directory,
+// which changed since the last call. rescan is set when changes were lost and the
+// whole directory has to be compared again.
+typedef void (*ResourceChangeCallback)(void *context, const std::vector<std::string> &paths, bool rescan);
+
+// Watches a directory tree for created, deleted, renamed and written files and
+// reports them in batches. A batch is handed out once no change arrived for the
+// delay, so a deploy writing many files or a file written in many steps is applied
+// at once. Under a steady stream of changes a batch waits at most BatchLimit
+// times the delay.
+class ResourceWatcher
+{
+private:
+	static constexpr DWORD BufferSize = 64 * 1024;
+	static constexpr DWORD BatchLimit = 20;
+
+	static DWORD WatchWorker(__in ResourceWatcher *watcher);
+private:
+	std::string m_directory;
+	DWORD m_delay;  // in milliseconds
+	ResourceChangeCallback m_callback;
+	void *m_context;
+
+	HANDLE m_handle;  // of the directory
+	HANDLE m_thread;
+	HANDLE m_stop;
+	OVERLAPPED m_overlapped;
+	DWORD *m_buffer;  // notifications have to be DWORD aligned
+
+	volatile LONGLONG m_batches;
+	volatile LONGLONG m_changes;
+
+	bool Listen();
+public:
+	ResourceWatcher(const std::string &directory, DWORD delay, ResourceChangeCallback callback, void *context);
+	~ResourceWatcher();
+
+	ResourceWatcher(const ResourceWatcher &) = delete;
+
+	bool Start();
+	void Stop();
+
+	// number of batches reported and the changes they contained
+	inline LONGLONG GetBatchCount() const
+	{
+		return m_batches;
+	}
+
+	inline LONGLONG GetChangeCount() const
+	{
+		return m_changes;
+	}
+};
@@ -0,0 +1,327 @@
+#include "ring_buffer.h"
+
+#include <string.h>
+#include <vector>
+
+#ifndef MEM_RESERVE_PLACEHOLDER
+#define MEM_RESERVE_PLACEHOLDER 0x00040000
+#endif
+
+#ifndef MEM_REPLACE_PLACEHOLDER
+#define MEM_REPLACE_PLACEHOLDER 0x00004000
+#endif
+
+#ifndef MEM_PRESERVE_PLACEHOLDER
+#define MEM_PRESERVE_PLACEHOLDER 0x00000002
+#endif
+
+// size of the regions kept in the pool, mirrored regions have to be a multiple
+// of the allocation granularity
+static constexpr size_t DefaultCapacity = 64 * 1024;
+
+// regions cached beyond this are freed
+static constexpr size_t MaxPooledRegions = 256;
+
+// regions each thread keeps before going to the shared pool
+static constexpr int ThreadCachedRegions = 4;
+
+// VirtualAlloc2 and MapViewOfFile3 are only exported by newer versions of Windows
+typedef PVOID (WINAPI *VirtualAlloc2Func)(HANDLE process, PVOID baseAddress, SIZE_T size,
+	ULONG allocationType, ULONG pageProtection, void *extendedParameters, ULONG parameterCount);
+typedef PVOID (WINAPI *MapViewOfFile3Func)(HANDLE fileMapping, HANDLE process, PVOID baseAddress,
+	ULONG64 offset, SIZE_T viewSize, ULONG allocationType, ULONG pageProtection,
+	void *extendedParameters, ULONG parameterCount);
+
+struct RingRegionPool
+{
+	VirtualAlloc2Func virtualAlloc2;
+	MapViewOfFile3Func mapViewOfFile3;
+
+	SRWLOCK lock;
+	std::vector<RingRegion> regions;
+
+	volatile LONG active;
+	volatile LONG pooled;
+
+	RingRegionPool() :
+		virtualAlloc2(nullptr), mapViewOfFile3(nullptr), regions(), active(0), pooled(0)
+	{
+		InitializeSRWLock(&lock);
+
+		HMODULE kernelbase = GetModuleHandleA("kernelbase.dll");
+		if (kernelbase)
+		{
+			virtualAlloc2 = (VirtualAlloc2Func)GetProcAddress(kernelbase, "VirtualAlloc2");
+			mapViewOfFile3 = (MapViewOfFile3Func)GetProcAddress(kernelbase, "MapViewOfFile3");
+		}
+	}
+};
+
+static RingRegionPool Pool;
+
+// regions released on this thread, reused without taking the pool lock. They
+// still count as pooled and go back to the shared pool when the thread exits.
+struct RingRegionCache
+{
+	RingRegion regions[ThreadCachedRegions];
+	int count;
+
+	RingRegionCache() :
+		regions(), count(0)
+	{
+	}
+
+	~RingRegionCache()
+	{
+		if (count == 0) return;
+
+		AcquireSRWLockExclusive(&Pool.lock);
+		while (count > 0)
+			Pool.regions.push_back(regions[--count]);
+		ReleaseSRWLockExclusive(&Pool.lock);
+	}
+};
+
+static thread_local RingRegionCache Cache;
+
+static bool CreateMirroredRegion(size_t capacity, RingRegion *region)
+{
+	if (!Pool.virtualAlloc2 || !Pool.mapViewOfFile3)
+		return false;
+
+	// reserve twice the size and split the reservation into two placeholders
+	char *placeholder = (char *)Pool.virtualAlloc2(NULL, NULL, capacity * 2,
+		MEM_RESERVE | MEM_RESERVE_PLACEHOLDER, PAGE_NOACCESS, NULL, 0);
+	if (!placeholder)
+		return false;
+
+	if (!VirtualFree(placeholder, capacity, MEM_RELEASE | MEM_PRESERVE_PLACEHOLDER))
+	{
+		VirtualFree(placeholder, 0, MEM_RELEASE);
+		return false;
+	}
+
+	HANDLE section = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE,
+		(DWORD)((ULONG64)capacity >> 32), (DWORD)capacity, NULL);
+	if (!section)
+	{
+		VirtualFree(placeholder, 0, MEM_RELEASE);
+		VirtualFree(placeholder + capacity, 0, MEM_RELEASE);
+		return false;
+	}
+
+	// map the same pages into both halves
+	void *first = Pool.mapViewOfFile3(section, NULL, placeholder, 0, capacity,
+		MEM_REPLACE_PLACEHOLDER, PAGE_READWRITE, NULL, 0);
+	void *second = first ? Pool.mapViewOfFile3(section, NULL, placeholder + capacity, 0, capacity,
+		MEM_REPLACE_PLACEHOLDER, PAGE_READWRITE, NULL, 0) : nullptr;
+
+	// the views keep the section alive
+	CloseHandle(section);
+
+	if (!second)
+	{
+		if (first)
+			UnmapViewOfFile(first);
+		else
+			VirtualFree(placeholder, 0, MEM_RELEASE);
+		VirtualFree(placeholder + capacity, 0, MEM_RELEASE);
+		return false;
+	}
+
+	region->base = placeholder;
+	region->capacity = capacity;
+	region->mirrored = true;
+	return true;
+}
+
+static bool CreateRegion(size_t capacity, RingRegion *region)
+{
+	capacity = (capacity + DefaultCapacity - 1) / DefaultCapacity * DefaultCapacity;
+
+	if (!CreateMirroredRegion(capacity, region))
+	{
+		region->base = (char *)VirtualAlloc(NULL, capacity, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+		if (!region->base)
+			return false;
+
+		region->capacity = capacity;
+		region->mirrored = false;
+	}
+
+	InterlockedIncrement(&Pool.active);
+	return true;
+}
+
+static void DestroyRegion(const RingRegion &region)
+{
+	if (region.mirrored)
+	{
+		UnmapViewOfFile(region.base);
+		UnmapViewOfFile(region.base + region.capacity);
+	}
+	else
+		VirtualFree(region.base, 0, MEM_RELEASE);
+}
+
+static bool AcquireRegion(size_t capacity, RingRegion *region)
+{
+	if (capacity <= DefaultCapacity)
+	{
+		if (Cache.count > 0)
+		{
+			*region = Cache.regions[--Cache.count];
+
+			InterlockedDecrement(&Pool.pooled);
+			InterlockedIncrement(&Pool.active);
+			return true;
+		}
+
+		AcquireSRWLockExclusive(&Pool.lock);
+		if (!Pool.regions.empty())
+		{
+			*region = Pool.regions.back();
+			Pool.regions.pop_back();
+			ReleaseSRWLockExclusive(&Pool.lock);
+
+			InterlockedDecrement(&Pool.pooled);
+			InterlockedIncrement(&Pool.active);
+			return true;
+		}
+		ReleaseSRWLockExclusive(&Pool.lock);
+
+		capacity = DefaultCapacity;
+	}
+
+	return CreateRegion(capacity, region);
+}
+
+static void ReleaseRegion(const RingRegion &region)
+{
+	InterlockedDecrement(&Pool.active);
+
+	if (region.capacity == DefaultCapacity)
+	{
+		if (Cache.count < ThreadCachedRegions)
+		{
+			Cache.regions[Cache.count++] = region;
+			InterlockedIncrement(&Pool.pooled);
+			return;
+		}
+
+		AcquireSRWLockExclusive(&Pool.lock);
+		if (Pool.regions.size() < MaxPooledRegions)
+		{
+			Pool.regions.push_back(region);
+			ReleaseSRWLockExclusive(&Pool.lock);
+
+			InterlockedIncrement(&Pool.pooled);
+			return;
+		}
+		ReleaseSRWLockExclusive(&Pool.lock);
+	}
+
+	DestroyRegion(region);
+}
+
+RingBuffer::RingBuffer() :
+	m_head(0), m_size(0)
+{
+	m_region.base = nullptr;
+	m_region.capacity = 0;
+	m_region.mirrored = false;
+}
+
+RingBuffer::~RingBuffer()
+{
+	if (m_region.base)
+		ReleaseRegion(m_region);
+}
+
+bool RingBuffer::Grow(size_t required)
+{
+	size_t capacity = m_region.capacity * 2;
+	if (capacity < required)
+		capacity = required;
+
+	RingRegion region;
+	if (!AcquireRegion(capacity, &region))
+		return false;
+
+	if (m_region.base)
+	{
+		memcpy(region.base, GetElements(), m_size);
+		ReleaseRegion(m_region);
+	}
+
+	m_region = region;
+	m_head = 0;
+	return true;
+}
+
+char *RingBuffer::Reserve(size_t len)
+{
+	if (m_size + len > m_region.capacity && !Grow(m_size + len))
+		return nullptr;
+
+	if (m_region.mirrored)
+	{
+		// the mirror makes the free space contiguous wherever it starts
+		return m_region.base + (m_head + m_size) % m_region.capacity;
+	}
+
+	if (m_head + m_size + len > m_region.capacity)
+	{
+		// only the unconsumed rest of the data is moved, and only when it blocks a write
+		memmove(m_region.base, m_region.base + m_head, m_size);
+		m_head = 0;
+	}
+
+	return m_region.base + m_head + m_size;
+}
+
+bool RingBuffer::Append(const char *data, size_t len)
+{
+	if (len == 0) return true;
+
+	char *dest = Reserve(len);
+	if (!dest) return false;
+
+	memcpy(dest, data, len);
+	Commit(len);
+	return true;
+}
+
+void RingBuffer::Consume(size_t count)
+{
+	if (count >= m_size)
+	{
+		m_head = 0;
+		m_size = 0;
+		return;
+	}
+
+	m_head += count;
+	m_size -= count;
+
+	if (m_region.mirrored && m_head >= m_region.capacity)
+		m_head -= m_region.capacity;
+}
+
+void RingBuffer::Release()
+{
+	if (m_size > 0 || !m_region.base) return;
+
+	ReleaseRegion(m_region);
+	m_region.base = nullptr;
+	m_region.capacity = 0;
+	m_region.mirrored = false;
+	m_head = 0;
+}
+
+void GetRingBufferStatistics(RingBufferStatistics *stats)
+{
+	stats->mirrored = Pool.virtualAlloc2 && Pool.mapViewOfFile3;
+	stats->active = Pool.active;
+	stats->pooled = Pool.pooled;
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include "common.h"
+
+// memory backing a RingBuffer. A mirrored region maps the same pages twice in a
+// row, so data wrapping around the end can still be read as one contiguous block.
+struct RingRegion
+{
+	char *base;
+	size_t capacity;
+	bool mirrored;
+};
+
+struct RingBufferStatistics
+{
+	bool mirrored;  // whether the system supports mirrored regions
+	LONG active;  // regions held by connections
+	LONG pooled;  // regions waiting in the shared pool or a thread's cache
+};
+
+// Input buffer of a connection. Consumed bytes are dropped by moving the read
+// position, so leftover data is never shifted. When mirrored mappings are not
+// available data is only moved to the front if a write would not fit otherwise.
+// An empty buffer can hand its region back to a pool shared by all connections,
+// each thread caches a few regions in front of it.
+class RingBuffer
+{
+private:
+	RingRegion m_region;
+	size_t m_head;  // offset of the first unread byte
+	size_t m_size;
+
+	bool Grow(size_t required);
+public:
+	RingBuffer();
+	~RingBuffer();
+
+	RingBuffer(const RingBuffer &) = delete;
+
+	// all buffered bytes as one contiguous block, valid until the next write
+	inline char *GetElements() const
+	{
+		return m_region.base + m_head;
+	}
+
+	constexpr size_t Size() const
+	{
+		return m_size;
+	}
+
+	// returns at least len contiguous writable bytes after the buffered data,
+	// nullptr if no memory could be allocated. Call Commit with the number written.
+	char *Reserve(size_t len);
+
+	inline void Commit(size_t len)
+	{
+		m_size += len;
+	}
+
+	bool Append(const char *data, size_t len);
+
+	// drops count bytes from the front
+	void Consume(size_t count);
+
+	// gives the region back to the shared pool if nothing is buffered
+	void Release();
+};
+
+void GetRingBufferStatistics(RingBufferStatistics *stats);
@@ -0,0 +1,92 @@
+#include "rio_transport.h"
+
+bool LoadRegisteredIO(SOCKET socket, RIO_EXTENSION_FUNCTION_TABLE *table)
+{
+	GUID rioId = WSAID_MULTIPLE_RIO;
+	DWORD bytes;
+
+	memset(table, 0, sizeof(RIO_EXTENSION_FUNCTION_TABLE));
+	table->cbSize = sizeof(RIO_EXTENSION_FUNCTION_TABLE);
+
+	return WSAIoctl(socket, SIO_GET_MULTIPLE_EXTENSION_FUNCTION_POINTER, &rioId, sizeof(rioId),
+		table, sizeof(RIO_EXTENSION_FUNCTION_TABLE), &bytes, NULL, NULL) != SOCKET_ERROR;
+}
+
+RIOBufferPool::RIOBufferPool() :
+	m_rio(nullptr), m_memory(nullptr), m_id(RIO_INVALID_BUFFERID), m_slotSize(0), m_slotCount(0),
+	m_free(nullptr), m_freeCount(0)
+{
+	InitializeSRWLock(&m_lock);
+}
+
+RIOBufferPool::~RIOBufferPool()
+{
+	Destroy();
+}
+
+bool RIOBufferPool::Create(const RIO_EXTENSION_FUNCTION_TABLE *rio, ULONG slotSize, int slotCount)
+{
+	if (m_memory || slotSize == 0 || slotCount <= 0) return false;
+
+	size_t total = (size_t)slotSize * slotCount;
+	if (total > MAXDWORD) return false;
+
+	m_memory = (char *)VirtualAlloc(NULL, total, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+	if (!m_memory) return false;
+
+	m_id = rio->RIORegisterBuffer(m_memory, (DWORD)total);
+	if (m_id == RIO_INVALID_BUFFERID)
+	{
+		VirtualFree(m_memory, 0, MEM_RELEASE);
+		m_memory = nullptr;
+		return false;
+	}
+
+	m_rio = rio;
+	m_slotSize = slotSize;
+	m_slotCount = slotCount;
+
+	m_free = new int[slotCount];
+	for (int i = 0; i < slotCount; i++)
+		m_free[i] = slotCount - i - 1;
+	m_freeCount = slotCount;
+
+	return true;
+}
+
+void RIOBufferPool::Destroy()
+{
+	if (!m_memory) return;
+
+	m_rio->RIODeregisterBuffer(m_id);
+	m_id = RIO_INVALID_BUFFERID;
+
+	VirtualFree(m_memory, 0, MEM_RELEASE);
+	m_memory = nullptr;
+
+	delete[] m_free;
+	m_free = nullptr;
+	m_freeCount = 0;
+	m_slotCount = 0;
+}
+
+int RIOBufferPool::Acquire()
+{
+	int slot = -1;
+
+	AcquireSRWLockExclusive(&m_lock);
+	if (m_freeCount > 0)
+		slot = m_free[--m_freeCount];
+	ReleaseSRWLockExclusive(&m_lock);
+
+	return slot;
+}
+
+void RIOBufferPool::Release(int slot)
+{
+	if (slot < 0) return;
+
+	AcquireSRWLockExclusive(&m_lock);
+	m_free[m_freeCount++] = slot;
+	ReleaseSRWLockExclusive(&m_lock);
+}
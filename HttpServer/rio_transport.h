@@ -0,0 +1,66 @@
+#pragma once
+
+#include "common.h"
+
+#include <MSWSock.h>
+
+// loads the registered I/O extension functions through any socket
+bool LoadRegisteredIO(SOCKET socket, RIO_EXTENSION_FUNCTION_TABLE *table);
+
+// A single registered memory region carved into fixed size slots. Registration
+// is expensive so it is done once and slots are handed out to connections.
+class RIOBufferPool
+{
+private:
+	const RIO_EXTENSION_FUNCTION_TABLE *m_rio;
+	char *m_memory;
+	RIO_BUFFERID m_id;
+
+	ULONG m_slotSize;
+	int m_slotCount;
+
+	int *m_free;
+	int m_freeCount;
+	SRWLOCK m_lock;
+public:
+	RIOBufferPool();
+	~RIOBufferPool();
+
+	RIOBufferPool(const RIOBufferPool &) = delete;
+
+	bool Create(const RIO_EXTENSION_FUNCTION_TABLE *rio, ULONG slotSize, int slotCount);
+	void Destroy();
+
+	// returns -1 if the pool is exhausted
+	int Acquire();
+	void Release(int slot);
+
+	inline char *GetSlot(int slot) const
+	{
+		return m_memory + (size_t)slot * m_slotSize;
+	}
+
+	inline RIO_BUF Describe(int slot, ULONG length) const
+	{
+		RIO_BUF buf;
+		buf.BufferId = m_id;
+		buf.Offset = (ULONG)slot * m_slotSize;
+		buf.Length = length;
+		return buf;
+	}
+
+	constexpr ULONG GetSlotSize() const
+	{
+		return m_slotSize;
+	}
+
+	constexpr int GetSlotCount() const
+	{
+		return m_slotCount;
+	}
+
+	inline int GetAvailable() const
+	{
+		return m_freeCount;
+	}
+};
@@ -1,6 +1,6 @@
 #include "server.h"
 
-Server::Server() : m_server(INVALID_SOCKET), m_mutex(NULL)
+Server::Server() : m_server(INVALID_SOCKET), m_family(0), m_mutex(NULL)
 {
 	m_mutex = CreateMutexA(0, FALSE, NULL);
 }
@@ -113,6 +113,7 @@ bool Server::Open(USHORT port, int family)
 	}
 
 	m_server = server;
+	m_family = family;
 
 	ReleaseMutex(m_mutex);
 	return true;
@@ -6,6 +6,7 @@ class Server
 {
 private:
 	SOCKET m_server;
+	int m_family;
 	HANDLE m_mutex;
 public:
 	Server();
@@ -15,4 +16,14 @@ public:
 	void Close();
 
 	ClientConnection *Accept();
+
+	constexpr SOCKET GetSocket() const
+	{
+		return m_server;
+	}
+
+	constexpr int GetFamily() const
+	{
+		return m_family;
+	}
 };
\ No newline at end of file
@@ -0,0 +1,303 @@
+#include "simd_scan.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <intrin.h>
+
+#include "common.h"
+
+typedef size_t (*FindAnyOfFunc)(const char *data, size_t len, const char *set, int setlen);
+typedef size_t (*FindAnyInRangesFunc)(const char *data, size_t len, const char *ranges, int rangeslen);
+
+struct ScanKernels
+{
+	int level;
+	FindAnyOfFunc findAnyOf;
+	FindAnyInRangesFunc findAnyInRanges;
+};
+
+static size_t FindAnyOfScalar(const char *data, size_t len, const char *set, int setlen)
+{
+	for (size_t i = 0; i < len; i++)
+	{
+		for (int j = 0; j < setlen; j++)
+		{
+			if (data[i] == set[j])
+				return i;
+		}
+	}
+	return len;
+}
+
+static size_t FindAnyInRangesScalar(const char *data, size_t len, const char *ranges, int rangeslen)
+{
+	for (size_t i = 0; i < len; i++)
+	{
+		unsigned char c = (unsigned char)data[i];
+		for (int j = 0; j + 1 < rangeslen; j += 2)
+		{
+			if (c >= (unsigned char)ranges[j] && c <= (unsigned char)ranges[j + 1])
+				return i;
+		}
+	}
+	return len;
+}
+
+// the needle operand of pcmpestri is always loaded as 16 bytes
+static inline __m128i LoadNeedles(const char *set, int setlen)
+{
+	char needles[16] = { 0 };
+	memcpy(needles, set, setlen);
+	return _mm_loadu_si128((const __m128i *)needles);
+}
+
+static size_t FindAnyOfSSE42(const char *data, size_t len, const char *set, int setlen)
+{
+	const __m128i needles = LoadNeedles(set, setlen);
+
+	size_t i = 0;
+	for (; i + 16 <= len; i += 16)
+	{
+		__m128i block = _mm_loadu_si128((const __m128i *)(data + i));
+		int index = _mm_cmpestri(needles, setlen, block, 16, _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY | _SIDD_LEAST_SIGNIFICANT);
+		if (index < 16)
+			return i + index;
+	}
+
+	return i + FindAnyOfScalar(data + i, len - i, set, setlen);
+}
+
+static size_t FindAnyInRangesSSE42(const char *data, size_t len, const char *ranges, int rangeslen)
+{
+	const __m128i needles = LoadNeedles(ranges, rangeslen);
+
+	size_t i = 0;
+	for (; i + 16 <= len; i += 16)
+	{
+		__m128i block = _mm_loadu_si128((const __m128i *)(data + i));
+		int index = _mm_cmpestri(needles, rangeslen, block, 16, _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES | _SIDD_LEAST_SIGNIFICANT);
+		if (index < 16)
+			return i + index;
+	}
+
+	return i + FindAnyInRangesScalar(data + i, len - i, ranges, rangeslen);
+}
+
+static size_t FindAnyOfAVX2(const char *data, size_t len, const char *set, int setlen)
+{
+	__m256i needles[16];
+	for (int j = 0; j < setlen; j++)
+		needles[j] = _mm256_set1_epi8(set[j]);
+
+	size_t i = 0;
+	for (; i + 32 <= len; i += 32)
+	{
+		__m256i block = _mm256_loadu_si256((const __m256i *)(data + i));
+
+		__m256i matches = _mm256_cmpeq_epi8(block, needles[0]);
+		for (int j = 1; j < setlen; j++)
+			matches = _mm256_or_si256(matches, _mm256_cmpeq_epi8(block, needles[j]));
+
+		unsigned long mask = (unsigned long)(unsigned int)_mm256_movemask_epi8(matches);
+		unsigned long index;
+		if (_BitScanForward(&index, mask))
+			return i + index;
+	}
+
+	return i + FindAnyOfScalar(data + i, len - i, set, setlen);
+}
+
+static size_t FindAnyInRangesAVX2(const char *data, size_t len, const char *ranges, int rangeslen)
+{
+	__m256i lower[8], upper[8];
+	int pairs = rangeslen / 2;
+	for (int j = 0; j < pairs; j++)
+	{
+		lower[j] = _mm256_set1_epi8(ranges[j * 2]);
+		upper[j] = _mm256_set1_epi8(ranges[j * 2 + 1]);
+	}
+
+	size_t i = 0;
+	for (; i + 32 <= len; i += 32)
+	{
+		__m256i block = _mm256_loadu_si256((const __m256i *)(data + i));
+
+		// unsigned lower <= c <= upper, there is no unsigned byte compare
+		__m256i matches = _mm256_setzero_si256();
+		for (int j = 0; j < pairs; j++)
+		{
+			__m256i above = _mm256_cmpeq_epi8(_mm256_max_epu8(block, lower[j]), block);
+			__m256i below = _mm256_cmpeq_epi8(_mm256_min_epu8(block, upper[j]), block);
+			matches = _mm256_or_si256(matches, _mm256_and_si256(above, below));
+		}
+
+		unsigned long mask = (unsigned long)(unsigned int)_mm256_movemask_epi8(matches);
+		unsigned long index;
+		if (_BitScanForward(&index, mask))
+			return i + index;
+	}
+
+	return i + FindAnyInRangesScalar(data + i, len - i, ranges, rangeslen);
+}
+
+static int DetectScanLevel()
+{
+	int info[4];
+
+	__cpuid(info, 0);
+	int maxLeaf = info[0];
+
+	__cpuid(info, 1);
+	bool sse42 = (info[2] & (1 << 20)) != 0;
+	bool osxsave = (info[2] & (1 << 27)) != 0;
+
+	// AVX2 also needs the OS to save the upper halves of the registers
+	bool avx2 = false;
+	if (maxLeaf >= 7 && osxsave && (_xgetbv(0) & 6) == 6)
+	{
+		__cpuidex(info, 7, 0);
+		avx2 = (info[1] & (1 << 5)) != 0;
+	}
+
+	if (avx2) return SCAN_AVX2;
+	if (sse42) return SCAN_SSE42;
+	return SCAN_SCALAR;
+}
+
+static ScanKernels GetKernels(int level)
+{
+	switch (level)
+	{
+	case SCAN_AVX2:
+		return { SCAN_AVX2, &FindAnyOfAVX2, &FindAnyInRangesAVX2 };
+	case SCAN_SSE42:
+		return { SCAN_SSE42, &FindAnyOfSSE42, &FindAnyInRangesSSE42 };
+	default:
+		return { SCAN_SCALAR, &FindAnyOfScalar, &FindAnyInRangesScalar };
+	}
+}
+
+static const ScanKernels Kernels = GetKernels(DetectScanLevel());
+
+size_t FindAnyOf(const char *data, size_t len, const char *set, int setlen)
+{
+	return Kernels.findAnyOf(data, len, set, setlen);
+}
+
+size_t FindAnyInRanges(const char *data, size_t len, const char *ranges, int rangeslen)
+{
+	return Kernels.findAnyInRanges(data, len, ranges, rangeslen);
+}
+
+int GetScanLevel()
+{
+	return Kernels.level;
+}
+
+const char *GetScanLevelString(int level)
+{
+	switch (level)
+	{
+	case SCAN_SCALAR:
+		return "SCALAR";
+	case SCAN_SSE42:
+		return "SSE4.2";
+	case SCAN_AVX2:
+		return "AVX2";
+	default:
+		return "UNKN";
+	}
+}
+
+static constexpr char BenchmarkRequest[] =
+"GET /images/banner.gif?size=large&theme=dark#top HTTP/1.1\r\n"
+"Host: localhost\r\n"
+"Connection: keep-alive\r\n"
+"sec-ch-ua: \"Chromium\";v=\"110\", \"Not A(Brand\";v=\"24\", \"Google Chrome\";v=\"110\"\r\n"
+"sec-ch-ua-mobile: ?0\r\n"
+"User-Agent: Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/110.0.0.0 Safari/537.36\r\n"
+"sec-ch-ua-platform: \"Windows\"\r\n"
+"Accept: image/avif,image/webp,image/apng,image/svg+xml,image/*,*/*;q=0.8\r\n"
+"Sec-Fetch-Site: same-origin\r\n"
+"Sec-Fetch-Mode: no-cors\r\n"
+"Sec-Fetch-Dest: image\r\n"
+"Referer: http://localhost/index.html\r\n"
+"Accept-Encoding: gzip, deflate, br\r\n"
+"Accept-Language: en-US,en;q=0.9\r\n"
+"Cookie: session=4f2a9c81d07b3e65; theme=dark; consent=yes\r\n"
+"\r\n";
+
+static constexpr int BenchmarkRounds = 200000;
+
+// walks the whole request stopping at every match, like a parser would
+static double MeasureFindAnyOf(FindAnyOfFunc func, const char *set, int setlen)
+{
+	const size_t len = sizeof(BenchmarkRequest) - 1;
+	volatile size_t sink = 0;
+
+	LARGE_INTEGER frequency, start, end;
+	QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&start);
+
+	for (int round = 0; round < BenchmarkRounds; round++)
+	{
+		size_t pos = 0;
+		while (pos < len)
+		{
+			pos += func(BenchmarkRequest + pos, len - pos, set, setlen) + 1;
+			sink = sink + pos;
+		}
+	}
+
+	QueryPerformanceCounter(&end);
+
+	double seconds = (double)(end.QuadPart - start.QuadPart) / frequency.QuadPart;
+	return (double)len * BenchmarkRounds / seconds / 1e9;
+}
+
+static double MeasureFindAnyInRanges(FindAnyInRangesFunc func, const char *ranges, int rangeslen)
+{
+	const size_t len = sizeof(BenchmarkRequest) - 1;
+	volatile size_t sink = 0;
+
+	LARGE_INTEGER frequency, start, end;
+	QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&start);
+
+	for (int round = 0; round < BenchmarkRounds; round++)
+	{
+		size_t pos = 0;
+		while (pos < len)
+		{
+			pos += func(BenchmarkRequest + pos, len - pos, ranges, rangeslen) + 1;
+			sink = sink + pos;
+		}
+	}
+
+	QueryPerformanceCounter(&end);
+
+	double seconds = (double)(end.QuadPart - start.QuadPart) / frequency.QuadPart;
+	return (double)len * BenchmarkRounds / seconds / 1e9;
+}
+
+void BenchmarkScanning()
+{
+	static constexpr char LineBreaks[] = "\r\n";
+	static constexpr char URIDelimiters[] = "?#&=";
+	static constexpr char ControlRanges[] = "\x00\x08\x0a\x1f\x7f\x7f";
+
+	const int detected = DetectScanLevel();
+
+	printf("Scanning %zu byte request head %d times, selected %s\n",
+		sizeof(BenchmarkRequest) - 1, BenchmarkRounds, GetScanLevelString(Kernels.level));
+	printf("%-10s %-14s %-14s %-14s\n", "[Kernel]", "[CR/LF GB/s]", "[?#&= GB/s]", "[Ctl GB/s]");
+
+	for (int level = SCAN_SCALAR; level <= detected; level++)
+	{
+		ScanKernels kernels = GetKernels(level);
+		printf("%-10s %-14.2f %-14.2f %-14.2f\n", GetScanLevelString(level),
+			MeasureFindAnyOf(kernels.findAnyOf, LineBreaks, sizeof(LineBreaks) - 1),
+			MeasureFindAnyOf(kernels.findAnyOf, URIDelimiters, sizeof(URIDelimiters) - 1),
+			MeasureFindAnyInRanges(kernels.findAnyInRanges, ControlRanges, sizeof(ControlRanges) - 1));
+	}
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stddef.h>
+
+enum
+{
+	SCAN_SCALAR = 0,
+	SCAN_SSE42,
+	SCAN_AVX2
+};
+
+// returns the index of the first byte of data which equals one of the setlen bytes
+// in set, or len if there is none. At most 16 bytes may be searched for at once.
+size_t FindAnyOf(const char *data, size_t len, const char *set, int setlen);
+
+// returns the index of the first byte of data inside one of the inclusive ranges, or
+// len if there is none. ranges holds pairs of lower and upper bounds, at most 8 pairs.
+size_t FindAnyInRanges(const char *data, size_t len, const char *ranges, int rangeslen);
+
+// the instruction set the scanning functions were selected for on this processor
+int GetScanLevel();
+const char *GetScanLevelString(int level);
+
+// measures every kernel the processor supports on a typical request head and
+// prints the throughput
+void BenchmarkScanning();
@@ -134,7 +134,8 @@ public:
 
 	inline void ShiftBack(size_t count)
 	{
-		memcpy(m_buf, m_buf + count, m_length - count);
+		// the ranges overlap
+		memmove(m_buf, m_buf + count, (m_length - count) * sizeof(_CharT));
 		m_length -= count;
 	}
 
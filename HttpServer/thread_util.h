@@ -0,0 +1,35 @@
+#pragma once
+
+#include "common.h"
+
+// number of logical processors available to the process
+inline int GetProcessorCount()
+{
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return (int)info.dwNumberOfProcessors;
+}
+
+// small number identifying the calling thread, handed out in the order threads
+// first ask. Spreads threads over per-thread structures like lock stripes.
+inline int GetThreadIndex()
+{
+	static volatile LONG next;
+	static thread_local LONG index = -1;
+
+	if (index < 0)
+		index = InterlockedIncrement(&next) & MAXLONG;
+	return (int)index;
+}
+
+// restricts a thread to a single logical processor, index wraps around the
+// processor count. Only processors in the first processor group are used.
+inline bool PinThread(HANDLE thread, int index)
+{
+	int processors = GetProcessorCount();
+	if (processors > (int)sizeof(DWORD_PTR) * 8)
+		processors = (int)sizeof(DWORD_PTR) * 8;
+
+	DWORD_PTR mask = (DWORD_PTR)1 << (index % processors);
+	return SetThreadAffinityMask(thread, mask) != 0;
+}
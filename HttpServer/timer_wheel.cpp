@@ -0,0 +1,226 @@
+#include "timer_wheel.h"
+
+#include <stdio.h>
+
+#include "thread_util.h"
+
+DWORD TimerWheel::TimerWorker(__in TimerWheel *wheel)
+{
+	while (WaitForSingleObject(wheel->m_stop, wheel->m_tickLength) == WAIT_TIMEOUT)
+	{
+		// catch up on every tick since the last wakeup, a late thread fires in order
+		const ULONGLONG until = GetTickCount64() / wheel->m_tickLength;
+		for (int i = 0; i < wheel->m_shardCount; i++)
+			wheel->Advance(wheel->m_shards[i], until);
+	}
+
+	return 0;
+}
+
+TimerWheel::TimerWheel(DWORD tickLength) :
+	m_shards(nullptr), m_shardCount(GetProcessorCount()), m_tickLength(tickLength > 0 ? tickLength : 1),
+	m_thread(NULL), m_stop(NULL)
+{
+	if (m_shardCount < 1)
+		m_shardCount = 1;
+
+	const ULONGLONG now = GetTickCount64() / m_tickLength;
+
+	m_shards = new Shard[m_shardCount];
+	for (int i = 0; i < m_shardCount; i++)
+	{
+		Shard &shard = m_shards[i];
+		memset(shard.slots, 0, sizeof(shard.slots));
+		shard.now = now;
+		InitializeSRWLock(&shard.lock);
+		InitializeConditionVariable(&shard.finished);
+		shard.running = nullptr;
+		shard.armed = 0;
+		shard.expired = 0;
+	}
+}
+
+TimerWheel::~TimerWheel()
+{
+	Stop();
+	delete[] m_shards;
+}
+
+bool TimerWheel::Start()
+{
+	if (m_thread) return false;
+
+	m_stop = CreateEventA(NULL, TRUE, FALSE, NULL);
+	if (!m_stop)
+		return false;
+
+	m_thread = CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE)&TimerWorker, this, 0, NULL);
+	if (!m_thread)
+	{
+		printf("ERROR> Failed to start timer thread\n");
+		CloseHandle(m_stop);
+		m_stop = NULL;
+		return false;
+	}
+
+	return true;
+}
+
+void TimerWheel::Stop()
+{
+	if (!m_thread) return;
+
+	SetEvent(m_stop);
+	WaitForSingleObject(m_thread, INFINITE);
+
+	CloseHandle(m_thread);
+	m_thread = NULL;
+	CloseHandle(m_stop);
+	m_stop = NULL;
+}
+
+void TimerWheel::Arm(Timer *timer, DWORD milliseconds)
+{
+	ULONGLONG ticks = (milliseconds + m_tickLength - 1) / m_tickLength;
+
+	if (timer->shard < 0)
+		timer->shard = GetThreadIndex() % m_shardCount;
+
+	Shard &shard = m_shards[timer->shard];
+	AcquireSRWLockExclusive(&shard.lock);
+
+	if (timer->IsArmed())
+		Unlink(timer);
+	else
+		shard.armed++;
+
+	// a timer never fires on the tick it was armed in
+	timer->expires = shard.now + (ticks > 0 ? ticks : 1);
+	Insert(shard, timer);
+
+	ReleaseSRWLockExclusive(&shard.lock);
+}
+
+void TimerWheel::Cancel(Timer *timer)
+{
+	if (timer->shard < 0) return;
+
+	Shard &shard = m_shards[timer->shard];
+	AcquireSRWLockExclusive(&shard.lock);
+
+	if (timer->IsArmed())
+	{
+		Unlink(timer);
+		shard.armed--;
+	}
+
+	while (shard.running == timer)
+		SleepConditionVariableSRW(&shard.finished, &shard.lock, INFINITE, 0);
+
+	ReleaseSRWLockExclusive(&shard.lock);
+}
+
+void TimerWheel::GetStatistics(TimerStatistics *stats) const
+{
+	stats->armed = 0;
+	stats->expired = 0;
+
+	for (int i = 0; i < m_shardCount; i++)
+	{
+		stats->armed += m_shards[i].armed;
+		stats->expired += m_shards[i].expired;
+	}
+}
+
+void TimerWheel::Insert(Shard &shard, Timer *timer)
+{
+	static constexpr ULONGLONG MaxDelta = (1ull << (LevelBits * LevelCount)) - 1;
+
+	// longer timeouts than the wheel spans are cut short, at 100 ms per tick it
+	// covers about 19 days
+	if (timer->expires - shard.now > MaxDelta)
+		timer->expires = shard.now + MaxDelta;
+
+	const ULONGLONG delta = timer->expires - shard.now;
+
+	int level = 0;
+	while (level < LevelCount - 1 && delta >= (1ull << (LevelBits * (level + 1))))
+		level++;
+
+	Timer **slot = &shard.slots[level][(timer->expires >> (LevelBits * level)) & (SlotCount - 1)];
+
+	timer->prev = nullptr;
+	timer->next = *slot;
+	if (*slot)
+		(*slot)->prev = timer;
+	*slot = timer;
+	timer->slot = slot;
+}
+
+void TimerWheel::Unlink(Timer *timer)
+{
+	if (timer->prev)
+		timer->prev->next = timer->next;
+	else
+		*timer->slot = timer->next;
+	if (timer->next)
+		timer->next->prev = timer->prev;
+
+	timer->prev = nullptr;
+	timer->next = nullptr;
+	timer->slot = nullptr;
+}
+
+void TimerWheel::Cascade(Shard &shard, int level)
+{
+	const int index = (int)((shard.now >> (LevelBits * level)) & (SlotCount - 1));
+
+	// the level above turns first, its timers may land in the slot moved here
+	if (index == 0 && level < LevelCount - 1)
+		Cascade(shard, level + 1);
+
+	Timer *timer = shard.slots[level][index];
+	shard.slots[level][index] = nullptr;
+
+	while (timer)
+	{
+		Timer *next = timer->next;
+		Insert(shard, timer);
+		timer = next;
+	}
+}
+
+void TimerWheel::Advance(Shard &shard, ULONGLONG until)
+{
+	AcquireSRWLockExclusive(&shard.lock);
+
+	while (shard.now < until)
+	{
+		shard.now++;
+
+		const int index = (int)(shard.now & (SlotCount - 1));
+		if (index == 0)
+			Cascade(shard, 1);
+
+		// the slot is read again after every callback, as timers in it may have
+		// been cancelled meanwhile. Timers armed meanwhile expire in later slots.
+		Timer *timer;
+		while ((timer = shard.slots[0][index]) != nullptr)
+		{
+			Unlink(timer);
+			shard.armed--;
+			shard.expired++;
+
+			shard.running = timer;
+			ReleaseSRWLockExclusive(&shard.lock);
+
+			timer->callback(timer->context);
+
+			AcquireSRWLockExclusive(&shard.lock);
+			shard.running = nullptr;
+			WakeAllConditionVariable(&shard.finished);
+		}
+	}
+
+	ReleaseSRWLockExclusive(&shard.lock);
+}
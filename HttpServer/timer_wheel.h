@@ -0,0 +1,99 @@
+#pragma once
+
+#include "common.h"
+
+typedef void (*TimerCallback)(void *context);
+
+// A timer is owned by the object it belongs to and linked into the wheel while
+// armed, so arming and cancelling never allocate.
+struct Timer
+{
+	Timer *prev;
+	Timer *next;
+	Timer **slot;  // list the timer is linked into, nullptr while not armed
+	ULONGLONG expires;  // in ticks
+	int shard;  // chosen by the thread arming it first, -1 until then
+
+	TimerCallback callback;
+	void *context;
+
+	inline Timer(TimerCallback callback, void *context) :
+		prev(nullptr), next(nullptr), slot(nullptr), expires(0), shard(-1), callback(callback), context(context) { }
+
+	Timer(const Timer &) = delete;
+
+	constexpr bool IsArmed() const
+	{
+		return slot != nullptr;
+	}
+};
+
+struct TimerStatistics
+{
+	LONG armed;
+	LONGLONG expired;
+};
+
+// Hierarchical timing wheel. Each level has 64 slots covering 64 times the span
+// of the level below, a timer is placed on the lowest level whose span reaches
+// its expiry and moves down a level each time the wheel turns past its slot.
+// Arming and cancelling are constant time and a tick only touches one slot
+// per level.
+//
+// There is a wheel with its own lock per processor. A timer stays with the
+// wheel of the thread which armed it first, so threads rearming their own
+// connections' timers rarely meet on a lock.
+//
+// Callbacks run on the wheel's thread without the lock held. Cancel waits for
+// a running callback, so once it returns the callback is not running and won't
+// run. Callbacks must not call back into the wheel.
+class TimerWheel
+{
+private:
+	static constexpr int LevelBits = 6;
+	static constexpr int SlotCount = 1 << LevelBits;
+	static constexpr int LevelCount = 4;
+
+	struct alignas(64) Shard
+	{
+		Timer *slots[LevelCount][SlotCount];
+		ULONGLONG now;  // last tick handled
+
+		SRWLOCK lock;
+		CONDITION_VARIABLE finished;  // signalled after each callback
+		Timer *running;  // timer whose callback is running
+
+		LONG armed;
+		LONGLONG expired;
+	};
+
+	static DWORD TimerWorker(__in TimerWheel *wheel);
+private:
+	Shard *m_shards;
+	int m_shardCount;
+	DWORD m_tickLength;  // in milliseconds
+
+	HANDLE m_thread;
+	HANDLE m_stop;
+
+	void Insert(Shard &shard, Timer *timer);
+	void Unlink(Timer *timer);
+	void Cascade(Shard &shard, int level);
+	void Advance(Shard &shard, ULONGLONG until);
+public:
+	TimerWheel(DWORD tickLength);
+	~TimerWheel();
+
+	TimerWheel(const TimerWheel &) = delete;
+
+	bool Start();
+	void Stop();
+
+	// (re)arms the timer to fire after at least the given number of milliseconds,
+	// rounded up to the tick length
+	void Arm(Timer *timer, DWORD milliseconds);
+
+	void Cancel(Timer *timer);
+
+	void GetStatistics(TimerStatistics *stats) const;
+};
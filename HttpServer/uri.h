@@ -4,6 +4,8 @@
 #include <unordered_map>
 #include <strutil/cpp_string_util.h>
 
+#include "case_insensitive.h"
+
 using namespace strutil;
 
 class URI
@@ -14,7 +16,7 @@ private:
 	std::string m_host;
 	std::string m_port;
 	std::string m_path;
-	std::unordered_map<CaseInsensitiveString, std::string> m_queries;
+	CaseInsensitiveMap<std::string> m_queries;
 	std::string m_fragment;
 public:
 	inline URI() { }
@@ -42,12 +44,12 @@ public:
 		return m_path;
 	}
 
-	constexpr const std::unordered_map<CaseInsensitiveString, std::string> &GetQueries() const
+	constexpr const CaseInsensitiveMap<std::string> &GetQueries() const
 	{
 		return m_queries;
 	}
 
-	inline const std::string *FindQuery(const CaseInsensitiveString &attribute) const
+	inline const std::string *FindQuery(std::string_view attribute) const
 	{
 		auto it = m_queries.find(attribute);
 		return it == m_queries.end() ? nullptr : &it->second;
@@ -4,6 +4,7 @@
 #include <string>
 
 #include "string_builder.h"
+#include "simd_scan.h"
 
 enum
 {
@@ -59,11 +60,38 @@ inline bool BytesEqual(const char *src, int srclen, const char *test, int testle
 	return true;
 }
 
+// ASCII only comparison which ignores case, both lengths have to match
+inline bool BytesEqualIgnoreCase(const char *src, size_t srclen, const char *test, size_t testlen)
+{
+	if (srclen != testlen) return false;
+
+	for (size_t i = 0; i < srclen; i++)
+	{
+		char a = src[i], b = test[i];
+		if (a >= 'A' && a <= 'Z') a += 'a' - 'A';
+		if (b >= 'A' && b <= 'Z') b += 'a' - 'A';
+		if (a != b) return false;
+	}
+
+	return true;
+}
+
 inline int FindFirstOf(const char *src, int srclen, const char *test, int testlen)
 {
+	if (testlen <= 0) return srclen >= 0 ? 0 : -1;
+
 	int ind = 0;
 	while (srclen >= testlen)
 	{
+		// jump straight to the next candidate for the first byte
+		int skip = (int)FindAnyOf(src, srclen - testlen + 1, test, 1);
+		if (skip > srclen - testlen)
+			return -1;
+
+		src += skip;
+		srclen -= skip;
+		ind += skip;
+
 		if (BytesEqual(src, srclen, test, testlen))
 			return ind;
 
@@ -0,0 +1,289 @@
+#include "work_pool.h"
+
+#include "thread_util.h"
+
+// number of items an idle worker moves from the shared queue into its own deque
+static constexpr int BatchSize = 4;
+
+// failed searches retried without sleeping, see PoolWorker
+static constexpr int SpinAttempts = 64;
+
+static thread_local void *CurrentWorker = nullptr;
+
+WorkQueue::WorkQueue(int capacity) :
+	m_cells(nullptr), m_mask(0), m_enqueuePos(0), m_dequeuePos(0)
+{
+	LONG64 size = 2;
+	while (size < capacity)
+		size <<= 1;
+
+	m_cells = new Cell[size];
+	m_mask = size - 1;
+
+	for (LONG64 i = 0; i < size; i++)
+		m_cells[i].sequence = i;
+}
+
+WorkQueue::~WorkQueue()
+{
+	delete[] m_cells;
+}
+
+bool WorkQueue::Push(const WorkItem &item)
+{
+	Cell *cell;
+	LONG64 pos = m_enqueuePos;
+	while (true)
+	{
+		cell = &m_cells[pos & m_mask];
+		LONG64 diff = cell->sequence - pos;
+		if (diff == 0)
+		{
+			LONG64 prev = InterlockedCompareExchange64(&m_enqueuePos, pos + 1, pos);
+			if (prev == pos)
+				break;
+			pos = prev;
+		}
+		else if (diff < 0)
+			return false;  // the consumer of the previous lap has not finished
+		else
+			pos = m_enqueuePos;
+	}
+
+	cell->item = item;
+
+	// publishes the item to consumers
+	InterlockedExchange64(&cell->sequence, pos + 1);
+	return true;
+}
+
+bool WorkQueue::Pop(WorkItem *item)
+{
+	Cell *cell;
+	LONG64 pos = m_dequeuePos;
+	while (true)
+	{
+		cell = &m_cells[pos & m_mask];
+		LONG64 diff = cell->sequence - (pos + 1);
+		if (diff == 0)
+		{
+			LONG64 prev = InterlockedCompareExchange64(&m_dequeuePos, pos + 1, pos);
+			if (prev == pos)
+				break;
+			pos = prev;
+		}
+		else if (diff < 0)
+			return false;
+		else
+			pos = m_dequeuePos;
+	}
+
+	*item = cell->item;
+
+	// hands the cell back to producers for the next lap
+	InterlockedExchange64(&cell->sequence, pos + m_mask + 1);
+	return true;
+}
+
+DWORD WorkPool::PoolWorker(__in Worker *worker)
+{
+	WorkPool *pool = worker->pool;
+	WorkItem item;
+
+	CurrentWorker = worker;
+
+	while (true)
+	{
+		WaitForSingleObject(pool->m_available, INFINITE);
+
+		// every unit of the semaphore stands for an item in the queue or a deque.
+		// Items only move between deques under their locks, so a search can only miss
+		// one whose producer claimed a queue cell ahead of the published ones and
+		// hasn't filled it yet, which takes a few instructions unless it is preempted
+		int attempts = 0;
+		while (!pool->TakeWork(worker, &item))
+		{
+			if (pool->m_stopping && pool->m_pending == 0)
+				return 0;
+
+			if (attempts++ < SpinAttempts)
+				YieldProcessor();
+			else
+				Sleep(1);
+		}
+
+		InterlockedDecrement(&pool->m_pending);
+		InterlockedIncrement(&pool->m_active);
+
+		item.func(item.arg);
+
+		InterlockedDecrement(&pool->m_active);
+		InterlockedIncrement64(&pool->m_executed);
+	}
+}
+
+WorkPool::WorkPool(int queueDepth) :
+	m_queue(queueDepth), m_workers(nullptr), m_workerCount(0), m_available(NULL),
+	m_pending(0), m_active(0), m_executed(0), m_stolen(0), m_rejected(0), m_stopping(false)
+{
+}
+
+WorkPool::~WorkPool()
+{
+	Stop();
+}
+
+bool WorkPool::Start(int threads, bool pinThreads)
+{
+	if (m_workers) return false;
+
+	if (threads <= 0)
+		threads = GetProcessorCount();
+
+	m_available = CreateSemaphoreA(NULL, 0, MAXLONG, NULL);
+	if (!m_available)
+		return false;
+
+	m_stopping = false;
+
+	m_workers = new Worker[threads];
+	for (m_workerCount = 0; m_workerCount < threads; m_workerCount++)
+	{
+		Worker *worker = &m_workers[m_workerCount];
+		worker->pool = this;
+		worker->index = m_workerCount;
+		InitializeSRWLock(&worker->lock);
+
+		worker->thread = CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE)&PoolWorker, worker, CREATE_SUSPENDED, NULL);
+		if (!worker->thread)
+		{
+			Stop();
+			return false;
+		}
+
+		if (pinThreads)
+			PinThread(worker->thread, m_workerCount);
+
+		ResumeThread(worker->thread);
+	}
+
+	return true;
+}
+
+void WorkPool::Stop()
+{
+	if (!m_workers) return;
+
+	m_stopping = true;
+
+	// one extra unit per worker lets each of them observe the stop once
+	// everything submitted before has been run
+	ReleaseSemaphore(m_available, m_workerCount, NULL);
+
+	for (int i = 0; i < m_workerCount; i++)
+	{
+		WaitForSingleObject(m_workers[i].thread, INFINITE);
+		CloseHandle(m_workers[i].thread);
+	}
+
+	delete[] m_workers;
+	m_workers = nullptr;
+	m_workerCount = 0;
+
+	CloseHandle(m_available);
+	m_available = NULL;
+}
+
+bool WorkPool::Submit(WorkFunc func, void *arg)
+{
+	if (!m_workers || m_stopping) return false;
+
+	WorkItem item = { func, arg };
+
+	Worker *worker = (Worker *)CurrentWorker;
+	if (worker && worker->pool == this)
+	{
+		AcquireSRWLockExclusive(&worker->lock);
+		worker->items.push_back(item);
+		ReleaseSRWLockExclusive(&worker->lock);
+	}
+	else if (!m_queue.Push(item))
+	{
+		InterlockedIncrement64(&m_rejected);
+		return false;
+	}
+
+	InterlockedIncrement(&m_pending);
+	ReleaseSemaphore(m_available, 1, NULL);
+	return true;
+}
+
+bool WorkPool::TakeWork(Worker *worker, WorkItem *item)
+{
+	// newest local work first, it is the most likely to still be in cache
+	AcquireSRWLockExclusive(&worker->lock);
+	if (!worker->items.empty())
+	{
+		*item = worker->items.back();
+		worker->items.pop_back();
+		ReleaseSRWLockExclusive(&worker->lock);
+		return true;
+	}
+	ReleaseSRWLockExclusive(&worker->lock);
+
+	if (m_queue.Pop(item))
+	{
+		// take a few more so the next wakeups of this worker skip the shared queue,
+		// other workers steal them if this one stays busy. They are popped under the
+		// lock, so a thief searching the deques can't miss them.
+		WorkItem extra;
+		AcquireSRWLockExclusive(&worker->lock);
+		for (int i = 1; i < BatchSize && m_queue.Pop(&extra); i++)
+			worker->items.push_front(extra);
+		ReleaseSRWLockExclusive(&worker->lock);
+		return true;
+	}
+
+	// don't wait behind the owners at first, only a deque which was busy may still
+	// hold the item this worker was woken for
+	return StealWork(worker, item, false) || StealWork(worker, item, true);
+}
+
+bool WorkPool::StealWork(Worker *thief, WorkItem *item, bool wait)
+{
+	for (int i = 1; i < m_workerCount; i++)
+	{
+		Worker *victim = &m_workers[(thief->index + i) % m_workerCount];
+
+		if (wait)
+			AcquireSRWLockExclusive(&victim->lock);
+		else if (!TryAcquireSRWLockExclusive(&victim->lock))
+			continue;
+
+		bool found = !victim->items.empty();
+		if (found)
+		{
+			*item = victim->items.front();
+			victim->items.pop_front();
+		}
+		ReleaseSRWLockExclusive(&victim->lock);
+
+		if (found)
+		{
+			InterlockedIncrement64(&m_stolen);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+void WorkPool::GetStatistics(WorkPoolStatistics *stats) const
+{
+	stats->workers = m_workerCount;
+	stats->pending = m_pending;
+	stats->active = m_active;
+	stats->executed = m_executed;
+	stats->stolen = m_stolen;
+	stats->rejected = m_rejected;
+}
@@ -0,0 +1,123 @@
+#pragma once
+
+#include "common.h"
+
+#include <deque>
+
+typedef void (*WorkFunc)(void *arg);
+
+struct WorkItem
+{
+	WorkFunc func;
+	void *arg;
+};
+
+// Bounded multi-producer multi-consumer queue. Every cell carries a sequence
+// number which tells producers and consumers whether it is free for their
+// position, so pushing and popping only contend on a single compare exchange.
+class WorkQueue
+{
+private:
+	struct Cell
+	{
+		volatile LONG64 sequence;
+		WorkItem item;
+	};
+
+	Cell *m_cells;
+	LONG64 m_mask;
+
+	// keep the two positions on separate cache lines
+	char m_pad0[64];
+	volatile LONG64 m_enqueuePos;
+	char m_pad1[64];
+	volatile LONG64 m_dequeuePos;
+	char m_pad2[64];
+public:
+	// capacity is rounded up to a power of two
+	WorkQueue(int capacity);
+	~WorkQueue();
+
+	WorkQueue(const WorkQueue &) = delete;
+
+	// returns false if the queue is full
+	bool Push(const WorkItem &item);
+
+	// returns false if the queue is empty
+	bool Pop(WorkItem *item);
+
+	constexpr int GetCapacity() const
+	{
+		return (int)(m_mask + 1);
+	}
+};
+
+struct WorkPoolStatistics
+{
+	int workers;
+	LONG pending;  // items submitted but not yet started
+	LONG active;  // items currently running
+	LONGLONG executed;
+	LONGLONG stolen;  // items taken from another worker's deque
+	LONGLONG rejected;  // submissions refused because the queue was full
+};
+
+// Fixed set of threads executing WorkItems. New work enters through a shared
+// lock-free queue, idle workers move a small batch of it into their own deque
+// and workers which run out of work steal from the front of the others' deques.
+// Work submitted from a worker thread goes straight to its own deque.
+class WorkPool
+{
+private:
+	struct Worker
+	{
+		WorkPool *pool;
+		int index;
+		HANDLE thread;
+
+		SRWLOCK lock;
+		std::deque<WorkItem> items;
+	};
+
+	static DWORD PoolWorker(__in Worker *worker);
+private:
+	WorkQueue m_queue;
+
+	Worker *m_workers;
+	int m_workerCount;
+
+	// counts submitted items, a worker takes one unit before looking for work
+	HANDLE m_available;
+
+	volatile LONG m_pending;
+	volatile LONG m_active;
+	volatile LONGLONG m_executed;
+	volatile LONGLONG m_stolen;
+	volatile LONGLONG m_rejected;
+	volatile bool m_stopping;
+
+	bool TakeWork(Worker *worker, WorkItem *item);
+	bool StealWork(Worker *thief, WorkItem *item, bool wait);
+public:
+	WorkPool(int queueDepth);
+	~WorkPool();
+
+	WorkPool(const WorkPool &) = delete;
+
+	// threads <= 0 uses one thread per logical processor
+	bool Start(int threads, bool pinThreads);
+
+	// runs every item which was already submitted, then joins the workers
+	void Stop();
+
+	// returns false if the pool is stopping or the queue is full, in which case
+	// the caller still owns arg
+	bool Submit(WorkFunc func, void *arg);
+
+	constexpr bool IsRunning() const
+	{
+		return m_workers != nullptr;
+	}
+
+	void GetStatistics(WorkPoolStatistics *stats) const;
+};